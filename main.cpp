@@ -1,12 +1,215 @@
 #include "src/Window.h"
+#include "src/Vulkan.h"
+#include <stdlib.h>
+#include <math.h>
+#include <stdio.h>
+#include <memory>
+#include <chrono>
+#include <algorithm>
 
-int main()
+// Regression runs: Vulkan --frames 100 --capture frame.png --golden golden.png
+// The last frame is captured, the exit code is 1 when it differs from the golden image.
+// Streaming: --stream video.y4m, --pipe name (named pipe) or --ffmpeg video.mp4|rtmp://server/app/key
+// Sprite batching stress test: --sprites 500000
+// Clustered lighting: --lights 4096 (point and spot lights around the quad), --cpu-lights 1 bins them on the CPU
+// Cascaded shadow maps: --shadows 1 (sun light)
+// Post chain: --exposure 1.5, --bloom 0.5 (intensity, 0 turns it off)
+// Dynamic resolution: --budget 16.6 (GPU milliseconds per frame), --min-scale 0.5
+// Multiple views of the scene: --windows 2 (the others seen from the side), --offscreen 2 (320x180 feeds orbiting the quad)
+// Meshlet culling: --meshlets 512 (segments of a dense sphere next to the quad, culled per cluster by the GPU)
+// Occlusion culling against the depth pyramid: on by default, --occlusion 0 only culls against the frustum
+// Traces: --record trace.bin writes the run, --replay trace.bin draws it again without a window as fast as possible
+// and prints the frame times (--capture and --golden check the last frame)
+
+// Frame times of a replay: from the end of a draw to the end of the next, the first one starting once the renderer is up
+static int replay(const std::string& filename, const std::string& captured, const std::string& golden)
 {
+	TracePlayer player;
+	if (!player.open(filename)) {
+		printf("Cannot read the trace %s\n", filename.c_str());
+		return 1;
+	}
+
+	typedef std::chrono::high_resolution_clock Clock;
+	std::vector<double> frameTimes;
+	Clock::time_point start;
+	Clock::time_point last;
+	for (uint32_t frame = 0; player.nextFrame(Vulkan::app); frame++) {
+		if (frame == 0) {
+			start = last = Clock::now();
+		}
+		if (!captured.empty() && frame + 1 == player.getFrameCount()) {
+			Vulkan::app.captureFrame(captured, golden);
+		}
+		Vulkan::app.draw();
+		Clock::time_point now = Clock::now();
+		frameTimes.push_back(std::chrono::duration<double, std::milli>(now - last).count());
+		last = now;
+	}
+	if (frameTimes.empty()) {
+		printf("No frame in the trace %s\n", filename.c_str());
+		return 1;
+	}
+	Vulkan::app.waitIdle();
+	double total = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+	std::sort(frameTimes.begin(), frameTimes.end());
+	size_t count = frameTimes.size();
+	printf("%zu frames in %.1f ms: %.1f fps\n", count, total, count * 1000.0 / total);
+	printf("Frame ms: average %.3f, min %.3f, median %.3f, 95%% %.3f, 99%% %.3f, max %.3f\n", total / count,
+		   frameTimes[0], frameTimes[count / 2], frameTimes[count * 95 / 100], frameTimes[count * 99 / 100], frameTimes[count - 1]);
+	return Vulkan::app.finishCaptures() > 0 ? 1 : 0;
+}
+
+int main(int argc, char** argv)
+{
+	uint32_t frames = 0;
+	std::string captured;
+	std::string golden;
+	StreamSink* sink = nullptr;
+	uint32_t spriteCount = 0;
+	uint32_t lightCount = 0;
+	bool sun = false;
+	float exposure = 1.0f;
+	float bloom = 0.5f;
+	float budget = 0.0f;
+	float minScale = 0.5f;
+	uint32_t windowCount = 1;
+	uint32_t offscreenCount = 0;
+	uint32_t sphereSegments = 0;
+	std::string replayed;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		std::string option = argv[i];
+		if (option == "--frames") frames = atoi(argv[i + 1]);
+		else if (option == "--capture") captured = argv[i + 1];
+		else if (option == "--golden") golden = argv[i + 1];
+		else if (option == "--stream") sink = new FileSink(argv[i + 1]);
+#ifdef _WIN32
+		else if (option == "--pipe") sink = new PipeSink(std::string("\\\\.\\pipe\\") + argv[i + 1]);
+#else
+		else if (option == "--pipe") sink = new PipeSink(argv[i + 1]);
+#endif
+		else if (option == "--ffmpeg") sink = ProcessSink::ffmpeg(argv[i + 1]);
+		else if (option == "--sprites") spriteCount = atoi(argv[i + 1]);
+		else if (option == "--lights") lightCount = atoi(argv[i + 1]);
+		else if (option == "--cpu-lights") Vulkan::app.setGpuLightBinning(atoi(argv[i + 1]) == 0);
+		else if (option == "--shadows") sun = atoi(argv[i + 1]) != 0;
+		else if (option == "--exposure") exposure = float(atof(argv[i + 1]));
+		else if (option == "--bloom") bloom = float(atof(argv[i + 1]));
+		else if (option == "--budget") budget = float(atof(argv[i + 1]));
+		else if (option == "--min-scale") minScale = float(atof(argv[i + 1]));
+		else if (option == "--windows") windowCount = atoi(argv[i + 1]);
+		else if (option == "--offscreen") offscreenCount = atoi(argv[i + 1]);
+		else if (option == "--meshlets") sphereSegments = atoi(argv[i + 1]);
+		else if (option == "--occlusion") Vulkan::app.setOcclusionCulling(atoi(argv[i + 1]) != 0);
+		else if (option == "--record") Vulkan::app.startTrace(argv[i + 1]);
+		else if (option == "--replay") replayed = argv[i + 1];
+	}
+	if (!replayed.empty()) {
+		return replay(replayed, captured, golden);
+	}
+
+	Vulkan::app.setSampleCount(VK_SAMPLE_COUNT_4_BIT);
 	Window window("Vulkan", 800, 600);
+
+	// Same device and resources, their own swapchain or image and camera
+	std::vector<std::unique_ptr<Window>> windows;
+	for (uint32_t i = 1; i < windowCount; i++) {
+		windows.emplace_back(new Window("Vulkan " + std::to_string(i + 1), 640, 480));
+		float angle = i * 1.2f;
+		Vulkan::app.setCamera(windows.back()->getView(), glm::lookAt(glm::vec3(5.0f * sinf(angle), 1.0f, 5.0f * cosf(angle)), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f)));
+	}
+	std::vector<uint32_t> feeds;
+	for (uint32_t i = 0; i < offscreenCount; i++) {
+		feeds.push_back(Vulkan::app.addOffscreenView({ 320, 180 }));
+	}
+
+	// Unit sphere, half as many rings as segments. Front faces wind like the quad.
+	if (sphereSegments > 0) {
+		uint32_t rings = sphereSegments / 2;
+		uint32_t row = sphereSegments + 1;
+		std::vector<Vertex> vertices;
+		std::vector<uint32_t> indices;
+		for (uint32_t ring = 0; ring <= rings; ring++) {
+			float theta = 3.14159265f * ring / rings;
+			for (uint32_t segment = 0; segment <= sphereSegments; segment++) {
+				float phi = 6.28318531f * segment / sphereSegments;
+				glm::vec3 normal(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi));
+				Vertex vertex = { { normal.x, normal.y, normal.z }, { 1.0f, 1.0f, 1.0f },
+								  { float(segment) / sphereSegments, float(ring) / rings }, { normal.x, normal.y, normal.z } };
+				vertices.push_back(vertex);
+			}
+		}
+		for (uint32_t ring = 0; ring < rings; ring++) {
+			for (uint32_t segment = 0; segment < sphereSegments; segment++) {
+				uint32_t top = ring * row + segment;
+				uint32_t bottom = top + row;
+				uint32_t quad[] = { top, bottom, top + 1, top + 1, bottom, bottom + 1 };
+				indices.insert(indices.end(), quad, quad + 6);
+			}
+		}
+		uint32_t sphere = Vulkan::app.addMesh(vertices.data(), uint32_t(vertices.size()), indices.data(), uint32_t(indices.size()));
+		if (sphere != UINT32_MAX) {
+			Vulkan::app.addObject(sphere, 0, glm::translate(glm::mat4(), glm::vec3(2.5f, 0.0f, 0.0f)));
+		}
+	}
+
+	// Small lights scattered around the quad, one in four is a spot light pointing at the center
+	std::vector<LightSource> lights(lightCount);
+	srand(1);
+	for (uint32_t i = 0; i < lightCount; i++) {
+		LightSource& light = lights[i];
+		light.position = glm::vec3(rand() % 600 / 100.0f - 3.0f, rand() % 600 / 100.0f - 3.0f, rand() % 600 / 100.0f - 3.0f);
+		light.range = 0.3f + rand() % 100 / 100.0f;
+		light.color = glm::vec3(rand() % 100 / 100.0f, rand() % 100 / 100.0f, rand() % 100 / 100.0f);
+		light.direction = glm::normalize(-light.position);
+		light.outerAngle = i % 4 == 0 ? 0.5f : 0.0f;
+		light.innerAngle = 0.4f;
+	}
+	Vulkan::app.setLights(lights.data(), lightCount);
+	if (sun) {
+		Vulkan::app.setSun(glm::vec3(0.4f, 1.0f, 0.6f), glm::vec3(1.0f, 0.95f, 0.85f));
+	}
+	Vulkan::app.setExposure(exposure);
+	Vulkan::app.setBloom(bloom);
+	Vulkan::app.setFrameBudget(budget, minScale);
+	if (sink) {
+		Vulkan::app.startStream(sink);
+	}
 	
-	while (!window.shouldClose()) {
+	std::vector<Sprite> sprites(spriteCount);
+	for (uint32_t frame = 0; !window.shouldClose() && (frames == 0 || frame < frames); frame++) {
+		// Small spinning quads swirling around the center of the window
+		for (uint32_t i = 0; i < spriteCount; i++) {
+			float angle = i * 0.001f + frame * 0.01f;
+			float radius = 20.0f + (i % 1000) * 0.25f;
+			Sprite& sprite = sprites[i];
+			sprite.position[0] = 400.0f + radius * cosf(angle);
+			sprite.position[1] = 300.0f + radius * sinf(angle);
+			sprite.size[0] = 4.0f;
+			sprite.size[1] = 4.0f;
+			sprite.rotation = angle;
+			sprite.color = 0x80FFFFFF;
+			sprite.texture = 0;
+			sprite.order = 0;
+		}
+		Vulkan::app.drawSprites(sprites.data(), spriteCount);
+
+		for (uint32_t i = 0; i < feeds.size(); i++) {
+			float angle = frame * 0.01f + i * 6.28f / feeds.size();
+			Vulkan::app.setCamera(feeds[i], glm::lookAt(glm::vec3(6.0f * cosf(angle), 2.0f, 6.0f * sinf(angle)), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f)));
+		}
+
+		if (!captured.empty() && frame + 1 == frames) {
+			Vulkan::app.captureFrame(captured, golden);
+		}
+		for (auto& other : windows) {
+			other->clear();
+		}
 		window.clear();
 	}
 
-	return 0;
-}
\ No newline at end of file
+	Vulkan::app.stopStream();
+	Vulkan::app.stopTrace();
+	return Vulkan::app.finishCaptures() > 0 ? 1 : 0;
+}
@@ -1,13 +1,140 @@
 #version 450
 
+// Set per pipeline permutation, the disabled paths are compiled out
+layout(constant_id = 0) const bool USE_VERTEX_COLOR = false;
+layout(constant_id = 1) const bool USE_TEXTURE = true;
+layout(constant_id = 2) const bool USE_ALPHA_TEST = false;
+layout(constant_id = 3) const float ALPHA_CUTOFF = 0.5;
+layout(constant_id = 4) const bool USE_LIGHTING = false;
+
 layout(location = 0) in vec3 colorFrag;
 layout(location = 1) in vec2 uvFrag;
+layout(location = 2) flat in float layerFrag;
+layout(location = 3) in vec3 viewPositionFrag;
+layout(location = 4) in vec3 viewNormalFrag;
 
 layout(location = 0) out vec4 outColor;
 
-layout(binding = 1) uniform sampler2D tex;
+// Texture atlas, one page per layer
+layout(binding = 1) uniform sampler2DArray tex;
+
+// CLUSTERED LIGHTING: same buffers as cluster.comp
+struct Light {
+	vec4 positionRange;
+	vec4 colorInnerCos;
+	vec4 directionOuterCos;	// Outer cosine under -1 for point lights
+	vec4 bounds;
+};
+
+layout(std430, set = 1, binding = 0) readonly buffer Lights {
+	vec4 tileScaleSlice;	// Clusters per pixel in xy, slice scale and bias in zw
+	uvec4 gridSize;			// Clusters in xyz, light count in w
+	vec4 frustum;
+	uvec4 capacity;			// Lights per cluster in x
+	Light lights[];
+};
+
+layout(std430, set = 1, binding = 1) readonly buffer ClusterCounts {
+	uint counts[];
+};
+
+layout(std430, set = 1, binding = 2) readonly buffer ClusterLights {
+	uint indices[];
+};
+
+// SHADOWS: directional light, same layout as ShadowUniforms
+layout(std140, set = 2, binding = 0) uniform ShadowUBO {
+	mat4 cascadeMatrices[4];	// View space to shadow map coordinates and depth
+	vec4 splitDepths;
+	vec4 lightDirection;		// View space, w is 1 when there is a light
+	vec4 lightColor;
+	vec4 texelSize;
+} shadow;
+
+layout(set = 2, binding = 1) uniform sampler2DArrayShadow shadowMaps;
+
+const vec3 AMBIENT = vec3(0.05);
+
+// Only the lights of the cluster of the fragment: the cost follows the local light density
+vec3 getLighting(vec3 position, vec3 normal)
+{
+	float slice = log(-position.z) * tileScaleSlice.z + tileScaleSlice.w;
+	uvec3 cell = uvec3(vec3(gl_FragCoord.xy * tileScaleSlice.xy, max(slice, 0.0)));
+	cell = min(cell, gridSize.xyz - 1);
+	uint cluster = (cell.z * gridSize.y + cell.y) * gridSize.x + cell.x;
+
+	vec3 lighting = AMBIENT;
+	uint first = cluster * capacity.x;
+	uint count = counts[cluster];
+	for (uint i = 0; i < count; i++) {
+		Light light = lights[indices[first + i]];
+		vec3 toLight = light.positionRange.xyz - position;
+		float distance2 = dot(toLight, toLight);
+		float range2 = light.positionRange.w * light.positionRange.w;
+		if (distance2 >= range2) {
+			continue;
+		}
+
+		// Inverse square, smoothly brought to 0 at the range
+		vec3 direction = toLight * inversesqrt(distance2);
+		float ratio = distance2 / range2;
+		float window = 1.0 - ratio * ratio;
+		float attenuation = window * window / max(distance2, 0.01);
+		if (light.directionOuterCos.w >= -1.0) {
+			float cosine = dot(-direction, light.directionOuterCos.xyz);
+			attenuation *= smoothstep(light.directionOuterCos.w, light.colorInnerCos.w, cosine);
+		}
+		lighting += light.colorInnerCos.rgb * max(dot(normal, direction), 0.0) * attenuation;
+	}
+	return lighting;
+}
+
+// First cascade covering the fragment, 4 filtered taps. Lit past the last one.
+float getShadow(vec3 position)
+{
+	float depth = -position.z;
+	uint cascade = 0;
+	while (cascade < 4 && depth > shadow.splitDepths[cascade]) {
+		cascade++;
+	}
+	if (cascade == 4) {
+		return 1.0;
+	}
+
+	vec4 coord = shadow.cascadeMatrices[cascade] * vec4(position, 1.0);
+	vec2 offset = shadow.texelSize.xy * 0.5;
+	float lit = 0.0;
+	lit += texture(shadowMaps, vec4(coord.xy + vec2(-offset.x, -offset.y), float(cascade), coord.z));
+	lit += texture(shadowMaps, vec4(coord.xy + vec2(offset.x, -offset.y), float(cascade), coord.z));
+	lit += texture(shadowMaps, vec4(coord.xy + vec2(-offset.x, offset.y), float(cascade), coord.z));
+	lit += texture(shadowMaps, vec4(coord.xy + vec2(offset.x, offset.y), float(cascade), coord.z));
+	return lit * 0.25;
+}
 
 void main()
 {
-	outColor = texture(tex, uvFrag);
+	vec4 color = vec4(1.0);
+	if (USE_TEXTURE) {
+		color *= texture(tex, vec3(uvFrag, layerFrag));
+	}
+	if (USE_VERTEX_COLOR) {
+		color.rgb *= colorFrag;
+	}
+	if (USE_ALPHA_TEST && color.a < ALPHA_CUTOFF) {
+		discard;
+	}
+	// Without any light, the surfaces are left unlit
+	if (USE_LIGHTING && (gridSize.w > 0 || shadow.lightDirection.w > 0.0)) {
+		vec3 normal = normalize(gl_FrontFacing ? viewNormalFrag : -viewNormalFrag);
+		vec3 lighting = getLighting(viewPositionFrag, normal);
+		if (shadow.lightDirection.w > 0.0) {
+			float sun = max(dot(normal, shadow.lightDirection.xyz), 0.0);
+			if (sun > 0.0) {
+				sun *= getShadow(viewPositionFrag);
+			}
+			lighting += shadow.lightColor.rgb * sun;
+		}
+		color.rgb *= lighting;
+	}
+	outColor = color;
 }
@@ -1,11 +1,18 @@
 #version 450
 
+// Same ids as color.frag: the unused outputs are removed
+layout(constant_id = 0) const bool USE_VERTEX_COLOR = false;
+layout(constant_id = 1) const bool USE_TEXTURE = true;
+layout(constant_id = 4) const bool USE_LIGHTING = false;
+
 layout(location = 0) in vec3 position;
 layout(location = 1) in vec3 color;
 layout(location = 2) in vec2 uv;
+layout(location = 3) in vec3 normal;
 
+// The depth pre-pass drops the fragment stage, the main pass tests EQUAL against its depth
 out gl_PerVertex {
-	vec4 gl_Position;
+	invariant vec4 gl_Position;
 };
 
 layout(set = 0, binding = 0) uniform UBO
@@ -13,14 +20,26 @@ layout(set = 0, binding = 0) uniform UBO
 	mat4 projectionMatrix;
 	mat4 modelMatrix;
 	mat4 viewMatrix;
+	vec4 uvTransform;	// Atlas region: offset in xy, scale in zw
+	float textureLayer;
 } ubo;
 
 layout(location = 0) out vec3 colorFrag;
 layout(location = 1) out vec2 uvFrag;
+layout(location = 2) flat out float layerFrag;
+layout(location = 3) out vec3 viewPositionFrag;	// The lights are in view space
+layout(location = 4) out vec3 viewNormalFrag;
 
 void main()
 {
-	colorFrag = color;
-	uvFrag = uv;
-	gl_Position = ubo.projectionMatrix * ubo.viewMatrix * ubo.modelMatrix * vec4(position, 1.0);
+	mat4 modelView = ubo.viewMatrix * ubo.modelMatrix;
+	vec4 viewPosition = modelView * vec4(position, 1.0);
+
+	colorFrag = USE_VERTEX_COLOR ? color : vec3(1.0);
+	uvFrag = USE_TEXTURE ? uv * ubo.uvTransform.zw + ubo.uvTransform.xy : vec2(0.0);
+	layerFrag = ubo.textureLayer;
+	viewPositionFrag = USE_LIGHTING ? viewPosition.xyz : vec3(0.0);
+	// No non-uniform scale so far
+	viewNormalFrag = USE_LIGHTING ? mat3(modelView) * normal : vec3(0.0);
+	gl_Position = ubo.projectionMatrix * viewPosition;
 }
@@ -0,0 +1,75 @@
+#version 450
+
+// color.vert with the vertices pulled from the meshlet buffers: the indices written by meshletCull.comp
+// hold a slot of the visible list in their upper bits, a vertex of that meshlet in the lower 6
+layout(constant_id = 0) const bool USE_VERTEX_COLOR = false;
+layout(constant_id = 1) const bool USE_TEXTURE = true;
+layout(constant_id = 4) const bool USE_LIGHTING = false;
+
+// The depth pre-pass drops the fragment stage, the main pass tests EQUAL against its depth
+out gl_PerVertex {
+	invariant vec4 gl_Position;
+};
+
+layout(set = 0, binding = 0) uniform UBO
+{
+	mat4 projectionMatrix;
+	mat4 modelMatrix;
+	mat4 viewMatrix;
+	vec4 uvTransform;	// Atlas region: offset in xy, scale in zw
+	float textureLayer;
+} ubo;
+
+struct Meshlet {
+	vec4 sphere;
+	vec4 cone;
+	uint vertexOffset;
+	uint triangleOffset;
+	uint vertexCount;
+	uint triangleCount;
+};
+
+// Same layout as Vertex: position, color, uv, normal
+layout(std430, set = 3, binding = 0) readonly buffer Vertices {
+	float vertices[];
+};
+
+layout(std430, set = 3, binding = 1) readonly buffer Meshlets {
+	Meshlet meshlets[];
+};
+
+layout(std430, set = 3, binding = 2) readonly buffer MeshletVertices {
+	uint meshletVertices[];
+};
+
+layout(std430, set = 3, binding = 3) readonly buffer Visible {
+	uint visible[];
+};
+
+layout(location = 0) out vec3 colorFrag;
+layout(location = 1) out vec2 uvFrag;
+layout(location = 2) flat out float layerFrag;
+layout(location = 3) out vec3 viewPositionFrag;
+layout(location = 4) out vec3 viewNormalFrag;
+
+const uint VERTEX_FLOATS = 11;
+
+void main()
+{
+	Meshlet meshlet = meshlets[visible[gl_VertexIndex >> 6]];
+	uint first = meshletVertices[meshlet.vertexOffset + (gl_VertexIndex & 63)] * VERTEX_FLOATS;
+	vec3 position = vec3(vertices[first], vertices[first + 1], vertices[first + 2]);
+	vec3 color = vec3(vertices[first + 3], vertices[first + 4], vertices[first + 5]);
+	vec2 uv = vec2(vertices[first + 6], vertices[first + 7]);
+	vec3 normal = vec3(vertices[first + 8], vertices[first + 9], vertices[first + 10]);
+
+	mat4 modelView = ubo.viewMatrix * ubo.modelMatrix;
+	vec4 viewPosition = modelView * vec4(position, 1.0);
+
+	colorFrag = USE_VERTEX_COLOR ? color : vec3(1.0);
+	uvFrag = USE_TEXTURE ? uv * ubo.uvTransform.zw + ubo.uvTransform.xy : vec2(0.0);
+	layerFrag = ubo.textureLayer;
+	viewPositionFrag = USE_LIGHTING ? viewPosition.xyz : vec3(0.0);
+	viewNormalFrag = USE_LIGHTING ? mat3(modelView) * normal : vec3(0.0);
+	gl_Position = ubo.projectionMatrix * viewPosition;
+}
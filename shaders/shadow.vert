@@ -0,0 +1,18 @@
+#version 450
+
+layout(location = 0) in vec3 position;
+
+out gl_PerVertex {
+	vec4 gl_Position;
+};
+
+// Model space to the clip space of a cascade
+layout(push_constant) uniform PushConstants
+{
+	mat4 transform;
+} caster;
+
+void main()
+{
+	gl_Position = caster.transform * vec4(position, 1.0);
+}
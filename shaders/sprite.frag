@@ -0,0 +1,16 @@
+#version 450
+
+layout(location = 0) in vec4 colorFrag;
+layout(location = 1) in vec2 uvFrag;
+layout(location = 2) flat in float layerFrag;
+
+layout(location = 0) out vec4 outColor;
+
+// Same atlas as the scene, premultiplied by alpha
+layout(binding = 1) uniform sampler2DArray tex;
+
+void main()
+{
+	vec4 tint = vec4(colorFrag.rgb * colorFrag.a, colorFrag.a);
+	outColor = tint * texture(tex, vec3(uvFrag, layerFrag));
+}
@@ -0,0 +1,29 @@
+#version 450
+
+layout(location = 0) in vec2 position;
+layout(location = 1) in vec2 uv;
+layout(location = 2) in vec4 color;
+layout(location = 3) in float layer;
+
+out gl_PerVertex {
+	vec4 gl_Position;
+};
+
+// Pixels to clip space
+layout(push_constant) uniform PushConstants
+{
+	vec2 scale;
+	vec2 offset;
+} screen;
+
+layout(location = 0) out vec4 colorFrag;
+layout(location = 1) out vec2 uvFrag;
+layout(location = 2) flat out float layerFrag;
+
+void main()
+{
+	colorFrag = color;
+	uvFrag = uv;
+	layerFrag = layer;
+	gl_Position = vec4(position * screen.scale + screen.offset, 0.0, 1.0);
+}
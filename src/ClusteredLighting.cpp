@@ -0,0 +1,357 @@
+#include "ClusteredLighting.h"
+#include "DeviceCapabilities.h"
+#include "ComputeScheduler.h"
+#include "JobSystem.h"
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <xmmintrin.h>
+#include "helpers\Helpers.h"
+
+#define CLUSTER_GROUP_SIZE 64	// local_size_x of cluster.comp
+
+namespace {
+
+	const float HALF_PI = 1.57079632f;
+
+	// Cone of a spot light: sphere through the apex and the rim when the cone is narrow,
+	// centered on the disc of the rim when it is wide. Past 90 degrees, the sphere of a point light.
+	glm::vec4 getBoundingSphere(const glm::vec3& position, const glm::vec3& direction, float range, float outerAngle)
+	{
+		if (outerAngle <= 0.0f || outerAngle >= HALF_PI) {
+			return glm::vec4(position, range);
+		}
+
+		float cosine = cosf(outerAngle);
+		float offset = range * cosine;
+		float radius = range * sinf(outerAngle);
+		if (cosine >= 0.70710678f) {
+			offset = range / (2.0f * cosine);
+			radius = offset;
+		}
+		return glm::vec4(position + direction * offset, radius);
+	}
+
+	inline float getDistance(float value, float min, float max)
+	{
+		return std::max(std::max(min - value, value - max), 0.0f);
+	}
+}
+
+void computeClusterBounds(const ClusterHeader& header, ClusterBounds& bounds)
+{
+	const uint32_t columns = header.gridSize[0];
+	const uint32_t rows = header.gridSize[1];
+	const uint32_t slices = header.gridSize[2];
+	bounds.minX.resize(slices * columns);
+	bounds.maxX.resize(slices * columns);
+	bounds.minY.resize(slices * rows);
+	bounds.maxY.resize(slices * rows);
+	bounds.nearDepth.resize(slices);
+	bounds.farDepth.resize(slices);
+
+	// Tiles are lines through the eye: the widest extent is at the near or far depth of the slice
+	float ratio = header.farPlane / header.nearPlane;
+	for (uint32_t slice = 0; slice < slices; slice++) {
+		float nearDepth = header.nearPlane * powf(ratio, float(slice) / slices);
+		float farDepth = header.nearPlane * powf(ratio, float(slice + 1) / slices);
+		bounds.nearDepth[slice] = nearDepth;
+		bounds.farDepth[slice] = farDepth;
+
+		for (uint32_t column = 0; column < columns; column++) {
+			float x0 = (-1.0f + 2.0f * column / columns) * header.tanHalfFov[0];
+			float x1 = (-1.0f + 2.0f * (column + 1) / columns) * header.tanHalfFov[0];
+			bounds.minX[slice * columns + column] = std::min(x0 * nearDepth, x0 * farDepth);
+			bounds.maxX[slice * columns + column] = std::max(x1 * nearDepth, x1 * farDepth);
+		}
+		for (uint32_t row = 0; row < rows; row++) {
+			float y0 = (-1.0f + 2.0f * row / rows) * header.tanHalfFov[1];
+			float y1 = (-1.0f + 2.0f * (row + 1) / rows) * header.tanHalfFov[1];
+			bounds.minY[slice * rows + row] = std::min(y0 * nearDepth, y0 * farDepth);
+			bounds.maxY[slice * rows + row] = std::max(y1 * nearDepth, y1 * farDepth);
+		}
+	}
+}
+
+void binLights(const ClusterHeader& header, const ClusterBounds& bounds, const GpuLight* lights,
+			   uint32_t* counts, uint32_t* indices, JobSystem* jobs)
+{
+	const uint32_t columns = header.gridSize[0];
+	const uint32_t rows = header.gridSize[1];
+	const uint32_t capacity = header.maxPerCluster;
+	assert(columns % 4 == 0);
+
+	// Sphere against box: the squared distances along the axes add up. The slice and the row are
+	// tested once for all the columns, which are then tested 4 at a time.
+	auto bin = [&](uint32_t firstSlice, uint32_t lastSlice) {
+		const __m128 zero = _mm_setzero_ps();
+		for (uint32_t slice = firstSlice; slice < lastSlice; slice++) {
+			uint32_t* sliceCounts = counts + slice * rows * columns;
+			uint32_t* sliceIndices = indices + size_t(slice) * rows * columns * capacity;
+			memset(sliceCounts, 0, rows * columns * sizeof(uint32_t));
+			const float* minX = bounds.minX.data() + slice * columns;
+			const float* maxX = bounds.maxX.data() + slice * columns;
+			const float* minY = bounds.minY.data() + slice * rows;
+			const float* maxY = bounds.maxY.data() + slice * rows;
+
+			for (uint32_t light = 0; light < header.lightCount; light++) {
+				const glm::vec4& sphere = lights[light].bounds;
+				float dz = getDistance(-sphere.z, bounds.nearDepth[slice], bounds.farDepth[slice]);
+				float remaining = sphere.w * sphere.w - dz * dz;
+				if (remaining < 0.0f) {
+					continue;
+				}
+
+				const __m128 centerX = _mm_set1_ps(sphere.x);
+				for (uint32_t row = 0; row < rows; row++) {
+					float dy = getDistance(sphere.y, minY[row], maxY[row]);
+					float rowRemaining = remaining - dy * dy;
+					if (rowRemaining < 0.0f) {
+						continue;
+					}
+
+					const __m128 limit = _mm_set1_ps(rowRemaining);
+					uint32_t* rowCounts = sliceCounts + row * columns;
+					uint32_t* rowIndices = sliceIndices + size_t(row) * columns * capacity;
+					for (uint32_t column = 0; column < columns; column += 4) {
+						__m128 dx = _mm_max_ps(_mm_sub_ps(_mm_loadu_ps(minX + column), centerX),
+											   _mm_sub_ps(centerX, _mm_loadu_ps(maxX + column)));
+						dx = _mm_max_ps(dx, zero);
+						int mask = _mm_movemask_ps(_mm_cmple_ps(_mm_mul_ps(dx, dx), limit));
+						for (uint32_t cluster = column; mask != 0; cluster++, mask >>= 1) {
+							if ((mask & 1) && rowCounts[cluster] < capacity) {
+								rowIndices[cluster * capacity + rowCounts[cluster]++] = light;
+							}
+						}
+					}
+				}
+			}
+		}
+	};
+
+	// Every slice has its own clusters: no lock, and the lights of a cluster stay in order
+	if (jobs) {
+		jobs->parallelFor(header.gridSize[2], 1, bin);
+	}
+	else {
+		bin(0, header.gridSize[2]);
+	}
+}
+
+void ClusteredLighting::init(const DeviceCapabilities& capabilities, VkDevice device, const ComputeScheduler& compute, JobSystem* jobs,
+							 uint32_t frameCount, uint32_t maxLights, bool gpuBinning)
+{
+	this->physicalDevice = capabilities.physicalDevice;
+	this->device = device;
+	this->jobs = jobs;
+	this->maxLights = maxLights;
+	this->gpuBinning = gpuBinning;
+
+	const uint32_t clusterCount = CLUSTER_GRID_X * CLUSTER_GRID_Y * CLUSTER_GRID_Z;
+	header.gridSize[0] = CLUSTER_GRID_X;
+	header.gridSize[1] = CLUSTER_GRID_Y;
+	header.gridSize[2] = CLUSTER_GRID_Z;
+	header.maxPerCluster = MAX_LIGHTS_PER_CLUSTER;
+	visible.reserve(maxLights);
+
+	// Each part starts on a storage buffer offset
+	VkDeviceSize alignment = capabilities.limits().minStorageBufferOffsetAlignment;
+	auto align = [alignment](VkDeviceSize size) { return (size + alignment - 1) / alignment * alignment; };
+	lightPartSize = align(sizeof(ClusterHeader) + VkDeviceSize(maxLights) * sizeof(GpuLight));
+	countsSize = align(clusterCount * sizeof(uint32_t));
+	clusterPartSize = align(countsSize + VkDeviceSize(clusterCount) * MAX_LIGHTS_PER_CLUSTER * sizeof(uint32_t));
+
+	uint32_t families[2];
+	VkBufferCreateInfo bufferInfo = {};
+	bufferInfo.size = lightPartSize * frameCount;
+	bufferInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	if (gpuBinning) {
+		compute.share(bufferInfo, families);
+	}
+
+	// Written every frame, a few hundred kilobytes at most: read from host memory through the GPU caches
+	vk::createBuffer(physicalDevice, device, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 bufferInfo, lightBuffer, lightMemory);
+	void* data;
+	VkResult res = vkMapMemory(device, lightMemory, 0, VK_WHOLE_SIZE, 0, &data);
+	assert(res == VK_SUCCESS);
+	lightData = static_cast<uint8_t*>(data);
+
+	// Read by every fragment: stays on the GPU unless the CPU fills it
+	bufferInfo.size = clusterPartSize * frameCount;
+	if (gpuBinning) {
+		vk::createBuffer(physicalDevice, device, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, bufferInfo, clusterBuffer, clusterMemory);
+	}
+	else {
+		vk::createBuffer(physicalDevice, device, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+						 bufferInfo, clusterBuffer, clusterMemory);
+		res = vkMapMemory(device, clusterMemory, 0, VK_WHOLE_SIZE, 0, &data);
+		assert(res == VK_SUCCESS);
+		clusterData = static_cast<uint8_t*>(data);
+		counts.resize(clusterCount);
+		indices.resize(size_t(clusterCount) * MAX_LIGHTS_PER_CLUSTER);
+	}
+
+	// DESCRIPTORS: lights, counts, indices
+	VkDescriptorType types[] = { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER };
+	setLayout = vk::createDescriptorSetLayout(device, types, 3, VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT);
+
+	VkDescriptorPoolSize poolSize = {};
+	poolSize.descriptorCount = 3 * frameCount;
+	poolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+
+	VkDescriptorPoolCreateInfo descriptorPoolInfo = {};
+	descriptorPoolInfo.maxSets = frameCount;
+	descriptorPoolInfo.poolSizeCount = 1;
+	descriptorPoolInfo.pPoolSizes = &poolSize;
+	descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+
+	res = vkCreateDescriptorPool(device, &descriptorPoolInfo, nullptr, &descriptorPool);
+	assert(res == VK_SUCCESS);
+
+	std::vector<VkDescriptorSetLayout> setLayouts(frameCount, setLayout);
+	VkDescriptorSetAllocateInfo descriptorSetAllocInfo = {};
+	descriptorSetAllocInfo.descriptorPool = descriptorPool;
+	descriptorSetAllocInfo.descriptorSetCount = frameCount;
+	descriptorSetAllocInfo.pSetLayouts = setLayouts.data();
+	descriptorSetAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+
+	descriptorSets.resize(frameCount);
+	res = vkAllocateDescriptorSets(device, &descriptorSetAllocInfo, descriptorSets.data());
+	assert(res == VK_SUCCESS);
+
+	for (uint32_t frame = 0; frame < frameCount; frame++) {
+		VkDescriptorBufferInfo bufferDescriptors[3];
+		bufferDescriptors[0] = { lightBuffer, frame * lightPartSize, lightPartSize };
+		bufferDescriptors[1] = { clusterBuffer, frame * clusterPartSize, countsSize };
+		bufferDescriptors[2] = { clusterBuffer, frame * clusterPartSize + countsSize, clusterPartSize - countsSize };
+
+		VkWriteDescriptorSet writeDescriptorSets[3];
+		for (uint32_t binding = 0; binding < 3; binding++) {
+			writeDescriptorSets[binding] = {};
+			writeDescriptorSets[binding].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			writeDescriptorSets[binding].descriptorCount = 1;
+			writeDescriptorSets[binding].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+			writeDescriptorSets[binding].dstSet = descriptorSets[frame];
+			writeDescriptorSets[binding].pBufferInfo = &bufferDescriptors[binding];
+			writeDescriptorSets[binding].dstBinding = binding;
+		}
+		vkUpdateDescriptorSets(device, 3, writeDescriptorSets, 0, nullptr);
+	}
+}
+
+void ClusteredLighting::destroy()
+{
+	vkDestroyPipeline(device, pipeline, nullptr);
+	vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+	vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+	vkDestroyDescriptorSetLayout(device, setLayout, nullptr);
+	vkUnmapMemory(device, lightMemory);
+	vkDestroyBuffer(device, lightBuffer, nullptr);
+	vkFreeMemory(device, lightMemory, nullptr);
+	if (clusterData) {
+		vkUnmapMemory(device, clusterMemory);
+	}
+	vkDestroyBuffer(device, clusterBuffer, nullptr);
+	vkFreeMemory(device, clusterMemory, nullptr);
+	pipeline = VK_NULL_HANDLE;
+	pipelineLayout = VK_NULL_HANDLE;
+	descriptorPool = VK_NULL_HANDLE;
+	setLayout = VK_NULL_HANDLE;
+	lightData = nullptr;
+	clusterData = nullptr;
+	descriptorSets.clear();
+}
+
+void ClusteredLighting::createPipeline(VkShaderModule shaderModule)
+{
+	pipelineLayout = vk::createPipelineLayout(device, setLayout, 0, 0);
+	pipeline = vk::createComputePipeline(device, shaderModule, pipelineLayout);
+}
+
+void ClusteredLighting::setLights(const LightSource* lights, uint32_t count)
+{
+	sources.assign(lights, lights + count);
+}
+
+void ClusteredLighting::prepare(uint32_t frame, const glm::mat4& viewMatrix, float fovY, VkExtent2D extent, float nearPlane, float farPlane)
+{
+	float tanY = tanf(fovY * 0.5f);
+	float tanX = tanY * float(extent.width) / float(extent.height);
+	bool resized = header.tanHalfFov[0] != tanX || header.tanHalfFov[1] != tanY ||
+				   header.nearPlane != nearPlane || header.farPlane != farPlane;
+
+	header.tileScale[0] = float(CLUSTER_GRID_X) / extent.width;
+	header.tileScale[1] = float(CLUSTER_GRID_Y) / extent.height;
+	header.sliceScale = CLUSTER_GRID_Z / logf(farPlane / nearPlane);
+	header.sliceBias = -header.sliceScale * logf(nearPlane);
+	header.tanHalfFov[0] = tanX;
+	header.tanHalfFov[1] = tanY;
+	header.nearPlane = nearPlane;
+	header.farPlane = farPlane;
+
+	// View space, without the lights out of the frustum: the binning only sees what may light a cluster
+	float sideX = sqrtf(1.0f + tanX * tanX);
+	float sideY = sqrtf(1.0f + tanY * tanY);
+	visible.clear();
+	for (const LightSource& source : sources) {
+		if (visible.size() == maxLights) {
+			break;
+		}
+
+		glm::vec4 position = viewMatrix * glm::vec4(source.position, 1.0f);
+		glm::vec4 direction = viewMatrix * glm::vec4(source.direction, 0.0f);
+		glm::vec3 center(position.x, position.y, position.z);
+		glm::vec3 axis(0.0f, 0.0f, -1.0f);
+		if (source.outerAngle > 0.0f) {
+			axis = glm::normalize(glm::vec3(direction.x, direction.y, direction.z));
+		}
+		glm::vec4 sphere = getBoundingSphere(center, axis, source.range, source.outerAngle);
+
+		// Side planes through the eye, at tan(fov / 2) * depth
+		float depth = -sphere.z;
+		if (depth + sphere.w < nearPlane || depth - sphere.w > farPlane ||
+			(fabsf(sphere.x) - tanX * depth) / sideX > sphere.w || (fabsf(sphere.y) - tanY * depth) / sideY > sphere.w) {
+			continue;
+		}
+
+		GpuLight light;
+		light.positionRange = glm::vec4(center, source.range);
+		light.colorInnerCos = glm::vec4(source.color, cosf(source.innerAngle));
+		light.directionOuterCos = glm::vec4(axis, source.outerAngle > 0.0f ? cosf(source.outerAngle) : -2.0f);
+		light.bounds = sphere;
+		visible.push_back(light);
+	}
+	header.lightCount = uint32_t(visible.size());
+
+	uint8_t* lightPart = lightData + frame * lightPartSize;
+	memcpy(lightPart, &header, sizeof(ClusterHeader));
+	memcpy(lightPart + sizeof(ClusterHeader), visible.data(), visible.size() * sizeof(GpuLight));
+
+	if (gpuBinning) {
+		return;
+	}
+
+	if (resized) {
+		computeClusterBounds(header, bounds);
+	}
+	binLights(header, bounds, visible.data(), counts.data(), indices.data(), jobs);
+
+	// Only the used part of the lists goes through the bus
+	uint8_t* clusterPart = clusterData + frame * clusterPartSize;
+	memcpy(clusterPart, counts.data(), counts.size() * sizeof(uint32_t));
+	uint32_t* mappedIndices = reinterpret_cast<uint32_t*>(clusterPart + countsSize);
+	for (size_t cluster = 0; cluster < counts.size(); cluster++) {
+		size_t first = cluster * MAX_LIGHTS_PER_CLUSTER;
+		memcpy(mappedIndices + first, indices.data() + first, counts[cluster] * sizeof(uint32_t));
+	}
+}
+
+void ClusteredLighting::record(VkCommandBuffer cmdBuffer, uint32_t frame)
+{
+	// One invocation per cluster
+	const uint32_t clusterCount = CLUSTER_GRID_X * CLUSTER_GRID_Y * CLUSTER_GRID_Z;
+	vk::dispatch(cmdBuffer, pipeline, pipelineLayout, descriptorSets[frame], vk::getGroupCount(clusterCount, CLUSTER_GROUP_SIZE));
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <stdint.h>
+#include <vector>
+#include <glm.hpp>
+
+class DeviceCapabilities;
+class ComputeScheduler;
+class JobSystem;
+
+#define CLUSTER_GRID_X 16	// Multiple of 4, the CPU binning tests 4 clusters of a row at a time
+#define CLUSTER_GRID_Y 9
+#define CLUSTER_GRID_Z 24	// Exponential slices between the near and far planes
+#define MAX_LIGHTS_PER_CLUSTER 128
+
+// Point light, or spot light when outerAngle is not 0
+struct LightSource {
+	glm::vec3 position;	// World space
+	float range;		// No light past it
+	glm::vec3 color;	// Linear, times the intensity
+	float outerAngle;	// Half angles of the cone, radians
+	glm::vec3 direction;
+	float innerAngle;
+};
+
+// Matches the Light struct of the shaders (std430), in view space
+struct GpuLight {
+	glm::vec4 positionRange;
+	glm::vec4 colorInnerCos;
+	glm::vec4 directionOuterCos;	// Outer cosine under -1 for point lights
+	glm::vec4 bounds;				// Bounding sphere, used for the binning
+};
+
+// First bytes of the light buffer, followed by the lights
+struct ClusterHeader {
+	float tileScale[2];		// Clusters per pixel
+	float sliceScale;		// Slice = log(view depth) * scale + bias
+	float sliceBias;
+	uint32_t gridSize[3];
+	uint32_t lightCount;
+	float tanHalfFov[2];	// View space extent at depth 1
+	float nearPlane;
+	float farPlane;
+	uint32_t maxPerCluster;
+	uint32_t padding[3];
+};
+
+// View space bounds of the clusters: x depends on the column and the slice, y on the row and the slice
+struct ClusterBounds {
+	std::vector<float> minX, maxX;	// [slice][column]
+	std::vector<float> minY, maxY;	// [slice][row]
+	std::vector<float> nearDepth, farDepth;	// [slice], positive depths
+};
+
+// Bins the lights into the clusters: cluster i gets counts[i] lights, listed from indices[i * MAX_LIGHTS_PER_CLUSTER].
+// Same lists as cluster.comp (up to rounding on the borders), sorted. SSE, one job per slice.
+void binLights(const ClusterHeader& header, const ClusterBounds& bounds, const GpuLight* lights,
+			   uint32_t* counts, uint32_t* indices, JobSystem* jobs);
+void computeClusterBounds(const ClusterHeader& header, ClusterBounds& bounds);
+
+// Clustered forward shading: the view frustum is cut into a grid of froxels (tiles of the screen
+// times exponential depth slices) and every froxel gets the list of lights reaching it, so that a
+// fragment only walks the lights of its froxel. The lights are written in view space every frame;
+// the binning is a compute task (cluster.comp), or done on the job threads when there is no GPU
+// binning (headless tests, debugging).
+// One part per frame in flight in each buffer, with its own descriptor set.
+class ClusteredLighting
+{
+private:
+	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+	VkDevice device = VK_NULL_HANDLE;
+	JobSystem* jobs = nullptr;
+	uint32_t maxLights = 0;
+	bool gpuBinning = true;
+
+	std::vector<LightSource> sources;
+	ClusterHeader header = {};
+	std::vector<GpuLight> visible;	// Copied to the buffer once complete, mapped memory is not read back
+
+	// CPU binning, copied to the mapped buffer afterwards
+	ClusterBounds bounds;
+	std::vector<uint32_t> counts;
+	std::vector<uint32_t> indices;
+
+	// Header and lights, written every frame
+	VkBuffer lightBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory lightMemory = VK_NULL_HANDLE;
+	uint8_t* lightData = nullptr;
+	VkDeviceSize lightPartSize = 0;
+
+	// Counts then indices. Device local when binned by the GPU, mapped otherwise.
+	VkBuffer clusterBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory clusterMemory = VK_NULL_HANDLE;
+	uint8_t* clusterData = nullptr;
+	VkDeviceSize countsSize = 0;
+	VkDeviceSize clusterPartSize = 0;
+
+	VkDescriptorSetLayout setLayout = VK_NULL_HANDLE;
+	VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+	std::vector<VkDescriptorSet> descriptorSets;	// Per frame
+
+	VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+	VkPipeline pipeline = VK_NULL_HANDLE;
+
+public:
+	// The buffers are shared with the compute queue family when binned by the GPU
+	void init(const DeviceCapabilities& capabilities, VkDevice device, const ComputeScheduler& compute, JobSystem* jobs,
+			  uint32_t frameCount, uint32_t maxLights, bool gpuBinning);
+	void destroy();
+
+	// Binning pipeline, the module is destroyed by the caller
+	void createPipeline(VkShaderModule shaderModule);
+
+	// Used every frame until the next call. Over maxLights visible lights, the last ones are ignored.
+	void setLights(const LightSource* lights, uint32_t count);
+	const std::vector<LightSource>& getLights() const { return sources; }
+
+	// Writes the visible lights of 'frame' in view space, and bins them when the CPU does it.
+	// The part of the frame must not be in use anymore.
+	void prepare(uint32_t frame, const glm::mat4& viewMatrix, float fovY, VkExtent2D extent, float nearPlane, float farPlane);
+
+	// Compute task: clusters of 'frame', read by the fragment shaders once it is done
+	void record(VkCommandBuffer cmdBuffer, uint32_t frame);
+
+	bool isGpuBinning() const { return gpuBinning; }
+	uint32_t getVisibleCount() const { return header.lightCount; }
+
+	// Set 1 of the scene pipelines, set 0 of the binning
+	VkDescriptorSetLayout getSetLayout() const { return setLayout; }
+	VkDescriptorSet getDescriptorSet(uint32_t frame) const { return descriptorSets[frame]; }
+};
@@ -0,0 +1,106 @@
+#include "ComputeScheduler.h"
+#include <assert.h>
+
+void ComputeScheduler::init(VkDevice device, uint32_t graphicsFamily, uint32_t computeFamily, VkQueue computeQueue, uint32_t frameCount, bool timelineSemaphores)
+{
+	this->device = device;
+	this->graphicsFamily = graphicsFamily;
+	this->computeFamily = computeFamily;
+	this->computeQueue = computeQueue;
+
+	VkCommandPoolCreateInfo commandPoolInfo = {};
+	commandPoolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+	commandPoolInfo.queueFamilyIndex = computeFamily;
+	commandPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+
+	VkResult res = vkCreateCommandPool(device, &commandPoolInfo, nullptr, &commandPool);
+	assert(res == VK_SUCCESS);
+
+	VkCommandBufferAllocateInfo bufferAllocInfo = {};
+	bufferAllocInfo.commandBufferCount = frameCount;
+	bufferAllocInfo.commandPool = commandPool;
+	bufferAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	bufferAllocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+
+	commandBuffers.resize(frameCount);
+	res = vkAllocateCommandBuffers(device, &bufferAllocInfo, commandBuffers.data());
+	assert(res == VK_SUCCESS);
+
+	timeline.init(device, computeQueue, timelineSemaphores);
+}
+
+void ComputeScheduler::destroy()
+{
+	timeline.destroy();
+
+	if (commandPool != VK_NULL_HANDLE) {
+		vkDestroyCommandPool(device, commandPool, nullptr);
+		commandPool = VK_NULL_HANDLE;
+	}
+}
+
+uint32_t ComputeScheduler::addTask(const std::string& name, const std::function<void(VkCommandBuffer)>& record, VkPipelineStageFlags consumerStages)
+{
+	tasks.push_back({ name, record, consumerStages });
+	return uint32_t(tasks.size()) - 1;
+}
+
+void ComputeScheduler::share(VkBufferCreateInfo& bufferInfo, uint32_t* families) const
+{
+	if (!isAsync()) {
+		bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		return;
+	}
+
+	// Concurrent access: no ownership transfer between the queues
+	families[0] = graphicsFamily;
+	families[1] = computeFamily;
+	bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+	bufferInfo.queueFamilyIndexCount = 2;
+	bufferInfo.pQueueFamilyIndices = families;
+}
+
+void ComputeScheduler::share(VkImageCreateInfo& imageInfo, uint32_t* families) const
+{
+	if (!isAsync()) {
+		imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		return;
+	}
+
+	families[0] = graphicsFamily;
+	families[1] = computeFamily;
+	imageInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+	imageInfo.queueFamilyIndexCount = 2;
+	imageInfo.pQueueFamilyIndices = families;
+}
+
+SyncPoint ComputeScheduler::submit(uint32_t frame, VkPipelineStageFlags& waitStages, SyncPoint wait, VkPipelineStageFlags waitStage)
+{
+	waitStages = 0;
+	if (tasks.empty()) {
+		return SyncPoint();
+	}
+
+	VkCommandBufferBeginInfo beginInfo = {};
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+	VkCommandBuffer cmdBuffer = commandBuffers[frame];
+	vkResetCommandBuffer(cmdBuffer, 0);
+	vkBeginCommandBuffer(cmdBuffer, &beginInfo);
+	for (const ComputeTask& task : tasks) {
+		task.record(cmdBuffer);
+		waitStages |= task.consumerStages;
+	}
+	vkEndCommandBuffer(cmdBuffer);
+
+	Submission submission;
+	submission.cmdBuffers.push_back(cmdBuffer);
+	submission.wait(wait, waitStage);
+
+	// Runs alongside the graphics work of the previous frame when the queue is async
+	SyncPoint done;
+	done.timeline = &timeline;
+	done.value = timeline.submit(submission);
+	return done;
+}
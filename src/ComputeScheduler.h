@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <vector>
+#include <string>
+#include <functional>
+#include "Timeline.h"
+
+struct ComputeTask {
+	std::string name;
+	std::function<void(VkCommandBuffer)> record;
+	VkPipelineStageFlags consumerStages;	// Graphics stages reading the results
+};
+
+// Records the compute work of a frame in its own command buffer and submits it to
+// the async compute queue when the device has one (to the graphics queue otherwise).
+// The graphics submission waits for its timeline value, only at the stages using its results.
+class ComputeScheduler
+{
+private:
+	VkDevice device;
+	uint32_t graphicsFamily;
+	uint32_t computeFamily;
+	VkQueue computeQueue;
+
+	VkCommandPool commandPool = VK_NULL_HANDLE;
+	std::vector<VkCommandBuffer> commandBuffers;	// Per frame
+	Timeline timeline;
+	std::vector<ComputeTask> tasks;
+
+public:
+	void init(VkDevice device, uint32_t graphicsFamily, uint32_t computeFamily, VkQueue computeQueue, uint32_t frameCount, bool timelineSemaphores);
+	void destroy();
+
+	bool isAsync() const { return computeFamily != graphicsFamily; }
+	uint32_t getFamily() const { return computeFamily; }
+
+	// Recorded every frame, in the order they were added
+	uint32_t addTask(const std::string& name, const std::function<void(VkCommandBuffer)>& record, VkPipelineStageFlags consumerStages);
+
+	// Resources written by compute and read by graphics are shared by both families
+	void share(VkBufferCreateInfo& bufferInfo, uint32_t* families) const;
+	void share(VkImageCreateInfo& imageInfo, uint32_t* families) const;
+
+	// The graphics work of this frame must be done before calling it again.
+	// Returns the point to wait for at waitStages, no timeline without compute work.
+	SyncPoint submit(uint32_t frame, VkPipelineStageFlags& waitStages, SyncPoint wait = SyncPoint(), VkPipelineStageFlags waitStage = 0);
+
+	Timeline& getTimeline() { return timeline; }
+};
@@ -0,0 +1,87 @@
+#include "DeletionQueue.h"
+
+#define HANDLE(type, object) ((type)(object))
+
+void DeletionQueue::close(uint64_t submitted)
+{
+	if (open.objects.empty() && open.deleters.empty()) {
+		return;
+	}
+
+	open.value = submitted;
+	closed.push_back(std::move(open));
+	open = Batch();
+}
+
+void DeletionQueue::collect(uint64_t completed)
+{
+	// Values only grow: once a batch is still in use, the next ones are too
+	while (!closed.empty() && closed.front().value <= completed) {
+		release(closed.front());
+		closed.pop_front();
+	}
+}
+
+void DeletionQueue::flush()
+{
+	for (Batch& batch : closed) {
+		release(batch);
+	}
+	closed.clear();
+
+	release(open);
+	open = Batch();
+}
+
+size_t DeletionQueue::size() const
+{
+	size_t count = open.objects.size() + open.deleters.size();
+	for (const Batch& batch : closed) {
+		count += batch.objects.size() + batch.deleters.size();
+	}
+	return count;
+}
+
+void DeletionQueue::release(Batch& batch)
+{
+	// Composite objects first, they may own some of the handles below
+	for (auto& deleter : batch.deleters) {
+		deleter();
+	}
+
+	// Views before images and everything before the memory it is bound to
+	static const ObjectType order[] = {
+		OBJECT_PIPELINE, OBJECT_DESCRIPTOR_SET, OBJECT_COMMAND_BUFFER, OBJECT_SAMPLER,
+		OBJECT_IMAGE_VIEW, OBJECT_IMAGE, OBJECT_BUFFER, OBJECT_MEMORY,
+	};
+
+	for (ObjectType type : order) {
+		for (const Object& object : batch.objects) {
+			if (object.type != type) {
+				continue;
+			}
+
+			switch (type) {
+			case OBJECT_BUFFER: vkDestroyBuffer(device, HANDLE(VkBuffer, object.handle), nullptr); break;
+			case OBJECT_IMAGE: vkDestroyImage(device, HANDLE(VkImage, object.handle), nullptr); break;
+			case OBJECT_IMAGE_VIEW: vkDestroyImageView(device, HANDLE(VkImageView, object.handle), nullptr); break;
+			case OBJECT_MEMORY: vkFreeMemory(device, HANDLE(VkDeviceMemory, object.handle), nullptr); break;
+			case OBJECT_SAMPLER: vkDestroySampler(device, HANDLE(VkSampler, object.handle), nullptr); break;
+			case OBJECT_PIPELINE: vkDestroyPipeline(device, HANDLE(VkPipeline, object.handle), nullptr); break;
+			case OBJECT_COMMAND_BUFFER: {
+				VkCommandBuffer cmdBuffer = (VkCommandBuffer)(uintptr_t)object.handle;
+				vkFreeCommandBuffers(device, HANDLE(VkCommandPool, object.pool), 1, &cmdBuffer);
+				break;
+			}
+			case OBJECT_DESCRIPTOR_SET: {
+				VkDescriptorSet set = HANDLE(VkDescriptorSet, object.handle);
+				vkFreeDescriptorSets(device, HANDLE(VkDescriptorPool, object.pool), 1, &set);
+				break;
+			}
+			}
+		}
+	}
+
+	batch.objects.clear();
+	batch.deleters.clear();
+}
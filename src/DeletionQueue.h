@@ -0,0 +1,80 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <functional>
+
+// Vulkan objects released once the GPU is done with them, without waiting for the device to be idle.
+// The objects queued since the last close() form a batch, tagged with the graphics timeline value
+// submitted last: it is released once the timeline reaches it. Compute work is always waited for by
+// a later graphics submission, so the graphics timeline covers it too.
+class DeletionQueue
+{
+private:
+	enum ObjectType {
+		OBJECT_BUFFER,
+		OBJECT_IMAGE,
+		OBJECT_IMAGE_VIEW,
+		OBJECT_MEMORY,
+		OBJECT_SAMPLER,
+		OBJECT_PIPELINE,
+		OBJECT_COMMAND_BUFFER,
+		OBJECT_DESCRIPTOR_SET,
+	};
+
+	struct Object {
+		ObjectType type;
+		uint64_t handle;
+		uint64_t pool;	// Command and descriptor pools
+	};
+
+	struct Batch {
+		uint64_t value = 0;
+		std::vector<Object> objects;
+		std::vector<std::function<void()>> deleters;
+	};
+
+	VkDevice device = VK_NULL_HANDLE;
+	Batch open;
+	std::deque<Batch> closed;	// Oldest first
+
+public:
+	void init(VkDevice device) { this->device = device; }
+
+	void destroy(VkBuffer buffer) { push(OBJECT_BUFFER, buffer); }
+	void destroy(VkImage image) { push(OBJECT_IMAGE, image); }
+	void destroy(VkImageView view) { push(OBJECT_IMAGE_VIEW, view); }
+	void destroy(VkSampler sampler) { push(OBJECT_SAMPLER, sampler); }
+	void destroy(VkPipeline pipeline) { push(OBJECT_PIPELINE, pipeline); }
+	void free(VkDeviceMemory memory) { push(OBJECT_MEMORY, memory); }
+	void free(VkCommandPool pool, VkCommandBuffer cmdBuffer) { push(OBJECT_COMMAND_BUFFER, cmdBuffer, (uint64_t)pool); }
+	// The pool needs VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT
+	void free(VkDescriptorPool pool, VkDescriptorSet set) { push(OBJECT_DESCRIPTOR_SET, set, (uint64_t)pool); }
+	// Anything else, or objects owning several handles
+	void destroy(const std::function<void()>& deleter) { open.deleters.push_back(deleter); }
+
+	// After a queue submission: the objects queued until now may be used by it
+	void close(uint64_t submitted);
+
+	// Releases the batches whose value is reached
+	void collect(uint64_t completed);
+
+	// Releases everything, the device must be idle
+	void flush();
+
+	size_t size() const;
+
+private:
+	// Non dispatchable handles are 64 bits integers on 32 bits platforms
+	template<typename T>
+	void push(ObjectType type, T handle, uint64_t pool = 0)
+	{
+		if (handle != VK_NULL_HANDLE) {
+			open.objects.push_back({ type, uint64_t(handle), pool });
+		}
+	}
+
+	void release(Batch& batch);
+};
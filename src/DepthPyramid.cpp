@@ -0,0 +1,277 @@
+#include "DepthPyramid.h"
+#include "DeviceCapabilities.h"
+#include "SamplerCache.h"
+#include <assert.h>
+#include <algorithm>
+#include "helpers\Helpers.h"
+
+namespace {
+
+	// Push constants of depthPyramid.comp and depthPyramidMS.comp
+	struct ReduceConstants {
+		uint32_t sourceSize[2];
+		uint32_t destinationSize[2];
+	};
+
+	// Layout change and dependency on some levels of the pyramid
+	void levelBarrier(VkCommandBuffer cmdBuffer, VkImage image, uint32_t firstLevel, uint32_t levelCount, VkImageLayout oldLayout, VkImageLayout newLayout,
+					  VkAccessFlags srcAccess, VkAccessFlags dstAccess, VkPipelineStageFlags srcStage, VkPipelineStageFlags dstStage)
+	{
+		VkImageMemoryBarrier imageBarrier = {};
+		imageBarrier.image = image;
+		imageBarrier.oldLayout = oldLayout;
+		imageBarrier.newLayout = newLayout;
+		imageBarrier.srcAccessMask = srcAccess;
+		imageBarrier.dstAccessMask = dstAccess;
+		imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		imageBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		imageBarrier.subresourceRange.baseMipLevel = firstLevel;
+		imageBarrier.subresourceRange.levelCount = levelCount;
+		imageBarrier.subresourceRange.layerCount = 1;
+		imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+
+		vkCmdPipelineBarrier(cmdBuffer, srcStage, dstStage, 0, 0, nullptr, 0, nullptr, 1, &imageBarrier);
+	}
+}
+
+void DepthPyramid::init(const DeviceCapabilities& capabilities, VkDevice device, SamplerCache& samplers, VkExtent2D depthExtent, VkSampleCountFlagBits depthSamples)
+{
+	this->physicalDevice = capabilities.physicalDevice;
+	this->device = device;
+	this->depthSamples = depthSamples;
+
+	// Half the depth rounded up, down to a single texel
+	size.width = std::max((depthExtent.width + 1) / 2, 1u);
+	size.height = std::max((depthExtent.height + 1) / 2, 1u);
+	levelCount = 1;
+	while ((std::max(size.width, size.height) >> levelCount) > 0) {
+		levelCount++;
+	}
+	builtExtent = depthExtent;
+
+	VkImageCreateInfo imageInfo = {};
+	imageInfo.arrayLayers = 1;
+	imageInfo.extent = { size.width, size.height, 1 };
+	imageInfo.imageType = VK_IMAGE_TYPE_2D;
+	imageInfo.format = DEPTH_PYRAMID_FORMAT;
+	imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	imageInfo.mipLevels = levelCount;
+	imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+	imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+	imageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+	imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+
+	VkResult res = vkCreateImage(device, &imageInfo, nullptr, &image);
+	assert(res == VK_SUCCESS);
+
+	VkMemoryRequirements memoryRequirements;
+	vkGetImageMemoryRequirements(device, image, &memoryRequirements);
+
+	VkMemoryAllocateInfo memoryAllocInfo = {};
+	memoryAllocInfo.allocationSize = memoryRequirements.size;
+	memoryAllocInfo.memoryTypeIndex = vk::getMemoryType(physicalDevice, memoryRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	memoryAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	res = vkAllocateMemory(device, &memoryAllocInfo, nullptr, &memory);
+	assert(res == VK_SUCCESS);
+
+	res = vkBindImageMemory(device, image, memory, 0);
+	assert(res == VK_SUCCESS);
+
+	// Every level for the culling, one view per level for the build
+	VkImageViewCreateInfo viewInfo = {};
+	viewInfo.format = DEPTH_PYRAMID_FORMAT;
+	viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	viewInfo.subresourceRange.levelCount = levelCount;
+	viewInfo.subresourceRange.layerCount = 1;
+	viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+	viewInfo.image = image;
+	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+
+	res = vkCreateImageView(device, &viewInfo, nullptr, &view);
+	assert(res == VK_SUCCESS);
+
+	levelViews.resize(levelCount);
+	viewInfo.subresourceRange.levelCount = 1;
+	for (uint32_t level = 0; level < levelCount; level++) {
+		viewInfo.subresourceRange.baseMipLevel = level;
+		res = vkCreateImageView(device, &viewInfo, nullptr, &levelViews[level]);
+		assert(res == VK_SUCCESS);
+	}
+
+	// Only read with texelFetch: no filtering
+	VkSamplerCreateInfo samplerInfo = {};
+	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.magFilter = VK_FILTER_NEAREST;
+	samplerInfo.minFilter = VK_FILTER_NEAREST;
+	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	samplerInfo.maxLod = float(levelCount);
+	samplerInfo.maxAnisotropy = 1.0f;
+	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	sampler = samplers.get(samplerInfo);
+
+	// DESCRIPTORS: source, level written
+	VkDescriptorType types[] = { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE };
+	setLayout = vk::createDescriptorSetLayout(device, types, 2, VK_SHADER_STAGE_COMPUTE_BIT);
+	pipelineLayout = vk::createPipelineLayout(device, setLayout, sizeof(ReduceConstants), VK_SHADER_STAGE_COMPUTE_BIT);
+}
+
+void DepthPyramid::destroy()
+{
+	vkDestroyPipeline(device, reducePipeline, nullptr);
+	vkDestroyPipeline(device, depthPipeline, nullptr);
+	vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+	vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+	vkDestroyDescriptorSetLayout(device, setLayout, nullptr);
+	for (VkImageView levelView : levelViews) {
+		vkDestroyImageView(device, levelView, nullptr);
+	}
+	vkDestroyImageView(device, view, nullptr);
+	vkDestroyImage(device, image, nullptr);
+	vkFreeMemory(device, memory, nullptr);
+
+	// The sampler belongs to the cache
+	reducePipeline = VK_NULL_HANDLE;
+	depthPipeline = VK_NULL_HANDLE;
+	pipelineLayout = VK_NULL_HANDLE;
+	descriptorPool = VK_NULL_HANDLE;
+	setLayout = VK_NULL_HANDLE;
+	image = VK_NULL_HANDLE;
+	view = VK_NULL_HANDLE;
+	levelViews.clear();
+	descriptorSets.clear();
+	initialized = false;
+}
+
+void DepthPyramid::createPipelines(VkShaderModule reduceModule, VkShaderModule multisampledModule)
+{
+	reducePipeline = vk::createComputePipeline(device, reduceModule, pipelineLayout);
+	if (depthSamples == VK_SAMPLE_COUNT_1_BIT) {
+		return;
+	}
+
+	// Samples of the depth buffer, constant_id 0
+	uint32_t samples = uint32_t(depthSamples);
+	VkSpecializationMapEntry entry = { 0, 0, sizeof(uint32_t) };
+	VkSpecializationInfo specialization = {};
+	specialization.mapEntryCount = 1;
+	specialization.pMapEntries = &entry;
+	specialization.dataSize = sizeof(samples);
+	specialization.pData = &samples;
+	depthPipeline = vk::createComputePipeline(device, multisampledModule, pipelineLayout, &specialization);
+}
+
+void DepthPyramid::createDescriptorSets(VkImageView depthView)
+{
+	VkDescriptorPoolSize poolSizes[2] = {};
+	poolSizes[0].descriptorCount = levelCount;
+	poolSizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	poolSizes[1].descriptorCount = levelCount;
+	poolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+
+	VkDescriptorPoolCreateInfo descriptorPoolInfo = {};
+	descriptorPoolInfo.maxSets = levelCount;
+	descriptorPoolInfo.poolSizeCount = 2;
+	descriptorPoolInfo.pPoolSizes = poolSizes;
+	descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+
+	VkResult res = vkCreateDescriptorPool(device, &descriptorPoolInfo, nullptr, &descriptorPool);
+	assert(res == VK_SUCCESS);
+
+	std::vector<VkDescriptorSetLayout> setLayouts(levelCount, setLayout);
+	VkDescriptorSetAllocateInfo descriptorSetAllocInfo = {};
+	descriptorSetAllocInfo.descriptorPool = descriptorPool;
+	descriptorSetAllocInfo.descriptorSetCount = levelCount;
+	descriptorSetAllocInfo.pSetLayouts = setLayouts.data();
+	descriptorSetAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+
+	descriptorSets.resize(levelCount);
+	res = vkAllocateDescriptorSets(device, &descriptorSetAllocInfo, descriptorSets.data());
+	assert(res == VK_SUCCESS);
+
+	// Level 0 reads the depth buffer, the others the level above them
+	for (uint32_t level = 0; level < levelCount; level++) {
+		VkDescriptorImageInfo imageDescriptors[2] = {};
+		imageDescriptors[0].imageLayout = level == 0 ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_GENERAL;
+		imageDescriptors[0].imageView = level == 0 ? depthView : levelViews[level - 1];
+		imageDescriptors[0].sampler = sampler;
+		imageDescriptors[1].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+		imageDescriptors[1].imageView = levelViews[level];
+
+		VkWriteDescriptorSet writeDescriptorSets[2] = {};
+		for (uint32_t i = 0; i < 2; i++) {
+			writeDescriptorSets[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			writeDescriptorSets[i].descriptorCount = 1;
+			writeDescriptorSets[i].descriptorType = i == 0 ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER : VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+			writeDescriptorSets[i].dstSet = descriptorSets[level];
+			writeDescriptorSets[i].pImageInfo = &imageDescriptors[i];
+			writeDescriptorSets[i].dstBinding = i;
+		}
+		vkUpdateDescriptorSets(device, 2, writeDescriptorSets, 0, nullptr);
+	}
+}
+
+void DepthPyramid::prepare(VkCommandBuffer cmdBuffer)
+{
+	if (initialized) {
+		// Built by the late phase of the previous frame
+		VkMemoryBarrier barrier = {};
+		barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+							 0, 1, &barrier, 0, nullptr, 0, nullptr);
+		return;
+	}
+
+	// Nothing drawn yet: the far plane hides nothing
+	levelBarrier(cmdBuffer, image, 0, levelCount, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+				 0, VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+	VkClearColorValue far = {};
+	far.float32[0] = 1.0f;
+	VkImageSubresourceRange range = {};
+	range.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	range.levelCount = levelCount;
+	range.layerCount = 1;
+	vkCmdClearColorImage(cmdBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &far, 1, &range);
+	levelBarrier(cmdBuffer, image, 0, levelCount, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL,
+				 VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+	initialized = true;
+}
+
+void DepthPyramid::record(VkCommandBuffer cmdBuffer, VkExtent2D extent)
+{
+	// The early culling of this frame read the previous build
+	vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 0, nullptr);
+	builtExtent = extent;
+
+	// Each level waits for the one above it, the last barrier also covers the culling
+	ReduceConstants constants = {};
+	constants.sourceSize[0] = extent.width;
+	constants.sourceSize[1] = extent.height;
+	for (uint32_t level = 0; level < levelCount; level++) {
+		constants.destinationSize[0] = std::max((constants.sourceSize[0] + 1) / 2, 1u);
+		constants.destinationSize[1] = std::max((constants.sourceSize[1] + 1) / 2, 1u);
+
+		VkPipeline pipeline = level == 0 && depthPipeline != VK_NULL_HANDLE ? depthPipeline : reducePipeline;
+		vkCmdPushConstants(cmdBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+		vk::dispatch(cmdBuffer, pipeline, pipelineLayout, descriptorSets[level],
+					 vk::getGroupCount(constants.destinationSize[0], DEPTH_PYRAMID_GROUP_SIZE),
+					 vk::getGroupCount(constants.destinationSize[1], DEPTH_PYRAMID_GROUP_SIZE));
+		levelBarrier(cmdBuffer, image, level, 1, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL,
+					 VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+		constants.sourceSize[0] = constants.destinationSize[0];
+		constants.sourceSize[1] = constants.destinationSize[1];
+	}
+}
+
+void DepthPyramid::setConstants(CullConstants& constants) const
+{
+	constants.pyramidSize[0] = std::max((builtExtent.width + 1) / 2, 1u);
+	constants.pyramidSize[1] = std::max((builtExtent.height + 1) / 2, 1u);
+	constants.levelCount = levelCount;
+}
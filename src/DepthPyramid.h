@@ -0,0 +1,83 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <stdint.h>
+#include <vector>
+
+class DeviceCapabilities;
+class SamplerCache;
+
+#define DEPTH_PYRAMID_FORMAT VK_FORMAT_R32_SFLOAT
+#define DEPTH_PYRAMID_GROUP_SIZE 8	// local_size_x and y of depthPyramid.comp
+
+// The culling runs twice per frame: the early phase draws what the pyramid of the previous frame does not hide,
+// the pyramid is built again from that depth, then the late phase draws what the early one hid but this one does not.
+enum CullPhase {
+	CULL_EARLY,
+	CULL_LATE,
+};
+
+// Push constants of the culling shaders (objectCull.comp, meshletCull.comp)
+struct CullConstants {
+	float tanHalfFov[2];
+	float nearPlane;
+	float farPlane;
+	float projection[4];	// [0][0], [1][1], [2][2] and [3][2]: screen box and depth of a sphere
+	uint32_t pyramidSize[2];	// Texels of level 0 covering the drawn part of the depth
+	uint32_t levelCount;	// 0 leaves the occlusion test out
+	uint32_t phase;
+	uint32_t coneCulling;	// Only when the back faces are culled
+	uint32_t objectCount;	// objectCull.comp
+	uint32_t padding[2];
+};
+
+// Hierarchical depth of a view: level 0 is half the depth buffer, every texel keeps the farthest depth of the
+// 2x2 texels under it. A sphere whose nearest depth is behind the texels covering its screen box is hidden.
+// Built by compute from the depth of the early passes, in a command pass of the graph reading it; the image
+// stays outside the graph (mipmapped, kept from one frame to the next) and in the general layout.
+class DepthPyramid
+{
+private:
+	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+	VkDevice device = VK_NULL_HANDLE;
+	VkSampleCountFlagBits depthSamples = VK_SAMPLE_COUNT_1_BIT;
+
+	VkImage image = VK_NULL_HANDLE;
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkImageView view = VK_NULL_HANDLE;	// Every level, read by the culling
+	std::vector<VkImageView> levelViews;
+	VkExtent2D size = {};
+	uint32_t levelCount = 0;
+	bool initialized = false;	// Cleared to the far plane before its first use
+
+	VkExtent2D builtExtent = {};	// Of the depth the last build read
+
+	VkSampler sampler = VK_NULL_HANDLE;	// Owned by the cache
+	VkDescriptorSetLayout setLayout = VK_NULL_HANDLE;
+	VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+	VkPipeline reducePipeline = VK_NULL_HANDLE;
+	VkPipeline depthPipeline = VK_NULL_HANDLE;	// Level 0, from every sample of a multisampled depth
+	VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+	std::vector<VkDescriptorSet> descriptorSets;	// Per level: its source, the level written
+
+public:
+	// 'depthExtent' and 'depthSamples' of the depth buffer it is built from
+	void init(const DeviceCapabilities& capabilities, VkDevice device, SamplerCache& samplers, VkExtent2D depthExtent, VkSampleCountFlagBits depthSamples);
+	void destroy();
+
+	// The modules are destroyed by the caller, 'multisampledModule' is only used with a multisampled depth
+	void createPipelines(VkShaderModule reduceModule, VkShaderModule multisampledModule);
+	// Once the graph is compiled: 'depthView' is read in the shader read only layout, depth aspect only
+	void createDescriptorSets(VkImageView depthView);
+
+	// Before the culling of the frame: waits for the last build, or clears the pyramid on its first use
+	void prepare(VkCommandBuffer cmdBuffer);
+	// From the top left 'extent' of the depth, every level. Followed by the barrier of the culling.
+	void record(VkCommandBuffer cmdBuffer, VkExtent2D extent);
+
+	// Occlusion part of the constants, for the pyramid as the last build left it
+	void setConstants(CullConstants& constants) const;
+
+	VkImageView getView() const { return view; }
+	VkSampler getSampler() const { return sampler; }
+};
@@ -0,0 +1,130 @@
+#include "DeviceCapabilities.h"
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+namespace {
+
+	uint64_t getTypeScore(VkPhysicalDeviceType type)
+	{
+		switch (type) {
+		case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: return 4;
+		case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: return 3;
+		case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: return 2;
+		case VK_PHYSICAL_DEVICE_TYPE_CPU: return 1;	// Software rasterizers (lavapipe, SwiftShader...)
+		default: return 0;
+		}
+	}
+}
+
+void DeviceCapabilities::query(VkPhysicalDevice physicalDevice)
+{
+	this->physicalDevice = physicalDevice;
+	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+	vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memory);
+	vkGetPhysicalDeviceFeatures(physicalDevice, &supported);
+
+	uint32_t familyCount;
+	vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount, nullptr);
+	queueFamilies.resize(familyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount, queueFamilies.data());
+
+	uint32_t extensionCount;
+	vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, nullptr);
+	std::vector<VkExtensionProperties> extensionProperties(extensionCount);
+	vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, extensionProperties.data());
+	extensions.clear();
+	for (const VkExtensionProperties& extension : extensionProperties) {
+		extensions.push_back(extension.extensionName);
+	}
+
+	deviceLocalMemory = 0;
+	for (uint32_t i = 0; i < memory.memoryHeapCount; i++) {
+		if ((memory.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) && memory.memoryHeaps[i].size > deviceLocalMemory) {
+			deviceLocalMemory = memory.memoryHeaps[i].size;
+		}
+	}
+
+	lazilyAllocatedMemory = false;
+	for (uint32_t i = 0; i < memory.memoryTypeCount; i++) {
+		lazilyAllocatedMemory = lazilyAllocatedMemory || (memory.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT);
+	}
+}
+
+uint64_t DeviceCapabilities::score() const
+{
+	// The type always wins, the heap size (in MB) only separates devices of the same type
+	return (getTypeScore(properties.deviceType) << 48) | (deviceLocalMemory >> 20);
+}
+
+void DeviceCapabilities::enableFeatures(const VkPhysicalDeviceFeatures& requested)
+{
+	// The structure is only made of VkBool32
+	const VkBool32* wanted = reinterpret_cast<const VkBool32*>(&requested);
+	const VkBool32* available = reinterpret_cast<const VkBool32*>(&supported);
+	VkBool32* enabling = reinterpret_cast<VkBool32*>(&enabled);
+
+	for (size_t i = 0; i < sizeof(VkPhysicalDeviceFeatures) / sizeof(VkBool32); i++) {
+		enabling[i] = wanted[i] && available[i] ? VK_TRUE : VK_FALSE;
+	}
+}
+
+bool DeviceCapabilities::hasExtension(const char* name) const
+{
+	for (const std::string& extension : extensions) {
+		if (extension == name) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool DeviceCapabilities::hasGraphicsQueue() const
+{
+	for (const VkQueueFamilyProperties& family : queueFamilies) {
+		if (family.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool DeviceCapabilities::hasTimestamps(uint32_t queueFamily) const
+{
+	return properties.limits.timestampComputeAndGraphics && queueFamilies[queueFamily].timestampValidBits > 0;
+}
+
+DeviceCapabilities DeviceCapabilities::choose(VkInstance instance, const char* requiredExtension)
+{
+	uint32_t physicalDeviceCount;
+	vkEnumeratePhysicalDevices(instance, &physicalDeviceCount, nullptr);
+	std::vector<VkPhysicalDevice> physicalDevices(physicalDeviceCount);
+	vkEnumeratePhysicalDevices(instance, &physicalDeviceCount, physicalDevices.data());
+
+	const char* preferred = getenv("VULKAN_DEVICE");
+
+	DeviceCapabilities best;
+	bool found = false;
+	for (VkPhysicalDevice physicalDevice : physicalDevices) {
+		DeviceCapabilities candidate;
+		candidate.query(physicalDevice);
+		if (!candidate.hasGraphicsQueue() || !candidate.hasExtension(requiredExtension)) {
+			continue;
+		}
+
+		if (preferred && strstr(candidate.properties.deviceName, preferred)) {
+			best = candidate;
+			found = true;
+			break;
+		}
+		if (!found || candidate.score() > best.score()) {
+			best = candidate;
+			found = true;
+		}
+	}
+	assert(found);
+
+	std::cout << "Device: " << best.properties.deviceName << std::endl;
+	return best;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <vector>
+#include <string>
+
+// What a physical device can do. The renderer chooses its paths from here instead of assuming.
+class DeviceCapabilities
+{
+public:
+	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+	VkPhysicalDeviceProperties properties;
+	VkPhysicalDeviceMemoryProperties memory;
+	VkPhysicalDeviceFeatures supported;
+	VkPhysicalDeviceFeatures enabled = {};	// Given to vkCreateDevice
+	std::vector<VkQueueFamilyProperties> queueFamilies;
+	std::vector<std::string> extensions;
+
+	VkDeviceSize deviceLocalMemory = 0;	// Largest device local heap
+	bool lazilyAllocatedMemory = false;
+
+	void query(VkPhysicalDevice physicalDevice);
+
+	// Discrete > integrated > virtual > CPU, then the largest device local heap
+	uint64_t score() const;
+
+	// Only the requested features the device supports are enabled
+	void enableFeatures(const VkPhysicalDeviceFeatures& requested);
+
+	bool hasExtension(const char* name) const;
+	bool hasGraphicsQueue() const;
+	bool hasTimestamps(uint32_t queueFamily) const;
+	const VkPhysicalDeviceLimits& limits() const { return properties.limits; }
+
+	// Best suitable device, or the first one whose name contains the VULKAN_DEVICE environment variable.
+	// Equal scores keep the enumeration order, so the choice is the same from one run to another.
+	static DeviceCapabilities choose(VkInstance instance, const char* requiredExtension);
+};
@@ -0,0 +1,66 @@
+#include "DrawList.h"
+
+namespace {
+
+	uint64_t depthBucket(float depth, float farPlane)
+	{
+		float normalized = depth / farPlane;
+		if (normalized < 0.0f) normalized = 0.0f;
+		if (normalized > 1.0f) normalized = 1.0f;
+		return uint64_t(normalized * float(0xFFFFFF));
+	}
+}
+
+uint64_t DrawList::makeKey(uint32_t pipeline, uint32_t material, float depth, float farPlane, uint32_t mesh)
+{
+	return (uint64_t(pipeline & 0xFF) << 56)
+		| (uint64_t(material & 0xFFFF) << 40)
+		| (depthBucket(depth, farPlane) << 16)
+		| uint64_t(mesh & 0xFFFF);
+}
+
+uint64_t DrawList::makeDepthKey(uint32_t pipeline, float depth, float farPlane, uint32_t mesh)
+{
+	return (uint64_t(pipeline & 0xFF) << 56)
+		| (depthBucket(depth, farPlane) << 16)
+		| uint64_t(mesh & 0xFFFF);
+}
+
+void DrawList::clear()
+{
+	commands.clear();
+}
+
+void DrawList::add(const DrawCommand& command)
+{
+	commands.push_back(command);
+}
+
+void DrawList::resize(size_t count)
+{
+	commands.resize(count);
+}
+
+void DrawList::sort()
+{
+	size_t count = commands.size();
+	if (count < 2) {
+		return;
+	}
+
+	// Only the keys move around during the sort, the commands are gathered once at the end
+	entries.resize(count);
+	scratch.resize(count);
+	for (size_t i = 0; i < count; i++) {
+		entries[i].key = commands[i].key;
+		entries[i].index = uint32_t(i);
+	}
+
+	const SortEntry* result = radixSort(entries.data(), scratch.data(), count, sizeof(uint64_t));
+
+	sorted.resize(count);
+	for (size_t i = 0; i < count; i++) {
+		sorted[i] = commands[result[i].index];
+	}
+	commands.swap(sorted);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "RadixSort.h"
+
+// Sort key, most significant bits first:
+// | pipeline (8) | material (16) | depth bucket (24) | mesh (16) |
+// Sorting by key groups draws by state and orders each group front to back.
+struct DrawCommand {
+	uint64_t key;
+	uint32_t pipeline;
+	uint32_t material;
+	uint32_t mesh;
+	uint32_t object;
+	uint32_t instance;	// Of the meshlet culling, UINT32_MAX for a regular draw
+};
+
+class DrawList
+{
+private:
+	std::vector<DrawCommand> commands;
+	std::vector<DrawCommand> sorted;
+	std::vector<SortEntry> entries;
+	std::vector<SortEntry> scratch;
+
+public:
+	// Opaque draws: minimizes state changes first, then front to back
+	static uint64_t makeKey(uint32_t pipeline, uint32_t material, float depth, float farPlane, uint32_t mesh);
+	// Depth-only draws: few pipelines (alpha test or not), then front to back
+	static uint64_t makeDepthKey(uint32_t pipeline, float depth, float farPlane, uint32_t mesh);
+
+	void clear();
+	void add(const DrawCommand& command);
+	// Room for 'count' commands, filled through data(), from several threads if needed
+	void resize(size_t count);
+	void sort();
+
+	inline size_t size() const { return commands.size(); }
+	inline DrawCommand* data() { return commands.data(); }
+	inline const DrawCommand& operator[](size_t i) const { return commands[i]; }
+	inline std::vector<DrawCommand>::const_iterator begin() const { return commands.begin(); }
+	inline std::vector<DrawCommand>::const_iterator end() const { return commands.end(); }
+};
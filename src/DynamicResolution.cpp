@@ -0,0 +1,113 @@
+#include "DynamicResolution.h"
+#include "DeviceCapabilities.h"
+#include <assert.h>
+#include <math.h>
+#include <algorithm>
+
+#define BUDGET_HEADROOM 0.9f	// Aims under the budget, the time of a frame is known a few frames late
+#define SCALE_UP_RATE 0.05f		// Part of the way to the wanted scale covered per frame when going up
+
+void DynamicResolution::init(const DeviceCapabilities& capabilities, VkDevice device, uint32_t queueFamily, uint32_t frameCount)
+{
+	this->device = device;
+	timed.assign(frameCount, false);
+	frameScales.assign(frameCount, maxScale);
+	scale = maxScale;
+
+	supported = capabilities.hasTimestamps(queueFamily);
+	if (!supported) {
+		return;
+	}
+
+	timestampPeriod = capabilities.limits().timestampPeriod;
+	uint32_t validBits = capabilities.queueFamilies[queueFamily].timestampValidBits;
+	timestampMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+
+	// Start and end of each frame
+	VkQueryPoolCreateInfo queryPoolInfo = {};
+	queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	queryPoolInfo.queryCount = 2 * frameCount;
+	queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+
+	VkResult res = vkCreateQueryPool(device, &queryPoolInfo, nullptr, &queryPool);
+	assert(res == VK_SUCCESS);
+}
+
+void DynamicResolution::destroy()
+{
+	vkDestroyQueryPool(device, queryPool, nullptr);
+	queryPool = VK_NULL_HANDLE;
+	supported = false;
+}
+
+void DynamicResolution::setBudget(float milliseconds, float minScale, float maxScale)
+{
+	budget = milliseconds;
+	this->minScale = minScale;
+	this->maxScale = maxScale;
+	scale = std::min(std::max(scale, minScale), maxScale);
+	if (budget <= 0.0f) {
+		scale = maxScale;
+	}
+}
+
+void DynamicResolution::update(uint32_t frame)
+{
+	if (!supported || !timed[frame]) {
+		return;
+	}
+	timed[frame] = false;
+
+	uint64_t timestamps[2];
+	VkResult res = vkGetQueryPoolResults(device, queryPool, 2 * frame, 2, sizeof(timestamps), timestamps, sizeof(uint64_t),
+										 VK_QUERY_RESULT_64_BIT);
+	if (res != VK_SUCCESS) {
+		return;
+	}
+	gpuTime = float(double((timestamps[1] - timestamps[0]) & timestampMask) * timestampPeriod * 1e-6);
+	if (budget <= 0.0f) {
+		return;
+	}
+
+	// The cost follows the pixel count, the square of the scale. Measured at the scale of that frame:
+	// the frames still in flight at a spike all ask for the same scale instead of dividing it again.
+	float wanted = frameScales[frame] * sqrtf(budget * BUDGET_HEADROOM / std::max(gpuTime, 0.01f));
+	if (wanted < scale) {
+		scale = wanted;
+	}
+	else {
+		scale += (wanted - scale) * SCALE_UP_RATE;
+	}
+	scale = std::min(std::max(scale, minScale), maxScale);
+}
+
+void DynamicResolution::begin(VkCommandBuffer cmdBuffer, uint32_t frame)
+{
+	if (!supported) {
+		return;
+	}
+
+	vkCmdResetQueryPool(cmdBuffer, queryPool, 2 * frame, 2);
+	vkCmdWriteTimestamp(cmdBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPool, 2 * frame);
+	frameScales[frame] = scale;
+}
+
+void DynamicResolution::end(VkCommandBuffer cmdBuffer, uint32_t frame)
+{
+	if (!supported) {
+		return;
+	}
+
+	vkCmdWriteTimestamp(cmdBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, 2 * frame + 1);
+	timed[frame] = true;
+}
+
+VkExtent2D DynamicResolution::getExtent(VkExtent2D extent) const
+{
+	VkExtent2D scaled;
+	scaled.width = std::max(uint32_t(extent.width * scale + 0.5f), 1u);
+	scaled.height = std::max(uint32_t(extent.height * scale + 0.5f), 1u);
+	scaled.width = std::min(scaled.width, extent.width);
+	scaled.height = std::min(scaled.height, extent.height);
+	return scaled;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <stdint.h>
+#include <vector>
+
+class DeviceCapabilities;
+
+// Render scale following the GPU time of the frames. The scene is drawn in the top left part of its
+// targets and stretched back to the output by the post chain: nothing is reallocated when the scale changes.
+// A frame is timed by timestamps at both ends of its command buffer, read once the frame is done.
+// Over the budget the scale drops at once, under it the scale climbs back slowly: a load spike costs
+// resolution for a moment instead of dropped frames, and the scale does not oscillate.
+class DynamicResolution
+{
+private:
+	VkDevice device = VK_NULL_HANDLE;
+	VkQueryPool queryPool = VK_NULL_HANDLE;
+	bool supported = false;
+	double timestampPeriod = 1.0;	// Nanoseconds per tick
+	uint64_t timestampMask = ~0ull;
+
+	// Per frame: timed since the last update, and the scale it was drawn with
+	std::vector<bool> timed;
+	std::vector<float> frameScales;
+
+	float budget = 0.0f;	// Milliseconds, 0 when disabled
+	float minScale = 0.5f;
+	float maxScale = 1.0f;
+	float scale = 1.0f;
+	float gpuTime = 0.0f;	// Of the last timed frame, milliseconds
+
+public:
+	// Without timestamps on this queue family, the scale stays at the maximum
+	void init(const DeviceCapabilities& capabilities, VkDevice device, uint32_t queueFamily, uint32_t frameCount);
+	void destroy();
+
+	// GPU time to hold, 0 keeps the scale at maxScale
+	void setBudget(float milliseconds, float minScale = 0.5f, float maxScale = 1.0f);
+
+	// Once 'frame' is done on the GPU: reads its time and moves the scale
+	void update(uint32_t frame);
+	// First and last commands of the command buffer of 'frame', outside of any render pass
+	void begin(VkCommandBuffer cmdBuffer, uint32_t frame);
+	void end(VkCommandBuffer cmdBuffer, uint32_t frame);
+
+	float getScale() const { return scale; }
+	float getGpuTime() const { return gpuTime; }
+	// 'extent' times the scale
+	VkExtent2D getExtent(VkExtent2D extent) const;
+};
@@ -0,0 +1,194 @@
+#include "EntityStore.h"
+#include "JobSystem.h"
+#include <string.h>
+#include <assert.h>
+
+namespace {
+
+	const uint32_t componentSizes[COMPONENT_COUNT] = {
+		sizeof(uint32_t),
+		sizeof(uint32_t),
+		sizeof(glm::mat4),
+		sizeof(Bounds),
+		sizeof(uint32_t),
+	};
+
+	// Every array starts on a 16 bytes boundary of the chunk
+	uint32_t alignArray(uint32_t offset)
+	{
+		return (offset + 15) & ~15u;
+	}
+
+	uint32_t arraysSize(uint32_t mask, uint32_t capacity)
+	{
+		uint32_t size = alignArray(capacity * sizeof(uint32_t));
+		for (uint32_t type = 0; type < COMPONENT_COUNT; type++) {
+			if (mask & COMPONENT_BIT(type)) {
+				size = alignArray(size + capacity * componentSizes[type]);
+			}
+		}
+		return size;
+	}
+}
+
+EntityStore::~EntityStore()
+{
+	for (Archetype& archetype : archetypes) {
+		for (EntityChunk* chunk : archetype.chunks) {
+			delete[] chunk->data;
+			delete chunk;
+		}
+	}
+}
+
+uint32_t EntityStore::createEntity(uint32_t mask)
+{
+	uint32_t archetypeIndex = findArchetype(mask);
+	Archetype& archetype = archetypes[archetypeIndex];
+
+	uint32_t chunkIndex = 0;
+	while (chunkIndex < archetype.chunks.size() && archetype.chunks[chunkIndex]->count == archetype.capacity) {
+		chunkIndex++;
+	}
+
+	if (chunkIndex == archetype.chunks.size()) {
+		EntityChunk* chunk = new EntityChunk();
+		chunk->mask = mask;
+		chunk->capacity = archetype.capacity;
+		memcpy(chunk->offsets, archetype.offsets, sizeof(chunk->offsets));
+		chunk->data = new uint8_t[ENTITY_CHUNK_SIZE];
+		archetype.chunks.push_back(chunk);
+	}
+
+	uint32_t entity;
+	if (!freeEntities.empty()) {
+		entity = freeEntities.back();
+		freeEntities.pop_back();
+	}
+	else {
+		entity = uint32_t(locations.size());
+		locations.push_back({});
+	}
+
+	EntityChunk* chunk = archetype.chunks[chunkIndex];
+	uint32_t slot = chunk->count++;
+	chunk->entities()[slot] = entity;
+	for (uint32_t type = 0; type < COMPONENT_COUNT; type++) {
+		if (mask & COMPONENT_BIT(type)) {
+			memset(chunk->data + chunk->offsets[type] + slot * componentSizes[type], 0, componentSizes[type]);
+		}
+	}
+
+	locations[entity] = { archetypeIndex, chunkIndex, slot };
+	return entity;
+}
+
+void EntityStore::destroyEntity(uint32_t entity)
+{
+	const EntityLocation location = locations[entity];
+	EntityChunk* chunk = archetypes[location.archetype].chunks[location.chunk];
+
+	// The last entity of the chunk takes the hole, the arrays stay packed
+	uint32_t last = chunk->count - 1;
+	if (location.slot != last) {
+		for (uint32_t type = 0; type < COMPONENT_COUNT; type++) {
+			if (chunk->mask & COMPONENT_BIT(type)) {
+				uint8_t* array = chunk->data + chunk->offsets[type];
+				memcpy(array + location.slot * componentSizes[type], array + last * componentSizes[type], componentSizes[type]);
+			}
+		}
+
+		uint32_t moved = chunk->entities()[last];
+		chunk->entities()[location.slot] = moved;
+		locations[moved].slot = location.slot;
+	}
+
+	chunk->count--;
+	freeEntities.push_back(entity);
+}
+
+uint32_t EntityStore::count(uint32_t mask) const
+{
+	uint32_t total = 0;
+	for (const Archetype& archetype : archetypes) {
+		if ((archetype.mask & mask) != mask) {
+			continue;
+		}
+		for (const EntityChunk* chunk : archetype.chunks) {
+			total += chunk->count;
+		}
+	}
+	return total;
+}
+
+void EntityStore::forEachChunk(uint32_t mask, JobSystem* jobs, const std::function<void(EntityChunk&, uint32_t)>& job)
+{
+	matchingChunks.clear();
+	firstIndices.clear();
+
+	uint32_t first = 0;
+	for (Archetype& archetype : archetypes) {
+		if ((archetype.mask & mask) != mask) {
+			continue;
+		}
+		for (EntityChunk* chunk : archetype.chunks) {
+			if (chunk->count == 0) {
+				continue;
+			}
+			matchingChunks.push_back(chunk);
+			firstIndices.push_back(first);
+			first += chunk->count;
+		}
+	}
+
+	// One chunk per job: a chunk is small enough to stay in the cache of the core working on it
+	uint32_t chunkCount = uint32_t(matchingChunks.size());
+	if (jobs) {
+		jobs->parallelFor(chunkCount, 1, [this, &job](uint32_t begin, uint32_t end) {
+			for (uint32_t i = begin; i < end; i++) {
+				job(*matchingChunks[i], firstIndices[i]);
+			}
+		});
+	}
+	else {
+		for (uint32_t i = 0; i < chunkCount; i++) {
+			job(*matchingChunks[i], firstIndices[i]);
+		}
+	}
+}
+
+uint32_t EntityStore::findArchetype(uint32_t mask)
+{
+	for (uint32_t i = 0; i < archetypes.size(); i++) {
+		if (archetypes[i].mask == mask) {
+			return i;
+		}
+	}
+
+	Archetype archetype;
+	archetype.mask = mask;
+
+	// As many entities as the chunk can hold, padding included
+	uint32_t entitySize = sizeof(uint32_t);
+	for (uint32_t type = 0; type < COMPONENT_COUNT; type++) {
+		if (mask & COMPONENT_BIT(type)) {
+			entitySize += componentSizes[type];
+		}
+	}
+	archetype.capacity = ENTITY_CHUNK_SIZE / entitySize;
+	while (arraysSize(mask, archetype.capacity) > ENTITY_CHUNK_SIZE) {
+		archetype.capacity--;
+	}
+	assert(archetype.capacity > 0);
+
+	uint32_t offset = alignArray(archetype.capacity * sizeof(uint32_t));
+	for (uint32_t type = 0; type < COMPONENT_COUNT; type++) {
+		archetype.offsets[type] = offset;
+		if (mask & COMPONENT_BIT(type)) {
+			offset = alignArray(offset + archetype.capacity * componentSizes[type]);
+		}
+	}
+
+	archetypes.push_back(archetype);
+	return uint32_t(archetypes.size()) - 1;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <functional>
+#include <glm.hpp>
+
+#define ENTITY_CHUNK_SIZE (16 * 1024)
+
+class JobSystem;
+
+enum ComponentType {
+	COMPONENT_MESH,			// uint32_t, index in Vulkan::meshes
+	COMPONENT_MATERIAL,		// uint32_t, index in Vulkan::materials
+	COMPONENT_TRANSFORM,	// glm::mat4, world matrix
+	COMPONENT_BOUNDS,		// Bounds, in object space
+	COMPONENT_SCENE_NODE,	// uint32_t, copied into the transform by the scene graph
+	COMPONENT_COUNT
+};
+
+#define COMPONENT_BIT(type) (1u << (type))
+
+// What is drawn: the uniform blocks and the draws are numbered by iterating this same mask
+#define RENDERABLE_COMPONENTS (COMPONENT_BIT(COMPONENT_MESH) | COMPONENT_BIT(COMPONENT_MATERIAL) | \
+	COMPONENT_BIT(COMPONENT_TRANSFORM) | COMPONENT_BIT(COMPONENT_BOUNDS))
+
+struct Bounds {
+	glm::vec3 center;
+	float radius;
+};
+
+// Fixed size block holding the entities of one archetype, one array per component
+struct EntityChunk {
+	uint32_t mask;
+	uint32_t count = 0;
+	uint32_t capacity;
+	uint32_t offsets[COMPONENT_COUNT];
+	uint8_t* data;
+
+	inline uint32_t* entities() { return reinterpret_cast<uint32_t*>(data); }
+
+	template<typename T>
+	inline T* get(ComponentType type) { return reinterpret_cast<T*>(data + offsets[type]); }
+};
+
+// All the entities having exactly the same components
+struct Archetype {
+	uint32_t mask;
+	uint32_t capacity;
+	uint32_t offsets[COMPONENT_COUNT];
+	std::vector<EntityChunk*> chunks;
+};
+
+class EntityStore
+{
+private:
+	struct EntityLocation {
+		uint32_t archetype;
+		uint32_t chunk;
+		uint32_t slot;
+	};
+
+	std::vector<Archetype> archetypes;
+	std::vector<EntityLocation> locations;	// Indexed by entity
+	std::vector<uint32_t> freeEntities;
+
+	// Scratch for the iterations
+	std::vector<EntityChunk*> matchingChunks;
+	std::vector<uint32_t> firstIndices;
+
+public:
+	~EntityStore();
+
+	uint32_t createEntity(uint32_t mask);
+	void destroyEntity(uint32_t entity);
+
+	template<typename T>
+	T& get(uint32_t entity, ComponentType type)
+	{
+		const EntityLocation& location = locations[entity];
+		EntityChunk* chunk = archetypes[location.archetype].chunks[location.chunk];
+		return chunk->get<T>(type)[location.slot];
+	}
+
+	// Number of entities having at least the components of the mask
+	uint32_t count(uint32_t mask) const;
+
+	// Calls job(chunk, first) for every chunk having at least the components of the mask, in parallel
+	// when jobs is given. 'first' numbers the entities consecutively across the chunks, in iteration order.
+	void forEachChunk(uint32_t mask, JobSystem* jobs, const std::function<void(EntityChunk&, uint32_t)>& job);
+
+private:
+	uint32_t findArchetype(uint32_t mask);
+};
@@ -0,0 +1,144 @@
+#include "FrameCapture.h"
+#include "DeviceCapabilities.h"
+#include <assert.h>
+#include "helpers\Helpers.h"
+
+void FrameCapture::init(const DeviceCapabilities& capabilities, VkDevice device, VkExtent2D extent, VkFormat format, uint32_t slotCount)
+{
+	this->device = device;
+	this->extent = extent;
+	this->format = format;
+
+	VkPhysicalDevice physicalDevice = capabilities.physicalDevice;
+	slots.resize(slotCount);
+	for (Slot& slot : slots) {
+		VkBufferCreateInfo bufferInfo = {};
+		bufferInfo.size = VkDeviceSize(extent.width) * extent.height * 4;
+		bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+		bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+
+		VkResult res = vkCreateBuffer(device, &bufferInfo, nullptr, &slot.buffer);
+		assert(res == VK_SUCCESS);
+
+		VkMemoryRequirements memoryRequirements;
+		vkGetBufferMemoryRequirements(device, slot.buffer, &memoryRequirements);
+
+		// Cached memory is much faster to read from the CPU, but may not be coherent
+		uint32_t memoryType = vk::getMemoryType(physicalDevice, memoryRequirements.memoryTypeBits,
+												VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+		coherent = false;
+		if (memoryType == uint32_t(-1)) {
+			memoryType = vk::getMemoryType(physicalDevice, memoryRequirements.memoryTypeBits,
+										   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+			coherent = true;
+		}
+
+		VkMemoryAllocateInfo memoryAllocInfo = {};
+		memoryAllocInfo.allocationSize = memoryRequirements.size;
+		memoryAllocInfo.memoryTypeIndex = memoryType;
+		memoryAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+		res = vkAllocateMemory(device, &memoryAllocInfo, nullptr, &slot.memory);
+		assert(res == VK_SUCCESS);
+
+		res = vkBindBufferMemory(device, slot.buffer, slot.memory, 0);
+		assert(res == VK_SUCCESS);
+
+		void* data;
+		res = vkMapMemory(device, slot.memory, 0, VK_WHOLE_SIZE, 0, &data);
+		assert(res == VK_SUCCESS);
+		slot.mapped = static_cast<uint8_t*>(data);
+	}
+}
+
+void FrameCapture::destroy()
+{
+	for (Slot& slot : slots) {
+		vkUnmapMemory(device, slot.memory);
+		vkDestroyBuffer(device, slot.buffer, nullptr);
+		vkFreeMemory(device, slot.memory, nullptr);
+	}
+	slots.clear();
+}
+
+bool FrameCapture::record(VkCommandBuffer cmdBuffer, VkImage image, VkImageLayout layout, uint64_t value, const std::string& tag)
+{
+	Slot& slot = slots[next];
+	if (slot.pending) {
+		return false;
+	}
+
+	VkImageMemoryBarrier imageBarrier = {};
+	imageBarrier.image = image;
+	imageBarrier.oldLayout = layout;
+	imageBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+	imageBarrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	imageBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	imageBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	imageBarrier.subresourceRange.levelCount = 1;
+	imageBarrier.subresourceRange.layerCount = 1;
+	imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+
+	vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+						 0, 0, nullptr, 0, nullptr, 1, &imageBarrier);
+
+	VkBufferImageCopy copy = {};
+	copy.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	copy.imageSubresource.layerCount = 1;
+	copy.imageExtent.width = extent.width;
+	copy.imageExtent.height = extent.height;
+	copy.imageExtent.depth = 1;
+	vkCmdCopyImageToBuffer(cmdBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, slot.buffer, 1, &copy);
+
+	// Back to where the image was, and the copy made visible to the host
+	imageBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+	imageBarrier.newLayout = layout;
+	imageBarrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	imageBarrier.dstAccessMask = 0;
+
+	VkBufferMemoryBarrier bufferBarrier = {};
+	bufferBarrier.buffer = slot.buffer;
+	bufferBarrier.size = VK_WHOLE_SIZE;
+	bufferBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	bufferBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	bufferBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	bufferBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	bufferBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+
+	vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT | VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+						 0, 0, nullptr, 1, &bufferBarrier, 1, &imageBarrier);
+
+	slot.pending = true;
+	slot.value = value;
+	slot.tag = tag;
+	next = (next + 1) % slots.size();
+	return true;
+}
+
+void FrameCapture::collect(uint64_t completed, const std::function<void(const CapturedFrame&)>& onReady)
+{
+	while (slots[oldest].pending && slots[oldest].value <= completed) {
+		Slot& slot = slots[oldest];
+
+		if (!coherent) {
+			VkMappedMemoryRange range = {};
+			range.memory = slot.memory;
+			range.size = VK_WHOLE_SIZE;
+			range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+			vkInvalidateMappedMemoryRanges(device, 1, &range);
+		}
+
+		CapturedFrame frame;
+		frame.pixels = slot.mapped;
+		frame.width = extent.width;
+		frame.height = extent.height;
+		frame.format = format;
+		frame.tag = slot.tag;
+		onReady(frame);
+
+		slot.pending = false;
+		oldest = (oldest + 1) % slots.size();
+	}
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <functional>
+
+class DeviceCapabilities;
+
+struct CapturedFrame {
+	const uint8_t* pixels;	// Tightly packed rows, 4 bytes per pixel
+	uint32_t width;
+	uint32_t height;
+	VkFormat format;		// Swapchain format: RGBA or BGRA
+	std::string tag;
+};
+
+// Ring of host visible buffers receiving copies of rendered images.
+// A copy is only read once the frame that recorded it is done: rendering never waits for it.
+class FrameCapture
+{
+private:
+	struct Slot {
+		VkBuffer buffer;
+		VkDeviceMemory memory;
+		uint8_t* mapped;
+		bool pending = false;
+		uint64_t value;		// Graphics timeline value of the submission doing the copy
+		std::string tag;
+	};
+
+	VkDevice device;
+	VkExtent2D extent;
+	VkFormat format;
+	bool coherent;
+	std::vector<Slot> slots;
+	uint32_t next = 0;		// Next slot to record
+	uint32_t oldest = 0;	// Next slot to collect, copies are collected in order
+
+public:
+	void init(const DeviceCapabilities& capabilities, VkDevice device, VkExtent2D extent, VkFormat format, uint32_t slotCount);
+	void destroy();
+
+	// All the slots wait for their frame to be done
+	bool isFull() const { return slots[next].pending; }
+
+	// Records the copy of an image at the end of a frame. Returns false when the ring is full.
+	bool record(VkCommandBuffer cmdBuffer, VkImage image, VkImageLayout layout, uint64_t value, const std::string& tag);
+
+	// onReady is called for each copy whose value is completed, in recording order.
+	// The pixels are only valid during the call.
+	void collect(uint64_t completed, const std::function<void(const CapturedFrame&)>& onReady);
+};
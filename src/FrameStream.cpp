@@ -0,0 +1,234 @@
+#include "FrameStream.h"
+#include "FrameCapture.h"
+#include "JobSystem.h"
+#include <emmintrin.h>
+#include <iostream>
+#include <string.h>
+
+#define YUV_GRAIN 16	// Row pairs per job
+
+namespace {
+
+	// 8 bits channel of 8 pixels as 16 bits integers
+	inline __m128i getChannel(__m128i low, __m128i high, __m128i shift)
+	{
+		const __m128i mask = _mm_set1_epi32(0xFF);
+		return _mm_packs_epi32(_mm_and_si128(_mm_srl_epi32(low, shift), mask),
+							   _mm_and_si128(_mm_srl_epi32(high, shift), mask));
+	}
+
+	// Y = ((66 R + 129 G + 25 B + 128) >> 8) + 16, the products fit in 16 bits unsigned
+	inline __m128i getLuma(__m128i r, __m128i g, __m128i b)
+	{
+		__m128i y = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)), _mm_mullo_epi16(g, _mm_set1_epi16(129)));
+		y = _mm_add_epi16(y, _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(25)), _mm_set1_epi16(128)));
+		return _mm_add_epi16(_mm_srli_epi16(y, 8), _mm_set1_epi16(16));
+	}
+
+	// Average of the 2x2 blocks, from the sums of two rows: 4 values, repeated to fill the register
+	inline __m128i getAverage(__m128i rowSum)
+	{
+		__m128i sum = _mm_madd_epi16(rowSum, _mm_set1_epi16(1));
+		sum = _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(2)), 2);
+		return _mm_packs_epi32(sum, sum);
+	}
+
+	// ((cr R + cg G + cb B + 128) >> 8) + 128, within 16 bits signed for the BT.601 coefficients
+	inline __m128i getChroma(__m128i r, __m128i g, __m128i b, short cr, short cg, short cb)
+	{
+		__m128i c = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(cr)), _mm_mullo_epi16(g, _mm_set1_epi16(cg)));
+		c = _mm_add_epi16(c, _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(cb)), _mm_set1_epi16(128)));
+		return _mm_add_epi16(_mm_srai_epi16(c, 8), _mm_set1_epi16(128));
+	}
+}
+
+void convertToYUV420(const uint8_t* rgba, uint32_t pitch, uint32_t width, bool bgra,
+					 uint8_t* y, uint8_t* u, uint8_t* v, uint32_t firstPair, uint32_t lastPair)
+{
+	const __m128i redShift = _mm_cvtsi32_si128(bgra ? 16 : 0);
+	const __m128i greenShift = _mm_cvtsi32_si128(8);
+	const __m128i blueShift = _mm_cvtsi32_si128(bgra ? 0 : 16);
+	const uint32_t red = bgra ? 2 : 0;
+	const uint32_t blue = bgra ? 0 : 2;
+	const uint32_t chromaWidth = width / 2;
+
+	for (uint32_t pair = firstPair; pair < lastPair; pair++) {
+		const uint8_t* src0 = rgba + size_t(pair * 2) * pitch;
+		const uint8_t* src1 = src0 + pitch;
+		uint8_t* y0 = y + size_t(pair * 2) * width;
+		uint8_t* y1 = y0 + width;
+		uint8_t* uRow = u + size_t(pair) * chromaWidth;
+		uint8_t* vRow = v + size_t(pair) * chromaWidth;
+
+		// 8 pixels of both rows at a time
+		uint32_t x = 0;
+		for (; x + 8 <= width; x += 8) {
+			__m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src0 + x * 4));
+			__m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src0 + x * 4 + 16));
+			__m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src1 + x * 4));
+			__m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src1 + x * 4 + 16));
+
+			__m128i r0 = getChannel(a0, a1, redShift);
+			__m128i g0 = getChannel(a0, a1, greenShift);
+			__m128i bl0 = getChannel(a0, a1, blueShift);
+			__m128i r1 = getChannel(b0, b1, redShift);
+			__m128i g1 = getChannel(b0, b1, greenShift);
+			__m128i bl1 = getChannel(b0, b1, blueShift);
+
+			__m128i luma0 = getLuma(r0, g0, bl0);
+			__m128i luma1 = getLuma(r1, g1, bl1);
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(y0 + x), _mm_packus_epi16(luma0, luma0));
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(y1 + x), _mm_packus_epi16(luma1, luma1));
+
+			__m128i r = getAverage(_mm_add_epi16(r0, r1));
+			__m128i g = getAverage(_mm_add_epi16(g0, g1));
+			__m128i b = getAverage(_mm_add_epi16(bl0, bl1));
+			__m128i cb = getChroma(r, g, b, -38, -74, 112);
+			__m128i cr = getChroma(r, g, b, 112, -94, -18);
+			int cbBytes = _mm_cvtsi128_si32(_mm_packus_epi16(cb, cb));
+			int crBytes = _mm_cvtsi128_si32(_mm_packus_epi16(cr, cr));
+			memcpy(uRow + x / 2, &cbBytes, 4);
+			memcpy(vRow + x / 2, &crBytes, 4);
+		}
+
+		for (; x + 2 <= width; x += 2) {
+			int r = 0, g = 0, b = 0;
+			const uint8_t* block[] = { src0 + x * 4, src0 + x * 4 + 4, src1 + x * 4, src1 + x * 4 + 4 };
+			uint8_t* luma[] = { y0 + x, y0 + x + 1, y1 + x, y1 + x + 1 };
+			for (int i = 0; i < 4; i++) {
+				int pr = block[i][red], pg = block[i][1], pb = block[i][blue];
+				*luma[i] = uint8_t(((66 * pr + 129 * pg + 25 * pb + 128) >> 8) + 16);
+				r += pr; g += pg; b += pb;
+			}
+			r = (r + 2) >> 2; g = (g + 2) >> 2; b = (b + 2) >> 2;
+			uRow[x / 2] = uint8_t(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+			vRow[x / 2] = uint8_t(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+		}
+	}
+}
+
+void FrameStream::start(StreamSink* sink, uint32_t width, uint32_t height, uint32_t fps, JobSystem* jobs)
+{
+	stop();
+
+	this->sink.reset(sink);
+	this->width = width & ~1u;
+	this->height = height & ~1u;
+	this->fps = fps;
+	this->jobs = jobs;
+	stopping = false;
+	failed = false;
+	written = 0;
+	dropped = 0;
+	queued.clear();
+	buffers.clear();
+
+	writer = std::thread([this]() { write(); });
+}
+
+void FrameStream::stop()
+{
+	if (!writer.joinable()) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wakeUp.notify_one();
+	writer.join();
+
+	sink->close();
+	sink.reset();
+	std::cout << "Stream: " << written << " frames written, " << dropped << " dropped" << std::endl;
+}
+
+void FrameStream::push(const CapturedFrame& frame)
+{
+	static const char frameHeader[] = "FRAME\n";
+	const size_t headerSize = sizeof(frameHeader) - 1;
+	const size_t lumaSize = size_t(width) * height;
+
+	std::vector<uint8_t> buffer;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (failed || queued.size() >= maxQueued) {
+			dropped++;
+			return;
+		}
+		if (!buffers.empty()) {
+			buffer = std::move(buffers.back());
+			buffers.pop_back();
+		}
+	}
+	buffer.resize(headerSize + lumaSize * 3 / 2);
+	memcpy(buffer.data(), frameHeader, headerSize);
+
+	// Converted straight from the readback memory, the planes follow the header
+	uint8_t* y = buffer.data() + headerSize;
+	uint8_t* u = y + lumaSize;
+	uint8_t* v = u + lumaSize / 4;
+	bool bgra = frame.format == VK_FORMAT_B8G8R8A8_UNORM || frame.format == VK_FORMAT_B8G8R8A8_SRGB;
+	uint32_t pitch = frame.width * 4;
+	uint32_t w = width;
+	auto convert = [&](uint32_t first, uint32_t last) {
+		convertToYUV420(frame.pixels, pitch, w, bgra, y, u, v, first, last);
+	};
+
+	if (jobs) {
+		jobs->parallelFor(height / 2, YUV_GRAIN, convert);
+	}
+	else {
+		convert(0, height / 2);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		queued.push_back(std::move(buffer));
+	}
+	wakeUp.notify_one();
+}
+
+void FrameStream::drop()
+{
+	dropped++;
+}
+
+void FrameStream::write()
+{
+	bool opened = sink->open();
+	if (opened) {
+		std::string header = "YUV4MPEG2 W" + std::to_string(width) + " H" + std::to_string(height) +
+							 " F" + std::to_string(fps) + ":1 Ip A1:1 C420jpeg\n";
+		opened = sink->write(reinterpret_cast<const uint8_t*>(header.data()), header.size());
+	}
+	if (!opened) {
+		std::cerr << "Stream: cannot open the output" << std::endl;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+	failed = !opened;
+	for (;;) {
+		wakeUp.wait(lock, [this]() { return stopping || !queued.empty(); });
+		if (queued.empty()) {
+			return;
+		}
+
+		std::vector<uint8_t> buffer = std::move(queued.front());
+		queued.pop_front();
+
+		lock.unlock();
+		bool ok = failed || sink->write(buffer.data(), buffer.size());
+		lock.lock();
+
+		if (!ok && !failed) {
+			std::cerr << "Stream: the output was closed" << std::endl;
+			failed = true;
+		}
+		if (!failed) {
+			written++;
+		}
+		buffers.push_back(std::move(buffer));
+	}
+}
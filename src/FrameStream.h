@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "StreamSink.h"
+
+class JobSystem;
+struct CapturedFrame;
+
+// RGBA (or BGRA) to planar YUV 4:2:0, BT.601 limited range. Chroma is the average of each 2x2 block.
+// Width must be even, 'pitch' is the size of a source row in bytes.
+// Rows are converted by pairs, [firstPair, lastPair) so that the conversion can be split in jobs.
+void convertToYUV420(const uint8_t* rgba, uint32_t pitch, uint32_t width, bool bgra,
+					 uint8_t* y, uint8_t* u, uint8_t* v, uint32_t firstPair, uint32_t lastPair);
+
+// Y4M video stream fed with captured frames.
+// The conversion is done by the thread collecting the frame (with the jobs), the writing by a thread of its own:
+// a slow sink drops frames instead of slowing down the rendering.
+class FrameStream
+{
+private:
+	std::unique_ptr<StreamSink> sink;
+	JobSystem* jobs = nullptr;
+	uint32_t width;
+	uint32_t height;
+	uint32_t fps;
+
+	std::thread writer;
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	std::deque<std::vector<uint8_t>> queued;	// Converted frames, oldest first
+	std::vector<std::vector<uint8_t>> buffers;	// Free frames, not reallocated
+	uint32_t maxQueued = 4;
+	bool stopping = false;
+	bool failed = false;
+
+	std::atomic<uint64_t> written{ 0 };
+	std::atomic<uint64_t> dropped{ 0 };
+
+public:
+	~FrameStream() { stop(); }
+
+	bool isRunning() const { return writer.joinable(); }
+	// Takes the ownership of the sink. Odd sizes lose their last row or column.
+	void start(StreamSink* sink, uint32_t width, uint32_t height, uint32_t fps, JobSystem* jobs);
+	// Writes the frames still queued and closes the sink
+	void stop();
+
+	void push(const CapturedFrame& frame);
+	// Frames not captured because the readback ring was full
+	void drop();
+
+	uint64_t getWritten() const { return written; }
+	uint64_t getDropped() const { return dropped; }
+
+private:
+	void write();
+};
@@ -0,0 +1,133 @@
+#include "ImageDiff.h"
+#include "JobSystem.h"
+#include <emmintrin.h>
+#include <math.h>
+#include <stdlib.h>
+#include <limits>
+#include <algorithm>
+
+namespace {
+
+	struct RowError {
+		uint64_t squared;
+		uint8_t max;
+	};
+
+	// Squared differences of the RGB channels of 'count' pixels
+	RowError compareRow(const uint8_t* a, const uint8_t* b, uint32_t count)
+	{
+		const __m128i rgb = _mm_set1_epi32(0x00FFFFFF);
+		const __m128i zero = _mm_setzero_si128();
+		__m128i sum = _mm_setzero_si128();
+		__m128i max = _mm_setzero_si128();
+
+		// 4 pixels at a time. A lane adds up at most 2 * 2 * 255^2 per iteration:
+		// the 32 bits sums are flushed every 1024 iterations.
+		uint64_t squared = 0;
+		uint32_t i = 0;
+		uint32_t pending = 0;
+		for (; i + 4 <= count; i += 4) {
+			__m128i pa = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i * 4)), rgb);
+			__m128i pb = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i * 4)), rgb);
+			__m128i diff = _mm_or_si128(_mm_subs_epu8(pa, pb), _mm_subs_epu8(pb, pa));
+			max = _mm_max_epu8(max, diff);
+
+			__m128i low = _mm_unpacklo_epi8(diff, zero);
+			__m128i high = _mm_unpackhi_epi8(diff, zero);
+			sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_madd_epi16(low, low), _mm_madd_epi16(high, high)));
+
+			if (++pending == 1024) {
+				uint32_t lanes[4];
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), sum);
+				squared += uint64_t(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+				sum = _mm_setzero_si128();
+				pending = 0;
+			}
+		}
+
+		uint32_t lanes[4];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), sum);
+		squared += uint64_t(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+
+		uint8_t bytes[16];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(bytes), max);
+		uint8_t maxError = *std::max_element(bytes, bytes + 16);
+
+		for (; i < count; i++) {
+			for (uint32_t c = 0; c < 3; c++) {
+				int diff = int(a[i * 4 + c]) - int(b[i * 4 + c]);
+				squared += uint64_t(diff * diff);
+				maxError = std::max(maxError, uint8_t(abs(diff)));
+			}
+		}
+
+		return { squared, maxError };
+	}
+}
+
+bool ImageDiff::passes(double minPsnr, double maxTileMse) const
+{
+	return sameSize && psnr >= minPsnr && (tileMse.empty() || tileMse[worstTile] <= maxTileMse);
+}
+
+ImageDiff compareImages(const Image& a, const Image& b, uint32_t tileSize, JobSystem* jobs)
+{
+	ImageDiff diff;
+	diff.sameSize = a.width == b.width && a.height == b.height;
+	if (!diff.sameSize || a.width == 0 || a.height == 0) {
+		return diff;
+	}
+
+	uint32_t width = a.width;
+	uint32_t height = a.height;
+	diff.tileSize = tileSize;
+	diff.tilesX = (width + tileSize - 1) / tileSize;
+	diff.tilesY = (height + tileSize - 1) / tileSize;
+
+	std::vector<uint64_t> tileSquared(diff.tilesX * diff.tilesY, 0);
+	std::vector<uint8_t> rowMax(diff.tilesY, 0);
+
+	// A range of tile rows: each job writes its own tiles only
+	auto compareTiles = [&](uint32_t begin, uint32_t end) {
+		for (uint32_t ty = begin; ty < end; ty++) {
+			uint32_t lastY = std::min(height, (ty + 1) * tileSize);
+			for (uint32_t y = ty * tileSize; y < lastY; y++) {
+				const uint8_t* rowA = &a.pixels[size_t(y) * width * 4];
+				const uint8_t* rowB = &b.pixels[size_t(y) * width * 4];
+				for (uint32_t tx = 0; tx < diff.tilesX; tx++) {
+					uint32_t x = tx * tileSize;
+					RowError error = compareRow(rowA + x * 4, rowB + x * 4, std::min(tileSize, width - x));
+					tileSquared[ty * diff.tilesX + tx] += error.squared;
+					rowMax[ty] = std::max(rowMax[ty], error.max);
+				}
+			}
+		}
+	};
+
+	if (jobs) {
+		jobs->parallelFor(diff.tilesY, 1, compareTiles);
+	}
+	else {
+		compareTiles(0, diff.tilesY);
+	}
+
+	uint64_t squared = 0;
+	diff.tileMse.resize(tileSquared.size());
+	for (uint32_t ty = 0; ty < diff.tilesY; ty++) {
+		uint32_t tileHeight = std::min(tileSize, height - ty * tileSize);
+		for (uint32_t tx = 0; tx < diff.tilesX; tx++) {
+			uint32_t tileWidth = std::min(tileSize, width - tx * tileSize);
+			uint32_t tile = ty * diff.tilesX + tx;
+			squared += tileSquared[tile];
+			diff.tileMse[tile] = double(tileSquared[tile]) / (double(tileWidth) * tileHeight * 3);
+			if (diff.tileMse[tile] > diff.tileMse[diff.worstTile]) {
+				diff.worstTile = tile;
+			}
+		}
+		diff.maxError = std::max(diff.maxError, rowMax[ty]);
+	}
+
+	diff.mse = double(squared) / (double(width) * height * 3);
+	diff.psnr = diff.mse > 0.0 ? 10.0 * log10(255.0 * 255.0 / diff.mse) : std::numeric_limits<double>::infinity();
+	return diff;
+}
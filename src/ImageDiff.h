@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "ImageIO.h"
+
+class JobSystem;
+
+// Difference between two images of the same size, alpha ignored.
+// The error is also kept per tile: a small broken area stands out even when the PSNR of the whole image is high.
+struct ImageDiff {
+	bool sameSize = false;
+	double mse = 0.0;			// Mean squared error per channel
+	double psnr = 0.0;			// dB, infinite for identical images
+	uint8_t maxError = 0;		// Largest difference of a channel
+	uint32_t tileSize = 0;
+	uint32_t tilesX = 0;
+	uint32_t tilesY = 0;
+	std::vector<double> tileMse;	// Row major
+	uint32_t worstTile = 0;
+
+	// Whole image PSNR and worst tile MSE both within bounds
+	bool passes(double minPsnr, double maxTileMse) const;
+};
+
+// Tile rows are compared in parallel when a job system is given
+ImageDiff compareImages(const Image& a, const Image& b, uint32_t tileSize = 32, JobSystem* jobs = nullptr);
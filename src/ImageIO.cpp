@@ -0,0 +1,175 @@
+#include "ImageIO.h"
+#include <stb_image.h>
+#include <emmintrin.h>
+#include <fstream>
+#include <algorithm>
+#include <string.h>
+
+namespace {
+
+	uint32_t crcTable[256];
+
+	void initCrcTable()
+	{
+		for (uint32_t n = 0; n < 256; n++) {
+			uint32_t c = n;
+			for (int k = 0; k < 8; k++) {
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			}
+			crcTable[n] = c;
+		}
+	}
+
+	uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0xFFFFFFFFu)
+	{
+		for (size_t i = 0; i < size; i++) {
+			crc = crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+		}
+		return crc;
+	}
+
+	void putBigEndian(std::vector<uint8_t>& out, uint32_t value)
+	{
+		out.push_back(uint8_t(value >> 24));
+		out.push_back(uint8_t(value >> 16));
+		out.push_back(uint8_t(value >> 8));
+		out.push_back(uint8_t(value));
+	}
+
+	// Length, type, data, CRC of type and data
+	void putChunk(std::vector<uint8_t>& out, const char* type, const std::vector<uint8_t>& data)
+	{
+		putBigEndian(out, uint32_t(data.size()));
+		size_t start = out.size();
+		out.insert(out.end(), type, type + 4);
+		out.insert(out.end(), data.begin(), data.end());
+		putBigEndian(out, crc32(&out[start], out.size() - start) ^ 0xFFFFFFFFu);
+	}
+}
+
+void image::swapRedBlue(uint8_t* pixels, size_t pixelCount)
+{
+	const __m128i greenAlpha = _mm_set1_epi32(0xFF00FF00);
+	const __m128i low = _mm_set1_epi32(0x000000FF);
+
+	size_t i = 0;
+	for (; i + 4 <= pixelCount; i += 4) {
+		__m128i p = _mm_loadu_si128(reinterpret_cast<__m128i*>(pixels + i * 4));
+		__m128i red = _mm_and_si128(_mm_srli_epi32(p, 16), low);
+		__m128i blue = _mm_slli_epi32(_mm_and_si128(p, low), 16);
+		p = _mm_or_si128(_mm_and_si128(p, greenAlpha), _mm_or_si128(red, blue));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + i * 4), p);
+	}
+	for (; i < pixelCount; i++) {
+		uint8_t red = pixels[i * 4 + 2];
+		pixels[i * 4 + 2] = pixels[i * 4];
+		pixels[i * 4] = red;
+	}
+}
+
+bool image::writePPM(const std::string& filename, const Image& image)
+{
+	std::ofstream file(filename, std::ios::binary);
+	if (!file) {
+		return false;
+	}
+
+	file << "P6\n" << image.width << " " << image.height << "\n255\n";
+
+	std::vector<uint8_t> row(image.width * 3);
+	for (uint32_t y = 0; y < image.height; y++) {
+		const uint8_t* src = &image.pixels[size_t(y) * image.width * 4];
+		for (uint32_t x = 0; x < image.width; x++) {
+			row[x * 3 + 0] = src[x * 4 + 0];
+			row[x * 3 + 1] = src[x * 4 + 1];
+			row[x * 3 + 2] = src[x * 4 + 2];
+		}
+		file.write(reinterpret_cast<const char*>(row.data()), row.size());
+	}
+	return bool(file);
+}
+
+bool image::writePNG(const std::string& filename, const Image& image)
+{
+	// Images may be written from several jobs at once
+	static const bool crcReady = (initCrcTable(), true);
+	(void)crcReady;
+
+	std::vector<uint8_t> png = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+	std::vector<uint8_t> header;
+	putBigEndian(header, image.width);
+	putBigEndian(header, image.height);
+	header.push_back(8);	// Bits per channel
+	header.push_back(6);	// RGBA
+	header.push_back(0);	// Deflate
+	header.push_back(0);	// Adaptive filtering
+	header.push_back(0);	// No interlacing
+	putChunk(png, "IHDR", header);
+
+	// Every row starts with its filter type: 0, none
+	size_t rowSize = size_t(image.width) * 4;
+	std::vector<uint8_t> raw;
+	raw.reserve((rowSize + 1) * image.height);
+	for (uint32_t y = 0; y < image.height; y++) {
+		raw.push_back(0);
+		raw.insert(raw.end(), image.pixels.begin() + y * rowSize, image.pixels.begin() + (y + 1) * rowSize);
+	}
+
+	// ZLIB STREAM OF STORED DEFLATE BLOCKS
+	std::vector<uint8_t> data = { 0x78, 0x01 };
+	uint32_t a = 1, b = 0;
+	for (size_t offset = 0; offset < raw.size() || offset == 0; ) {
+		uint16_t size = uint16_t(std::min<size_t>(raw.size() - offset, 65535));
+		bool last = offset + size == raw.size();
+		data.push_back(last ? 1 : 0);
+		data.push_back(uint8_t(size));
+		data.push_back(uint8_t(size >> 8));
+		data.push_back(uint8_t(~size));
+		data.push_back(uint8_t(~size >> 8));
+		data.insert(data.end(), raw.begin() + offset, raw.begin() + offset + size);
+
+		for (size_t i = offset; i < offset + size; i++) {
+			a = (a + raw[i]) % 65521;
+			b = (b + a) % 65521;
+		}
+		offset += size;
+		if (last) {
+			break;
+		}
+	}
+	putBigEndian(data, (b << 16) | a);
+	putChunk(png, "IDAT", data);
+	putChunk(png, "IEND", {});
+
+	std::ofstream file(filename, std::ios::binary);
+	if (!file) {
+		return false;
+	}
+	file.write(reinterpret_cast<const char*>(png.data()), png.size());
+	return bool(file);
+}
+
+bool image::write(const std::string& filename, const Image& image)
+{
+	size_t length = filename.size();
+	if (length >= 4 && filename.compare(length - 4, 4, ".png") == 0) {
+		return writePNG(filename, image);
+	}
+	return writePPM(filename, image);
+}
+
+bool image::load(const std::string& filename, Image& image)
+{
+	int width, height, components;
+	stbi_uc* pixels = stbi_load(filename.c_str(), &width, &height, &components, STBI_rgb_alpha);
+	if (!pixels) {
+		return false;
+	}
+
+	image.width = width;
+	image.height = height;
+	image.pixels.assign(pixels, pixels + size_t(width) * height * 4);
+	stbi_image_free(pixels);
+	return true;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+
+// 8 bits RGBA images, rows tightly packed
+struct Image {
+	uint32_t width = 0;
+	uint32_t height = 0;
+	std::vector<uint8_t> pixels;
+};
+
+namespace image {
+
+	// Swaps the red and blue channels in place (BGRA swapchains)
+	void swapRedBlue(uint8_t* pixels, size_t pixelCount);
+
+	// Alpha is dropped
+	bool writePPM(const std::string& filename, const Image& image);
+
+	// Uncompressed deflate: fast to write, golden images are small enough
+	bool writePNG(const std::string& filename, const Image& image);
+
+	// .png writes a PNG, anything else a PPM
+	bool write(const std::string& filename, const Image& image);
+
+	// Every format stb_image reads
+	bool load(const std::string& filename, Image& image);
+}
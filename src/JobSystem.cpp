@@ -0,0 +1,203 @@
+#include "JobSystem.h"
+#include <atomic>
+#include <memory>
+
+namespace {
+
+	struct ParallelRanges {
+		std::function<void(uint32_t, uint32_t)> job;
+		uint32_t count;
+		uint32_t grain;
+		uint32_t rangeCount;
+		std::atomic<uint32_t> next;
+		std::atomic<uint32_t> done;
+	};
+
+	// Called by every participant until no range is left
+	void runRanges(ParallelRanges& ranges)
+	{
+		for (;;) {
+			uint32_t range = ranges.next.fetch_add(1);
+			if (range >= ranges.rangeCount) {
+				return;
+			}
+
+			uint32_t begin = range * ranges.grain;
+			uint32_t end = begin + ranges.grain < ranges.count ? begin + ranges.grain : ranges.count;
+			ranges.job(begin, end);
+			ranges.done.fetch_add(1);
+		}
+	}
+}
+
+void JobSystem::init(uint32_t threadCount)
+{
+	if (threadCount == 0) {
+		uint32_t cores = std::thread::hardware_concurrency();
+		threadCount = cores > 1 ? cores - 1 : 1;
+	}
+
+	for (uint32_t i = 0; i < threadCount; i++) {
+		workers.push_back(std::thread([this]() { work(); }));
+	}
+}
+
+JobSystem::~JobSystem()
+{
+	shutdown();
+}
+
+void JobSystem::shutdown()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wakeUp.notify_all();
+
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+	workers.clear();
+}
+
+void JobSystem::submit(const std::function<void()>& task)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		tasks.push_back(task);
+	}
+	wakeUp.notify_one();
+}
+
+void JobSystem::parallelFor(uint32_t count, uint32_t grain, const std::function<void(uint32_t, uint32_t)>& job)
+{
+	if (count == 0) {
+		return;
+	}
+
+	uint32_t rangeCount = (count + grain - 1) / grain;
+	if (rangeCount == 1 || workers.empty()) {
+		job(0, count);
+		return;
+	}
+
+	std::shared_ptr<ParallelRanges> ranges = std::make_shared<ParallelRanges>();
+	ranges->job = job;
+	ranges->count = count;
+	ranges->grain = grain;
+	ranges->rangeCount = rangeCount;
+	ranges->next = 0;
+	ranges->done = 0;
+
+	// The helpers may start after everything is done, they then return immediately
+	uint32_t helperCount = rangeCount - 1 < workers.size() ? rangeCount - 1 : uint32_t(workers.size());
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (uint32_t i = 0; i < helperCount; i++) {
+			tasks.push_back([ranges]() { runRanges(*ranges); });
+		}
+	}
+	wakeUp.notify_all();
+
+	runRanges(*ranges);
+
+	// Ranges still running on other threads
+	while (ranges->done.load() < rangeCount) {
+		std::this_thread::yield();
+	}
+}
+
+Job JobSystem::schedule(const std::function<void()>& task, const std::vector<Job>& dependencies)
+{
+	Job job = std::make_shared<JobState>();
+	job->task = task;
+	job->remaining = 1;
+
+	for (const Job& dependency : dependencies) {
+		if (!dependency) {
+			continue;
+		}
+		std::lock_guard<std::mutex> lock(dependency->mutex);
+		if (!dependency->done) {
+			job->remaining.fetch_add(1);
+			dependency->dependents.push_back(job);
+		}
+	}
+
+	// Submitted here when everything it needs is already done
+	release(job);
+	return job;
+}
+
+void JobSystem::release(const Job& job)
+{
+	if (job->remaining.fetch_sub(1) != 1) {
+		return;
+	}
+
+	submit([this, job]() {
+		job->task();
+		job->task = nullptr;
+
+		std::vector<Job> dependents;
+		{
+			std::lock_guard<std::mutex> lock(job->mutex);
+			job->done = true;
+			dependents.swap(job->dependents);
+		}
+		for (const Job& dependent : dependents) {
+			release(dependent);
+		}
+	});
+}
+
+void JobSystem::wait(const Job& job)
+{
+	while (!isDone(job)) {
+		if (!runOne()) {
+			std::this_thread::yield();
+		}
+	}
+}
+
+bool JobSystem::isDone(const Job& job)
+{
+	if (!job) {
+		return true;
+	}
+	std::lock_guard<std::mutex> lock(job->mutex);
+	return job->done;
+}
+
+bool JobSystem::runOne()
+{
+	std::function<void()> task;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (tasks.empty()) {
+			return false;
+		}
+		task = std::move(tasks.front());
+		tasks.pop_front();
+	}
+	task();
+	return true;
+}
+
+void JobSystem::work()
+{
+	for (;;) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wakeUp.wait(lock, [this]() { return stopping || !tasks.empty(); });
+			if (stopping && tasks.empty()) {
+				return;
+			}
+			task = std::move(tasks.front());
+			tasks.pop_front();
+		}
+		task();
+	}
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <atomic>
+
+// A scheduled task, and the tasks waiting for it
+struct JobState {
+	std::function<void()> task;
+	std::atomic<uint32_t> remaining;	// Dependencies not done yet, plus one until scheduled
+	std::mutex mutex;
+	bool done = false;
+	std::vector<std::shared_ptr<JobState>> dependents;
+};
+typedef std::shared_ptr<JobState> Job;
+
+// Worker threads shared by the whole renderer.
+// Tasks are picked in submission order, the thread waiting on a parallelFor() works too.
+class JobSystem
+{
+private:
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	bool stopping = false;
+
+public:
+	// 0 threads: one per core, minus the calling thread
+	void init(uint32_t threadCount = 0);
+	~JobSystem();
+
+	// Runs the tasks left and stops the threads
+	void shutdown();
+
+	void submit(const std::function<void()>& task);
+
+	// Submitted once every dependency is done. Null dependencies are ignored.
+	Job schedule(const std::function<void()>& task, const std::vector<Job>& dependencies = {});
+	// Runs other tasks meanwhile: can be called from a task. A null job is done.
+	void wait(const Job& job);
+	static bool isDone(const Job& job);
+
+	// Splits [0, count) in ranges of 'grain' elements and calls job(begin, end) for each of them.
+	// Returns once every range is done.
+	void parallelFor(uint32_t count, uint32_t grain, const std::function<void(uint32_t, uint32_t)>& job);
+
+	uint32_t getThreadCount() const { return uint32_t(workers.size()) + 1; }
+
+private:
+	void work();
+	// Runs one waiting task, false when there is none
+	bool runOne();
+	void release(const Job& job);
+};
@@ -0,0 +1,473 @@
+#include "Meshlets.h"
+#include "DeviceCapabilities.h"
+#include "DeletionQueue.h"
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include "helpers\Helpers.h"
+
+namespace {
+
+	const uint8_t NOT_IN_MESHLET = 0xFF;
+
+	inline glm::vec3 getPosition(const uint8_t* vertices, uint32_t stride, uint32_t index)
+	{
+		const float* position = reinterpret_cast<const float*>(vertices + size_t(index) * stride);
+		return glm::vec3(position[0], position[1], position[2]);
+	}
+
+	// Sphere around the box of the vertices, cone around the normals of the triangles
+	void computeBounds(const uint8_t* vertices, uint32_t stride, const uint32_t* meshletVertices,
+					   const std::vector<glm::vec3>& normals, Meshlet& meshlet)
+	{
+		glm::vec3 low = getPosition(vertices, stride, meshletVertices[0]);
+		glm::vec3 high = low;
+		for (uint32_t i = 1; i < meshlet.vertexCount; i++) {
+			glm::vec3 position = getPosition(vertices, stride, meshletVertices[i]);
+			low = glm::min(low, position);
+			high = glm::max(high, position);
+		}
+		glm::vec3 center = (low + high) * 0.5f;
+		float radius = 0.0f;
+		for (uint32_t i = 0; i < meshlet.vertexCount; i++) {
+			radius = std::max(radius, glm::length(getPosition(vertices, stride, meshletVertices[i]) - center));
+		}
+
+		glm::vec3 axis(0.0f);
+		for (const glm::vec3& normal : normals) {
+			axis += normal;
+		}
+		float cutoff = 1.0f;
+		float length = glm::length(axis);
+		if (length > 1e-6f) {
+			axis = axis / length;
+			float minDot = 1.0f;
+			for (const glm::vec3& normal : normals) {
+				minDot = std::min(minDot, glm::dot(normal, axis));
+			}
+			// Past 90 degrees, some triangle faces the camera from anywhere
+			cutoff = minDot <= 0.0f ? 1.0f : sqrtf(1.0f - minDot * minDot);
+		}
+
+		meshlet.center[0] = center.x;
+		meshlet.center[1] = center.y;
+		meshlet.center[2] = center.z;
+		meshlet.radius = radius;
+		meshlet.coneAxis[0] = axis.x;
+		meshlet.coneAxis[1] = axis.y;
+		meshlet.coneAxis[2] = axis.z;
+		meshlet.coneCutoff = cutoff;
+	}
+}
+
+void buildMeshlets(const uint8_t* vertices, uint32_t stride, const uint32_t* indices, uint32_t indexCount,
+				   std::vector<Meshlet>& meshlets, std::vector<uint32_t>& meshletVertices, std::vector<uint32_t>& triangles)
+{
+	uint32_t vertexCount = 0;
+	for (uint32_t i = 0; i < indexCount; i++) {
+		vertexCount = std::max(vertexCount, indices[i] + 1);
+	}
+
+	// Index of each vertex in the current meshlet
+	std::vector<uint8_t> local(vertexCount, NOT_IN_MESHLET);
+	std::vector<glm::vec3> normals;
+	Meshlet meshlet = {};
+	meshlet.vertexOffset = uint32_t(meshletVertices.size());
+	meshlet.triangleOffset = uint32_t(triangles.size());
+
+	auto close = [&]() {
+		computeBounds(vertices, stride, meshletVertices.data() + meshlet.vertexOffset, normals, meshlet);
+		meshlets.push_back(meshlet);
+		for (uint32_t i = 0; i < meshlet.vertexCount; i++) {
+			local[meshletVertices[meshlet.vertexOffset + i]] = NOT_IN_MESHLET;
+		}
+		normals.clear();
+		meshlet = {};
+		meshlet.vertexOffset = uint32_t(meshletVertices.size());
+		meshlet.triangleOffset = uint32_t(triangles.size());
+	};
+
+	for (uint32_t i = 0; i + 2 < indexCount; i += 3) {
+		const uint32_t* triangle = indices + i;
+		uint32_t added = 0;
+		for (uint32_t k = 0; k < 3; k++) {
+			bool repeated = (k > 0 && triangle[k] == triangle[0]) || (k > 1 && triangle[k] == triangle[1]);
+			added += local[triangle[k]] == NOT_IN_MESHLET && !repeated ? 1 : 0;
+		}
+		if (meshlet.vertexCount + added > MESHLET_MAX_VERTICES || meshlet.triangleCount == MESHLET_MAX_TRIANGLES) {
+			close();
+		}
+
+		uint32_t packed = 0;
+		for (uint32_t k = 0; k < 3; k++) {
+			if (local[triangle[k]] == NOT_IN_MESHLET) {
+				local[triangle[k]] = uint8_t(meshlet.vertexCount++);
+				meshletVertices.push_back(triangle[k]);
+			}
+			packed |= uint32_t(local[triangle[k]]) << (k * 8);
+		}
+		triangles.push_back(packed);
+		meshlet.triangleCount++;
+
+		// Front faces wind clockwise in world space, like the quad: the projection flips y.
+		// The degenerate triangles face nowhere.
+		glm::vec3 p0 = getPosition(vertices, stride, triangle[0]);
+		glm::vec3 normal = glm::cross(getPosition(vertices, stride, triangle[2]) - p0, getPosition(vertices, stride, triangle[1]) - p0);
+		float area = glm::length(normal);
+		if (area > 0.0f) {
+			normals.push_back(normal / area);
+		}
+	}
+	if (meshlet.triangleCount > 0) {
+		close();
+	}
+}
+
+void MeshletGeometry::init(const DeviceCapabilities& capabilities, VkDevice device, uint32_t vertexSize)
+{
+	this->physicalDevice = capabilities.physicalDevice;
+	this->device = device;
+	this->vertexSize = vertexSize;
+
+	// Uploaded once, read every frame: device local
+	VkFlags local = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+	VkBufferUsageFlags storage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	vk::createBuffer(physicalDevice, device, local, storage | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+					 VkDeviceSize(MESHLET_GEOMETRY_VERTICES) * vertexSize, vertexBuffer, vertexMemory);
+	vk::createBuffer(physicalDevice, device, local, VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+					 VkDeviceSize(MESHLET_GEOMETRY_INDICES) * sizeof(uint32_t), indexBuffer, indexMemory);
+	vk::createBuffer(physicalDevice, device, local, storage,
+					 VkDeviceSize(MESHLET_GEOMETRY_MESHLETS) * sizeof(Meshlet), meshletBuffer, meshletMemory);
+	vk::createBuffer(physicalDevice, device, local, storage,
+					 VkDeviceSize(MESHLET_GEOMETRY_MESHLETS) * MESHLET_MAX_VERTICES * sizeof(uint32_t), meshletVertexBuffer, meshletVertexMemory);
+	vk::createBuffer(physicalDevice, device, local, storage,
+					 VkDeviceSize(MESHLET_GEOMETRY_MESHLETS) * MESHLET_MAX_TRIANGLES * sizeof(uint32_t), triangleBuffer, triangleMemory);
+}
+
+void MeshletGeometry::destroy()
+{
+	VkBuffer buffers[] = { vertexBuffer, indexBuffer, meshletBuffer, meshletVertexBuffer, triangleBuffer };
+	VkDeviceMemory memories[] = { vertexMemory, indexMemory, meshletMemory, meshletVertexMemory, triangleMemory };
+	for (uint32_t i = 0; i < 5; i++) {
+		vkDestroyBuffer(device, buffers[i], nullptr);
+		vkFreeMemory(device, memories[i], nullptr);
+	}
+	vertexBuffer = indexBuffer = meshletBuffer = meshletVertexBuffer = triangleBuffer = VK_NULL_HANDLE;
+	vertexMemory = indexMemory = meshletMemory = meshletVertexMemory = triangleMemory = VK_NULL_HANDLE;
+}
+
+bool MeshletGeometry::add(const void* vertices, uint32_t vertexCount, const uint32_t* indices, uint32_t indexCount, MeshletRange& range)
+{
+	std::vector<Meshlet> meshlets;
+	std::vector<uint32_t> meshletVertices;
+	std::vector<uint32_t> triangles;
+	const uint8_t* bytes = static_cast<const uint8_t*>(vertices);
+	buildMeshlets(bytes, vertexSize, indices, indexCount, meshlets, meshletVertices, triangles);
+
+	if (this->vertexCount + vertexCount > MESHLET_GEOMETRY_VERTICES || this->indexCount + indexCount > MESHLET_GEOMETRY_INDICES ||
+		meshletCount + meshlets.size() > MESHLET_GEOMETRY_MESHLETS) {
+		return false;
+	}
+
+	// Offsets in the whole buffers
+	for (Meshlet& meshlet : meshlets) {
+		meshlet.vertexOffset += meshletVertexCount;
+		meshlet.triangleOffset += triangleCount;
+	}
+	for (uint32_t& vertex : meshletVertices) {
+		vertex += this->vertexCount;
+	}
+
+	range.firstIndex = this->indexCount;
+	range.indexCount = indexCount;
+	range.vertexOffset = int32_t(this->vertexCount);
+	range.firstMeshlet = meshletCount;
+	range.meshletCount = uint32_t(meshlets.size());
+	range.triangleCount = indexCount / 3;
+
+	pendingVertices.insert(pendingVertices.end(), bytes, bytes + size_t(vertexCount) * vertexSize);
+	pendingIndices.insert(pendingIndices.end(), indices, indices + indexCount);
+	pendingMeshlets.insert(pendingMeshlets.end(), meshlets.begin(), meshlets.end());
+	pendingMeshletVertices.insert(pendingMeshletVertices.end(), meshletVertices.begin(), meshletVertices.end());
+	pendingTriangles.insert(pendingTriangles.end(), triangles.begin(), triangles.end());
+
+	this->vertexCount += vertexCount;
+	this->indexCount += indexCount;
+	meshletCount += uint32_t(meshlets.size());
+	meshletVertexCount += uint32_t(meshletVertices.size());
+	triangleCount += uint32_t(triangles.size());
+	return true;
+}
+
+void MeshletGeometry::upload(VkCommandBuffer cmdBuffer, DeletionQueue& deletions)
+{
+	if (!hasPending()) {
+		return;
+	}
+
+	// Every part in one staging buffer, copied after what is already there
+	struct Part {
+		const void* data;
+		VkDeviceSize size;
+		VkBuffer buffer;
+		VkDeviceSize offset;
+	};
+	Part parts[] = {
+		{ pendingVertices.data(), pendingVertices.size(), vertexBuffer, VkDeviceSize(vertexCount) * vertexSize - pendingVertices.size() },
+		{ pendingIndices.data(), pendingIndices.size() * sizeof(uint32_t), indexBuffer, (indexCount - pendingIndices.size()) * sizeof(uint32_t) },
+		{ pendingMeshlets.data(), pendingMeshlets.size() * sizeof(Meshlet), meshletBuffer, (meshletCount - pendingMeshlets.size()) * sizeof(Meshlet) },
+		{ pendingMeshletVertices.data(), pendingMeshletVertices.size() * sizeof(uint32_t), meshletVertexBuffer,
+		  (meshletVertexCount - pendingMeshletVertices.size()) * sizeof(uint32_t) },
+		{ pendingTriangles.data(), pendingTriangles.size() * sizeof(uint32_t), triangleBuffer, (triangleCount - pendingTriangles.size()) * sizeof(uint32_t) },
+	};
+	VkDeviceSize size = 0;
+	for (const Part& part : parts) {
+		size += part.size;
+	}
+
+	VkBuffer stagingBuffer;
+	VkDeviceMemory stagingMemory;
+	vk::createBuffer(physicalDevice, device, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 VK_BUFFER_USAGE_TRANSFER_SRC_BIT, size, stagingBuffer, stagingMemory);
+	void* data;
+	VkResult res = vkMapMemory(device, stagingMemory, 0, VK_WHOLE_SIZE, 0, &data);
+	assert(res == VK_SUCCESS);
+
+	VkDeviceSize offset = 0;
+	for (const Part& part : parts) {
+		if (part.size == 0) {
+			continue;
+		}
+		memcpy(static_cast<uint8_t*>(data) + offset, part.data, size_t(part.size));
+		VkBufferCopy copy = {};
+		copy.srcOffset = offset;
+		copy.dstOffset = part.offset;
+		copy.size = part.size;
+		vkCmdCopyBuffer(cmdBuffer, stagingBuffer, part.buffer, 1, &copy);
+		offset += part.size;
+	}
+	vkUnmapMemory(device, stagingMemory);
+
+	// Pulled by the vertex shaders, read by the culling and the regular draws
+	VkMemoryBarrier barrier = {};
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+						 VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+						 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+	deletions.destroy(stagingBuffer);
+	deletions.free(stagingMemory);
+	pendingVertices.clear();
+	pendingIndices.clear();
+	pendingMeshlets.clear();
+	pendingMeshletVertices.clear();
+	pendingTriangles.clear();
+}
+
+void MeshletCulling::init(const DeviceCapabilities& capabilities, VkDevice device, const MeshletGeometry& geometry, const DepthPyramid& pyramid,
+						  uint32_t frameCount)
+{
+	this->physicalDevice = capabilities.physicalDevice;
+	this->device = device;
+
+	// Each part starts on a storage buffer offset
+	VkDeviceSize alignment = std::max(capabilities.limits().minStorageBufferOffsetAlignment, VkDeviceSize(sizeof(uint32_t)));
+	auto align = [alignment](VkDeviceSize size) { return (size + alignment - 1) / alignment * alignment; };
+	instancePartSize = align(MESHLET_MAX_INSTANCES * sizeof(MeshletInstance));
+	drawPartSize = align(MESHLET_MAX_INSTANCES * 2 * sizeof(MeshletDraw));
+	visiblePartSize = align(MESHLET_MAX_VISIBLE * sizeof(uint32_t));
+	indexPartSize = align(MESHLET_MAX_DRAWN_INDICES * sizeof(uint32_t));
+	drawnPartSize = visiblePartSize;
+
+	// A few tens of kilobytes per frame: read from host memory
+	vk::createBuffer(physicalDevice, device, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, instancePartSize * frameCount, instanceBuffer, instanceMemory);
+	void* data;
+	VkResult res = vkMapMemory(device, instanceMemory, 0, VK_WHOLE_SIZE, 0, &data);
+	assert(res == VK_SUCCESS);
+	instanceData = static_cast<uint8_t*>(data);
+
+	// Never seen by the CPU
+	VkFlags local = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+	vk::createBuffer(physicalDevice, device, local, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+					 drawPartSize * frameCount, drawBuffer, drawMemory);
+	vk::createBuffer(physicalDevice, device, local, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+					 visiblePartSize * frameCount, visibleBuffer, visibleMemory);
+	vk::createBuffer(physicalDevice, device, local, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+					 indexPartSize * frameCount, indexBuffer, indexMemory);
+	vk::createBuffer(physicalDevice, device, local, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+					 drawnPartSize * frameCount, drawnBuffer, drawnMemory);
+
+	// DESCRIPTORS: meshlets, triangles, instances, draws, visible, indices, drawn by the early phase, pyramid
+	// for the culling; vertices, meshlets, meshlet vertices, visible for the draws
+	VkDescriptorType types[] = {
+		VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+		VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+		VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+	};
+	cullSetLayout = vk::createDescriptorSetLayout(device, types, 8, VK_SHADER_STAGE_COMPUTE_BIT);
+	drawSetLayout = vk::createDescriptorSetLayout(device, types, 4, VK_SHADER_STAGE_VERTEX_BIT);
+
+	VkDescriptorPoolSize poolSizes[2] = {};
+	poolSizes[0].descriptorCount = 11 * frameCount;
+	poolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	poolSizes[1].descriptorCount = frameCount;
+	poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+
+	VkDescriptorPoolCreateInfo descriptorPoolInfo = {};
+	descriptorPoolInfo.maxSets = 2 * frameCount;
+	descriptorPoolInfo.poolSizeCount = 2;
+	descriptorPoolInfo.pPoolSizes = poolSizes;
+	descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+
+	res = vkCreateDescriptorPool(device, &descriptorPoolInfo, nullptr, &descriptorPool);
+	assert(res == VK_SUCCESS);
+
+	std::vector<VkDescriptorSetLayout> setLayouts(frameCount, cullSetLayout);
+	setLayouts.resize(2 * frameCount, drawSetLayout);
+	VkDescriptorSetAllocateInfo descriptorSetAllocInfo = {};
+	descriptorSetAllocInfo.descriptorPool = descriptorPool;
+	descriptorSetAllocInfo.descriptorSetCount = 2 * frameCount;
+	descriptorSetAllocInfo.pSetLayouts = setLayouts.data();
+	descriptorSetAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+
+	std::vector<VkDescriptorSet> sets(2 * frameCount);
+	res = vkAllocateDescriptorSets(device, &descriptorSetAllocInfo, sets.data());
+	assert(res == VK_SUCCESS);
+	cullSets.assign(sets.begin(), sets.begin() + frameCount);
+	drawSets.assign(sets.begin() + frameCount, sets.end());
+
+	VkDescriptorImageInfo imageDescriptor = {};
+	imageDescriptor.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+	imageDescriptor.imageView = pyramid.getView();
+	imageDescriptor.sampler = pyramid.getSampler();
+
+	for (uint32_t frame = 0; frame < frameCount; frame++) {
+		VkDescriptorBufferInfo meshlets = { geometry.getMeshletBuffer(), 0, VK_WHOLE_SIZE };
+		VkDescriptorBufferInfo visible = { visibleBuffer, frame * visiblePartSize, visiblePartSize };
+		VkDescriptorBufferInfo bufferDescriptors[] = {
+			meshlets,
+			{ geometry.getTriangleBuffer(), 0, VK_WHOLE_SIZE },
+			{ instanceBuffer, frame * instancePartSize, instancePartSize },
+			{ drawBuffer, frame * drawPartSize, drawPartSize },
+			visible,
+			{ indexBuffer, frame * indexPartSize, indexPartSize },
+			{ drawnBuffer, frame * drawnPartSize, drawnPartSize },
+			{ geometry.getVertexBuffer(), 0, VK_WHOLE_SIZE },
+			meshlets,
+			{ geometry.getMeshletVertexBuffer(), 0, VK_WHOLE_SIZE },
+			visible,
+		};
+
+		// The pyramid comes last in the culling set, after the 7 buffers
+		VkWriteDescriptorSet writeDescriptorSets[12];
+		for (uint32_t i = 0; i < 12; i++) {
+			uint32_t buffer = i < 7 ? i : i - 1;
+			writeDescriptorSets[i] = {};
+			writeDescriptorSets[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			writeDescriptorSets[i].descriptorCount = 1;
+			writeDescriptorSets[i].descriptorType = i == 7 ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+			writeDescriptorSets[i].dstSet = i < 8 ? cullSets[frame] : drawSets[frame];
+			if (i == 7) {
+				writeDescriptorSets[i].pImageInfo = &imageDescriptor;
+			}
+			else {
+				writeDescriptorSets[i].pBufferInfo = &bufferDescriptors[buffer];
+			}
+			writeDescriptorSets[i].dstBinding = i < 8 ? i : i - 8;
+		}
+		vkUpdateDescriptorSets(device, 12, writeDescriptorSets, 0, nullptr);
+	}
+}
+
+void MeshletCulling::destroy()
+{
+	vkDestroyPipeline(device, pipeline, nullptr);
+	vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+	vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+	vkDestroyDescriptorSetLayout(device, cullSetLayout, nullptr);
+	vkDestroyDescriptorSetLayout(device, drawSetLayout, nullptr);
+	vkUnmapMemory(device, instanceMemory);
+	VkBuffer buffers[] = { instanceBuffer, drawBuffer, visibleBuffer, indexBuffer, drawnBuffer };
+	VkDeviceMemory memories[] = { instanceMemory, drawMemory, visibleMemory, indexMemory, drawnMemory };
+	for (uint32_t i = 0; i < 5; i++) {
+		vkDestroyBuffer(device, buffers[i], nullptr);
+		vkFreeMemory(device, memories[i], nullptr);
+	}
+	pipeline = VK_NULL_HANDLE;
+	pipelineLayout = VK_NULL_HANDLE;
+	descriptorPool = VK_NULL_HANDLE;
+	cullSetLayout = VK_NULL_HANDLE;
+	drawSetLayout = VK_NULL_HANDLE;
+	instanceData = nullptr;
+	cullSets.clear();
+	drawSets.clear();
+}
+
+void MeshletCulling::createPipeline(VkShaderModule shaderModule)
+{
+	pipelineLayout = vk::createPipelineLayout(device, cullSetLayout, sizeof(CullConstants), VK_SHADER_STAGE_COMPUTE_BIT);
+	pipeline = vk::createComputePipeline(device, shaderModule, pipelineLayout);
+}
+
+void MeshletCulling::begin(uint32_t frame)
+{
+	this->frame = frame;
+	instanceCount = 0;
+	visibleCount = 0;
+	indexCount = 0;
+}
+
+uint32_t MeshletCulling::addInstance(const glm::mat4& modelView, float scale, uint32_t firstMeshlet, uint32_t meshletCount, uint32_t triangleCount)
+{
+	uint32_t instance = instanceCount.fetch_add(1);
+	if (instance >= MESHLET_MAX_INSTANCES) {
+		return UINT32_MAX;
+	}
+
+	// Room for all of its meshlets: the culling writes the visible ones from the start of its ranges
+	uint32_t firstVisible = visibleCount.fetch_add(meshletCount);
+	uint32_t firstIndex = indexCount.fetch_add(triangleCount * 3);
+	bool fits = firstVisible + meshletCount <= MESHLET_MAX_VISIBLE && firstIndex + triangleCount * 3 <= MESHLET_MAX_DRAWN_INDICES;
+
+	// Skipped by the culling when it does not fit, the slot is taken anyway
+	MeshletInstance written = {};
+	written.modelView = modelView;
+	written.firstMeshlet = firstMeshlet;
+	written.meshletCount = fits ? meshletCount : 0;
+	written.firstVisible = firstVisible;
+	written.firstIndex = firstIndex;
+	written.scale = scale;
+	memcpy(instanceData + frame * instancePartSize + instance * sizeof(MeshletInstance), &written, sizeof(written));
+	return fits ? instance : UINT32_MAX;
+}
+
+void MeshletCulling::record(VkCommandBuffer cmdBuffer, uint32_t frame, const CullConstants& constants)
+{
+	uint32_t count = std::min(instanceCount.load(), uint32_t(MESHLET_MAX_INSTANCES));
+	if (count == 0) {
+		return;
+	}
+
+	// One work group per instance
+	vkCmdPushConstants(cmdBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+	vk::dispatch(cmdBuffer, pipeline, pipelineLayout, cullSets[frame], count);
+
+	// Draw parameters, indices, then the visible list pulled by the vertex shader; the late phase reads the early one
+	VkMemoryBarrier barrier = {};
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+						 VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+						 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void MeshletCulling::draw(VkCommandBuffer cmdBuffer, uint32_t frame, uint32_t instance, CullPhase phase) const
+{
+	vkCmdBindIndexBuffer(cmdBuffer, indexBuffer, frame * indexPartSize, VK_INDEX_TYPE_UINT32);
+	vkCmdDrawIndexedIndirect(cmdBuffer, drawBuffer, frame * drawPartSize + (instance * 2 + phase) * sizeof(MeshletDraw), 1, sizeof(MeshletDraw));
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <stdint.h>
+#include <vector>
+#include <atomic>
+#include <glm.hpp>
+#include "DepthPyramid.h"
+
+class DeviceCapabilities;
+class DeletionQueue;
+
+#define MESHLET_MAX_VERTICES 64		// The indices drawn keep 6 bits for the vertex in the meshlet
+#define MESHLET_MAX_TRIANGLES 124
+#define MESHLET_GROUP_SIZE 64		// local_size_x of meshletCull.comp
+
+// Every mesh added, fixed sizes: the descriptor sets of the views never change
+#define MESHLET_GEOMETRY_VERTICES 262144
+#define MESHLET_GEOMETRY_INDICES 1048576
+#define MESHLET_GEOMETRY_MESHLETS 16384
+
+// Per view and per frame
+#define MESHLET_MAX_INSTANCES 1024
+#define MESHLET_MAX_VISIBLE 16384		// Under 2^18: the largest index stays under the 2^24 guaranteed by maxDrawIndexedIndexValue
+#define MESHLET_MAX_DRAWN_INDICES 786432
+
+// Matches the Meshlet struct of the shaders (std430), in object space
+struct Meshlet {
+	float center[3];
+	float radius;
+	float coneAxis[3];		// Average normal of the triangles
+	float coneCutoff;		// Sine of the cone half angle, 1 when the triangles face every way
+	uint32_t vertexOffset;	// In the meshlet vertices
+	uint32_t triangleOffset;	// In the packed triangles
+	uint32_t vertexCount;
+	uint32_t triangleCount;
+};
+
+// Matches the Instance struct of meshletCull.comp (std430): an object drawn with its meshlets
+struct MeshletInstance {
+	glm::mat4 modelView;
+	uint32_t firstMeshlet;
+	uint32_t meshletCount;	// 0 skips the instance
+	uint32_t firstVisible;	// Slots of its meshlets in the visible list
+	uint32_t firstIndex;	// Of its range in the index buffer of the frame
+	float scale;			// Largest axis of the model matrix, for the radii
+	uint32_t padding[3];
+};
+
+// Written by meshletCull.comp, drawn with vkCmdDrawIndexedIndirect. One per instance and phase.
+struct MeshletDraw {
+	VkDrawIndexedIndirectCommand command;
+	uint32_t visibleCount;
+	uint32_t padding[2];
+};
+
+// Meshlets of an added mesh, and the range of its triangles for the regular draws
+struct MeshletRange {
+	uint32_t firstIndex;
+	uint32_t indexCount;
+	int32_t vertexOffset;
+	uint32_t firstMeshlet;
+	uint32_t meshletCount;
+	uint32_t triangleCount;
+};
+
+// Greedy, in triangle order: a meshlet is closed when the next triangle takes it over MESHLET_MAX_VERTICES
+// or MESHLET_MAX_TRIANGLES. The offsets start at the current end of 'meshletVertices' and 'triangles'.
+// 'meshletVertices' gets the indices of the vertices, 'triangles' their index in the meshlet packed 3 x 8 bits.
+// The positions are the first 3 floats of each vertex, 'stride' bytes apart.
+void buildMeshlets(const uint8_t* vertices, uint32_t stride, const uint32_t* indices, uint32_t indexCount,
+				   std::vector<Meshlet>& meshlets, std::vector<uint32_t>& meshletVertices, std::vector<uint32_t>& triangles);
+
+// Vertices, indices and meshlets of the clustered meshes, shared by the views.
+// Read by the vertex shader (vertex pulling) and by the culling; the vertex and index buffers also draw
+// the meshes without culling, and their shadows.
+class MeshletGeometry
+{
+private:
+	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+	VkDevice device = VK_NULL_HANDLE;
+	uint32_t vertexSize = 0;
+
+	VkBuffer vertexBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory vertexMemory = VK_NULL_HANDLE;
+	VkBuffer indexBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory indexMemory = VK_NULL_HANDLE;
+	VkBuffer meshletBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory meshletMemory = VK_NULL_HANDLE;
+	VkBuffer meshletVertexBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory meshletVertexMemory = VK_NULL_HANDLE;
+	VkBuffer triangleBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory triangleMemory = VK_NULL_HANDLE;
+
+	// Added so far, uploaded or not
+	uint32_t vertexCount = 0;
+	uint32_t indexCount = 0;
+	uint32_t meshletCount = 0;
+	uint32_t meshletVertexCount = 0;
+	uint32_t triangleCount = 0;
+
+	// Added since the last upload, at the end of the buffers
+	std::vector<uint8_t> pendingVertices;
+	std::vector<uint32_t> pendingIndices;
+	std::vector<Meshlet> pendingMeshlets;
+	std::vector<uint32_t> pendingMeshletVertices;
+	std::vector<uint32_t> pendingTriangles;
+
+public:
+	// 'vertexSize' bytes per vertex, the position first
+	void init(const DeviceCapabilities& capabilities, VkDevice device, uint32_t vertexSize);
+	void destroy();
+
+	// Split into meshlets, uploaded by the next upload(). False when the buffers are full.
+	bool add(const void* vertices, uint32_t vertexCount, const uint32_t* indices, uint32_t indexCount, MeshletRange& range);
+	// Copies what was added since the last call, read by the commands submitted after it
+	void upload(VkCommandBuffer cmdBuffer, DeletionQueue& deletions);
+	bool hasPending() const { return !pendingIndices.empty(); }
+
+	VkBuffer getVertexBuffer() const { return vertexBuffer; }
+	VkBuffer getIndexBuffer() const { return indexBuffer; }
+	VkBuffer getMeshletBuffer() const { return meshletBuffer; }
+	VkBuffer getMeshletVertexBuffer() const { return meshletVertexBuffer; }
+	VkBuffer getTriangleBuffer() const { return triangleBuffer; }
+};
+
+// Culling of the meshlets against the camera of a view, on the GPU before its scene is drawn:
+// meshletCull.comp drops the meshlets out of the frustum, the ones whose normal cone faces away and the ones
+// the depth pyramid hides, then writes the triangles of the others into an index buffer and one indirect draw
+// per object and phase: the late phase appends what the early one left out.
+// The indices point into the visible list: the meshlet in the upper bits, its vertex in the lower 6.
+// One part per frame in flight in each buffer, with its own descriptor sets.
+class MeshletCulling
+{
+private:
+	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+	VkDevice device = VK_NULL_HANDLE;
+
+	// Written every frame by the job threads gathering the draws
+	VkBuffer instanceBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory instanceMemory = VK_NULL_HANDLE;
+	uint8_t* instanceData = nullptr;
+	VkDeviceSize instancePartSize = 0;
+
+	// Written by the culling, read by the draws
+	VkBuffer drawBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory drawMemory = VK_NULL_HANDLE;
+	VkDeviceSize drawPartSize = 0;
+	VkBuffer visibleBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory visibleMemory = VK_NULL_HANDLE;
+	VkDeviceSize visiblePartSize = 0;
+	VkBuffer indexBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory indexMemory = VK_NULL_HANDLE;
+	VkDeviceSize indexPartSize = 0;
+	VkBuffer drawnBuffer = VK_NULL_HANDLE;	// What the early phase drew, per meshlet slot
+	VkDeviceMemory drawnMemory = VK_NULL_HANDLE;
+	VkDeviceSize drawnPartSize = 0;
+
+	// Of the frame being prepared
+	uint32_t frame = 0;
+	std::atomic<uint32_t> instanceCount{ 0 };
+	std::atomic<uint32_t> visibleCount{ 0 };
+	std::atomic<uint32_t> indexCount{ 0 };
+
+	VkDescriptorSetLayout cullSetLayout = VK_NULL_HANDLE;
+	VkDescriptorSetLayout drawSetLayout = VK_NULL_HANDLE;
+	VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+	std::vector<VkDescriptorSet> cullSets;	// Per frame
+	std::vector<VkDescriptorSet> drawSets;	// Per frame
+
+	VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+	VkPipeline pipeline = VK_NULL_HANDLE;
+
+public:
+	void init(const DeviceCapabilities& capabilities, VkDevice device, const MeshletGeometry& geometry, const DepthPyramid& pyramid, uint32_t frameCount);
+	void destroy();
+
+	// Culling pipeline, the module is destroyed by the caller
+	void createPipeline(VkShaderModule shaderModule);
+
+	// Starts the instances of 'frame', its part must not be in use anymore
+	void begin(uint32_t frame);
+	// From any thread. UINT32_MAX when the frame is full: the object is drawn whole, without culling.
+	uint32_t addInstance(const glm::mat4& modelView, float scale, uint32_t firstMeshlet, uint32_t meshletCount, uint32_t triangleCount);
+
+	// Culls the instances of 'frame' for a phase, outside of a render pass. Followed by the barrier of the draws.
+	void record(VkCommandBuffer cmdBuffer, uint32_t frame, const CullConstants& constants);
+	// Inside the pass, with a meshlet pipeline and the draw set bound
+	void draw(VkCommandBuffer cmdBuffer, uint32_t frame, uint32_t instance, CullPhase phase) const;
+
+	// Set 3 of the scene pipelines
+	VkDescriptorSetLayout getDrawSetLayout() const { return drawSetLayout; }
+	VkDescriptorSet getDrawSet(uint32_t frame) const { return drawSets[frame]; }
+};
@@ -0,0 +1,160 @@
+#include "ObjectCulling.h"
+#include "DeviceCapabilities.h"
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include "helpers\Helpers.h"
+
+void ObjectCulling::init(const DeviceCapabilities& capabilities, VkDevice device, const DepthPyramid& pyramid, uint32_t frameCount, uint32_t maxObjects)
+{
+	this->physicalDevice = capabilities.physicalDevice;
+	this->device = device;
+	this->maxObjects = maxObjects;
+
+	// Each part starts on a storage buffer offset
+	VkDeviceSize alignment = std::max(capabilities.limits().minStorageBufferOffsetAlignment, VkDeviceSize(sizeof(uint32_t)));
+	auto align = [alignment](VkDeviceSize size) { return (size + alignment - 1) / alignment * alignment; };
+	objectPartSize = align(maxObjects * sizeof(CulledObject));
+	drawPartSize = align(maxObjects * 2 * sizeof(VkDrawIndexedIndirectCommand));
+	drawnPartSize = align(maxObjects * sizeof(uint32_t));
+
+	vk::createBuffer(physicalDevice, device, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, objectPartSize * frameCount, objectBuffer, objectMemory);
+	void* data;
+	VkResult res = vkMapMemory(device, objectMemory, 0, VK_WHOLE_SIZE, 0, &data);
+	assert(res == VK_SUCCESS);
+	objectData = static_cast<uint8_t*>(data);
+
+	VkFlags local = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+	vk::createBuffer(physicalDevice, device, local, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+					 drawPartSize * frameCount, drawBuffer, drawMemory);
+	vk::createBuffer(physicalDevice, device, local, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, drawnPartSize * frameCount, drawnBuffer, drawnMemory);
+
+	// DESCRIPTORS: objects, draws, drawn by the early phase, pyramid
+	VkDescriptorType types[] = {
+		VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+		VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+	};
+	setLayout = vk::createDescriptorSetLayout(device, types, 4, VK_SHADER_STAGE_COMPUTE_BIT);
+
+	VkDescriptorPoolSize poolSizes[2] = {};
+	poolSizes[0].descriptorCount = 3 * frameCount;
+	poolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	poolSizes[1].descriptorCount = frameCount;
+	poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+
+	VkDescriptorPoolCreateInfo descriptorPoolInfo = {};
+	descriptorPoolInfo.maxSets = frameCount;
+	descriptorPoolInfo.poolSizeCount = 2;
+	descriptorPoolInfo.pPoolSizes = poolSizes;
+	descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+
+	res = vkCreateDescriptorPool(device, &descriptorPoolInfo, nullptr, &descriptorPool);
+	assert(res == VK_SUCCESS);
+
+	std::vector<VkDescriptorSetLayout> setLayouts(frameCount, setLayout);
+	VkDescriptorSetAllocateInfo descriptorSetAllocInfo = {};
+	descriptorSetAllocInfo.descriptorPool = descriptorPool;
+	descriptorSetAllocInfo.descriptorSetCount = frameCount;
+	descriptorSetAllocInfo.pSetLayouts = setLayouts.data();
+	descriptorSetAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+
+	descriptorSets.resize(frameCount);
+	res = vkAllocateDescriptorSets(device, &descriptorSetAllocInfo, descriptorSets.data());
+	assert(res == VK_SUCCESS);
+
+	VkDescriptorImageInfo imageDescriptor = {};
+	imageDescriptor.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+	imageDescriptor.imageView = pyramid.getView();
+	imageDescriptor.sampler = pyramid.getSampler();
+
+	for (uint32_t frame = 0; frame < frameCount; frame++) {
+		VkDescriptorBufferInfo bufferDescriptors[] = {
+			{ objectBuffer, frame * objectPartSize, objectPartSize },
+			{ drawBuffer, frame * drawPartSize, drawPartSize },
+			{ drawnBuffer, frame * drawnPartSize, drawnPartSize },
+		};
+
+		VkWriteDescriptorSet writeDescriptorSets[4] = {};
+		for (uint32_t i = 0; i < 4; i++) {
+			writeDescriptorSets[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			writeDescriptorSets[i].descriptorCount = 1;
+			writeDescriptorSets[i].descriptorType = types[i];
+			writeDescriptorSets[i].dstSet = descriptorSets[frame];
+			writeDescriptorSets[i].dstBinding = i;
+			if (i < 3) {
+				writeDescriptorSets[i].pBufferInfo = &bufferDescriptors[i];
+			}
+			else {
+				writeDescriptorSets[i].pImageInfo = &imageDescriptor;
+			}
+		}
+		vkUpdateDescriptorSets(device, 4, writeDescriptorSets, 0, nullptr);
+	}
+}
+
+void ObjectCulling::destroy()
+{
+	vkDestroyPipeline(device, pipeline, nullptr);
+	vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+	vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+	vkDestroyDescriptorSetLayout(device, setLayout, nullptr);
+	vkUnmapMemory(device, objectMemory);
+	VkBuffer buffers[] = { objectBuffer, drawBuffer, drawnBuffer };
+	VkDeviceMemory memories[] = { objectMemory, drawMemory, drawnMemory };
+	for (uint32_t i = 0; i < 3; i++) {
+		vkDestroyBuffer(device, buffers[i], nullptr);
+		vkFreeMemory(device, memories[i], nullptr);
+	}
+	pipeline = VK_NULL_HANDLE;
+	pipelineLayout = VK_NULL_HANDLE;
+	descriptorPool = VK_NULL_HANDLE;
+	setLayout = VK_NULL_HANDLE;
+	objectData = nullptr;
+	descriptorSets.clear();
+}
+
+void ObjectCulling::createPipeline(VkShaderModule shaderModule)
+{
+	pipelineLayout = vk::createPipelineLayout(device, setLayout, sizeof(CullConstants), VK_SHADER_STAGE_COMPUTE_BIT);
+	pipeline = vk::createComputePipeline(device, shaderModule, pipelineLayout);
+}
+
+void ObjectCulling::begin(uint32_t frame, uint32_t objectCount)
+{
+	assert(objectCount <= maxObjects);
+	this->frame = frame;
+	this->objectCount = objectCount;
+}
+
+void ObjectCulling::setObject(uint32_t object, const CulledObject& culled)
+{
+	memcpy(objectData + frame * objectPartSize + object * sizeof(CulledObject), &culled, sizeof(culled));
+}
+
+void ObjectCulling::record(VkCommandBuffer cmdBuffer, uint32_t frame, const CullConstants& constants)
+{
+	if (objectCount == 0) {
+		return;
+	}
+
+	CullConstants pushed = constants;
+	pushed.objectCount = objectCount;
+	vkCmdPushConstants(cmdBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pushed), &pushed);
+	vk::dispatch(cmdBuffer, pipeline, pipelineLayout, descriptorSets[frame], vk::getGroupCount(objectCount, OBJECT_CULL_GROUP_SIZE));
+
+	// Draw parameters, and what the early phase drew for the late one
+	VkMemoryBarrier barrier = {};
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+						 VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+						 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void ObjectCulling::draw(VkCommandBuffer cmdBuffer, uint32_t frame, uint32_t object, CullPhase phase) const
+{
+	VkDeviceSize offset = frame * drawPartSize + (object * 2 + phase) * sizeof(VkDrawIndexedIndirectCommand);
+	vkCmdDrawIndexedIndirect(cmdBuffer, drawBuffer, offset, 1, sizeof(VkDrawIndexedIndirectCommand));
+}
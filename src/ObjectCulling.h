@@ -0,0 +1,74 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <stdint.h>
+#include <vector>
+#include "DepthPyramid.h"
+
+class DeviceCapabilities;
+
+#define OBJECT_CULL_GROUP_SIZE 64	// local_size_x of objectCull.comp
+
+// Matches the Object struct of objectCull.comp (std430): a regular draw with its sphere in view space
+struct CulledObject {
+	float center[3];
+	float radius;
+	uint32_t indexCount;	// 0 skips the object: drawn by the meshlet culling
+	uint32_t firstIndex;
+	int32_t vertexOffset;
+	uint32_t padding;
+};
+
+// Culling of the regular draws of a view on the GPU: objectCull.comp tests the sphere of every object against
+// the frustum and the depth pyramid, and writes one indirect draw per object and phase. The hidden ones get
+// no instance: the draws are still recorded in the order of the draw list, the GPU skips them.
+// One part per frame in flight in each buffer, with its own descriptor set.
+class ObjectCulling
+{
+private:
+	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+	VkDevice device = VK_NULL_HANDLE;
+	uint32_t maxObjects = 0;
+
+	// Written every frame by the job threads gathering the draws
+	VkBuffer objectBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory objectMemory = VK_NULL_HANDLE;
+	uint8_t* objectData = nullptr;
+	VkDeviceSize objectPartSize = 0;
+
+	// Written by the culling: the draws of both phases, and what the early one drew
+	VkBuffer drawBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory drawMemory = VK_NULL_HANDLE;
+	VkDeviceSize drawPartSize = 0;
+	VkBuffer drawnBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory drawnMemory = VK_NULL_HANDLE;
+	VkDeviceSize drawnPartSize = 0;
+
+	// Of the frame being prepared
+	uint32_t frame = 0;
+	uint32_t objectCount = 0;
+
+	VkDescriptorSetLayout setLayout = VK_NULL_HANDLE;
+	VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+	std::vector<VkDescriptorSet> descriptorSets;	// Per frame
+
+	VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+	VkPipeline pipeline = VK_NULL_HANDLE;
+
+public:
+	void init(const DeviceCapabilities& capabilities, VkDevice device, const DepthPyramid& pyramid, uint32_t frameCount, uint32_t maxObjects);
+	void destroy();
+
+	// Culling pipeline, the module is destroyed by the caller
+	void createPipeline(VkShaderModule shaderModule);
+
+	// Starts the objects of 'frame', its part must not be in use anymore
+	void begin(uint32_t frame, uint32_t objectCount);
+	// From any thread, every object under the count once
+	void setObject(uint32_t object, const CulledObject& culled);
+
+	// Culls the objects of 'frame' for a phase, outside of a render pass. Followed by the barrier of the draws.
+	void record(VkCommandBuffer cmdBuffer, uint32_t frame, const CullConstants& constants);
+	// Inside the pass, with the vertex and index buffers of the object bound
+	void draw(VkCommandBuffer cmdBuffer, uint32_t frame, uint32_t object, CullPhase phase) const;
+};
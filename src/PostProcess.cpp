@@ -0,0 +1,262 @@
+#include "PostProcess.h"
+#include "DeviceCapabilities.h"
+#include "SamplerCache.h"
+#include "RenderGraph.h"
+#include <assert.h>
+#include <algorithm>
+#include "helpers\Helpers.h"
+
+#define POST_GROUP_SIZE 8	// local_size_x and local_size_y of the post shaders
+
+void PostProcess::init(const DeviceCapabilities& capabilities, VkDevice device, SamplerCache& samplers, VkFormat targetFormat)
+{
+	this->device = device;
+	this->targetFormat = targetFormat;
+
+	// Same texel size and channels as the 8 bit image: the bytes are copied as they are
+	rawCopy = targetFormat == VK_FORMAT_R8G8B8A8_UNORM || targetFormat == VK_FORMAT_R8G8B8A8_SRGB
+		   || targetFormat == VK_FORMAT_B8G8R8A8_UNORM || targetFormat == VK_FORMAT_B8G8R8A8_SRGB;
+	if (!rawCopy) {
+		VkFormatProperties properties;
+		vkGetPhysicalDeviceFormatProperties(capabilities.physicalDevice, targetFormat, &properties);
+		assert(properties.optimalTilingFeatures & VK_FORMAT_FEATURE_BLIT_DST_BIT);
+	}
+
+	// Bilinear taps of the tonemapping, the shared memory tiles use texelFetch
+	VkSamplerCreateInfo samplerInfo = {};
+	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.anisotropyEnable = VK_FALSE;
+	samplerInfo.borderColor = VK_BORDER_COLOR_FLOAT_TRANSPARENT_BLACK;
+	samplerInfo.magFilter = VK_FILTER_LINEAR;
+	samplerInfo.minFilter = VK_FILTER_LINEAR;
+	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	samplerInfo.maxAnisotropy = 1.0f;
+	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	sampler = samplers.get(samplerInfo);
+
+	// DESCRIPTORS: source, detail, result
+	VkDescriptorType types[] = { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE };
+	setLayout = vk::createDescriptorSetLayout(device, types, 3, VK_SHADER_STAGE_COMPUTE_BIT);
+	pipelineLayout = vk::createPipelineLayout(device, setLayout, sizeof(PostConstants), VK_SHADER_STAGE_COMPUTE_BIT);
+
+	// Down, up, tonemapping
+	const uint32_t setCount = 2 * BLOOM_LEVELS;
+	VkDescriptorPoolSize poolSizes[2] = {};
+	poolSizes[0].descriptorCount = 2 * setCount;
+	poolSizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	poolSizes[1].descriptorCount = setCount;
+	poolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+
+	VkDescriptorPoolCreateInfo descriptorPoolInfo = {};
+	descriptorPoolInfo.maxSets = setCount;
+	descriptorPoolInfo.poolSizeCount = 2;
+	descriptorPoolInfo.pPoolSizes = poolSizes;
+	descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+
+	VkResult res = vkCreateDescriptorPool(device, &descriptorPoolInfo, nullptr, &descriptorPool);
+	assert(res == VK_SUCCESS);
+}
+
+void PostProcess::destroy()
+{
+	vkDestroyPipeline(device, downsamplePipeline, nullptr);
+	vkDestroyPipeline(device, upsamplePipeline, nullptr);
+	vkDestroyPipeline(device, tonemapPipeline, nullptr);
+	vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+	vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+	vkDestroyDescriptorSetLayout(device, setLayout, nullptr);
+	downsamplePipeline = VK_NULL_HANDLE;
+	upsamplePipeline = VK_NULL_HANDLE;
+	tonemapPipeline = VK_NULL_HANDLE;
+	pipelineLayout = VK_NULL_HANDLE;
+	descriptorPool = VK_NULL_HANDLE;
+	setLayout = VK_NULL_HANDLE;
+	descriptorSets.clear();
+	steps.clear();
+}
+
+void PostProcess::createPipelines(VkShaderModule downsampleModule, VkShaderModule upsampleModule, VkShaderModule tonemapModule)
+{
+	downsamplePipeline = vk::createComputePipeline(device, downsampleModule, pipelineLayout);
+	upsamplePipeline = vk::createComputePipeline(device, upsampleModule, pipelineLayout);
+
+	// Raw copy: the shader does what the target format would have done (sRGB encoding, channel order).
+	// The blit converts on its own.
+	bool srgb = targetFormat == VK_FORMAT_R8G8B8A8_SRGB || targetFormat == VK_FORMAT_B8G8R8A8_SRGB;
+	bool bgra = targetFormat == VK_FORMAT_B8G8R8A8_UNORM || targetFormat == VK_FORMAT_B8G8R8A8_SRGB;
+	VkBool32 constants[] = { rawCopy && srgb, rawCopy && bgra };
+	VkSpecializationMapEntry entries[2];
+	for (uint32_t i = 0; i < 2; i++) {
+		entries[i].constantID = i;
+		entries[i].offset = i * sizeof(VkBool32);
+		entries[i].size = sizeof(VkBool32);
+	}
+
+	VkSpecializationInfo specialization = {};
+	specialization.mapEntryCount = 2;
+	specialization.pMapEntries = entries;
+	specialization.dataSize = sizeof(constants);
+	specialization.pData = constants;
+	tonemapPipeline = vk::createComputePipeline(device, tonemapModule, pipelineLayout, &specialization);
+}
+
+void PostProcess::addPasses(RenderGraph& renderGraph, uint32_t hdr, uint32_t target, VkExtent2D extent)
+{
+	this->target = target;
+	targetExtent = extent;
+	sourceExtent = extent;
+	steps.clear();
+
+	VkClearValue clearValue = {};
+	uint32_t levels[BLOOM_LEVELS];
+	VkExtent2D levelExtents[BLOOM_LEVELS];
+	for (uint32_t level = 0; level < BLOOM_LEVELS; level++) {
+		levelExtents[level].width = std::max(extent.width >> (level + 1), 1u);
+		levelExtents[level].height = std::max(extent.height >> (level + 1), 1u);
+		levels[level] = renderGraph.createImage("bloomDown" + std::to_string(level), HDR_FORMAT, levelExtents[level],
+												VK_IMAGE_ASPECT_COLOR_BIT, clearValue);
+	}
+
+	// DOWN: each level from the one above, the scene color for the first one
+	for (uint32_t level = 0; level < BLOOM_LEVELS; level++) {
+		Step step = {};
+		step.name = "bloomDown" + std::to_string(level);
+		step.type = POST_DOWNSAMPLE;
+		step.source = level == 0 ? hdr : levels[level - 1];
+		step.detail = step.source;	// Unused
+		step.result = levels[level];
+		step.extent = levelExtents[level];
+		steps.push_back(step);
+	}
+
+	// UP: the smaller level blurred and added to the level of the same size
+	uint32_t blurred = levels[BLOOM_LEVELS - 1];
+	for (uint32_t level = BLOOM_LEVELS - 1; level-- > 0;) {
+		Step step = {};
+		step.name = "bloomUp" + std::to_string(level);
+		step.type = POST_UPSAMPLE;
+		step.source = blurred;
+		step.detail = levels[level];
+		step.result = renderGraph.createImage(step.name, HDR_FORMAT, levelExtents[level], VK_IMAGE_ASPECT_COLOR_BIT, clearValue);
+		step.extent = levelExtents[level];
+		steps.push_back(step);
+		blurred = step.result;
+	}
+
+	// Scene and bloom, full resolution
+	ldr = renderGraph.createImage("ldr", VK_FORMAT_R8G8B8A8_UNORM, extent, VK_IMAGE_ASPECT_COLOR_BIT, clearValue);
+	Step tonemap = {};
+	tonemap.name = "tonemap";
+	tonemap.type = POST_TONEMAP;
+	tonemap.source = hdr;
+	tonemap.detail = blurred;
+	tonemap.result = ldr;
+	tonemap.extent = extent;
+	steps.push_back(tonemap);
+
+	// One pass each: the graph adds the barriers between them
+	for (uint32_t s = 0; s < steps.size(); s++) {
+		const Step& step = steps[s];
+		uint32_t pass = renderGraph.addCommandPass(step.name, [this, s](VkCommandBuffer cmdBuffer) { dispatch(cmdBuffer, s); });
+		renderGraph.addComputeInput(pass, step.source);
+		if (step.detail != step.source) {
+			renderGraph.addComputeInput(pass, step.detail);
+		}
+		renderGraph.addStorageOutput(pass, step.result);
+	}
+
+	uint32_t output = renderGraph.addCommandPass("postOutput", [this](VkCommandBuffer cmdBuffer) { copyToTarget(cmdBuffer); });
+	renderGraph.addTransferInput(output, ldr);
+	renderGraph.addTransferOutput(output, target);
+}
+
+void PostProcess::createDescriptorSets(const RenderGraph& renderGraph)
+{
+	graph = &renderGraph;
+	VkResult res = vkResetDescriptorPool(device, descriptorPool, 0);
+	assert(res == VK_SUCCESS);
+
+	std::vector<VkDescriptorSetLayout> setLayouts(steps.size(), setLayout);
+	VkDescriptorSetAllocateInfo descriptorSetAllocInfo = {};
+	descriptorSetAllocInfo.descriptorPool = descriptorPool;
+	descriptorSetAllocInfo.descriptorSetCount = uint32_t(steps.size());
+	descriptorSetAllocInfo.pSetLayouts = setLayouts.data();
+	descriptorSetAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+
+	descriptorSets.resize(steps.size());
+	res = vkAllocateDescriptorSets(device, &descriptorSetAllocInfo, descriptorSets.data());
+	assert(res == VK_SUCCESS);
+
+	// Layouts of the compute accesses in the graph
+	for (uint32_t s = 0; s < steps.size(); s++) {
+		const Step& step = steps[s];
+		VkDescriptorImageInfo imageDescriptors[3];
+		imageDescriptors[0] = { sampler, renderGraph.getImageView(step.source), VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+		imageDescriptors[1] = { sampler, renderGraph.getImageView(step.detail), VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+		imageDescriptors[2] = { VK_NULL_HANDLE, renderGraph.getImageView(step.result), VK_IMAGE_LAYOUT_GENERAL };
+
+		VkWriteDescriptorSet writeDescriptorSets[3];
+		for (uint32_t binding = 0; binding < 3; binding++) {
+			writeDescriptorSets[binding] = {};
+			writeDescriptorSets[binding].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			writeDescriptorSets[binding].descriptorCount = 1;
+			writeDescriptorSets[binding].descriptorType = binding < 2 ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER : VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+			writeDescriptorSets[binding].dstSet = descriptorSets[s];
+			writeDescriptorSets[binding].pImageInfo = &imageDescriptors[binding];
+			writeDescriptorSets[binding].dstBinding = binding;
+		}
+		vkUpdateDescriptorSets(device, 3, writeDescriptorSets, 0, nullptr);
+	}
+}
+
+void PostProcess::dispatch(VkCommandBuffer cmdBuffer, uint32_t s)
+{
+	const Step& step = steps[s];
+	if (bloomIntensity <= 0.0f && step.type != POST_TONEMAP) {
+		return;
+	}
+	VkPipeline pipeline = step.type == POST_DOWNSAMPLE ? downsamplePipeline
+						: step.type == POST_UPSAMPLE ? upsamplePipeline : tonemapPipeline;
+
+	// The levels add up on the way up
+	PostConstants constants = {};
+	constants.threshold = bloomThreshold;
+	constants.knee = bloomThreshold * 0.5f;
+	constants.intensity = bloomIntensity / BLOOM_LEVELS;
+	constants.exposure = exposure;
+	constants.firstPass = s == 0 ? 1 : 0;
+	constants.sourceScale[0] = float(sourceExtent.width) / targetExtent.width;
+	constants.sourceScale[1] = float(sourceExtent.height) / targetExtent.height;
+	vkCmdPushConstants(cmdBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PostConstants), &constants);
+	vk::dispatch(cmdBuffer, pipeline, pipelineLayout, descriptorSets[s],
+				 vk::getGroupCount(step.extent.width, POST_GROUP_SIZE), vk::getGroupCount(step.extent.height, POST_GROUP_SIZE));
+}
+
+void PostProcess::copyToTarget(VkCommandBuffer cmdBuffer)
+{
+	VkImageSubresourceLayers subresource = {};
+	subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	subresource.layerCount = 1;
+
+	VkImage source = graph->getImage(ldr);
+	VkImage destination = graph->getImage(target);
+	if (rawCopy) {
+		VkImageCopy region = {};
+		region.srcSubresource = subresource;
+		region.dstSubresource = subresource;
+		region.extent = { targetExtent.width, targetExtent.height, 1 };
+		vkCmdCopyImage(cmdBuffer, source, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, destination, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+		return;
+	}
+
+	// Same size, only converted
+	VkImageBlit region = {};
+	region.srcSubresource = subresource;
+	region.dstSubresource = subresource;
+	region.srcOffsets[1] = { int32_t(targetExtent.width), int32_t(targetExtent.height), 1 };
+	region.dstOffsets[1] = region.srcOffsets[1];
+	vkCmdBlitImage(cmdBuffer, source, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, destination, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+				   1, &region, VK_FILTER_NEAREST);
+}
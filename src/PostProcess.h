@@ -0,0 +1,97 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <stdint.h>
+#include <vector>
+#include <string>
+
+class DeviceCapabilities;
+class SamplerCache;
+class RenderGraph;
+
+#define HDR_FORMAT VK_FORMAT_R16G16B16A16_SFLOAT	// Scene color, linear
+#define BLOOM_LEVELS 5	// Half resolution first, then halved again at each level
+
+// Push constants of the post shaders
+struct PostConstants {
+	float threshold;	// Bloom starts at this brightness, after the exposure
+	float knee;			// Soft transition under the threshold
+	float intensity;	// Of the bloom added to the scene, per level
+	float exposure;
+	uint32_t firstPass;	// Downsample of the scene color: thresholded
+	uint32_t padding;
+	float sourceScale[2];	// Rendered part of the scene color, in texture coordinates
+};
+
+// Post chain, compute passes of the render graph reading the HDR scene color:
+// bloom downsampled level by level from half resolution, upsampled back with the levels added on
+// the way up, then tonemapped (ACES fit) with the bloom into an 8 bit image copied to the target.
+// Every level is a graph image: the levels die as soon as the way up went past them, so
+// they share their memory with each other and with the 8 bit image.
+// The shaders load their tile of the source in shared memory once, every texel is read by a single
+// invocation instead of up to 16 taps each.
+class PostProcess
+{
+private:
+	enum StepType {
+		POST_DOWNSAMPLE,
+		POST_UPSAMPLE,
+		POST_TONEMAP,
+	};
+
+	struct Step {
+		std::string name;
+		StepType type;
+		uint32_t source;
+		uint32_t detail;	// Level added on the way up, the bloom for the tonemapping
+		uint32_t result;
+		VkExtent2D extent;	// Of the result
+	};
+
+	VkDevice device = VK_NULL_HANDLE;
+	VkFormat targetFormat = VK_FORMAT_UNDEFINED;
+	bool rawCopy = false;	// 8 bit RGBA or BGRA target: copied instead of blitted
+
+	VkSampler sampler = VK_NULL_HANDLE;	// Owned by the cache
+	VkDescriptorSetLayout setLayout = VK_NULL_HANDLE;
+	VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+	VkPipeline downsamplePipeline = VK_NULL_HANDLE;
+	VkPipeline upsamplePipeline = VK_NULL_HANDLE;
+	VkPipeline tonemapPipeline = VK_NULL_HANDLE;
+	VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+
+	const RenderGraph* graph = nullptr;
+	std::vector<Step> steps;
+	std::vector<VkDescriptorSet> descriptorSets;	// Per step
+	uint32_t ldr = 0;
+	uint32_t target = 0;
+	VkExtent2D targetExtent = {};
+
+	VkExtent2D sourceExtent = {};
+	float exposure = 1.0f;
+	float bloomThreshold = 1.0f;
+	float bloomIntensity = 0.5f;
+
+public:
+	// 'targetFormat' is the format of the image the chain ends in
+	void init(const DeviceCapabilities& capabilities, VkDevice device, SamplerCache& samplers, VkFormat targetFormat);
+	void destroy();
+
+	// The modules are destroyed by the caller
+	void createPipelines(VkShaderModule downsampleModule, VkShaderModule upsampleModule, VkShaderModule tonemapModule);
+
+	// Passes from 'hdr' (HDR_FORMAT, written by the scene) to 'target' (swapchain, or any image imported in the graph)
+	void addPasses(RenderGraph& renderGraph, uint32_t hdr, uint32_t target, VkExtent2D extent);
+	// Once the graph is compiled: the views of its images exist
+	void createDescriptorSets(const RenderGraph& renderGraph);
+
+	// Scene drawn in the top left 'extent' of the HDR image only, stretched to the target by the chain
+	void setSourceExtent(VkExtent2D extent) { sourceExtent = extent; }
+	void setExposure(float value) { exposure = value; }
+	// A zero intensity leaves the bloom out
+	void setBloom(float intensity, float threshold) { bloomIntensity = intensity; bloomThreshold = threshold; }
+
+private:
+	void dispatch(VkCommandBuffer cmdBuffer, uint32_t step);
+	void copyToTarget(VkCommandBuffer cmdBuffer);
+};
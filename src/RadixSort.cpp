@@ -0,0 +1,46 @@
+#include "RadixSort.h"
+#include <assert.h>
+
+SortEntry* radixSort(SortEntry* entries, SortEntry* scratch, size_t count, uint32_t keyBytes)
+{
+	assert(keyBytes <= 8);
+	if (count < 2) {
+		return entries;
+	}
+
+	uint32_t histograms[8][256] = {};
+	for (size_t i = 0; i < count; i++) {
+		for (uint32_t pass = 0; pass < keyBytes; pass++) {
+			histograms[pass][(entries[i].key >> (pass * 8)) & 0xFF]++;
+		}
+	}
+
+	// Each pass reads in order and writes 256 sequential streams
+	SortEntry* src = entries;
+	SortEntry* dst = scratch;
+	for (uint32_t pass = 0; pass < keyBytes; pass++) {
+		uint32_t shift = pass * 8;
+		uint32_t* histogram = histograms[pass];
+
+		// Every key has the same byte here (unused pipeline bits...): nothing to do
+		if (histogram[(src[0].key >> shift) & 0xFF] == count) {
+			continue;
+		}
+
+		uint32_t offsets[256];
+		uint32_t sum = 0;
+		for (int b = 0; b < 256; b++) {
+			offsets[b] = sum;
+			sum += histogram[b];
+		}
+
+		for (size_t i = 0; i < count; i++) {
+			dst[offsets[(src[i].key >> shift) & 0xFF]++] = src[i];
+		}
+
+		SortEntry* tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+	return src;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// What gets sorted: the items stay in place, their keys and indices move around
+struct SortEntry {
+	uint64_t key;
+	uint32_t index;
+};
+
+// Stable LSD radix sort on the low 'keyBytes' bytes of the keys, 8 bits per pass, all histograms built in a single read.
+// Bytes shared by every entry are skipped. 'scratch' holds 'count' entries too, the result is in one of the two: returned.
+SortEntry* radixSort(SortEntry* entries, SortEntry* scratch, size_t count, uint32_t keyBytes);
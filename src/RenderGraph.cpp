@@ -0,0 +1,929 @@
+#include "RenderGraph.h"
+#include <assert.h>
+#include <algorithm>
+#include "helpers\Helpers.h"
+
+namespace {
+
+	bool isWrite(RenderGraphAccessType type)
+	{
+		return type == RENDER_GRAPH_COLOR_WRITE || type == RENDER_GRAPH_RESOLVE_WRITE || type == RENDER_GRAPH_DEPTH_WRITE
+			|| type == RENDER_GRAPH_STORAGE_WRITE || type == RENDER_GRAPH_TRANSFER_WRITE;
+	}
+
+	bool isAttachment(RenderGraphAccessType type)
+	{
+		return type == RENDER_GRAPH_COLOR_WRITE || type == RENDER_GRAPH_RESOLVE_WRITE || type == RENDER_GRAPH_DEPTH_WRITE
+			|| type == RENDER_GRAPH_DEPTH_READ || type == RENDER_GRAPH_INPUT_READ;
+	}
+
+	// Whatever an aliased image shared its memory with may still be writing to it
+	const VkPipelineStageFlags ALL_WRITE_STAGES = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT
+												| VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+	const VkAccessFlags ALL_WRITE_ACCESSES = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT
+										   | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+
+	VkImageLayout layoutFor(RenderGraphAccessType type, VkImageAspectFlags aspect)
+	{
+		switch (type)
+		{
+		case RENDER_GRAPH_COLOR_WRITE:
+		case RENDER_GRAPH_RESOLVE_WRITE:
+			return VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+		case RENDER_GRAPH_DEPTH_WRITE:
+			return VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+		case RENDER_GRAPH_DEPTH_READ:
+			return VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+		case RENDER_GRAPH_INPUT_READ:
+			return (aspect & VK_IMAGE_ASPECT_DEPTH_BIT) ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL
+														: VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		case RENDER_GRAPH_STORAGE_WRITE:
+			return VK_IMAGE_LAYOUT_GENERAL;
+		case RENDER_GRAPH_TRANSFER_READ:
+			return VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		case RENDER_GRAPH_TRANSFER_WRITE:
+			return VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		default:
+			return VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		}
+	}
+
+	VkPipelineStageFlags stageFor(RenderGraphAccessType type)
+	{
+		switch (type)
+		{
+		case RENDER_GRAPH_COLOR_WRITE:
+		case RENDER_GRAPH_RESOLVE_WRITE:
+			return VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+		case RENDER_GRAPH_DEPTH_WRITE:
+		case RENDER_GRAPH_DEPTH_READ:
+			return VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+		case RENDER_GRAPH_STORAGE_WRITE:
+		case RENDER_GRAPH_COMPUTE_READ:
+			return VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+		case RENDER_GRAPH_TRANSFER_READ:
+		case RENDER_GRAPH_TRANSFER_WRITE:
+			return VK_PIPELINE_STAGE_TRANSFER_BIT;
+		default:
+			return VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+		}
+	}
+
+	VkAccessFlags accessFor(RenderGraphAccessType type)
+	{
+		switch (type)
+		{
+		case RENDER_GRAPH_COLOR_WRITE:
+			return VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		case RENDER_GRAPH_RESOLVE_WRITE:
+			return VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		case RENDER_GRAPH_DEPTH_WRITE:
+			return VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+		case RENDER_GRAPH_DEPTH_READ:
+			return VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT;
+		case RENDER_GRAPH_INPUT_READ:
+			return VK_ACCESS_INPUT_ATTACHMENT_READ_BIT;
+		case RENDER_GRAPH_STORAGE_WRITE:
+			return VK_ACCESS_SHADER_WRITE_BIT;
+		case RENDER_GRAPH_TRANSFER_READ:
+			return VK_ACCESS_TRANSFER_READ_BIT;
+		case RENDER_GRAPH_TRANSFER_WRITE:
+			return VK_ACCESS_TRANSFER_WRITE_BIT;
+		default:
+			return VK_ACCESS_SHADER_READ_BIT;
+		}
+	}
+
+	VkImageUsageFlags usageFor(RenderGraphAccessType type)
+	{
+		switch (type)
+		{
+		case RENDER_GRAPH_COLOR_WRITE:
+		case RENDER_GRAPH_RESOLVE_WRITE:
+			return VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+		case RENDER_GRAPH_DEPTH_WRITE:
+		case RENDER_GRAPH_DEPTH_READ:
+			return VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+		case RENDER_GRAPH_INPUT_READ:
+			return VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
+		case RENDER_GRAPH_STORAGE_WRITE:
+			return VK_IMAGE_USAGE_STORAGE_BIT;
+		case RENDER_GRAPH_TRANSFER_READ:
+			return VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+		case RENDER_GRAPH_TRANSFER_WRITE:
+			return VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+		default:
+			return VK_IMAGE_USAGE_SAMPLED_BIT;
+		}
+	}
+
+	// Merges dependencies between the same pair of subpasses
+	void addDependency(std::vector<VkSubpassDependency>& dependencies, uint32_t src, uint32_t dst,
+					   VkPipelineStageFlags srcStage, VkPipelineStageFlags dstStage, VkAccessFlags srcAccess, VkAccessFlags dstAccess)
+	{
+		for (VkSubpassDependency& dependency : dependencies) {
+			if (dependency.srcSubpass == src && dependency.dstSubpass == dst) {
+				dependency.srcStageMask |= srcStage;
+				dependency.dstStageMask |= dstStage;
+				dependency.srcAccessMask |= srcAccess;
+				dependency.dstAccessMask |= dstAccess;
+				return;
+			}
+		}
+
+		VkSubpassDependency dependency = {};
+		dependency.srcSubpass = src;
+		dependency.dstSubpass = dst;
+		dependency.srcStageMask = srcStage;
+		dependency.dstStageMask = dstStage;
+		dependency.srcAccessMask = srcAccess;
+		dependency.dstAccessMask = dstAccess;
+		// Attachments are only ever read at the pixel that was written
+		dependency.dependencyFlags = (src != VK_SUBPASS_EXTERNAL && dst != VK_SUBPASS_EXTERNAL) ? VK_DEPENDENCY_BY_REGION_BIT : 0;
+		dependencies.push_back(dependency);
+	}
+}
+
+void RenderGraph::init(VkPhysicalDevice physicalDevice, VkDevice device)
+{
+	this->physicalDevice = physicalDevice;
+	this->device = device;
+}
+
+uint32_t RenderGraph::importImage(const std::string& name, VkFormat format, VkExtent2D extent, const std::vector<VkImage>& frameImages,
+								  const std::vector<VkImageView>& views, VkImageLayout finalLayout, VkClearValue clearValue)
+{
+	RenderGraphImage image;
+	image.name = name;
+	image.format = format;
+	image.extent = extent;
+	image.aspect = VK_IMAGE_ASPECT_COLOR_BIT;
+	image.clearValue = clearValue;
+	image.imported = true;
+	image.importedImages = frameImages;
+	image.importedViews = views;
+	image.importedFinalLayout = finalLayout;
+
+	images.push_back(image);
+	return uint32_t(images.size() - 1);
+}
+
+uint32_t RenderGraph::createImage(const std::string& name, VkFormat format, VkExtent2D extent, VkImageAspectFlags aspect, VkClearValue clearValue,
+								  VkSampleCountFlagBits samples)
+{
+	RenderGraphImage image;
+	image.name = name;
+	image.format = format;
+	image.extent = extent;
+	image.aspect = aspect;
+	image.samples = samples;
+	image.clearValue = clearValue;
+
+	images.push_back(image);
+	return uint32_t(images.size() - 1);
+}
+
+uint32_t RenderGraph::addPass(const std::string& name, const std::function<void(VkCommandBuffer)>& record)
+{
+	RenderGraphPass pass;
+	pass.name = name;
+	pass.record = record;
+
+	passes.push_back(pass);
+	return uint32_t(passes.size() - 1);
+}
+
+void RenderGraph::addColorOutput(uint32_t pass, uint32_t image, uint32_t resolveTarget)
+{
+	passes[pass].accesses.push_back({ image, RENDER_GRAPH_COLOR_WRITE, resolveTarget });
+	if (resolveTarget != RENDER_GRAPH_NONE) {
+		passes[pass].accesses.push_back({ resolveTarget, RENDER_GRAPH_RESOLVE_WRITE });
+	}
+}
+
+void RenderGraph::setDepthOutput(uint32_t pass, uint32_t image)
+{
+	passes[pass].accesses.push_back({ image, RENDER_GRAPH_DEPTH_WRITE });
+}
+
+void RenderGraph::setDepthInput(uint32_t pass, uint32_t image)
+{
+	passes[pass].accesses.push_back({ image, RENDER_GRAPH_DEPTH_READ });
+}
+
+void RenderGraph::addInputAttachment(uint32_t pass, uint32_t image)
+{
+	passes[pass].accesses.push_back({ image, RENDER_GRAPH_INPUT_READ });
+}
+
+void RenderGraph::addTextureInput(uint32_t pass, uint32_t image)
+{
+	passes[pass].accesses.push_back({ image, RENDER_GRAPH_TEXTURE_READ });
+}
+
+uint32_t RenderGraph::addCommandPass(const std::string& name, const std::function<void(VkCommandBuffer)>& record)
+{
+	uint32_t pass = addPass(name, record);
+	passes[pass].commands = true;
+	return pass;
+}
+
+void RenderGraph::addStorageOutput(uint32_t pass, uint32_t image)
+{
+	assert(passes[pass].commands);
+	passes[pass].accesses.push_back({ image, RENDER_GRAPH_STORAGE_WRITE });
+}
+
+void RenderGraph::addComputeInput(uint32_t pass, uint32_t image)
+{
+	assert(passes[pass].commands);
+	passes[pass].accesses.push_back({ image, RENDER_GRAPH_COMPUTE_READ });
+}
+
+void RenderGraph::addTransferInput(uint32_t pass, uint32_t image)
+{
+	assert(passes[pass].commands);
+	passes[pass].accesses.push_back({ image, RENDER_GRAPH_TRANSFER_READ });
+}
+
+void RenderGraph::addTransferOutput(uint32_t pass, uint32_t image)
+{
+	assert(passes[pass].commands);
+	passes[pass].accesses.push_back({ image, RENDER_GRAPH_TRANSFER_WRITE });
+}
+
+void RenderGraph::compile()
+{
+	buildBatches();
+	computeLifetimes();
+	allocateImages();
+	createRenderPasses();
+	createFrameBuffers();
+}
+
+void RenderGraph::buildBatches()
+{
+	batches.clear();
+
+	for (uint32_t p = 0; p < passes.size(); p++) {
+		RenderGraphPass& pass = passes[p];
+
+		// Never merged with anything
+		if (pass.commands) {
+			RenderGraphBatch batch;
+			batch.extent = {};
+			batch.commands = true;
+			batch.passes.push_back(p);
+			batches.push_back(batch);
+			pass.batch = uint32_t(batches.size() - 1);
+			pass.subpass = 0;
+			continue;
+		}
+
+		VkExtent2D extent = {};
+		bool readsCurrentBatch = false;
+		for (RenderGraphAccess& access : pass.accesses) {
+			if (isAttachment(access.type) && extent.width == 0) {
+				extent = images[access.image].extent;
+			}
+
+			// Sampling something written in the same render pass is not allowed
+			if (access.type == RENDER_GRAPH_TEXTURE_READ && !batches.empty()) {
+				for (uint32_t other : batches.back().passes) {
+					for (RenderGraphAccess& otherAccess : passes[other].accesses) {
+						if (otherAccess.image == access.image && isWrite(otherAccess.type)) {
+							readsCurrentBatch = true;
+						}
+					}
+				}
+			}
+		}
+		assert(extent.width != 0); // A pass needs at least one attachment
+
+		if (batches.empty() || readsCurrentBatch || batches.back().commands
+			|| batches.back().extent.width != extent.width || batches.back().extent.height != extent.height) {
+			RenderGraphBatch batch;
+			batch.extent = extent;
+			batches.push_back(batch);
+		}
+
+		pass.batch = uint32_t(batches.size() - 1);
+		pass.subpass = uint32_t(batches.back().passes.size());
+		batches.back().passes.push_back(p);
+	}
+}
+
+void RenderGraph::computeLifetimes()
+{
+	for (RenderGraphPass& pass : passes) {
+		for (RenderGraphAccess& access : pass.accesses) {
+			RenderGraphImage& image = images[access.image];
+			image.usage |= usageFor(access.type);
+			image.firstBatch = std::min(image.firstBatch, pass.batch);
+			image.lastBatch = std::max(image.lastBatch, pass.batch);
+		}
+	}
+
+	// Never leaves the render pass: the driver may keep it in tile memory only
+	const VkImageUsageFlags attachmentUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT
+											| VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
+	for (RenderGraphImage& image : images) {
+		image.transient = !image.imported && image.firstBatch == image.lastBatch && !(image.usage & ~attachmentUsage);
+		if (image.transient) {
+			image.usage |= VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+		}
+	}
+}
+
+void RenderGraph::allocateImages()
+{
+	std::vector<uint32_t> owned;
+
+	for (uint32_t i = 0; i < images.size(); i++) {
+		RenderGraphImage& image = images[i];
+		if (image.imported || image.firstBatch == RENDER_GRAPH_NONE) {
+			continue;
+		}
+
+		VkImageCreateInfo imageInfo = {};
+		imageInfo.arrayLayers = 1;
+		imageInfo.extent.width = image.extent.width;
+		imageInfo.extent.height = image.extent.height;
+		imageInfo.extent.depth = 1;
+		imageInfo.format = image.format;
+		imageInfo.imageType = VK_IMAGE_TYPE_2D;
+		imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		imageInfo.mipLevels = 1;
+		imageInfo.samples = image.samples;
+		imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+		imageInfo.usage = image.usage;
+		imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+
+		VkResult res = vkCreateImage(device, &imageInfo, nullptr, &image.image);
+		assert(res == VK_SUCCESS);
+
+		vkGetImageMemoryRequirements(device, image.image, &image.memoryRequirements);
+		owned.push_back(i);
+	}
+
+	// Attachments that never leave the render pass (multisampled color, depth...)
+	// do not need real memory on tiled GPUs: they only live in tile memory
+	std::vector<uint32_t> lazy;
+	std::vector<uint32_t> regular;
+	for (uint32_t i : owned) {
+		RenderGraphImage& image = images[i];
+		bool lazilyAllocated = image.transient
+			&& vk::getMemoryType(physicalDevice, image.memoryRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT) != uint32_t(-1);
+		(lazilyAllocated ? lazy : regular).push_back(i);
+	}
+
+	transientMemorySize = bindImages(regular, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, transientMemory);
+	bindImages(lazy, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT, lazyMemory);
+
+	for (uint32_t i : owned) {
+		RenderGraphImage& image = images[i];
+
+		VkImageViewCreateInfo viewInfo = {};
+		viewInfo.format = image.format;
+		viewInfo.image = image.image;
+		viewInfo.subresourceRange.aspectMask = image.aspect;
+		viewInfo.subresourceRange.baseArrayLayer = 0;
+		viewInfo.subresourceRange.baseMipLevel = 0;
+		viewInfo.subresourceRange.layerCount = 1;
+		viewInfo.subresourceRange.levelCount = 1;
+		viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+
+		VkResult res = vkCreateImageView(device, &viewInfo, nullptr, &image.view);
+		assert(res == VK_SUCCESS);
+	}
+}
+
+VkDeviceSize RenderGraph::bindImages(std::vector<uint32_t> group, VkMemoryPropertyFlags properties, VkDeviceMemory& memory)
+{
+	if (group.empty()) {
+		return 0;
+	}
+
+	// ALIASING: images whose lifetimes do not overlap share the same memory range.
+	// Biggest images are placed first, each one at the lowest offset that does not
+	// collide with an already placed image alive at the same time.
+	std::sort(group.begin(), group.end(), [this](uint32_t a, uint32_t b) {
+		return images[a].memoryRequirements.size > images[b].memoryRequirements.size;
+	});
+
+	std::vector<uint32_t> placed;
+	uint32_t memoryTypeBits = ~0u;
+	VkDeviceSize totalSize = 0;
+
+	for (uint32_t i : group) {
+		RenderGraphImage& image = images[i];
+		VkDeviceSize size = image.memoryRequirements.size;
+		VkDeviceSize alignment = image.memoryRequirements.alignment;
+
+		std::vector<uint32_t> alive;
+		std::vector<VkDeviceSize> candidates = { 0 };
+		for (uint32_t other : placed) {
+			if (images[other].firstBatch <= image.lastBatch && image.firstBatch <= images[other].lastBatch) {
+				alive.push_back(other);
+				VkDeviceSize end = images[other].memoryOffset + images[other].memoryRequirements.size;
+				candidates.push_back((end + alignment - 1) / alignment * alignment);
+			}
+		}
+		std::sort(candidates.begin(), candidates.end());
+
+		for (VkDeviceSize offset : candidates) {
+			bool collides = false;
+			for (uint32_t other : alive) {
+				VkDeviceSize otherOffset = images[other].memoryOffset;
+				if (offset < otherOffset + images[other].memoryRequirements.size && otherOffset < offset + size) {
+					collides = true;
+					break;
+				}
+			}
+
+			if (!collides) {
+				image.memoryOffset = offset;
+				break;
+			}
+		}
+
+		for (uint32_t other : placed) {
+			VkDeviceSize otherOffset = images[other].memoryOffset;
+			if (image.memoryOffset < otherOffset + images[other].memoryRequirements.size && otherOffset < image.memoryOffset + size) {
+				image.aliased = images[other].aliased = true;
+			}
+		}
+
+		totalSize = std::max(totalSize, image.memoryOffset + size);
+		memoryTypeBits &= image.memoryRequirements.memoryTypeBits;
+		placed.push_back(i);
+	}
+
+	VkMemoryAllocateInfo allocateInfo = {};
+	allocateInfo.allocationSize = totalSize;
+	allocateInfo.memoryTypeIndex = vk::getMemoryType(physicalDevice, memoryTypeBits, properties);
+	allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+
+	VkResult res = vkAllocateMemory(device, &allocateInfo, nullptr, &memory);
+	assert(res == VK_SUCCESS);
+
+	for (uint32_t i : group) {
+		res = vkBindImageMemory(device, images[i].image, memory, images[i].memoryOffset);
+		assert(res == VK_SUCCESS);
+	}
+
+	return totalSize;
+}
+
+const RenderGraphAccess* RenderGraph::findFirstAccess(uint32_t image, uint32_t firstBatch) const
+{
+	for (const RenderGraphPass& pass : passes) {
+		if (pass.batch < firstBatch) {
+			continue;
+		}
+		for (const RenderGraphAccess& access : pass.accesses) {
+			if (access.image == image) {
+				return &access;
+			}
+		}
+	}
+	return nullptr;
+}
+
+const RenderGraphAccess* RenderGraph::findLastAccess(uint32_t image, uint32_t batch) const
+{
+	const RenderGraphAccess* last = nullptr;
+	for (const RenderGraphPass& pass : passes) {
+		if (pass.batch > batch) {
+			break;
+		}
+		for (const RenderGraphAccess& access : pass.accesses) {
+			if (access.image == image) {
+				last = &access;
+			}
+		}
+	}
+	return last;
+}
+
+void RenderGraph::createRenderPasses()
+{
+	std::vector<VkImageLayout> currentLayouts(images.size(), VK_IMAGE_LAYOUT_UNDEFINED);
+
+	for (uint32_t b = 0; b < batches.size(); b++) {
+		RenderGraphBatch& batch = batches[b];
+		if (batch.commands) {
+			createBarriers(b, currentLayouts);
+			continue;
+		}
+
+		for (uint32_t p : batch.passes) {
+			for (RenderGraphAccess& access : passes[p].accesses) {
+				if (isAttachment(access.type)
+					&& std::find(batch.attachments.begin(), batch.attachments.end(), access.image) == batch.attachments.end()) {
+					batch.attachments.push_back(access.image);
+				}
+			}
+		}
+
+		// ATTACHMENTS: load/store ops and layouts come from the neighbouring batches
+		std::vector<VkAttachmentDescription> attachmentDescriptions(batch.attachments.size());
+		batch.clearValues.resize(batch.attachments.size());
+
+		for (uint32_t a = 0; a < batch.attachments.size(); a++) {
+			uint32_t id = batch.attachments[a];
+			RenderGraphImage& image = images[id];
+			bool usedBefore = image.firstBatch < b;
+			bool usedAfter = image.lastBatch > b;
+
+			const RenderGraphAccess* firstAccess = findFirstAccess(id, b);
+			const RenderGraphAccess* lastAccess = findLastAccess(id, b);
+
+			VkAttachmentDescription& description = attachmentDescriptions[a];
+			description = {};
+			description.format = image.format;
+			description.samples = image.samples;
+			// Resolve targets are entirely overwritten at the end of the subpass
+			description.loadOp = usedBefore ? VK_ATTACHMENT_LOAD_OP_LOAD
+						: firstAccess->type == RENDER_GRAPH_RESOLVE_WRITE ? VK_ATTACHMENT_LOAD_OP_DONT_CARE
+						: isWrite(firstAccess->type) ? VK_ATTACHMENT_LOAD_OP_CLEAR : VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+			// Nobody reads it afterwards: the content can be thrown away
+			description.storeOp = (image.imported || usedAfter) ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+			description.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+			description.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+			if (image.aspect & VK_IMAGE_ASPECT_STENCIL_BIT) {
+				description.stencilLoadOp = description.loadOp;
+				description.stencilStoreOp = description.storeOp;
+			}
+			description.initialLayout = usedBefore ? currentLayouts[id] : VK_IMAGE_LAYOUT_UNDEFINED;
+
+			if (usedAfter) {
+				const RenderGraphAccess* nextAccess = findFirstAccess(id, b + 1);
+				description.finalLayout = layoutFor(nextAccess->type, image.aspect);
+			}
+			else if (image.imported) {
+				description.finalLayout = image.importedFinalLayout;
+			}
+			else {
+				description.finalLayout = layoutFor(lastAccess->type, image.aspect);
+			}
+			currentLayouts[id] = description.finalLayout;
+
+			batch.clearValues[a] = image.clearValue;
+		}
+
+		// SUBPASSES
+		std::vector<std::vector<VkAttachmentReference>> colorReferences(batch.passes.size());
+		std::vector<std::vector<VkAttachmentReference>> resolveReferences(batch.passes.size());
+		std::vector<std::vector<VkAttachmentReference>> inputReferences(batch.passes.size());
+		std::vector<VkAttachmentReference> depthReferences(batch.passes.size());
+		std::vector<VkSubpassDescription> subpassDescriptions(batch.passes.size());
+		std::vector<VkSubpassDependency> dependencies;
+
+		// Last subpass that touched each image in this batch, with how it touched it
+		std::vector<uint32_t> lastSubpass(images.size(), RENDER_GRAPH_NONE);
+		std::vector<RenderGraphAccessType> lastType(images.size());
+
+		for (uint32_t s = 0; s < batch.passes.size(); s++) {
+			RenderGraphPass& pass = passes[batch.passes[s]];
+			VkSubpassDescription& subpass = subpassDescriptions[s];
+			subpass = {};
+			subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+
+			for (RenderGraphAccess& access : pass.accesses) {
+				if (!isAttachment(access.type)) {
+					continue;
+				}
+
+				RenderGraphImage& image = images[access.image];
+				VkAttachmentReference reference = {};
+				reference.attachment = uint32_t(std::find(batch.attachments.begin(), batch.attachments.end(), access.image) - batch.attachments.begin());
+				reference.layout = layoutFor(access.type, image.aspect);
+
+				switch (access.type)
+				{
+				case RENDER_GRAPH_COLOR_WRITE: {
+					colorReferences[s].push_back(reference);
+
+					// Resolved inside the subpass: the multisampled image never goes to memory
+					VkAttachmentReference resolveReference = {};
+					resolveReference.attachment = VK_ATTACHMENT_UNUSED;
+					resolveReference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+					if (access.resolveTarget != RENDER_GRAPH_NONE) {
+						resolveReference.attachment = uint32_t(std::find(batch.attachments.begin(), batch.attachments.end(), access.resolveTarget) - batch.attachments.begin());
+					}
+					resolveReferences[s].push_back(resolveReference);
+					break;
+				}
+				case RENDER_GRAPH_RESOLVE_WRITE:
+					break;
+				case RENDER_GRAPH_DEPTH_WRITE:
+				case RENDER_GRAPH_DEPTH_READ:
+					depthReferences[s] = reference;
+					subpass.pDepthStencilAttachment = &depthReferences[s];
+					break;
+				case RENDER_GRAPH_INPUT_READ:
+					inputReferences[s].push_back(reference);
+					break;
+				default:	// Not attachments, skipped above
+					break;
+				}
+
+				// DEPENDENCIES: read after write and write after anything
+				uint32_t previous = lastSubpass[access.image];
+				if (previous != RENDER_GRAPH_NONE) {
+					if (previous != s && (isWrite(lastType[access.image]) || isWrite(access.type))) {
+						addDependency(dependencies, previous, s,
+									  stageFor(lastType[access.image]), stageFor(access.type),
+									  accessFor(lastType[access.image]), accessFor(access.type));
+					}
+				}
+				else if (image.firstBatch < b) {
+					const RenderGraphAccess* before = findLastAccess(access.image, b - 1);
+					addDependency(dependencies, VK_SUBPASS_EXTERNAL, s,
+								  stageFor(before->type), stageFor(access.type), accessFor(before->type), accessFor(access.type));
+				}
+				else if (image.aliased) {
+					// Whatever lived in this memory before may still be written to
+					addDependency(dependencies, VK_SUBPASS_EXTERNAL, s, ALL_WRITE_STAGES, stageFor(access.type),
+								  ALL_WRITE_ACCESSES, accessFor(access.type));
+				}
+				else {
+					// Same image written by the previous frame, or the swapchain image being acquired
+					addDependency(dependencies, VK_SUBPASS_EXTERNAL, s,
+								  stageFor(access.type), stageFor(access.type),
+								  isWrite(access.type) ? accessFor(access.type) : 0, accessFor(access.type));
+				}
+
+				lastSubpass[access.image] = s;
+				lastType[access.image] = access.type;
+			}
+
+			subpass.colorAttachmentCount = uint32_t(colorReferences[s].size());
+			subpass.pColorAttachments = colorReferences[s].data();
+			for (VkAttachmentReference& resolveReference : resolveReferences[s]) {
+				if (resolveReference.attachment != VK_ATTACHMENT_UNUSED) {
+					subpass.pResolveAttachments = resolveReferences[s].data();
+				}
+			}
+			subpass.inputAttachmentCount = uint32_t(inputReferences[s].size());
+			subpass.pInputAttachments = inputReferences[s].data();
+		}
+
+		// Make the results visible to the batches reading them later on
+		for (uint32_t id : batch.attachments) {
+			if (images[id].lastBatch > b) {
+				const RenderGraphAccess* nextAccess = findFirstAccess(id, b + 1);
+				addDependency(dependencies, lastSubpass[id], VK_SUBPASS_EXTERNAL,
+							  stageFor(lastType[id]), stageFor(nextAccess->type), accessFor(lastType[id]), accessFor(nextAccess->type));
+			}
+		}
+
+		VkRenderPassCreateInfo renderPassInfo = {};
+		renderPassInfo.attachmentCount = uint32_t(attachmentDescriptions.size());
+		renderPassInfo.pAttachments = attachmentDescriptions.data();
+		renderPassInfo.subpassCount = uint32_t(subpassDescriptions.size());
+		renderPassInfo.pSubpasses = subpassDescriptions.data();
+		renderPassInfo.dependencyCount = uint32_t(dependencies.size());
+		renderPassInfo.pDependencies = dependencies.data();
+		renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+
+		VkResult res = vkCreateRenderPass(device, &renderPassInfo, nullptr, &batch.renderPass);
+		assert(res == VK_SUCCESS);
+	}
+}
+
+void RenderGraph::createBarriers(uint32_t b, std::vector<VkImageLayout>& currentLayouts)
+{
+	RenderGraphBatch& batch = batches[b];
+	for (RenderGraphAccess& access : passes[batch.passes[0]].accesses) {
+		RenderGraphImage& image = images[access.image];
+
+		RenderGraphBarrier barrier = {};
+		barrier.image = access.image;
+		barrier.newLayout = layoutFor(access.type, image.aspect);
+		barrier.dstStage = stageFor(access.type);
+		barrier.dstAccess = accessFor(access.type);
+
+		// The render passes leave their attachments in the layout of the next access, with a dependency
+		const RenderGraphAccess* before = image.firstBatch < b ? findLastAccess(access.image, b - 1) : nullptr;
+		// Read after read in the same layout: nothing to wait for
+		bool needed = !before || isWrite(before->type) || isWrite(access.type) || currentLayouts[access.image] != barrier.newLayout;
+		if (before && isAttachment(before->type)) {
+			currentLayouts[access.image] = barrier.newLayout;
+		}
+		else if (needed) {
+			if (before) {
+				barrier.oldLayout = currentLayouts[access.image];
+				barrier.srcStage = stageFor(before->type);
+				barrier.srcAccess = isWrite(before->type) ? accessFor(before->type) : 0;
+			}
+			else if (image.aliased) {
+				barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+				barrier.srcStage = ALL_WRITE_STAGES;
+				barrier.srcAccess = ALL_WRITE_ACCESSES;
+			}
+			else {
+				// Same image used by the previous frame, or the swapchain image being acquired
+				barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+				barrier.srcStage = stageFor(access.type);
+				barrier.srcAccess = isWrite(access.type) ? accessFor(access.type) : 0;
+			}
+			batch.barriers.push_back(barrier);
+			currentLayouts[access.image] = barrier.newLayout;
+		}
+
+		// Sampled by a render pass next, or handed back to its owner
+		RenderGraphBarrier finalBarrier = {};
+		finalBarrier.image = access.image;
+		finalBarrier.oldLayout = barrier.newLayout;
+		finalBarrier.srcStage = barrier.dstStage;
+		finalBarrier.srcAccess = isWrite(access.type) ? barrier.dstAccess : 0;
+		if (image.lastBatch > b) {
+			const RenderGraphAccess* nextAccess = findFirstAccess(access.image, b + 1);
+			if (nextAccess->type != RENDER_GRAPH_TEXTURE_READ) {
+				continue;
+			}
+			finalBarrier.newLayout = layoutFor(nextAccess->type, image.aspect);
+			finalBarrier.dstStage = stageFor(nextAccess->type);
+			finalBarrier.dstAccess = accessFor(nextAccess->type);
+		}
+		else if (image.imported) {
+			finalBarrier.newLayout = image.importedFinalLayout;
+			finalBarrier.dstStage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+			finalBarrier.dstAccess = 0;
+		}
+		else {
+			continue;
+		}
+		batch.finalBarriers.push_back(finalBarrier);
+		currentLayouts[access.image] = finalBarrier.newLayout;
+	}
+}
+
+void RenderGraph::recordBarriers(VkCommandBuffer cmdBuffer, const std::vector<RenderGraphBarrier>& barriers) const
+{
+	if (barriers.empty()) {
+		return;
+	}
+
+	std::vector<VkImageMemoryBarrier> imageBarriers(barriers.size());
+	VkPipelineStageFlags srcStages = 0;
+	VkPipelineStageFlags dstStages = 0;
+	for (size_t i = 0; i < barriers.size(); i++) {
+		const RenderGraphBarrier& barrier = barriers[i];
+		VkImageMemoryBarrier& imageBarrier = imageBarriers[i];
+		imageBarrier = {};
+		imageBarrier.image = getImage(barrier.image);
+		imageBarrier.oldLayout = barrier.oldLayout;
+		imageBarrier.newLayout = barrier.newLayout;
+		imageBarrier.srcAccessMask = barrier.srcAccess;
+		imageBarrier.dstAccessMask = barrier.dstAccess;
+		imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		imageBarrier.subresourceRange.aspectMask = images[barrier.image].aspect;
+		imageBarrier.subresourceRange.levelCount = 1;
+		imageBarrier.subresourceRange.layerCount = 1;
+		imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		srcStages |= barrier.srcStage;
+		dstStages |= barrier.dstStage;
+	}
+
+	vkCmdPipelineBarrier(cmdBuffer, srcStages, dstStages, 0, 0, nullptr, 0, nullptr, uint32_t(imageBarriers.size()), imageBarriers.data());
+}
+
+void RenderGraph::createFrameBuffers()
+{
+	for (RenderGraphBatch& batch : batches) {
+		if (batch.commands) {
+			continue;
+		}
+
+		// One framebuffer per imported view (swapchain image), at least one
+		size_t frameCount = 1;
+		for (uint32_t id : batch.attachments) {
+			frameCount = std::max(frameCount, images[id].importedViews.size());
+		}
+
+		std::vector<VkImageView> attachments(batch.attachments.size());
+
+		VkFramebufferCreateInfo frameBufferInfo = {};
+		frameBufferInfo.height = batch.extent.height;
+		frameBufferInfo.width = batch.extent.width;
+		frameBufferInfo.layers = 1;
+		frameBufferInfo.attachmentCount = uint32_t(attachments.size());
+		frameBufferInfo.renderPass = batch.renderPass;
+		frameBufferInfo.pAttachments = attachments.data();
+		frameBufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+
+		batch.frameBuffers.resize(frameCount);
+		for (size_t f = 0; f < frameCount; f++) {
+			for (size_t a = 0; a < attachments.size(); a++) {
+				RenderGraphImage& image = images[batch.attachments[a]];
+				attachments[a] = image.imported ? image.importedViews[f % image.importedViews.size()] : image.view;
+			}
+
+			VkResult res = vkCreateFramebuffer(device, &frameBufferInfo, nullptr, &batch.frameBuffers[f]);
+			assert(res == VK_SUCCESS);
+		}
+	}
+}
+
+void RenderGraph::execute(VkCommandBuffer cmdBuffer, uint32_t frameIndex)
+{
+	executedFrame = frameIndex;
+	for (RenderGraphBatch& batch : batches) {
+		if (batch.commands) {
+			RenderGraphPass& pass = passes[batch.passes[0]];
+			recordBarriers(cmdBuffer, batch.barriers);
+			if (pass.record) {
+				pass.record(cmdBuffer);
+			}
+			recordBarriers(cmdBuffer, batch.finalBarriers);
+			continue;
+		}
+
+		VkRenderPassBeginInfo renderPassBegin = {};
+		renderPassBegin.clearValueCount = uint32_t(batch.clearValues.size());
+		renderPassBegin.pClearValues = batch.clearValues.data();
+		renderPassBegin.renderArea.extent = batch.renderArea.width > 0 ? batch.renderArea : batch.extent;
+		renderPassBegin.renderArea.offset = { 0, 0 };
+		renderPassBegin.renderPass = batch.renderPass;
+		renderPassBegin.framebuffer = batch.frameBuffers[frameIndex % batch.frameBuffers.size()];
+		renderPassBegin.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+
+		vkCmdBeginRenderPass(cmdBuffer, &renderPassBegin, VK_SUBPASS_CONTENTS_INLINE);
+		for (uint32_t s = 0; s < batch.passes.size(); s++) {
+			if (s > 0) {
+				vkCmdNextSubpass(cmdBuffer, VK_SUBPASS_CONTENTS_INLINE);
+			}
+			RenderGraphPass& pass = passes[batch.passes[s]];
+			if (pass.record) {
+				pass.record(cmdBuffer);
+			}
+		}
+		vkCmdEndRenderPass(cmdBuffer);
+	}
+}
+
+void RenderGraph::setRenderArea(uint32_t pass, VkExtent2D extent)
+{
+	RenderGraphBatch& batch = batches[passes[pass].batch];
+	assert(!batch.commands && extent.width <= batch.extent.width && extent.height <= batch.extent.height);
+	batch.renderArea = extent;
+}
+
+void RenderGraph::reset()
+{
+	for (RenderGraphBatch& batch : batches) {
+		for (VkFramebuffer& frameBuffer : batch.frameBuffers) {
+			vkDestroyFramebuffer(device, frameBuffer, nullptr);
+		}
+		vkDestroyRenderPass(device, batch.renderPass, nullptr);
+	}
+
+	for (RenderGraphImage& image : images) {
+		if (!image.imported && image.image != VK_NULL_HANDLE) {
+			vkDestroyImageView(device, image.view, nullptr);
+			vkDestroyImage(device, image.image, nullptr);
+		}
+	}
+
+	if (transientMemory != VK_NULL_HANDLE) {
+		vkFreeMemory(device, transientMemory, nullptr);
+		transientMemory = VK_NULL_HANDLE;
+	}
+	if (lazyMemory != VK_NULL_HANDLE) {
+		vkFreeMemory(device, lazyMemory, nullptr);
+		lazyMemory = VK_NULL_HANDLE;
+	}
+
+	transientMemorySize = 0;
+	batches.clear();
+	passes.clear();
+	images.clear();
+}
+
+VkRenderPass RenderGraph::getRenderPass(uint32_t pass) const
+{
+	return batches[passes[pass].batch].renderPass;
+}
+
+uint32_t RenderGraph::getSubpass(uint32_t pass) const
+{
+	return passes[pass].subpass;
+}
+
+VkImageView RenderGraph::getImageView(uint32_t image) const
+{
+	const RenderGraphImage& graphImage = images[image];
+	return graphImage.imported ? graphImage.importedViews[executedFrame % graphImage.importedViews.size()] : graphImage.view;
+}
+
+VkImage RenderGraph::getImage(uint32_t image) const
+{
+	const RenderGraphImage& graphImage = images[image];
+	return graphImage.imported ? graphImage.importedImages[executedFrame % graphImage.importedImages.size()] : graphImage.image;
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <vector>
+#include <string>
+#include <functional>
+
+#define RENDER_GRAPH_NONE UINT32_MAX
+
+// How a pass touches an image. Everything else (usage flags, layouts,
+// load/store ops, dependencies) is derived from these by RenderGraph::compile()
+enum RenderGraphAccessType {
+	RENDER_GRAPH_COLOR_WRITE,
+	RENDER_GRAPH_RESOLVE_WRITE,	// Target of a multisampled color attachment
+	RENDER_GRAPH_DEPTH_WRITE,
+	RENDER_GRAPH_DEPTH_READ,
+	RENDER_GRAPH_INPUT_READ,	// Subpass input attachment, can stay in the same render pass
+	RENDER_GRAPH_TEXTURE_READ,	// Sampled in a shader, forces a new render pass
+
+	// Command passes only
+	RENDER_GRAPH_STORAGE_WRITE,	// Storage image written by a compute shader
+	RENDER_GRAPH_COMPUTE_READ,	// Sampled in a compute shader
+	RENDER_GRAPH_TRANSFER_READ,	// Source of a copy or a blit
+	RENDER_GRAPH_TRANSFER_WRITE,
+};
+
+struct RenderGraphAccess {
+	uint32_t image;
+	RenderGraphAccessType type;
+	uint32_t resolveTarget = RENDER_GRAPH_NONE;
+};
+
+struct RenderGraphImage {
+	std::string name;
+	VkFormat format;
+	VkExtent2D extent;
+	VkImageAspectFlags aspect;
+	VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT;
+	VkClearValue clearValue;
+
+	// Imported images are owned by someone else (swapchain...), one view per frame
+	bool imported = false;
+	std::vector<VkImage> importedImages;
+	std::vector<VkImageView> importedViews;
+	VkImageLayout importedFinalLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+	// Filled by compile()
+	VkImageUsageFlags usage = 0;
+	bool transient = false;
+	uint32_t firstBatch = RENDER_GRAPH_NONE;
+	uint32_t lastBatch = 0;
+	VkImage image = VK_NULL_HANDLE;
+	VkImageView view = VK_NULL_HANDLE;
+	VkMemoryRequirements memoryRequirements;
+	VkDeviceSize memoryOffset = 0;
+	bool aliased = false;	// Shares memory with another image
+};
+
+struct RenderGraphPass {
+	std::string name;
+	std::vector<RenderGraphAccess> accesses;
+	std::function<void(VkCommandBuffer)> record;
+	bool commands = false;	// Recorded outside of any render pass (dispatches, copies)
+
+	// Filled by compile()
+	uint32_t batch = RENDER_GRAPH_NONE;
+	uint32_t subpass = 0;
+};
+
+// Layout change and dependency recorded around a command pass
+struct RenderGraphBarrier {
+	uint32_t image;
+	VkImageLayout oldLayout;
+	VkImageLayout newLayout;
+	VkPipelineStageFlags srcStage;
+	VkPipelineStageFlags dstStage;
+	VkAccessFlags srcAccess;
+	VkAccessFlags dstAccess;
+};
+
+// Consecutive passes merged into a single VkRenderPass, one subpass each.
+// A command pass is a batch on its own, with barriers instead of a render pass.
+struct RenderGraphBatch {
+	std::vector<uint32_t> passes;
+	std::vector<uint32_t> attachments;	// Image ids, in attachment order
+	std::vector<VkClearValue> clearValues;
+	VkExtent2D extent;
+	VkExtent2D renderArea = {};	// Drawn part of the attachments, all of them when empty
+	VkRenderPass renderPass = VK_NULL_HANDLE;
+	std::vector<VkFramebuffer> frameBuffers;
+
+	bool commands = false;
+	std::vector<RenderGraphBarrier> barriers;		// Before the pass
+	std::vector<RenderGraphBarrier> finalBarriers;	// To the layouts expected by the render passes and the presentation
+};
+
+class RenderGraph
+{
+private:
+	VkPhysicalDevice physicalDevice;
+	VkDevice device;
+
+	std::vector<RenderGraphImage> images;
+	std::vector<RenderGraphPass> passes;
+	std::vector<RenderGraphBatch> batches;
+
+	VkDeviceMemory transientMemory = VK_NULL_HANDLE;
+	VkDeviceSize transientMemorySize = 0;
+	VkDeviceMemory lazyMemory = VK_NULL_HANDLE;
+	uint32_t executedFrame = 0;
+
+public:
+	void init(VkPhysicalDevice physicalDevice, VkDevice device);
+
+	// One image and view per frame, the images are only needed by the command passes
+	uint32_t importImage(const std::string& name, VkFormat format, VkExtent2D extent, const std::vector<VkImage>& frameImages,
+						 const std::vector<VkImageView>& views, VkImageLayout finalLayout, VkClearValue clearValue);
+	uint32_t createImage(const std::string& name, VkFormat format, VkExtent2D extent, VkImageAspectFlags aspect, VkClearValue clearValue,
+						 VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT);
+
+	uint32_t addPass(const std::string& name, const std::function<void(VkCommandBuffer)>& record);
+	void addColorOutput(uint32_t pass, uint32_t image, uint32_t resolveTarget = RENDER_GRAPH_NONE);
+	void setDepthOutput(uint32_t pass, uint32_t image);
+	void setDepthInput(uint32_t pass, uint32_t image);
+	void addInputAttachment(uint32_t pass, uint32_t image);
+	void addTextureInput(uint32_t pass, uint32_t image);
+
+	// Command passes: the images are given to the recording function through getImage() and getImageView()
+	uint32_t addCommandPass(const std::string& name, const std::function<void(VkCommandBuffer)>& record);
+	void addStorageOutput(uint32_t pass, uint32_t image);
+	void addComputeInput(uint32_t pass, uint32_t image);
+	void addTransferInput(uint32_t pass, uint32_t image);
+	void addTransferOutput(uint32_t pass, uint32_t image);
+
+	void compile();
+	void execute(VkCommandBuffer cmdBuffer, uint32_t frameIndex);
+
+	// After compile(), for the render pass of 'pass' and the ones merged with it: only the top left
+	// 'extent' of the attachments is cleared, drawn and stored. The rest is left as it was.
+	void setRenderArea(uint32_t pass, VkExtent2D extent);
+
+	// Releases every Vulkan object and forgets all the declared passes and images
+	void reset();
+
+	VkRenderPass getRenderPass(uint32_t pass) const;
+	uint32_t getSubpass(uint32_t pass) const;
+	VkImageView getImageView(uint32_t image) const;
+	// Imported images: the one of the frame being executed
+	VkImage getImage(uint32_t image) const;
+	VkDeviceSize getTransientMemorySize() const { return transientMemorySize; }
+
+private:
+	void buildBatches();
+	void computeLifetimes();
+	void createRenderPasses();
+	void allocateImages();
+	VkDeviceSize bindImages(std::vector<uint32_t> group, VkMemoryPropertyFlags properties, VkDeviceMemory& memory);
+	void createFrameBuffers();
+	void createBarriers(uint32_t batch, std::vector<VkImageLayout>& currentLayouts);
+	void recordBarriers(VkCommandBuffer cmdBuffer, const std::vector<RenderGraphBarrier>& barriers) const;
+
+	const RenderGraphAccess* findFirstAccess(uint32_t image, uint32_t firstBatch) const;
+	const RenderGraphAccess* findLastAccess(uint32_t image, uint32_t batch) const;
+};
@@ -0,0 +1,66 @@
+#include "SamplerCache.h"
+#include <assert.h>
+#include <string.h>
+
+namespace {
+
+	inline uint32_t getBits(float value)
+	{
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		return bits;
+	}
+}
+
+void SamplerCache::destroy()
+{
+	for (auto& entry : samplers) {
+		vkDestroySampler(device, entry.second, nullptr);
+	}
+	samplers.clear();
+}
+
+VkSampler SamplerCache::get(const VkSamplerCreateInfo& samplerInfo)
+{
+	// Extensions in pNext would be part of the state
+	assert(samplerInfo.pNext == nullptr);
+
+	Key key = getKey(samplerInfo);
+	std::lock_guard<std::mutex> lock(mutex);
+	auto found = samplers.find(key);
+	if (found != samplers.end()) {
+		return found->second;
+	}
+
+	VkSampler sampler;
+	VkResult res = vkCreateSampler(device, &samplerInfo, nullptr, &sampler);
+	assert(res == VK_SUCCESS);
+
+	samplers[key] = sampler;
+	return sampler;
+}
+
+SamplerCache::Key SamplerCache::getKey(const VkSamplerCreateInfo& samplerInfo)
+{
+	// Anisotropy and comparison parameters only count when enabled
+	bool anisotropy = samplerInfo.anisotropyEnable == VK_TRUE;
+	bool compare = samplerInfo.compareEnable == VK_TRUE;
+	Key key = {{
+		uint32_t(samplerInfo.flags),
+		uint32_t(samplerInfo.magFilter),
+		uint32_t(samplerInfo.minFilter),
+		uint32_t(samplerInfo.mipmapMode),
+		uint32_t(samplerInfo.addressModeU),
+		uint32_t(samplerInfo.addressModeV),
+		uint32_t(samplerInfo.addressModeW),
+		getBits(samplerInfo.mipLodBias),
+		anisotropy ? getBits(samplerInfo.maxAnisotropy) : 0,
+		compare ? uint32_t(samplerInfo.compareOp) + 1 : 0,
+		getBits(samplerInfo.minLod),
+		getBits(samplerInfo.maxLod),
+		uint32_t(samplerInfo.borderColor),
+		uint32_t(samplerInfo.unnormalizedCoordinates),
+		uint32_t(anisotropy),
+	}};
+	return key;
+}
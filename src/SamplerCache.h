@@ -0,0 +1,32 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <stdint.h>
+#include <array>
+#include <map>
+#include <mutex>
+
+// Samplers shared by every texture with the same state: the device only allows
+// maxSamplerAllocationCount of them, and most textures sample the same way.
+class SamplerCache
+{
+private:
+	// The state of VkSamplerCreateInfo, floats as their bits
+	typedef std::array<uint32_t, 15> Key;
+
+	VkDevice device = VK_NULL_HANDLE;
+	std::map<Key, VkSampler> samplers;
+	std::mutex mutex;	// The views are set up on several threads
+
+public:
+	void init(VkDevice device) { this->device = device; }
+	void destroy();
+
+	// Created on the first request, owned by the cache
+	VkSampler get(const VkSamplerCreateInfo& samplerInfo);
+
+	size_t size() const { return samplers.size(); }
+
+private:
+	static Key getKey(const VkSamplerCreateInfo& samplerInfo);
+};
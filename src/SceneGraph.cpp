@@ -0,0 +1,303 @@
+#include "SceneGraph.h"
+#include "JobSystem.h"
+#include <xmmintrin.h>
+#include <string.h>
+
+#define SCENE_GRAPH_GRAIN 4096	// Nodes per job, multiple of 4
+
+namespace {
+
+	template<typename T>
+	void permute(std::vector<T>& values, const std::vector<uint32_t>& order)
+	{
+		std::vector<T> permuted(values.size());
+		for (size_t i = 0; i < order.size(); i++) {
+			permuted[i] = values[order[i]];
+		}
+		values.swap(permuted);
+	}
+
+	inline __m128 gather(const float* values, const uint32_t* index)
+	{
+		return _mm_set_ps(values[index[3]], values[index[2]], values[index[1]], values[index[0]]);
+	}
+}
+
+uint32_t SceneGraph::addNode(uint32_t parent)
+{
+	uint32_t index = uint32_t(parents.size());
+	uint32_t parentIndex = parent == SCENE_GRAPH_NONE ? SCENE_GRAPH_NONE : indices[parent];
+	uint32_t depth = parent == SCENE_GRAPH_NONE ? 0 : depths[parentIndex] + 1;
+
+	// Appended at the end: still sorted as long as the depth does not decrease
+	if (index > 0 && depth < depths.back()) {
+		sorted = false;
+	}
+
+	uint32_t handle = uint32_t(indices.size());
+	indices.push_back(index);
+	handles.push_back(handle);
+	parents.push_back(parentIndex);
+	depths.push_back(depth);
+	dirty.push_back(1);
+
+	for (int i = 0; i < 3; i++) {
+		position[i].push_back(0.0f);
+		scale[i].push_back(1.0f);
+	}
+	for (int i = 0; i < 3; i++) {
+		rotation[i].push_back(0.0f);
+	}
+	rotation[3].push_back(1.0f);
+	for (int i = 0; i < 12; i++) {
+		world[i].push_back(i % 4 == 0 ? 1.0f : 0.0f);	// Identity
+	}
+
+	hierarchyChanged = true;
+	transformsChanged = true;
+	return handle;
+}
+
+void SceneGraph::setPosition(uint32_t node, const glm::vec3& value)
+{
+	uint32_t i = indices[node];
+	position[0][i] = value.x;
+	position[1][i] = value.y;
+	position[2][i] = value.z;
+	dirty[i] = 1;
+	transformsChanged = true;
+}
+
+void SceneGraph::setRotation(uint32_t node, const glm::quat& value)
+{
+	uint32_t i = indices[node];
+	rotation[0][i] = value.x;
+	rotation[1][i] = value.y;
+	rotation[2][i] = value.z;
+	rotation[3][i] = value.w;
+	dirty[i] = 1;
+	transformsChanged = true;
+}
+
+void SceneGraph::setScale(uint32_t node, const glm::vec3& value)
+{
+	uint32_t i = indices[node];
+	scale[0][i] = value.x;
+	scale[1][i] = value.y;
+	scale[2][i] = value.z;
+	dirty[i] = 1;
+	transformsChanged = true;
+}
+
+void SceneGraph::update(JobSystem* jobs)
+{
+	if (hierarchyChanged) {
+		sortByDepth();
+	}
+	if (!transformsChanged) {
+		return;
+	}
+
+	// Levels one after the other, the nodes of a level in parallel
+	for (size_t level = 0; level + 1 < levels.size(); level++) {
+		uint32_t begin = levels[level];
+		uint32_t count = levels[level + 1] - begin;
+
+		if (count == 0) {
+			continue;
+		}
+		if (jobs) {
+			jobs->parallelFor(count, SCENE_GRAPH_GRAIN, [this, begin](uint32_t first, uint32_t last) {
+				updateRange(begin + first, begin + last);
+			});
+		}
+		else {
+			updateRange(begin, begin + count);
+		}
+	}
+
+	memset(dirty.data(), 0, dirty.size());
+	transformsChanged = false;
+}
+
+glm::mat4 SceneGraph::getWorldMatrix(uint32_t node) const
+{
+	uint32_t i = indices[node];
+	glm::mat4 matrix;
+	for (int column = 0; column < 4; column++) {
+		for (int row = 0; row < 3; row++) {
+			matrix[column][row] = world[column * 3 + row][i];
+		}
+		matrix[column][3] = column == 3 ? 1.0f : 0.0f;
+	}
+	return matrix;
+}
+
+void SceneGraph::sortByDepth()
+{
+	uint32_t count = uint32_t(parents.size());
+	uint32_t maxDepth = 0;
+	for (uint32_t depth : depths) {
+		maxDepth = depth > maxDepth ? depth : maxDepth;
+	}
+
+	// COUNTING SORT: stable, so the nodes keep their order within a level
+	levels.assign(maxDepth + 2, 0);
+	for (uint32_t depth : depths) {
+		levels[depth + 1]++;
+	}
+	for (uint32_t depth = 0; depth <= maxDepth; depth++) {
+		levels[depth + 1] += levels[depth];
+	}
+
+	if (!sorted) {
+		std::vector<uint32_t> order(count);
+		std::vector<uint32_t> newIndices(count);
+		std::vector<uint32_t> next(levels.begin(), levels.end() - 1);
+		for (uint32_t i = 0; i < count; i++) {
+			uint32_t newIndex = next[depths[i]]++;
+			order[newIndex] = i;
+			newIndices[i] = newIndex;
+		}
+
+		permute(parents, order);
+		permute(depths, order);
+		permute(handles, order);
+		permute(dirty, order);
+		for (int i = 0; i < 3; i++) {
+			permute(position[i], order);
+			permute(scale[i], order);
+		}
+		for (int i = 0; i < 4; i++) {
+			permute(rotation[i], order);
+		}
+		for (int i = 0; i < 12; i++) {
+			permute(world[i], order);
+		}
+
+		for (uint32_t i = 0; i < count; i++) {
+			if (parents[i] != SCENE_GRAPH_NONE) {
+				parents[i] = newIndices[parents[i]];
+			}
+			indices[handles[i]] = i;
+		}
+		sorted = true;
+	}
+
+	hierarchyChanged = false;
+}
+
+void SceneGraph::updateRange(uint32_t begin, uint32_t end)
+{
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 two = _mm_set1_ps(2.0f);
+	bool root = parents[begin] == SCENE_GRAPH_NONE;
+
+	uint32_t i = begin;
+	for (; i + 4 <= end; i += 4) {
+		// A node is dirty if it was modified or if its parent was updated
+		if (!root) {
+			for (uint32_t j = i; j < i + 4; j++) {
+				dirty[j] |= dirty[parents[j]];
+			}
+		}
+		uint32_t mask;
+		memcpy(&mask, &dirty[i], sizeof(mask));
+		if (mask == 0) {
+			continue;
+		}
+
+		// LOCAL MATRIX of 4 nodes at once: scale, then rotation, then translation
+		__m128 qx = _mm_loadu_ps(&rotation[0][i]);
+		__m128 qy = _mm_loadu_ps(&rotation[1][i]);
+		__m128 qz = _mm_loadu_ps(&rotation[2][i]);
+		__m128 qw = _mm_loadu_ps(&rotation[3][i]);
+		__m128 sx = _mm_loadu_ps(&scale[0][i]);
+		__m128 sy = _mm_loadu_ps(&scale[1][i]);
+		__m128 sz = _mm_loadu_ps(&scale[2][i]);
+
+		__m128 xx = _mm_mul_ps(qx, qx), yy = _mm_mul_ps(qy, qy), zz = _mm_mul_ps(qz, qz);
+		__m128 xy = _mm_mul_ps(qx, qy), xz = _mm_mul_ps(qx, qz), yz = _mm_mul_ps(qy, qz);
+		__m128 wx = _mm_mul_ps(qw, qx), wy = _mm_mul_ps(qw, qy), wz = _mm_mul_ps(qw, qz);
+
+		__m128 local[12];
+		local[0] = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))), sx);
+		local[1] = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xy, wz)), sx);
+		local[2] = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xz, wy)), sx);
+		local[3] = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xy, wz)), sy);
+		local[4] = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))), sy);
+		local[5] = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(yz, wx)), sy);
+		local[6] = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xz, wy)), sz);
+		local[7] = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(yz, wx)), sz);
+		local[8] = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))), sz);
+		local[9] = _mm_loadu_ps(&position[0][i]);
+		local[10] = _mm_loadu_ps(&position[1][i]);
+		local[11] = _mm_loadu_ps(&position[2][i]);
+
+		if (root) {
+			for (int e = 0; e < 12; e++) {
+				_mm_storeu_ps(&world[e][i], local[e]);
+			}
+			continue;
+		}
+
+		// WORLD = PARENT * LOCAL, the parents are scattered in the previous level
+		__m128 parent[12];
+		for (int e = 0; e < 12; e++) {
+			parent[e] = gather(world[e].data(), &parents[i]);
+		}
+
+		for (int column = 0; column < 4; column++) {
+			__m128 x = local[column * 3 + 0];
+			__m128 y = local[column * 3 + 1];
+			__m128 z = local[column * 3 + 2];
+			for (int row = 0; row < 3; row++) {
+				__m128 value = _mm_add_ps(_mm_add_ps(_mm_mul_ps(parent[row], x), _mm_mul_ps(parent[3 + row], y)), _mm_mul_ps(parent[6 + row], z));
+				if (column == 3) {
+					value = _mm_add_ps(value, parent[9 + row]);
+				}
+				_mm_storeu_ps(&world[column * 3 + row][i], value);
+			}
+		}
+	}
+
+	// Remaining nodes at the end of the level
+	for (; i < end; i++) {
+		if (!root) {
+			dirty[i] |= dirty[parents[i]];
+		}
+		if (dirty[i]) {
+			updateNode(i);
+		}
+	}
+}
+
+void SceneGraph::updateNode(uint32_t i)
+{
+	float x = rotation[0][i], y = rotation[1][i], z = rotation[2][i], w = rotation[3][i];
+
+	float local[12] = {
+		(1.0f - 2.0f * (y * y + z * z)) * scale[0][i], 2.0f * (x * y + w * z) * scale[0][i], 2.0f * (x * z - w * y) * scale[0][i],
+		2.0f * (x * y - w * z) * scale[1][i], (1.0f - 2.0f * (x * x + z * z)) * scale[1][i], 2.0f * (y * z + w * x) * scale[1][i],
+		2.0f * (x * z + w * y) * scale[2][i], 2.0f * (y * z - w * x) * scale[2][i], (1.0f - 2.0f * (x * x + y * y)) * scale[2][i],
+		position[0][i], position[1][i], position[2][i],
+	};
+
+	uint32_t p = parents[i];
+	if (p == SCENE_GRAPH_NONE) {
+		for (int e = 0; e < 12; e++) {
+			world[e][i] = local[e];
+		}
+		return;
+	}
+
+	for (int column = 0; column < 4; column++) {
+		for (int row = 0; row < 3; row++) {
+			float value = world[row][p] * local[column * 3] + world[3 + row][p] * local[column * 3 + 1] + world[6 + row][p] * local[column * 3 + 2];
+			if (column == 3) {
+				value += world[9 + row][p];
+			}
+			world[column * 3 + row][i] = value;
+		}
+	}
+}
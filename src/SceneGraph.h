@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <glm.hpp>
+#include <gtc/quaternion.hpp>
+
+#define SCENE_GRAPH_NONE UINT32_MAX
+
+class JobSystem;
+
+// Transform hierarchy stored as structure of arrays, nodes sorted by depth:
+// a whole level is updated at once, its parents being all done in the previous one.
+// Nodes are referred to by handles, their index changes when the hierarchy is sorted again.
+class SceneGraph
+{
+private:
+	// Indexed by position in the sorted arrays
+	std::vector<uint32_t> parents;		// Index of the parent, SCENE_GRAPH_NONE for roots
+	std::vector<uint32_t> depths;
+	std::vector<uint32_t> handles;
+	std::vector<uint8_t> dirty;
+	std::vector<float> position[3];
+	std::vector<float> rotation[4];		// Quaternion x, y, z, w
+	std::vector<float> scale[3];
+	std::vector<float> world[12];		// Column major, last row is always (0, 0, 0, 1)
+
+	std::vector<uint32_t> indices;		// Handle -> index
+	std::vector<uint32_t> levels;		// Index of the first node of each depth, plus the end
+	bool sorted = true;
+	bool hierarchyChanged = false;
+	bool transformsChanged = false;
+
+public:
+	uint32_t addNode(uint32_t parent = SCENE_GRAPH_NONE);
+
+	void setPosition(uint32_t node, const glm::vec3& value);
+	void setRotation(uint32_t node, const glm::quat& value);
+	void setScale(uint32_t node, const glm::vec3& value);
+
+	// Recomputes the world matrices of the modified nodes and of their children only
+	void update(JobSystem* jobs = nullptr);
+
+	glm::mat4 getWorldMatrix(uint32_t node) const;
+	size_t size() const { return parents.size(); }
+
+private:
+	void sortByDepth();
+	void updateRange(uint32_t begin, uint32_t end);
+	void updateNode(uint32_t i);
+};
@@ -0,0 +1,207 @@
+#include "ShaderManager.h"
+#include "JobSystem.h"
+#include <shaderc/shaderc.hpp>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <assert.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <sys/stat.h>
+#else
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#define SHADER_WATCH_TIMEOUT_MS 200	// How long stop() may wait for the watcher
+
+namespace {
+
+	bool endsWith(const std::string& value, const std::string& suffix)
+	{
+		return value.size() >= suffix.size() && value.compare(value.size() - suffix.size(), suffix.size(), suffix) == 0;
+	}
+
+	bool isShader(const std::string& name)
+	{
+		return endsWith(name, ".vert") || endsWith(name, ".frag") || endsWith(name, ".comp");
+	}
+
+	shaderc_shader_kind getShaderKind(const std::string& name)
+	{
+		if (endsWith(name, ".vert")) return shaderc_glsl_vertex_shader;
+		if (endsWith(name, ".frag")) return shaderc_glsl_fragment_shader;
+		if (endsWith(name, ".comp")) return shaderc_glsl_compute_shader;
+		return shaderc_glsl_infer_from_source;
+	}
+}
+
+ShaderManager::ShaderManager() : stopping(false)
+{
+}
+
+ShaderManager::~ShaderManager()
+{
+	stop();
+}
+
+void ShaderManager::init(JobSystem* jobs, const std::string& directory)
+{
+	this->jobs = jobs;
+	this->directory = directory;
+}
+
+bool ShaderManager::precompile(const std::string& name)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (spirv.find(name) != spirv.end()) {
+			return true;
+		}
+	}
+	return compile(name);
+}
+
+VkShaderModule ShaderManager::createModule(const std::string& name)
+{
+	assert(device != VK_NULL_HANDLE);
+	std::unique_lock<std::mutex> lock(mutex);
+	if (spirv.find(name) == spirv.end()) {
+		// No earlier version to fall back to: the renderer cannot go on without it
+		lock.unlock();
+		if (!compile(name)) {
+			std::cerr << "Shader " << name << " does not compile" << std::endl;
+			abort();
+		}
+		lock.lock();
+	}
+
+	const std::vector<uint32_t>& code = spirv[name];
+
+	VkShaderModuleCreateInfo shaderModuleInfo = {};
+	shaderModuleInfo.codeSize = code.size() * sizeof(uint32_t);
+	shaderModuleInfo.pCode = code.data();
+	shaderModuleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+
+	VkShaderModule shaderModule;
+	VkResult res = vkCreateShaderModule(device, &shaderModuleInfo, nullptr, &shaderModule);
+	assert(res == VK_SUCCESS);
+	return shaderModule;
+}
+
+void ShaderManager::watch(const std::vector<std::string>& names, const std::function<void(const std::string&)>& onReload)
+{
+	this->onReload = onReload;
+	watched = std::set<std::string>(names.begin(), names.end());
+	stopping = false;
+	watcher = std::thread([this]() { watchDirectory(); });
+}
+
+void ShaderManager::stop()
+{
+	stopping = true;
+	if (watcher.joinable()) {
+		watcher.join();
+	}
+}
+
+bool ShaderManager::compile(const std::string& name)
+{
+	std::ifstream file(directory + "/" + name);
+	if (!file) {
+		std::cerr << "Cannot open shader " << name << std::endl;
+		return false;
+	}
+	std::stringstream source;
+	source << file.rdbuf();
+
+	shaderc::Compiler compiler;
+	shaderc::CompileOptions options;
+	options.SetOptimizationLevel(shaderc_optimization_level_performance);
+
+	shaderc::SpvCompilationResult result = compiler.CompileGlslToSpv(source.str(), getShaderKind(name), name.c_str(), options);
+	if (result.GetCompilationStatus() != shaderc_compilation_status_success) {
+		// The previous version stays in use
+		std::cerr << result.GetErrorMessage();
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	spirv[name] = std::vector<uint32_t>(result.cbegin(), result.cend());
+	return true;
+}
+
+void ShaderManager::watchDirectory()
+{
+	// Compiles in the background, the render thread picks the result up later
+	auto reload = [this](const std::string& name) {
+		jobs->submit([this, name]() {
+			if (compile(name)) {
+				onReload(name);
+			}
+		});
+	};
+
+#ifdef _WIN32
+	// No file names with change notifications: compare the modification times
+	std::map<std::string, time_t> modificationTimes;
+	auto scan = [this, &modificationTimes](bool notify, const std::function<void(const std::string&)>& reload) {
+		WIN32_FIND_DATAA found;
+		HANDLE search = FindFirstFileA((directory + "/*").c_str(), &found);
+		if (search == INVALID_HANDLE_VALUE) {
+			return;
+		}
+		do {
+			std::string name = found.cFileName;
+			struct _stat info;
+			if (!isShader(name) || !isWatched(name) || _stat((directory + "/" + name).c_str(), &info) != 0) {
+				continue;
+			}
+			if (notify && modificationTimes[name] != info.st_mtime) {
+				reload(name);
+			}
+			modificationTimes[name] = info.st_mtime;
+		} while (FindNextFileA(search, &found));
+		FindClose(search);
+	};
+	scan(false, reload);
+
+	HANDLE notification = FindFirstChangeNotificationA(directory.c_str(), FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+	assert(notification != INVALID_HANDLE_VALUE);
+
+	while (!stopping) {
+		if (WaitForSingleObject(notification, SHADER_WATCH_TIMEOUT_MS) == WAIT_OBJECT_0) {
+			scan(true, reload);
+			FindNextChangeNotification(notification);
+		}
+	}
+	FindCloseChangeNotification(notification);
+#else
+	int inotify = inotify_init1(IN_NONBLOCK);
+	assert(inotify >= 0);
+	// Editors often write a temporary file and rename it
+	int watch = inotify_add_watch(inotify, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+	assert(watch >= 0);
+
+	char buffer[4096];
+	while (!stopping) {
+		pollfd descriptor = { inotify, POLLIN, 0 };
+		if (poll(&descriptor, 1, SHADER_WATCH_TIMEOUT_MS) <= 0) {
+			continue;
+		}
+
+		ssize_t length = read(inotify, buffer, sizeof(buffer));
+		for (ssize_t offset = 0; offset < length; ) {
+			const inotify_event* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+			if (event->len > 0 && isShader(event->name) && isWatched(event->name)) {
+				reload(event->name);
+			}
+			offset += sizeof(inotify_event) + event->len;
+		}
+	}
+	close(inotify);
+#endif
+}
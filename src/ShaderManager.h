@@ -0,0 +1,57 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+
+class JobSystem;
+
+// Compiles the GLSL sources of the shaders directory to SPIR-V at runtime and
+// compiles them again, on the job threads, as soon as a file is saved.
+class ShaderManager
+{
+private:
+	VkDevice device = VK_NULL_HANDLE;
+	JobSystem* jobs;
+	std::string directory;
+
+	std::mutex mutex;
+	std::map<std::string, std::vector<uint32_t>> spirv;	// Last successful compilation of each shader
+
+	std::thread watcher;
+	std::atomic<bool> stopping;
+	std::function<void(const std::string&)> onReload;
+	std::set<std::string> watched;
+
+public:
+	ShaderManager();
+	~ShaderManager();
+
+	void init(JobSystem* jobs, const std::string& directory);
+	// Before the first createModule(), the SPIR-V can be compiled without it
+	void setDevice(VkDevice device) { this->device = device; }
+
+	// Compiled ahead of the first createModule(), from any thread. False when it does not compile.
+	bool precompile(const std::string& name);
+
+	// Fresh module from the last successful compilation (compiled on first use).
+	// The caller owns it and may destroy it once its pipelines are created.
+	VkShaderModule createModule(const std::string& name);
+
+	// Watches the shaders whose pipelines can be rebuilt, the others are compiled once. onReload(name)
+	// is called on a job thread once a modified shader compiles: createModule(name) then returns the new code.
+	void watch(const std::vector<std::string>& names, const std::function<void(const std::string&)>& onReload);
+	void stop();
+
+private:
+	bool compile(const std::string& name);
+	bool isWatched(const std::string& name) const { return watched.find(name) != watched.end(); }
+	void watchDirectory();
+};
@@ -0,0 +1,648 @@
+#include "ShadowCascades.h"
+#include "DeviceCapabilities.h"
+#include "SamplerCache.h"
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <gtc/matrix_transform.hpp>
+#include "helpers\Helpers.h"
+
+namespace {
+
+	// FNV-1a, over the casters drawn in a cache
+	inline uint64_t hash(uint64_t h, const void* data, size_t size)
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		for (size_t i = 0; i < size; i++) {
+			h = (h ^ bytes[i]) * 1099511628211ull;
+		}
+		return h;
+	}
+
+	// Right handed view space to [0, 1] depth, like the main projection but without the perspective
+	glm::mat4 orthographic(float left, float right, float bottom, float top, float nearPlane, float farPlane)
+	{
+		glm::mat4 m(1.0f);
+		m[0][0] = 2.0f / (right - left);
+		m[1][1] = 2.0f / (top - bottom);
+		m[2][2] = -1.0f / (farPlane - nearPlane);
+		m[3][0] = -(right + left) / (right - left);
+		m[3][1] = -(top + bottom) / (top - bottom);
+		m[3][2] = -nearPlane / (farPlane - nearPlane);
+		return m;
+	}
+}
+
+void ShadowCascades::init(const DeviceCapabilities& capabilities, VkDevice device, SamplerCache& samplers, VkFormat format, bool linearFiltering,
+						  uint32_t frameCount, uint32_t resolution, float maxDistance)
+{
+	this->physicalDevice = capabilities.physicalDevice;
+	this->device = device;
+	this->format = format;
+	this->resolution = resolution;
+	this->maxDistance = maxDistance;
+
+	// The layers start in the static pass (cleared) or after a copy: only the ones that end up sampled
+	// need the shader read layout, the attachments of the cache never go back to it.
+	VkSubpassDependency staticDependencies[2] = {};
+	staticDependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+	staticDependencies[0].dstSubpass = 0;
+	staticDependencies[0].srcStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+	staticDependencies[0].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	staticDependencies[0].srcAccessMask = 0;
+	staticDependencies[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	staticDependencies[1].srcSubpass = 0;
+	staticDependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+	staticDependencies[1].srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	staticDependencies[1].dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+	staticDependencies[1].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	staticDependencies[1].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	staticPass = createRenderPass(VK_ATTACHMENT_LOAD_OP_CLEAR, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, staticDependencies);
+
+	VkSubpassDependency dynamicDependencies[2] = {};
+	dynamicDependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+	dynamicDependencies[0].dstSubpass = 0;
+	dynamicDependencies[0].srcStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+	dynamicDependencies[0].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	dynamicDependencies[0].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	dynamicDependencies[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	dynamicDependencies[1].srcSubpass = 0;
+	dynamicDependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+	dynamicDependencies[1].srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	dynamicDependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+	dynamicDependencies[1].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	dynamicDependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	dynamicPass = createRenderPass(VK_ATTACHMENT_LOAD_OP_LOAD, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+								   dynamicDependencies);
+
+	createImage(VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+				image, memory, layerViews, frameBuffers);
+	createImage(VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+				staticImage, staticMemory, staticLayerViews, staticFrameBuffers);
+
+	// Every cascade through one view, the shader picks the layer
+	VkImageViewCreateInfo viewInfo = {};
+	viewInfo.format = format;
+	viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+	viewInfo.subresourceRange.levelCount = 1;
+	viewInfo.subresourceRange.layerCount = SHADOW_CASCADES;
+	viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+	viewInfo.image = image;
+	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+
+	VkResult res = vkCreateImageView(device, &viewInfo, nullptr, &arrayView);
+	assert(res == VK_SUCCESS);
+
+	// Hardware comparison, filtered over 2x2 texels when the format allows it. Outside the map is lit.
+	VkSamplerCreateInfo samplerInfo = {};
+	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+	samplerInfo.anisotropyEnable = VK_FALSE;
+	samplerInfo.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
+	samplerInfo.compareEnable = VK_TRUE;
+	samplerInfo.compareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+	samplerInfo.magFilter = linearFiltering ? VK_FILTER_LINEAR : VK_FILTER_NEAREST;
+	samplerInfo.minFilter = samplerInfo.magFilter;
+	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	samplerInfo.maxAnisotropy = 1.0f;
+	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	sampler = samplers.get(samplerInfo);
+
+	// UNIFORMS: one part per frame in flight
+	VkDeviceSize alignment = capabilities.limits().minUniformBufferOffsetAlignment;
+	uniformStride = (sizeof(ShadowUniforms) + alignment - 1) / alignment * alignment;
+	vk::createBuffer(physicalDevice, device, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, uniformStride * frameCount, uniformBuffer, uniformMemory);
+	void* data;
+	res = vkMapMemory(device, uniformMemory, 0, VK_WHOLE_SIZE, 0, &data);
+	assert(res == VK_SUCCESS);
+	uniformData = static_cast<uint8_t*>(data);
+	for (uint32_t frame = 0; frame < frameCount; frame++) {
+		memset(uniformData + frame * uniformStride, 0, sizeof(ShadowUniforms));
+	}
+
+	// DESCRIPTORS: uniforms, shadow maps
+	VkDescriptorType types[] = { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER };
+	setLayout = vk::createDescriptorSetLayout(device, types, 2, VK_SHADER_STAGE_FRAGMENT_BIT);
+
+	VkDescriptorPoolSize poolSizes[2] = {};
+	poolSizes[0].descriptorCount = frameCount;
+	poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	poolSizes[1].descriptorCount = frameCount;
+	poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+
+	VkDescriptorPoolCreateInfo descriptorPoolInfo = {};
+	descriptorPoolInfo.maxSets = frameCount;
+	descriptorPoolInfo.poolSizeCount = 2;
+	descriptorPoolInfo.pPoolSizes = poolSizes;
+	descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+
+	res = vkCreateDescriptorPool(device, &descriptorPoolInfo, nullptr, &descriptorPool);
+	assert(res == VK_SUCCESS);
+
+	std::vector<VkDescriptorSetLayout> setLayouts(frameCount, setLayout);
+	VkDescriptorSetAllocateInfo descriptorSetAllocInfo = {};
+	descriptorSetAllocInfo.descriptorPool = descriptorPool;
+	descriptorSetAllocInfo.descriptorSetCount = frameCount;
+	descriptorSetAllocInfo.pSetLayouts = setLayouts.data();
+	descriptorSetAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+
+	descriptorSets.resize(frameCount);
+	res = vkAllocateDescriptorSets(device, &descriptorSetAllocInfo, descriptorSets.data());
+	assert(res == VK_SUCCESS);
+
+	VkDescriptorImageInfo imageDescriptor = {};
+	imageDescriptor.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	imageDescriptor.imageView = arrayView;
+	imageDescriptor.sampler = sampler;
+
+	for (uint32_t frame = 0; frame < frameCount; frame++) {
+		VkDescriptorBufferInfo bufferDescriptor = { uniformBuffer, frame * uniformStride, sizeof(ShadowUniforms) };
+
+		VkWriteDescriptorSet writeDescriptorSets[2] = {};
+		writeDescriptorSets[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writeDescriptorSets[0].descriptorCount = 1;
+		writeDescriptorSets[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		writeDescriptorSets[0].dstSet = descriptorSets[frame];
+		writeDescriptorSets[0].pBufferInfo = &bufferDescriptor;
+		writeDescriptorSets[0].dstBinding = 0;
+		writeDescriptorSets[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writeDescriptorSets[1].descriptorCount = 1;
+		writeDescriptorSets[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		writeDescriptorSets[1].dstSet = descriptorSets[frame];
+		writeDescriptorSets[1].pImageInfo = &imageDescriptor;
+		writeDescriptorSets[1].dstBinding = 1;
+		vkUpdateDescriptorSets(device, 2, writeDescriptorSets, 0, nullptr);
+	}
+}
+
+void ShadowCascades::destroy()
+{
+	vkDestroyPipeline(device, pipeline, nullptr);
+	vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+	vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+	vkDestroyDescriptorSetLayout(device, setLayout, nullptr);
+	vkUnmapMemory(device, uniformMemory);
+	vkDestroyBuffer(device, uniformBuffer, nullptr);
+	vkFreeMemory(device, uniformMemory, nullptr);
+
+	for (size_t i = 0; i < frameBuffers.size(); i++) {
+		vkDestroyFramebuffer(device, frameBuffers[i], nullptr);
+		vkDestroyFramebuffer(device, staticFrameBuffers[i], nullptr);
+		vkDestroyImageView(device, layerViews[i], nullptr);
+		vkDestroyImageView(device, staticLayerViews[i], nullptr);
+	}
+	vkDestroyImageView(device, arrayView, nullptr);
+	vkDestroyImage(device, image, nullptr);
+	vkDestroyImage(device, staticImage, nullptr);
+	vkFreeMemory(device, memory, nullptr);
+	vkFreeMemory(device, staticMemory, nullptr);
+	vkDestroyRenderPass(device, staticPass, nullptr);
+	vkDestroyRenderPass(device, dynamicPass, nullptr);
+
+	// The sampler belongs to the cache
+	pipeline = VK_NULL_HANDLE;
+	pipelineLayout = VK_NULL_HANDLE;
+	descriptorPool = VK_NULL_HANDLE;
+	setLayout = VK_NULL_HANDLE;
+	uniformData = nullptr;
+	image = VK_NULL_HANDLE;
+	staticImage = VK_NULL_HANDLE;
+	arrayView = VK_NULL_HANDLE;
+	frameBuffers.clear();
+	staticFrameBuffers.clear();
+	layerViews.clear();
+	staticLayerViews.clear();
+	descriptorSets.clear();
+	initialized = false;
+}
+
+void ShadowCascades::createPipeline(const VkPipelineShaderStageCreateInfo& vertexStage, uint32_t vertexStride, bool depthClamp)
+{
+	// View projection times model matrix, no descriptor
+	VkPushConstantRange pushConstants = {};
+	pushConstants.size = sizeof(glm::mat4);
+	pushConstants.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+	pipelineLayoutInfo.pushConstantRangeCount = 1;
+	pipelineLayoutInfo.pPushConstantRanges = &pushConstants;
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	VkResult res = vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout);
+	assert(res == VK_SUCCESS);
+
+	VkVertexInputBindingDescription binding = {};
+	binding.binding = 0;
+	binding.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+	binding.stride = vertexStride;
+
+	VkVertexInputAttributeDescription attribute = { 0, 0, VK_FORMAT_R32G32B32_SFLOAT, 0 };
+
+	VkPipelineVertexInputStateCreateInfo vertexInput = {};
+	vertexInput.vertexBindingDescriptionCount = 1;
+	vertexInput.pVertexBindingDescriptions = &binding;
+	vertexInput.vertexAttributeDescriptionCount = 1;
+	vertexInput.pVertexAttributeDescriptions = &attribute;
+	vertexInput.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+
+	VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
+	inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+
+	// Every cascade has the same size
+	VkViewport viewport = { 0.0f, 0.0f, float(resolution), float(resolution), 0.0f, 1.0f };
+	VkRect2D scissor = { { 0, 0 }, { resolution, resolution } };
+
+	VkPipelineViewportStateCreateInfo viewportState = {};
+	viewportState.viewportCount = 1;
+	viewportState.pViewports = &viewport;
+	viewportState.scissorCount = 1;
+	viewportState.pScissors = &scissor;
+	viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+
+	// Both faces: open meshes and planes cast shadows too. The slope term of the bias fights the acne
+	// of the surfaces seen at grazing angles by the light. With the depth clamp, the casters in front
+	// of the near plane are flattened on it instead of being clipped.
+	VkPipelineRasterizationStateCreateInfo rasterizationState = {};
+	rasterizationState.cullMode = VK_CULL_MODE_NONE;
+	rasterizationState.frontFace = VK_FRONT_FACE_CLOCKWISE;
+	rasterizationState.lineWidth = 1.0f;
+	rasterizationState.polygonMode = VK_POLYGON_MODE_FILL;
+	rasterizationState.depthClampEnable = depthClamp ? VK_TRUE : VK_FALSE;
+	rasterizationState.depthBiasEnable = VK_TRUE;
+	rasterizationState.depthBiasConstantFactor = 1.25f;
+	rasterizationState.depthBiasSlopeFactor = 1.75f;
+	rasterizationState.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+
+	VkPipelineMultisampleStateCreateInfo multisampleState = {};
+	multisampleState.minSampleShading = 1.0f;
+	multisampleState.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+	multisampleState.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+
+	VkPipelineDepthStencilStateCreateInfo depthStencilState = {};
+	depthStencilState.depthTestEnable = VK_TRUE;
+	depthStencilState.depthWriteEnable = VK_TRUE;
+	depthStencilState.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+	depthStencilState.back.compareOp = VK_COMPARE_OP_ALWAYS;
+	depthStencilState.front = depthStencilState.back;
+	depthStencilState.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+
+	VkPipelineColorBlendStateCreateInfo colorBlendState = {};
+	colorBlendState.logicOp = VK_LOGIC_OP_COPY;
+	colorBlendState.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+
+	// Both passes have the same attachment and subpass: compatible render passes
+	VkGraphicsPipelineCreateInfo pipelineInfo = {};
+	pipelineInfo.basePipelineIndex = -1;
+	pipelineInfo.subpass = 0;
+	pipelineInfo.renderPass = staticPass;
+	pipelineInfo.layout = pipelineLayout;
+	pipelineInfo.pColorBlendState = &colorBlendState;
+	pipelineInfo.pInputAssemblyState = &inputAssembly;
+	pipelineInfo.pMultisampleState = &multisampleState;
+	pipelineInfo.pRasterizationState = &rasterizationState;
+	pipelineInfo.pVertexInputState = &vertexInput;
+	pipelineInfo.pViewportState = &viewportState;
+	pipelineInfo.pDepthStencilState = &depthStencilState;
+	pipelineInfo.stageCount = 1;
+	pipelineInfo.pStages = &vertexStage;
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+
+	res = vkCreateGraphicsPipelines(device, 0, 1, &pipelineInfo, nullptr, &pipeline);
+	assert(res == VK_SUCCESS);
+}
+
+void ShadowCascades::setLight(const glm::vec3& direction, const glm::vec3& color)
+{
+	hasLight = color.x > 0.0f || color.y > 0.0f || color.z > 0.0f;
+	lightDirection = glm::normalize(direction);
+	lightColor = color;
+}
+
+void ShadowCascades::prepare(uint32_t frame, const glm::mat4& viewMatrix, float fovY, float aspect, float nearPlane, float farPlane,
+							 const std::vector<ShadowCaster>& frameCasters)
+{
+	// A w of 0 in the light direction turns the sun off in the shaders
+	if (!hasLight) {
+		casters.clear();
+		previousTransforms.clear();
+		memset(uniformData + frame * uniformStride, 0, sizeof(ShadowUniforms));
+		return;
+	}
+
+	// A caster moves when its matrix is not the one of the last frame
+	casters = frameCasters;
+	moving.resize(casters.size());
+	for (size_t i = 0; i < casters.size(); i++) {
+		moving[i] = i >= previousTransforms.size() ||
+					memcmp(&previousTransforms[i], &casters[i].transform, sizeof(glm::mat4)) != 0;
+	}
+	previousTransforms.resize(casters.size());
+	for (size_t i = 0; i < casters.size(); i++) {
+		previousTransforms[i] = casters[i].transform;
+	}
+
+	// The light looks along its rays, from the world origin: only the cascades move
+	glm::vec3 up = fabsf(lightDirection.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+	glm::mat4 lightView = glm::lookAt(glm::vec3(0.0f), -lightDirection, up);
+	glm::mat4 inverseView = glm::inverse(viewMatrix);
+
+	float tanY = tanf(fovY * 0.5f);
+	float tanX = tanY * aspect;
+	float distance = std::min(maxDistance, farPlane);
+
+	// Clip space to shadow map coordinates
+	glm::mat4 bias(1.0f);
+	bias[0][0] = 0.5f;
+	bias[1][1] = 0.5f;
+	bias[3][0] = 0.5f;
+	bias[3][1] = 0.5f;
+
+	ShadowUniforms uniforms;
+	float splits[4] = { 1e30f, 1e30f, 1e30f, 1e30f };
+	float splitNear = nearPlane;
+	for (uint32_t i = 0; i < SHADOW_CASCADES; i++) {
+		// Between the logarithmic splits (even texel density) and the uniform ones (less detail wasted near the eye)
+		float ratio = float(i + 1) / SHADOW_CASCADES;
+		float logarithmic = nearPlane * powf(distance / nearPlane, ratio);
+		float uniform = nearPlane + (distance - nearPlane) * ratio;
+		float split = 0.75f * logarithmic + 0.25f * uniform;
+
+		Cascade& cascade = cascades[i];
+		cascade.splitDepth = split;
+		fitCascade(cascade, inverseView, lightView, tanX, tanY, splitNear, split);
+		sortCasters(cascade);
+
+		// From the view space of the fragments
+		uniforms.cascadeMatrices[i] = bias * cascade.viewProjection * inverseView;
+		splits[i] = split;
+		splitNear = split;
+	}
+
+	glm::vec4 direction = viewMatrix * glm::vec4(lightDirection, 0.0f);
+	uniforms.splitDepths = glm::vec4(splits[0], splits[1], splits[2], splits[3]);
+	uniforms.lightDirection = glm::vec4(glm::normalize(glm::vec3(direction.x, direction.y, direction.z)), 1.0f);
+	uniforms.lightColor = glm::vec4(lightColor, 0.0f);
+	uniforms.texelSize = glm::vec4(1.0f / resolution, 1.0f / resolution, 0.0f, 0.0f);
+	memcpy(uniformData + frame * uniformStride, &uniforms, sizeof(ShadowUniforms));
+}
+
+void ShadowCascades::record(VkCommandBuffer cmdBuffer)
+{
+	// Sampled by the scene whether or not there is a light
+	if (!initialized) {
+		vk::transitionLayers(cmdBuffer, image, VK_IMAGE_ASPECT_DEPTH_BIT, 0, SHADOW_CASCADES,
+							 VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 0, VK_ACCESS_SHADER_READ_BIT,
+							 VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+		initialized = true;
+	}
+
+	renderedCount = 0;
+	if (!hasLight) {
+		return;
+	}
+
+	VkClearValue clearValue = {};
+	clearValue.depthStencil = { 1.0f, 0 };
+
+	VkRenderPassBeginInfo renderPassBegin = {};
+	renderPassBegin.renderArea.extent = { resolution, resolution };
+	renderPassBegin.renderArea.offset = { 0, 0 };
+	renderPassBegin.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+
+	for (uint32_t i = 0; i < SHADOW_CASCADES; i++) {
+		Cascade& cascade = cascades[i];
+
+		// CACHE: the casters that do not move, drawn again when they or the cascade change
+		bool refreshed = !cascade.cached || cascade.cachedKey != cascade.staticKey ||
+						 memcmp(&cascade.cachedViewProjection, &cascade.viewProjection, sizeof(glm::mat4)) != 0;
+		if (refreshed) {
+			renderPassBegin.renderPass = staticPass;
+			renderPassBegin.framebuffer = staticFrameBuffers[i];
+			renderPassBegin.clearValueCount = 1;
+			renderPassBegin.pClearValues = &clearValue;
+			vkCmdBeginRenderPass(cmdBuffer, &renderPassBegin, VK_SUBPASS_CONTENTS_INLINE);
+			drawCasters(cmdBuffer, cascade, cascade.staticCasters);
+			vkCmdEndRenderPass(cmdBuffer);
+
+			cascade.cached = true;
+			cascade.cachedKey = cascade.staticKey;
+			cascade.cachedViewProjection = cascade.viewProjection;
+		}
+
+		// SAMPLED: the cache, then the moving casters. Left as it is when neither changed.
+		bool dynamic = !cascade.dynamicCasters.empty();
+		if (refreshed || dynamic || cascade.hadDynamic) {
+			vk::transitionLayers(cmdBuffer, image, VK_IMAGE_ASPECT_DEPTH_BIT, i, 1,
+								 VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0, VK_ACCESS_TRANSFER_WRITE_BIT,
+								 VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+			VkImageCopy region = {};
+			region.srcSubresource = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, i, 1 };
+			region.dstSubresource = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, i, 1 };
+			region.extent = { resolution, resolution, 1 };
+			vkCmdCopyImage(cmdBuffer, staticImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+			renderPassBegin.renderPass = dynamicPass;
+			renderPassBegin.framebuffer = frameBuffers[i];
+			renderPassBegin.clearValueCount = 0;
+			renderPassBegin.pClearValues = nullptr;
+			vkCmdBeginRenderPass(cmdBuffer, &renderPassBegin, VK_SUBPASS_CONTENTS_INLINE);
+			drawCasters(cmdBuffer, cascade, cascade.dynamicCasters);
+			vkCmdEndRenderPass(cmdBuffer);
+			renderedCount++;
+		}
+		cascade.hadDynamic = dynamic;
+	}
+}
+
+void ShadowCascades::createImage(VkImageUsageFlags usage, VkImage& created, VkDeviceMemory& createdMemory,
+								 std::vector<VkImageView>& views, std::vector<VkFramebuffer>& framebuffers)
+{
+	VkImageCreateInfo imageInfo = {};
+	imageInfo.arrayLayers = SHADOW_CASCADES;
+	imageInfo.extent = { resolution, resolution, 1 };
+	imageInfo.imageType = VK_IMAGE_TYPE_2D;
+	imageInfo.format = format;
+	imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	imageInfo.mipLevels = 1;
+	imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+	imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+	imageInfo.usage = usage;
+	imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+
+	VkResult res = vkCreateImage(device, &imageInfo, nullptr, &created);
+	assert(res == VK_SUCCESS);
+
+	VkMemoryRequirements memoryRequirements;
+	vkGetImageMemoryRequirements(device, created, &memoryRequirements);
+
+	VkMemoryAllocateInfo memoryAllocInfo = {};
+	memoryAllocInfo.allocationSize = memoryRequirements.size;
+	memoryAllocInfo.memoryTypeIndex = vk::getMemoryType(physicalDevice, memoryRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	memoryAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	res = vkAllocateMemory(device, &memoryAllocInfo, nullptr, &createdMemory);
+	assert(res == VK_SUCCESS);
+
+	res = vkBindImageMemory(device, created, createdMemory, 0);
+	assert(res == VK_SUCCESS);
+
+	// One view and one framebuffer per cascade
+	VkImageViewCreateInfo viewInfo = {};
+	viewInfo.format = format;
+	viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+	viewInfo.subresourceRange.levelCount = 1;
+	viewInfo.subresourceRange.layerCount = 1;
+	viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+	viewInfo.image = created;
+	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+
+	VkFramebufferCreateInfo frameBufferInfo = {};
+	frameBufferInfo.height = resolution;
+	frameBufferInfo.width = resolution;
+	frameBufferInfo.layers = 1;
+	frameBufferInfo.attachmentCount = 1;
+	frameBufferInfo.renderPass = staticPass;
+	frameBufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+
+	views.resize(SHADOW_CASCADES);
+	framebuffers.resize(SHADOW_CASCADES);
+	for (uint32_t i = 0; i < SHADOW_CASCADES; i++) {
+		viewInfo.subresourceRange.baseArrayLayer = i;
+		res = vkCreateImageView(device, &viewInfo, nullptr, &views[i]);
+		assert(res == VK_SUCCESS);
+
+		frameBufferInfo.pAttachments = &views[i];
+		res = vkCreateFramebuffer(device, &frameBufferInfo, nullptr, &framebuffers[i]);
+		assert(res == VK_SUCCESS);
+	}
+}
+
+VkRenderPass ShadowCascades::createRenderPass(VkAttachmentLoadOp loadOp, VkImageLayout initialLayout, VkImageLayout finalLayout,
+											  const VkSubpassDependency* dependencies)
+{
+	VkAttachmentDescription attachment = {};
+	attachment.format = format;
+	attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+	attachment.loadOp = loadOp;
+	attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	attachment.initialLayout = initialLayout;
+	attachment.finalLayout = finalLayout;
+
+	VkAttachmentReference depthReference = { 0, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL };
+
+	VkSubpassDescription subpass = {};
+	subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+	subpass.pDepthStencilAttachment = &depthReference;
+
+	VkRenderPassCreateInfo renderPassInfo = {};
+	renderPassInfo.attachmentCount = 1;
+	renderPassInfo.pAttachments = &attachment;
+	renderPassInfo.subpassCount = 1;
+	renderPassInfo.pSubpasses = &subpass;
+	renderPassInfo.dependencyCount = 2;
+	renderPassInfo.pDependencies = dependencies;
+	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+
+	VkRenderPass renderPass;
+	VkResult res = vkCreateRenderPass(device, &renderPassInfo, nullptr, &renderPass);
+	assert(res == VK_SUCCESS);
+	return renderPass;
+}
+
+void ShadowCascades::fitCascade(Cascade& cascade, const glm::mat4& inverseView, const glm::mat4& lightView,
+								float tanX, float tanY, float nearDepth, float farDepth)
+{
+	// Smallest sphere through the 8 corners of the slice, its center on the view axis.
+	// It only depends on the depths and the field of view: the same size whatever the orientation.
+	float k2 = tanX * tanX + tanY * tanY;
+	float centerDepth = 0.5f * (1.0f + k2) * (nearDepth + farDepth);
+	float radius;
+	if (centerDepth >= farDepth) {
+		centerDepth = farDepth;
+		radius = sqrtf(k2) * farDepth;
+	}
+	else {
+		float offset = centerDepth - nearDepth;
+		radius = sqrtf(k2 * nearDepth * nearDepth + offset * offset);
+	}
+	radius = ceilf(radius * 16.0f) / 16.0f;
+
+	// Moved by whole texels only: the edges of the shadows do not crawl when the camera moves
+	glm::vec4 center = lightView * (inverseView * glm::vec4(0.0f, 0.0f, -centerDepth, 1.0f));
+	float texel = 2.0f * radius / resolution;
+	float x = floorf(center.x / texel) * texel;
+	float y = floorf(center.y / texel) * texel;
+
+	// Casters up to maxDistance towards the light still shadow the slice.
+	// The depth range moves by whole radii: the cache survives small moves along the light as well.
+	float depth = floorf(-center.z / radius) * radius;
+	float nearPlane = depth - radius - maxDistance;
+	float farPlane = depth + 2.0f * radius;
+
+	cascade.radius = radius;
+	cascade.depthRange = farPlane - nearPlane;
+	cascade.viewProjection = orthographic(x - radius, x + radius, y - radius, y + radius, nearPlane, farPlane) * lightView;
+}
+
+void ShadowCascades::sortCasters(Cascade& cascade)
+{
+	cascade.staticCasters.clear();
+	cascade.dynamicCasters.clear();
+
+	uint64_t key = 14695981039346656037ull;
+	for (uint32_t i = 0; i < casters.size(); i++) {
+		const ShadowCaster& caster = casters[i];
+		glm::vec4 clip = cascade.viewProjection * glm::vec4(caster.center, 1.0f);
+		float marginXY = caster.radius / cascade.radius;
+		float marginZ = caster.radius / cascade.depthRange;
+		if (fabsf(clip.x) > 1.0f + marginXY || fabsf(clip.y) > 1.0f + marginXY || clip.z < -marginZ || clip.z > 1.0f + marginZ) {
+			continue;
+		}
+
+		if (moving[i]) {
+			cascade.dynamicCasters.push_back(i);
+			continue;
+		}
+		cascade.staticCasters.push_back(i);
+		key = hash(key, &caster.vertexBuffer, sizeof(VkBuffer));
+		key = hash(key, &caster.indexBuffer, sizeof(VkBuffer));
+		key = hash(key, &caster.indexCount, sizeof(uint32_t));
+		key = hash(key, &caster.firstIndex, sizeof(uint32_t));
+		key = hash(key, &caster.vertexOffset, sizeof(int32_t));
+		key = hash(key, &caster.transform, sizeof(glm::mat4));
+	}
+	cascade.staticKey = key;
+}
+
+void ShadowCascades::drawCasters(VkCommandBuffer cmdBuffer, const Cascade& cascade, const std::vector<uint32_t>& drawn)
+{
+	if (drawn.empty()) {
+		return;
+	}
+
+	vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+	VkBuffer boundVertices = VK_NULL_HANDLE;
+	VkBuffer boundIndices = VK_NULL_HANDLE;
+	for (uint32_t index : drawn) {
+		const ShadowCaster& caster = casters[index];
+		if (caster.vertexBuffer != boundVertices) {
+			VkDeviceSize offset = 0;
+			vkCmdBindVertexBuffers(cmdBuffer, 0, 1, &caster.vertexBuffer, &offset);
+			boundVertices = caster.vertexBuffer;
+		}
+		if (caster.indexBuffer != boundIndices) {
+			vkCmdBindIndexBuffer(cmdBuffer, caster.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+			boundIndices = caster.indexBuffer;
+		}
+
+		glm::mat4 transform = cascade.viewProjection * caster.transform;
+		vkCmdPushConstants(cmdBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(glm::mat4), &transform);
+		vkCmdDrawIndexed(cmdBuffer, caster.indexCount, 1, caster.firstIndex, caster.vertexOffset, 0);
+	}
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <stdint.h>
+#include <vector>
+#include <glm.hpp>
+
+class DeviceCapabilities;
+class SamplerCache;
+
+#define SHADOW_CASCADES 4	// Up to 4, the split depths are a vec4 in the shaders
+
+// Mesh drawn into the shadow maps, the vertex position comes first in the vertex
+struct ShadowCaster {
+	VkBuffer vertexBuffer;
+	VkBuffer indexBuffer;
+	uint32_t indexCount;
+	uint32_t firstIndex;
+	int32_t vertexOffset;
+	glm::mat4 transform;
+	glm::vec3 center;	// World space bounding sphere
+	float radius;
+};
+
+// Matches the ShadowUBO of color.frag (std140)
+struct ShadowUniforms {
+	glm::mat4 cascadeMatrices[SHADOW_CASCADES];	// View space to shadow map coordinates and depth
+	glm::vec4 splitDepths;		// Far view depth of each cascade
+	glm::vec4 lightDirection;	// View space, towards the light. w is 1 when there is a light.
+	glm::vec4 lightColor;
+	glm::vec4 texelSize;		// Of the shadow maps in xy
+};
+
+// Directional light shadows: one depth-only render pass per cascade into the layers of a depth image,
+// the cascades splitting the view frustum between the near plane and maxDistance.
+// Each cascade is a sphere around its slice of the frustum, its size does not change as the camera turns
+// and its center is snapped to the texels: the cascade is the same as long as the camera stays still.
+// The casters that did not move since the last frame are drawn into a cached copy of each cascade, only
+// rendered again when the cascade or these casters change. Every frame, a cascade is copied from its
+// cache and gets the moving casters drawn over it, and only if it has some (or had last frame):
+// a static scene costs nothing.
+class ShadowCascades
+{
+private:
+	struct Cascade {
+		glm::mat4 viewProjection;	// World space to clip space
+		float radius = 0.0f;		// Half width, world units
+		float depthRange = 0.0f;
+		float splitDepth = 0.0f;
+
+		// This frame
+		std::vector<uint32_t> staticCasters;
+		std::vector<uint32_t> dynamicCasters;
+		uint64_t staticKey = 0;
+
+		// What the cache holds
+		bool cached = false;
+		glm::mat4 cachedViewProjection;
+		uint64_t cachedKey = 0;
+		bool hadDynamic = false;	// Moving casters drawn over the cache last time
+	};
+
+	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+	VkDevice device = VK_NULL_HANDLE;
+	VkFormat format = VK_FORMAT_UNDEFINED;
+	uint32_t resolution = 0;
+	float maxDistance = 0.0f;
+
+	glm::vec3 lightDirection;	// World space, towards the light
+	glm::vec3 lightColor;
+	bool hasLight = false;
+
+	Cascade cascades[SHADOW_CASCADES];
+	std::vector<ShadowCaster> casters;
+	std::vector<glm::mat4> previousTransforms;	// Casters of the last frame, in the same order
+	std::vector<bool> moving;
+	uint32_t renderedCount = 0;	// Cascades refreshed by the last record()
+
+	// Sampled one, and cache of the casters that do not move. Same layers.
+	VkImage image = VK_NULL_HANDLE;
+	VkImage staticImage = VK_NULL_HANDLE;
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceMemory staticMemory = VK_NULL_HANDLE;
+	bool initialized = false;	// Layers made readable once, before anything is drawn
+	VkImageView arrayView = VK_NULL_HANDLE;
+	std::vector<VkImageView> layerViews;
+	std::vector<VkImageView> staticLayerViews;
+	std::vector<VkFramebuffer> frameBuffers;
+	std::vector<VkFramebuffer> staticFrameBuffers;
+
+	// Cache: cleared, ends ready to be copied. Moving casters: loaded after the copy, ends sampled.
+	VkRenderPass staticPass = VK_NULL_HANDLE;
+	VkRenderPass dynamicPass = VK_NULL_HANDLE;
+	VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+	VkPipeline pipeline = VK_NULL_HANDLE;
+	VkSampler sampler = VK_NULL_HANDLE;
+
+	// Per frame uniforms and sets
+	VkBuffer uniformBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory uniformMemory = VK_NULL_HANDLE;
+	uint8_t* uniformData = nullptr;
+	VkDeviceSize uniformStride = 0;
+	VkDescriptorSetLayout setLayout = VK_NULL_HANDLE;
+	VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+	std::vector<VkDescriptorSet> descriptorSets;
+
+public:
+	// 'format' comes from the depth formats supporting sampling, linearFiltering when it can be filtered
+	void init(const DeviceCapabilities& capabilities, VkDevice device, SamplerCache& samplers, VkFormat format, bool linearFiltering,
+			  uint32_t frameCount, uint32_t resolution = 2048, float maxDistance = 50.0f);
+	void destroy();
+
+	// Position only, read from the first attribute of vertices of 'vertexStride' bytes
+	void createPipeline(const VkPipelineShaderStageCreateInfo& vertexStage, uint32_t vertexStride, bool depthClamp);
+
+	// A zero color removes the light, and the shadows with it
+	void setLight(const glm::vec3& direction, const glm::vec3& color);
+
+	// Fits the cascades to the camera, sorts the casters into them and writes the uniforms of 'frame'
+	void prepare(uint32_t frame, const glm::mat4& viewMatrix, float fovY, float aspect, float nearPlane, float farPlane,
+				 const std::vector<ShadowCaster>& frameCasters);
+
+	// Refreshes the cascades that changed, before the passes sampling them
+	void record(VkCommandBuffer cmdBuffer);
+
+	uint32_t getRenderedCount() const { return renderedCount; }
+
+	// Set 2 of the scene pipelines: uniforms then shadow maps
+	VkDescriptorSetLayout getSetLayout() const { return setLayout; }
+	VkDescriptorSet getDescriptorSet(uint32_t frame) const { return descriptorSets[frame]; }
+
+private:
+	void createImage(VkImageUsageFlags usage, VkImage& created, VkDeviceMemory& createdMemory,
+					 std::vector<VkImageView>& views, std::vector<VkFramebuffer>& framebuffers);
+	VkRenderPass createRenderPass(VkAttachmentLoadOp loadOp, VkImageLayout initialLayout, VkImageLayout finalLayout,
+								  const VkSubpassDependency* dependencies);
+	void fitCascade(Cascade& cascade, const glm::mat4& inverseView, const glm::mat4& lightView,
+					float tanX, float tanY, float nearDepth, float farDepth);
+	void sortCasters(Cascade& cascade);
+	void drawCasters(VkCommandBuffer cmdBuffer, const Cascade& cascade, const std::vector<uint32_t>& drawn);
+};
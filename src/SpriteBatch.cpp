@@ -0,0 +1,433 @@
+#include "SpriteBatch.h"
+#include "DeviceCapabilities.h"
+#include "DeletionQueue.h"
+#include "TextureAtlas.h"
+#include "JobSystem.h"
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#include "helpers\Helpers.h"
+
+#define SPRITE_GRAIN 4096	// Sprites per job
+
+namespace {
+
+	struct SpritePushConstants {
+		float scale[2];		// Pixels to clip space
+		float offset[2];
+	};
+
+	inline float getLayer(const AtlasRegion& region)
+	{
+		return float(region.layer);
+	}
+
+	inline void getRotation(float rotation, float& c, float& s)
+	{
+		c = 1.0f;
+		s = 0.0f;
+		if (rotation != 0.0f) {
+			c = cosf(rotation);
+			s = sinf(rotation);
+		}
+	}
+
+	// Corners 0 1 / 2 3, top left first
+	void writeQuad(const Sprite& sprite, const AtlasRegion& region, SpriteVertex* quad)
+	{
+		static const float cornerX[] = { -0.5f, 0.5f, -0.5f, 0.5f };
+		static const float cornerY[] = { -0.5f, -0.5f, 0.5f, 0.5f };
+
+		float c, s;
+		getRotation(sprite.rotation, c, s);
+		for (int i = 0; i < 4; i++) {
+			float x = cornerX[i] * sprite.size[0];
+			float y = cornerY[i] * sprite.size[1];
+			quad[i].position[0] = sprite.position[0] + x * c - y * s;
+			quad[i].position[1] = sprite.position[1] + x * s + y * c;
+			quad[i].uv[0] = region.uvOffset[0] + (cornerX[i] + 0.5f) * region.uvScale[0];
+			quad[i].uv[1] = region.uvOffset[1] + (cornerY[i] + 0.5f) * region.uvScale[1];
+			quad[i].color = sprite.color;
+			quad[i].layer = getLayer(region);
+		}
+	}
+
+	// Sine and cosine of 4 angles: reduced to [-pi/4, pi/4] around the closest multiple of pi/2,
+	// then minimax polynomials. About 1e-7 absolute error for the angles of sprites (|angle| < 1e4).
+	inline void sinCos(__m128 angle, __m128& sine, __m128& cosine)
+	{
+		__m128i quadrant = _mm_cvtps_epi32(_mm_mul_ps(angle, _mm_set1_ps(0.636619772f)));
+		__m128 q = _mm_cvtepi32_ps(quadrant);
+		__m128 r = _mm_sub_ps(angle, _mm_mul_ps(q, _mm_set1_ps(1.5703125f)));
+		r = _mm_sub_ps(r, _mm_mul_ps(q, _mm_set1_ps(4.83826794897e-4f)));
+		__m128 r2 = _mm_mul_ps(r, r);
+
+		__m128 sr = _mm_set1_ps(-1.9515295891e-4f);
+		sr = _mm_add_ps(_mm_mul_ps(sr, r2), _mm_set1_ps(8.3321608736e-3f));
+		sr = _mm_add_ps(_mm_mul_ps(sr, r2), _mm_set1_ps(-1.6666654611e-1f));
+		sr = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(sr, r2), r), r);
+
+		__m128 cr = _mm_set1_ps(2.443315711809948e-5f);
+		cr = _mm_add_ps(_mm_mul_ps(cr, r2), _mm_set1_ps(-1.388731625493765e-3f));
+		cr = _mm_add_ps(_mm_mul_ps(cr, r2), _mm_set1_ps(4.166664568298827e-2f));
+		cr = _mm_mul_ps(_mm_mul_ps(cr, r2), r2);
+		cr = _mm_add_ps(_mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(r2, _mm_set1_ps(0.5f))), cr);
+
+		// Odd quadrants swap them, quadrants 2 and 3 negate the sine, 1 and 2 the cosine
+		__m128 swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(quadrant, _mm_set1_epi32(1)), _mm_set1_epi32(1)));
+		__m128 sinSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(quadrant, _mm_set1_epi32(2)), 30));
+		__m128 cosSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(_mm_add_epi32(quadrant, _mm_set1_epi32(1)), _mm_set1_epi32(2)), 30));
+		sine = _mm_xor_ps(_mm_or_ps(_mm_and_ps(swap, cr), _mm_andnot_ps(swap, sr)), sinSign);
+		cosine = _mm_xor_ps(_mm_or_ps(_mm_and_ps(swap, sr), _mm_andnot_ps(swap, cr)), cosSign);
+	}
+
+	// Same quad computed for the 4 corners at once, then interleaved into 6 aligned stores.
+	// The memory is write-combined: streaming stores do not read it back into the cache.
+	void writeQuadSSE(const Sprite& sprite, const AtlasRegion& region, float c, float s, SpriteVertex* quad)
+	{
+		__m128 x = _mm_mul_ps(_mm_set1_ps(sprite.size[0]), _mm_setr_ps(-0.5f, 0.5f, -0.5f, 0.5f));
+		__m128 y = _mm_mul_ps(_mm_set1_ps(sprite.size[1]), _mm_setr_ps(-0.5f, -0.5f, 0.5f, 0.5f));
+		__m128 cosine = _mm_set1_ps(c);
+		__m128 sine = _mm_set1_ps(s);
+		__m128 px = _mm_add_ps(_mm_set1_ps(sprite.position[0]), _mm_sub_ps(_mm_mul_ps(x, cosine), _mm_mul_ps(y, sine)));
+		__m128 py = _mm_add_ps(_mm_set1_ps(sprite.position[1]), _mm_add_ps(_mm_mul_ps(x, sine), _mm_mul_ps(y, cosine)));
+
+		float u0 = region.uvOffset[0];
+		float u1 = u0 + region.uvScale[0];
+		float v0 = region.uvOffset[1];
+		float v1 = v0 + region.uvScale[1];
+		__m128 u = _mm_setr_ps(u0, u1, u0, u1);
+		__m128 v = _mm_setr_ps(v0, v0, v1, v1);
+
+		// One (x, y, u, v) row per corner
+		_MM_TRANSPOSE4_PS(px, py, u, v);
+
+		float layer = getLayer(region);
+		int32_t layerBits;
+		memcpy(&layerBits, &layer, sizeof(layerBits));
+		__m128 colorLayer = _mm_castsi128_ps(_mm_setr_epi32(int32_t(sprite.color), layerBits, int32_t(sprite.color), layerBits));
+
+		float* dst = reinterpret_cast<float*>(quad);
+		_mm_stream_ps(dst, px);
+		_mm_stream_ps(dst + 4, _mm_movelh_ps(colorLayer, py));
+		_mm_stream_ps(dst + 8, _mm_shuffle_ps(py, colorLayer, _MM_SHUFFLE(1, 0, 3, 2)));
+		_mm_stream_ps(dst + 12, u);
+		_mm_stream_ps(dst + 16, _mm_movelh_ps(colorLayer, v));
+		_mm_stream_ps(dst + 20, _mm_shuffle_ps(v, colorLayer, _MM_SHUFFLE(1, 0, 3, 2)));
+	}
+}
+
+void SpriteBatch::init(const DeviceCapabilities& capabilities, VkDevice device, const TextureAtlas* atlas, JobSystem* jobs,
+					   uint32_t frameCount, uint32_t maxSprites)
+{
+	this->physicalDevice = capabilities.physicalDevice;
+	this->device = device;
+	this->atlas = atlas;
+	this->jobs = jobs;
+	this->maxSprites = maxSprites;
+
+	// 4 vertices per sprite, the parts stay 16 bytes aligned for the SSE stores
+	static_assert(sizeof(SpriteVertex) * 4 % 16 == 0, "Quads must be 16 bytes aligned");
+	frameSize = VkDeviceSize(maxSprites) * 4 * sizeof(SpriteVertex);
+
+	// Written once and read once per frame: host memory read through the bus is enough
+	vk::createBuffer(physicalDevice, device, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, frameSize * frameCount, vertexBuffer, vertexMemory);
+
+	void* data;
+	VkResult res = vkMapMemory(device, vertexMemory, 0, VK_WHOLE_SIZE, 0, &data);
+	assert(res == VK_SUCCESS);
+	vertexData = static_cast<uint8_t*>(data);
+
+	vk::createBuffer(physicalDevice, device, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+					 VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+					 VkDeviceSize(maxSprites) * 6 * sizeof(uint32_t), indexBuffer, indexMemory);
+	indicesUploaded = false;
+
+	sprites.reserve(maxSprites);
+}
+
+void SpriteBatch::destroy()
+{
+	vkDestroyPipeline(device, pipeline, nullptr);
+	vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+	vkUnmapMemory(device, vertexMemory);
+	vkDestroyBuffer(device, vertexBuffer, nullptr);
+	vkFreeMemory(device, vertexMemory, nullptr);
+	vkDestroyBuffer(device, indexBuffer, nullptr);
+	vkFreeMemory(device, indexMemory, nullptr);
+	pipeline = VK_NULL_HANDLE;
+	pipelineLayout = VK_NULL_HANDLE;
+	vertexData = nullptr;
+}
+
+void SpriteBatch::createPipeline(VkRenderPass renderPass, uint32_t subpass, VkSampleCountFlagBits samples,
+								 VkDescriptorSetLayout setLayout, const VkPipelineShaderStageCreateInfo* stages)
+{
+	VkPushConstantRange pushConstants = {};
+	pushConstants.size = sizeof(SpritePushConstants);
+	pushConstants.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+	pipelineLayoutInfo.setLayoutCount = 1;
+	pipelineLayoutInfo.pSetLayouts = &setLayout;
+	pipelineLayoutInfo.pushConstantRangeCount = 1;
+	pipelineLayoutInfo.pPushConstantRanges = &pushConstants;
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	VkResult res = vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout);
+	assert(res == VK_SUCCESS);
+
+	VkVertexInputBindingDescription binding = {};
+	binding.binding = 0;
+	binding.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+	binding.stride = sizeof(SpriteVertex);
+
+	VkVertexInputAttributeDescription attributes[] = {
+		{ 0, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(SpriteVertex, position) },
+		{ 1, 0, VK_FORMAT_R32G32_SFLOAT, offsetof(SpriteVertex, uv) },
+		{ 2, 0, VK_FORMAT_R8G8B8A8_UNORM, offsetof(SpriteVertex, color) },
+		{ 3, 0, VK_FORMAT_R32_SFLOAT, offsetof(SpriteVertex, layer) },
+	};
+
+	VkPipelineVertexInputStateCreateInfo vertexInput = {};
+	vertexInput.vertexBindingDescriptionCount = 1;
+	vertexInput.pVertexBindingDescriptions = &binding;
+	vertexInput.vertexAttributeDescriptionCount = 4;
+	vertexInput.pVertexAttributeDescriptions = attributes;
+	vertexInput.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+
+	VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
+	inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+
+	// The extent changes with the swapchain
+	VkPipelineViewportStateCreateInfo viewportState = {};
+	viewportState.viewportCount = 1;
+	viewportState.scissorCount = 1;
+	viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+
+	VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+	VkPipelineDynamicStateCreateInfo dynamicState = {};
+	dynamicState.dynamicStateCount = 2;
+	dynamicState.pDynamicStates = dynamicStates;
+	dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+
+	// Rotated sprites may be seen from the back
+	VkPipelineRasterizationStateCreateInfo rasterizationState = {};
+	rasterizationState.cullMode = VK_CULL_MODE_NONE;
+	rasterizationState.frontFace = VK_FRONT_FACE_CLOCKWISE;
+	rasterizationState.lineWidth = 1.0f;
+	rasterizationState.polygonMode = VK_POLYGON_MODE_FILL;
+	rasterizationState.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+
+	VkPipelineMultisampleStateCreateInfo multisampleState = {};
+	multisampleState.minSampleShading = 1.0f;
+	multisampleState.rasterizationSamples = samples;
+	multisampleState.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+
+	VkPipelineDepthStencilStateCreateInfo depthStencilState = {};
+	depthStencilState.depthTestEnable = VK_FALSE;
+	depthStencilState.depthWriteEnable = VK_FALSE;
+	depthStencilState.depthCompareOp = VK_COMPARE_OP_ALWAYS;
+	depthStencilState.back.compareOp = VK_COMPARE_OP_ALWAYS;
+	depthStencilState.front = depthStencilState.back;
+	depthStencilState.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+
+	VkPipelineColorBlendAttachmentState colorBlendAttachment = {};
+	colorBlendAttachment.blendEnable = VK_TRUE;
+	colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+	colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+	colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+	colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+	colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+	colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+	colorBlendAttachment.colorWriteMask = 0xF;
+
+	VkPipelineColorBlendStateCreateInfo colorBlendState = {};
+	colorBlendState.attachmentCount = 1;
+	colorBlendState.pAttachments = &colorBlendAttachment;
+	colorBlendState.logicOp = VK_LOGIC_OP_COPY;
+	colorBlendState.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+
+	VkGraphicsPipelineCreateInfo pipelineInfo = {};
+	pipelineInfo.basePipelineIndex = -1;
+	pipelineInfo.subpass = subpass;
+	pipelineInfo.renderPass = renderPass;
+	pipelineInfo.layout = pipelineLayout;
+	pipelineInfo.pColorBlendState = &colorBlendState;
+	pipelineInfo.pInputAssemblyState = &inputAssembly;
+	pipelineInfo.pMultisampleState = &multisampleState;
+	pipelineInfo.pRasterizationState = &rasterizationState;
+	pipelineInfo.pVertexInputState = &vertexInput;
+	pipelineInfo.pViewportState = &viewportState;
+	pipelineInfo.pDynamicState = &dynamicState;
+	pipelineInfo.pDepthStencilState = &depthStencilState;
+	pipelineInfo.stageCount = 2;
+	pipelineInfo.pStages = stages;
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+
+	res = vkCreateGraphicsPipelines(device, 0, 1, &pipelineInfo, nullptr, &pipeline);
+	assert(res == VK_SUCCESS);
+}
+
+void SpriteBatch::upload(VkCommandBuffer cmdBuffer, DeletionQueue& deletions)
+{
+	if (indicesUploaded) {
+		return;
+	}
+
+	VkDeviceSize size = VkDeviceSize(maxSprites) * 6 * sizeof(uint32_t);
+	VkBuffer stagingBuffer;
+	VkDeviceMemory stagingMemory;
+	vk::createBuffer(physicalDevice, device, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 VK_BUFFER_USAGE_TRANSFER_SRC_BIT, size, stagingBuffer, stagingMemory);
+
+	void* data;
+	VkResult res = vkMapMemory(device, stagingMemory, 0, VK_WHOLE_SIZE, 0, &data);
+	assert(res == VK_SUCCESS);
+
+	// Two triangles per quad: 0 1 2, 2 1 3
+	uint32_t* indices = static_cast<uint32_t*>(data);
+	for (uint32_t i = 0; i < maxSprites; i++) {
+		uint32_t first = i * 4;
+		indices[0] = first;
+		indices[1] = first + 1;
+		indices[2] = first + 2;
+		indices[3] = first + 2;
+		indices[4] = first + 1;
+		indices[5] = first + 3;
+		indices += 6;
+	}
+	vkUnmapMemory(device, stagingMemory);
+
+	VkBufferCopy copy = {};
+	copy.size = size;
+	vkCmdCopyBuffer(cmdBuffer, stagingBuffer, indexBuffer, 1, &copy);
+	vk::bufferBarrier(cmdBuffer, indexBuffer, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_INDEX_READ_BIT,
+					  VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT);
+
+	deletions.destroy(stagingBuffer);
+	deletions.free(stagingMemory);
+	indicesUploaded = true;
+}
+
+void SpriteBatch::add(const Sprite& sprite)
+{
+	if (sprites.size() >= maxSprites) {
+		dropped++;
+		return;
+	}
+	sprites.push_back(sprite);
+}
+
+void SpriteBatch::add(const Sprite* added, uint32_t count)
+{
+	uint32_t room = maxSprites - uint32_t(sprites.size());
+	if (count > room) {
+		dropped += count - room;
+		count = room;
+	}
+	sprites.insert(sprites.end(), added, added + count);
+}
+
+void SpriteBatch::prepare(uint32_t frame)
+{
+	preparedCount = uint32_t(sprites.size());
+	if (preparedCount == 0) {
+		return;
+	}
+
+	sort();
+
+	SpriteVertex* vertices = reinterpret_cast<SpriteVertex*>(vertexData + frame * frameSize);
+	auto generate = [this, vertices](uint32_t begin, uint32_t end) {
+		if (simd) {
+			// The rotations of 4 sprites at once
+			for (uint32_t i = begin; i < end; i += 4) {
+				uint32_t n = end - i < 4 ? end - i : 4;
+				float angles[4] = {};
+				for (uint32_t k = 0; k < n; k++) {
+					angles[k] = sprites[i + k].rotation;
+				}
+				float c[4], s[4];
+				__m128 sine, cosine;
+				sinCos(_mm_loadu_ps(angles), sine, cosine);
+				_mm_storeu_ps(c, cosine);
+				_mm_storeu_ps(s, sine);
+
+				for (uint32_t k = 0; k < n; k++) {
+					const Sprite& sprite = sprites[i + k];
+					writeQuadSSE(sprite, atlas->getRegion(sprite.texture), c[k], s[k], vertices + (i + k) * 4);
+				}
+			}
+			// The streaming stores must be visible before the submission
+			_mm_sfence();
+		}
+		else {
+			for (uint32_t i = begin; i < end; i++) {
+				const Sprite& sprite = sprites[i];
+				writeQuad(sprite, atlas->getRegion(sprite.texture), vertices + i * 4);
+			}
+		}
+	};
+
+	if (jobs && preparedCount > SPRITE_GRAIN) {
+		jobs->parallelFor(preparedCount, SPRITE_GRAIN, generate);
+	}
+	else {
+		generate(0, preparedCount);
+	}
+
+	sprites.clear();
+}
+
+void SpriteBatch::record(VkCommandBuffer cmdBuffer, uint32_t frame, VkExtent2D extent, VkDescriptorSet descriptorSet, uint32_t uniformOffset)
+{
+	if (preparedCount == 0) {
+		return;
+	}
+
+	VkViewport viewport = { 0.0f, 0.0f, float(extent.width), float(extent.height), 0.0f, 1.0f };
+	VkRect2D scissor = { { 0, 0 }, extent };
+	SpritePushConstants constants = { { 2.0f / extent.width, 2.0f / extent.height }, { -1.0f, -1.0f } };
+
+	vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+	vkCmdSetViewport(cmdBuffer, 0, 1, &viewport);
+	vkCmdSetScissor(cmdBuffer, 0, 1, &scissor);
+	vkCmdPushConstants(cmdBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(constants), &constants);
+	vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSet, 1, &uniformOffset);
+
+	VkDeviceSize offset = frame * frameSize;
+	vkCmdBindVertexBuffers(cmdBuffer, 0, 1, &vertexBuffer, &offset);
+	vkCmdBindIndexBuffer(cmdBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+	vkCmdDrawIndexed(cmdBuffer, preparedCount * 6, 1, 0, 0, 0);
+}
+
+void SpriteBatch::sort()
+{
+	// Order in the high bits, page in the low ones
+	uint32_t count = uint32_t(sprites.size());
+	entries.resize(count);
+	scratch.resize(count);
+
+	bool ordered = true;
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t key = (uint32_t(sprites[i].order) << 16) | atlas->getRegion(sprites[i].texture).layer;
+		ordered = ordered && (i == 0 || entries[i - 1].key <= key);
+		entries[i].key = key;
+		entries[i].index = i;
+	}
+	if (ordered) {
+		return;
+	}
+
+	// Stable: sprites of the same order and page keep the order they were added in
+	const SortEntry* result = radixSort(entries.data(), scratch.data(), count, sizeof(uint32_t));
+	sortedSprites.resize(count);
+	for (uint32_t i = 0; i < count; i++) {
+		sortedSprites[i] = sprites[result[i].index];
+	}
+	sprites.swap(sortedSprites);
+}
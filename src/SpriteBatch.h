@@ -0,0 +1,95 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <stdint.h>
+#include <vector>
+#include "RadixSort.h"
+
+class DeviceCapabilities;
+class DeletionQueue;
+class TextureAtlas;
+class JobSystem;
+
+// Screen space quad, textured with an atlas region
+struct Sprite {
+	float position[2];	// Center, in pixels from the top left corner
+	float size[2];
+	float rotation;		// Radians
+	uint32_t color;		// RGBA8, multiplied with the texture
+	uint32_t texture;	// Atlas region
+	uint16_t order;		// Lower first, sprites of the same order keep the order they were added in
+};
+
+struct SpriteVertex {
+	float position[2];
+	float uv[2];
+	uint32_t color;
+	float layer;
+};
+
+// Sprites of a frame turned into quads in a persistently mapped buffer, one part per frame in flight.
+// They are sorted by order then atlas page, the page being a vertex attribute the whole frame is one draw.
+// The vertices are generated on the job threads, with SSE unless disabled.
+class SpriteBatch
+{
+private:
+	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+	VkDevice device = VK_NULL_HANDLE;
+	const TextureAtlas* atlas = nullptr;
+	JobSystem* jobs = nullptr;
+	uint32_t maxSprites = 0;
+	bool simd = true;
+
+	// Stay mapped, written every frame straight from the job threads
+	VkBuffer vertexBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory vertexMemory = VK_NULL_HANDLE;
+	uint8_t* vertexData = nullptr;
+	VkDeviceSize frameSize = 0;
+
+	// Same for every frame, uploaded once
+	VkBuffer indexBuffer = VK_NULL_HANDLE;
+	VkDeviceMemory indexMemory = VK_NULL_HANDLE;
+	bool indicesUploaded = false;
+
+	VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+	VkPipeline pipeline = VK_NULL_HANDLE;
+
+	// Added since the last prepare()
+	std::vector<Sprite> sprites;
+	// Sort buffers: the keys are sorted, the sprites gathered once in their order, the vertices then written reading them in order
+	std::vector<SortEntry> entries;
+	std::vector<SortEntry> scratch;
+	std::vector<Sprite> sortedSprites;
+	uint32_t preparedCount = 0;
+	uint32_t dropped = 0;
+
+public:
+	void init(const DeviceCapabilities& capabilities, VkDevice device, const TextureAtlas* atlas, JobSystem* jobs,
+			  uint32_t frameCount, uint32_t maxSprites);
+	void destroy();
+
+	// Premultiplied alpha blending, no depth test: drawn over whatever the subpass drew before.
+	// The set layout is the one of the scene, binding 1 being the atlas.
+	void createPipeline(VkRenderPass renderPass, uint32_t subpass, VkSampleCountFlagBits samples,
+						VkDescriptorSetLayout setLayout, const VkPipelineShaderStageCreateInfo* stages);
+
+	// Records the index buffer upload the first time, the staging buffer goes to the deletion queue
+	void upload(VkCommandBuffer cmdBuffer, DeletionQueue& deletions);
+
+	// From the render thread, for the next prepared frame. Over maxSprites, the last ones are dropped.
+	void add(const Sprite& sprite);
+	void add(const Sprite* added, uint32_t count);
+
+	// Sorts the sprites and writes their vertices in the part of 'frame', which must not be in use anymore
+	void prepare(uint32_t frame);
+
+	// One draw for every prepared sprite. The descriptor set is the one of the scene.
+	void record(VkCommandBuffer cmdBuffer, uint32_t frame, VkExtent2D extent, VkDescriptorSet descriptorSet, uint32_t uniformOffset);
+
+	void setSimd(bool enabled) { simd = enabled; }
+	uint32_t getPreparedCount() const { return preparedCount; }
+	uint32_t getDroppedCount() const { return dropped; }
+
+private:
+	void sort();
+};
@@ -0,0 +1,148 @@
+#include "StreamSink.h"
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#define popen _popen
+#define pclose _pclose
+#else
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#endif
+
+// FILE
+
+bool FileSink::open()
+{
+	file = fopen(path.c_str(), "wb");
+	return file != nullptr;
+}
+
+bool FileSink::write(const uint8_t* data, size_t size)
+{
+	return fwrite(data, 1, size, file) == size;
+}
+
+void FileSink::close()
+{
+	if (file) {
+		fclose(file);
+		file = nullptr;
+	}
+}
+
+// NAMED PIPE
+
+#ifdef _WIN32
+
+bool PipeSink::open()
+{
+	HANDLE handle = CreateNamedPipeA(path.c_str(), PIPE_ACCESS_OUTBOUND, PIPE_TYPE_BYTE | PIPE_WAIT, 1, 1 << 20, 0, 0, nullptr);
+	if (handle == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	if (!ConnectNamedPipe(handle, nullptr) && GetLastError() != ERROR_PIPE_CONNECTED) {
+		CloseHandle(handle);
+		return false;
+	}
+	pipe = handle;
+	return true;
+}
+
+bool PipeSink::write(const uint8_t* data, size_t size)
+{
+	while (size > 0) {
+		DWORD written;
+		if (!WriteFile(pipe, data, DWORD(size), &written, nullptr)) {
+			return false;
+		}
+		data += written;
+		size -= written;
+	}
+	return true;
+}
+
+void PipeSink::close()
+{
+	if (pipe) {
+		FlushFileBuffers(pipe);
+		DisconnectNamedPipe(pipe);
+		CloseHandle(pipe);
+		pipe = nullptr;
+	}
+}
+
+#else
+
+bool PipeSink::open()
+{
+	if (mkfifo(path.c_str(), 0644) != 0 && errno != EEXIST) {
+		return false;
+	}
+	// A reader closing the pipe must fail the write, not kill the process
+	signal(SIGPIPE, SIG_IGN);
+	pipe = ::open(path.c_str(), O_WRONLY);
+	return pipe >= 0;
+}
+
+bool PipeSink::write(const uint8_t* data, size_t size)
+{
+	while (size > 0) {
+		ssize_t written = ::write(pipe, data, size);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		data += written;
+		size -= written;
+	}
+	return true;
+}
+
+void PipeSink::close()
+{
+	if (pipe >= 0) {
+		::close(pipe);
+		pipe = -1;
+	}
+}
+
+#endif
+
+// CHILD PROCESS
+
+bool ProcessSink::open()
+{
+#ifdef _WIN32
+	process = popen(command.c_str(), "wb");
+#else
+	signal(SIGPIPE, SIG_IGN);
+	process = popen(command.c_str(), "w");
+#endif
+	return process != nullptr;
+}
+
+bool ProcessSink::write(const uint8_t* data, size_t size)
+{
+	return fwrite(data, 1, size, process) == size;
+}
+
+void ProcessSink::close()
+{
+	if (process) {
+		pclose(process);
+		process = nullptr;
+	}
+}
+
+ProcessSink* ProcessSink::ffmpeg(const std::string& output)
+{
+	std::string format = output.compare(0, 7, "rtmp://") == 0 ? " -f flv" : "";
+	return new ProcessSink("ffmpeg -y -loglevel error -f yuv4mpegpipe -i - -c:v libx264 -preset veryfast -tune zerolatency -pix_fmt yuv420p"
+						   + format + " \"" + output + "\"");
+}
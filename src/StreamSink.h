@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+
+// Where a video stream goes. Opened and written from the stream writer thread only.
+class StreamSink
+{
+public:
+	virtual ~StreamSink() {}
+
+	// May block, until a reader connects to a pipe for instance
+	virtual bool open() = 0;
+	virtual bool write(const uint8_t* data, size_t size) = 0;
+	virtual void close() = 0;
+};
+
+// Plain file
+class FileSink : public StreamSink
+{
+private:
+	std::string path;
+	FILE* file = nullptr;
+
+public:
+	explicit FileSink(const std::string& path) : path(path) {}
+	~FileSink() { close(); }
+
+	bool open() override;
+	bool write(const uint8_t* data, size_t size) override;
+	void close() override;
+};
+
+// Named pipe created by the sink: \\.\pipe\name on Windows, a FIFO elsewhere.
+// open() waits for a reader (ffplay, OBS...) to connect.
+class PipeSink : public StreamSink
+{
+private:
+	std::string path;
+#ifdef _WIN32
+	void* pipe = nullptr;
+#else
+	int pipe = -1;
+#endif
+
+public:
+	explicit PipeSink(const std::string& path) : path(path) {}
+	~PipeSink() { close(); }
+
+	bool open() override;
+	bool write(const uint8_t* data, size_t size) override;
+	void close() override;
+};
+
+// Standard input of a child process
+class ProcessSink : public StreamSink
+{
+private:
+	std::string command;
+	FILE* process = nullptr;
+
+public:
+	explicit ProcessSink(const std::string& command) : command(command) {}
+	~ProcessSink() { close(); }
+
+	bool open() override;
+	bool write(const uint8_t* data, size_t size) override;
+	void close() override;
+
+	// ffmpeg encoding the Y4M stream to H.264: a file, or an RTMP server for a live stream
+	static ProcessSink* ffmpeg(const std::string& output);
+};
@@ -0,0 +1,408 @@
+#include "TextureAtlas.h"
+#include "DeviceCapabilities.h"
+#include "DeletionQueue.h"
+#include <assert.h>
+#include <string.h>
+#include "helpers\Helpers.h"
+
+#define STAGING_CHUNK_SIZE (16 * 1024 * 1024)
+
+void TextureAtlas::init(const DeviceCapabilities& capabilities, VkDevice device, VkFormat format, uint32_t pageSize, uint32_t padding)
+{
+	this->physicalDevice = capabilities.physicalDevice;
+	this->device = device;
+	this->format = format;
+	this->padding = padding;
+
+	uint32_t maxSize = capabilities.limits().maxImageDimension2D;
+	this->pageSize = pageSize < maxSize ? pageSize : maxSize;
+	maxPages = capabilities.limits().maxImageArrayLayers;
+}
+
+void TextureAtlas::destroy()
+{
+	vkDestroyImageView(device, view, nullptr);
+	vkDestroyImage(device, image, nullptr);
+	vkFreeMemory(device, memory, nullptr);
+	view = VK_NULL_HANDLE;
+	image = VK_NULL_HANDLE;
+	memory = VK_NULL_HANDLE;
+	layerCount = 0;
+
+	for (const StagingChunk& chunk : staging) {
+		vkUnmapMemory(device, chunk.memory);
+		vkDestroyBuffer(device, chunk.buffer, nullptr);
+		vkFreeMemory(device, chunk.memory, nullptr);
+	}
+	staging.clear();
+	pages.clear();
+	regions.clear();
+	pending.clear();
+}
+
+AtlasWrite TextureAtlas::allocate(uint32_t width, uint32_t height)
+{
+	uint32_t paddedWidth = width + 2 * padding;
+	uint32_t paddedHeight = height + 2 * padding;
+	assert(paddedWidth <= pageSize && paddedHeight <= pageSize);
+
+	// First page where it fits, a new one otherwise
+	uint32_t x = 0;
+	uint32_t y = 0;
+	uint32_t layer = 0;
+	for (; layer < pages.size(); layer++) {
+		if (pack(pages[layer], paddedWidth, paddedHeight, x, y)) {
+			break;
+		}
+	}
+	if (layer == pages.size()) {
+		assert(pages.size() < maxPages);
+		Page page;
+		page.skyline.push_back({ 0, 0, pageSize });
+		pages.push_back(page);
+		bool packed = pack(pages.back(), paddedWidth, paddedHeight, x, y);
+		assert(packed);
+	}
+
+	AtlasRegion region;
+	region.layer = layer;
+	region.x = x + padding;
+	region.y = y + padding;
+	region.width = width;
+	region.height = height;
+	region.uvOffset[0] = float(region.x) / float(pageSize);
+	region.uvOffset[1] = float(region.y) / float(pageSize);
+	region.uvScale[0] = float(width) / float(pageSize);
+	region.uvScale[1] = float(height) / float(pageSize);
+	regions.push_back(region);
+
+	PendingTexture texture;
+	texture.region = uint32_t(regions.size() - 1);
+	texture.chunk = reserveStaging(VkDeviceSize(paddedWidth) * paddedHeight * 4, texture.offset);
+	pending.push_back(texture);
+
+	// The padding is filled by the upload
+	AtlasWrite write;
+	write.region = texture.region;
+	write.pitch = paddedWidth * 4;
+	write.pixels = staging[texture.chunk].mapped + texture.offset + size_t(padding) * write.pitch + padding * 4;
+	return write;
+}
+
+uint32_t TextureAtlas::add(const uint8_t* rgba, uint32_t width, uint32_t height)
+{
+	AtlasWrite write = allocate(width, height);
+	for (uint32_t row = 0; row < height; row++) {
+		memcpy(write.pixels + size_t(row) * write.pitch, rgba + size_t(row) * width * 4, size_t(width) * 4);
+	}
+	return write.region;
+}
+
+bool TextureAtlas::upload(VkCommandBuffer cmdBuffer, DeletionQueue& deletions)
+{
+	VkImage previousImage = image;
+	uint32_t previousLayers = layerCount;
+	bool recreated = false;
+
+	// New pages: a bigger image, the previous layers are copied on the GPU
+	if (pages.size() > layerCount) {
+		VkImageView previousView = view;
+		VkDeviceMemory previousMemory = memory;
+		createImage(uint32_t(pages.size()));
+		recreated = true;
+
+		vk::transitionLayers(cmdBuffer, image, VK_IMAGE_ASPECT_COLOR_BIT, 0, layerCount, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+						     0, VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+		if (previousImage != VK_NULL_HANDLE) {
+			vk::transitionLayers(cmdBuffer, previousImage, VK_IMAGE_ASPECT_COLOR_BIT, 0, previousLayers,
+							     VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+							     VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+							     VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+			VkImageCopy copy = {};
+			copy.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+			copy.srcSubresource.layerCount = previousLayers;
+			copy.dstSubresource = copy.srcSubresource;
+			copy.extent = { pageSize, pageSize, 1 };
+			vkCmdCopyImage(cmdBuffer, previousImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+						   image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy);
+
+			deletions.destroy(previousView);
+			deletions.destroy(previousImage);
+			deletions.free(previousMemory);
+		}
+	}
+	else if (!pending.empty()) {
+		vk::transitionLayers(cmdBuffer, image, VK_IMAGE_ASPECT_COLOR_BIT, 0, layerCount, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+						     VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+						     VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT);
+	}
+	else {
+		return false;
+	}
+
+	// One copy region per texture, one command per staging chunk
+	std::vector<std::vector<VkBufferImageCopy>> copies(staging.size());
+	for (const PendingTexture& texture : pending) {
+		pad(texture);
+
+		const AtlasRegion& region = regions[texture.region];
+		VkBufferImageCopy copy = {};
+		copy.bufferOffset = texture.offset;
+		copy.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		copy.imageSubresource.baseArrayLayer = region.layer;
+		copy.imageSubresource.layerCount = 1;
+		copy.imageOffset = { int32_t(region.x - padding), int32_t(region.y - padding), 0 };
+		copy.imageExtent = { region.width + 2 * padding, region.height + 2 * padding, 1 };
+		copies[texture.chunk].push_back(copy);
+	}
+
+	for (size_t i = 0; i < staging.size(); i++) {
+		const StagingChunk& chunk = staging[i];
+		if (!stagingCoherent) {
+			VkMappedMemoryRange range = {};
+			range.memory = chunk.memory;
+			range.size = VK_WHOLE_SIZE;
+			range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+			vkFlushMappedMemoryRanges(device, 1, &range);
+		}
+		vkUnmapMemory(device, chunk.memory);
+
+		if (!copies[i].empty()) {
+			vkCmdCopyBufferToImage(cmdBuffer, chunk.buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+								   uint32_t(copies[i].size()), copies[i].data());
+		}
+		deletions.destroy(chunk.buffer);
+		deletions.free(chunk.memory);
+	}
+	staging.clear();
+	pending.clear();
+
+	vk::transitionLayers(cmdBuffer, image, VK_IMAGE_ASPECT_COLOR_BIT, 0, layerCount, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+					     VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
+					     VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+	return recreated;
+}
+
+float TextureAtlas::getOccupancy() const
+{
+	if (pages.empty()) {
+		return 0.0f;
+	}
+
+	uint64_t used = 0;
+	for (const Page& page : pages) {
+		used += page.usedTexels;
+	}
+	return float(double(used) / (double(pageSize) * pageSize * pages.size()));
+}
+
+uint32_t TextureAtlas::fit(const Page& page, size_t index, uint32_t width, uint32_t height) const
+{
+	uint32_t x = page.skyline[index].x;
+	if (x + width > pageSize) {
+		return UINT32_MAX;
+	}
+
+	// Rests on the highest node below it
+	uint32_t y = 0;
+	uint32_t left = width;
+	for (size_t i = index; left > 0; i++) {
+		const SkylineNode& node = page.skyline[i];
+		y = node.y > y ? node.y : y;
+		if (y + height > pageSize) {
+			return UINT32_MAX;
+		}
+		left -= node.width < left ? node.width : left;
+	}
+	return y;
+}
+
+bool TextureAtlas::pack(Page& page, uint32_t width, uint32_t height, uint32_t& x, uint32_t& y)
+{
+	// Lowest top first, then the narrowest node: keeps the skyline flat
+	size_t best = SIZE_MAX;
+	uint32_t bestTop = UINT32_MAX;
+	uint32_t bestWidth = UINT32_MAX;
+	for (size_t i = 0; i < page.skyline.size(); i++) {
+		uint32_t top = fit(page, i, width, height);
+		if (top == UINT32_MAX) {
+			continue;
+		}
+		top += height;
+		if (top < bestTop || (top == bestTop && page.skyline[i].width < bestWidth)) {
+			best = i;
+			bestTop = top;
+			bestWidth = page.skyline[i].width;
+		}
+	}
+	if (best == SIZE_MAX) {
+		return false;
+	}
+
+	x = page.skyline[best].x;
+	y = bestTop - height;
+	std::vector<SkylineNode>& skyline = page.skyline;
+	skyline.insert(skyline.begin() + best, { x, bestTop, width });
+
+	// The nodes now under the rectangle are shortened or removed
+	for (size_t i = best + 1; i < skyline.size();) {
+		uint32_t end = skyline[i - 1].x + skyline[i - 1].width;
+		if (skyline[i].x >= end) {
+			break;
+		}
+		uint32_t overlap = end - skyline[i].x;
+		if (skyline[i].width <= overlap) {
+			skyline.erase(skyline.begin() + i);
+			continue;
+		}
+		skyline[i].x += overlap;
+		skyline[i].width -= overlap;
+		break;
+	}
+
+	// Neighbours at the same height become one node
+	for (size_t i = 0; i + 1 < skyline.size();) {
+		if (skyline[i].y == skyline[i + 1].y) {
+			skyline[i].width += skyline[i + 1].width;
+			skyline.erase(skyline.begin() + i + 1);
+		}
+		else {
+			i++;
+		}
+	}
+
+	page.usedTexels += uint64_t(width) * height;
+	return true;
+}
+
+void TextureAtlas::createImage(uint32_t layers)
+{
+	VkImageCreateInfo imageInfo = {};
+	imageInfo.arrayLayers = layers;
+	imageInfo.extent = { pageSize, pageSize, 1 };
+	imageInfo.imageType = VK_IMAGE_TYPE_2D;
+	imageInfo.format = format;
+	imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	imageInfo.mipLevels = 1;
+	imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+	imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+	imageInfo.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+	imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+
+	VkResult res = vkCreateImage(device, &imageInfo, nullptr, &image);
+	assert(res == VK_SUCCESS);
+
+	VkMemoryRequirements memoryRequirements;
+	vkGetImageMemoryRequirements(device, image, &memoryRequirements);
+
+	VkMemoryAllocateInfo memoryAllocInfo = {};
+	memoryAllocInfo.allocationSize = memoryRequirements.size;
+	memoryAllocInfo.memoryTypeIndex = vk::getMemoryType(physicalDevice, memoryRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	memoryAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	res = vkAllocateMemory(device, &memoryAllocInfo, nullptr, &memory);
+	assert(res == VK_SUCCESS);
+
+	res = vkBindImageMemory(device, image, memory, 0);
+	assert(res == VK_SUCCESS);
+
+	// Every page through one view
+	VkImageViewCreateInfo viewInfo = {};
+	viewInfo.format = format;
+	viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	viewInfo.subresourceRange.levelCount = 1;
+	viewInfo.subresourceRange.layerCount = layers;
+	viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+	viewInfo.image = image;
+	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+
+	res = vkCreateImageView(device, &viewInfo, nullptr, &view);
+	assert(res == VK_SUCCESS);
+
+	layerCount = layers;
+}
+
+uint32_t TextureAtlas::reserveStaging(VkDeviceSize size, VkDeviceSize& offset)
+{
+	// Texel aligned, and 16 bytes for the SIMD writers
+	if (!staging.empty()) {
+		StagingChunk& chunk = staging.back();
+		VkDeviceSize aligned = (chunk.used + 15) & ~VkDeviceSize(15);
+		if (aligned + size <= chunk.size) {
+			offset = aligned;
+			chunk.used = aligned + size;
+			return uint32_t(staging.size() - 1);
+		}
+	}
+
+	StagingChunk chunk;
+	chunk.size = size > STAGING_CHUNK_SIZE ? size : STAGING_CHUNK_SIZE;
+	chunk.used = size;
+
+	VkBufferCreateInfo bufferInfo = {};
+	bufferInfo.size = chunk.size;
+	bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	VkResult res = vkCreateBuffer(device, &bufferInfo, nullptr, &chunk.buffer);
+	assert(res == VK_SUCCESS);
+
+	VkMemoryRequirements memoryRequirements;
+	vkGetBufferMemoryRequirements(device, chunk.buffer, &memoryRequirements);
+
+	// The converters read what they wrote (premultiplication, padding): write-combined memory would be very slow
+	uint32_t memoryType = vk::getMemoryType(physicalDevice, memoryRequirements.memoryTypeBits,
+											VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+	stagingCoherent = false;
+	if (memoryType == uint32_t(-1)) {
+		memoryType = vk::getMemoryType(physicalDevice, memoryRequirements.memoryTypeBits,
+									   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+		stagingCoherent = true;
+	}
+
+	VkMemoryAllocateInfo memoryAllocInfo = {};
+	memoryAllocInfo.allocationSize = memoryRequirements.size;
+	memoryAllocInfo.memoryTypeIndex = memoryType;
+	memoryAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	res = vkAllocateMemory(device, &memoryAllocInfo, nullptr, &chunk.memory);
+	assert(res == VK_SUCCESS);
+	res = vkBindBufferMemory(device, chunk.buffer, chunk.memory, 0);
+	assert(res == VK_SUCCESS);
+
+	void* data;
+	res = vkMapMemory(device, chunk.memory, 0, VK_WHOLE_SIZE, 0, &data);
+	assert(res == VK_SUCCESS);
+	chunk.mapped = static_cast<uint8_t*>(data);
+
+	offset = 0;
+	staging.push_back(chunk);
+	return uint32_t(staging.size() - 1);
+}
+
+void TextureAtlas::pad(const PendingTexture& texture)
+{
+	if (padding == 0) {
+		return;
+	}
+
+	const AtlasRegion& region = regions[texture.region];
+	uint32_t pitch = (region.width + 2 * padding) * 4;
+	uint8_t* rect = staging[texture.chunk].mapped + texture.offset;
+
+	// Left and right of every row, then the first and last rows repeated above and below
+	for (uint32_t row = padding; row < padding + region.height; row++) {
+		uint8_t* line = rect + size_t(row) * pitch;
+		uint8_t* first = line + padding * 4;
+		uint8_t* last = line + (padding + region.width - 1) * 4;
+		for (uint32_t i = 0; i < padding; i++) {
+			memcpy(line + i * 4, first, 4);
+			memcpy(last + (i + 1) * 4, last, 4);
+		}
+	}
+	for (uint32_t i = 0; i < padding; i++) {
+		memcpy(rect + size_t(i) * pitch, rect + size_t(padding) * pitch, pitch);
+		memcpy(rect + size_t(padding + region.height + i) * pitch, rect + size_t(padding + region.height - 1) * pitch, pitch);
+	}
+}
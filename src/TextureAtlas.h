@@ -0,0 +1,114 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <stdint.h>
+#include <vector>
+
+class DeviceCapabilities;
+class DeletionQueue;
+
+// Where a texture ended up: uv' = uv * uvScale + uvOffset, in layer 'layer'
+struct AtlasRegion {
+	uint32_t layer;
+	float uvOffset[2];
+	float uvScale[2];
+	uint32_t x, y;		// Texels, padding excluded
+	uint32_t width, height;
+};
+
+// Where to write the pixels of an allocated region: RGBA rows 'pitch' bytes apart, in the staging memory
+struct AtlasWrite {
+	uint32_t region;
+	uint8_t* pixels;
+	uint32_t pitch;
+};
+
+// Many small RGBA textures in one 2D array image: each layer is a page packed with a skyline
+// (bottom-left), so thousands of textures need one image, one view and one descriptor.
+// Each texture is surrounded by copies of its edges, bilinear filtering never reads its neighbours.
+// Regions only work for UVs within [0, 1]: sample the atlas with VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE.
+class TextureAtlas
+{
+private:
+	// Top of the used space, from x to x + width
+	struct SkylineNode {
+		uint32_t x, y, width;
+	};
+
+	struct Page {
+		std::vector<SkylineNode> skyline;	// Sorted by x, covers the whole page
+		uint64_t usedTexels = 0;
+	};
+
+	// Mapped host memory the textures are written to, cached so that the padding can be read back
+	struct StagingChunk {
+		VkBuffer buffer;
+		VkDeviceMemory memory;
+		uint8_t* mapped;
+		VkDeviceSize size;
+		VkDeviceSize used;
+	};
+
+	// Allocated since the last upload
+	struct PendingTexture {
+		uint32_t region;
+		uint32_t chunk;
+		VkDeviceSize offset;	// Of the padded rectangle
+	};
+
+	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+	VkDevice device = VK_NULL_HANDLE;
+	uint32_t pageSize = 0;
+	uint32_t padding = 0;
+	uint32_t maxPages = 0;
+	VkFormat format = VK_FORMAT_R8G8B8A8_UNORM;
+	bool stagingCoherent = true;
+
+	std::vector<Page> pages;
+	std::vector<AtlasRegion> regions;
+	std::vector<PendingTexture> pending;
+	std::vector<StagingChunk> staging;
+
+	VkImage image = VK_NULL_HANDLE;
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkImageView view = VK_NULL_HANDLE;
+	uint32_t layerCount = 0;	// Layers of the image, pages may have been added since
+
+public:
+	// The page size is clamped to the device limits. An sRGB format is decoded to linear by the samplers.
+	void init(const DeviceCapabilities& capabilities, VkDevice device, VkFormat format = VK_FORMAT_R8G8B8A8_UNORM,
+			  uint32_t pageSize = 2048, uint32_t padding = 2);
+	void destroy();
+
+	// Packs a region and returns where its pixels go. From one thread at a time, but the pixels
+	// can be written from any thread until the next upload, which fills the padding.
+	AtlasWrite allocate(uint32_t width, uint32_t height);
+
+	// Pixels are copied, the texture is on the GPU after the next upload. Returns the region index.
+	uint32_t add(const uint8_t* rgba, uint32_t width, uint32_t height);
+
+	VkFormat getFormat() const { return format; }
+
+	// Records the copies of the textures added since the last upload. The staging buffers, and the previous
+	// image when pages were added, go to the deletion queue: close it after submitting.
+	// Returns true when the image was recreated, the descriptors using the view must then be written again.
+	bool upload(VkCommandBuffer cmdBuffer, DeletionQueue& deletions);
+
+	const AtlasRegion& getRegion(uint32_t region) const { return regions[region]; }
+	uint32_t getRegionCount() const { return uint32_t(regions.size()); }
+	uint32_t getPageCount() const { return uint32_t(pages.size()); }
+	VkImageView getView() const { return view; }
+
+	// Share of the pages covered by textures, padding included
+	float getOccupancy() const;
+
+private:
+	// Top of a width x height rectangle put at the left of node 'index', UINT32_MAX when it does not fit
+	uint32_t fit(const Page& page, size_t index, uint32_t width, uint32_t height) const;
+	bool pack(Page& page, uint32_t width, uint32_t height, uint32_t& x, uint32_t& y);
+	void createImage(uint32_t layers);
+	// Room for 'size' bytes in the current chunk, or a new one
+	uint32_t reserveStaging(VkDeviceSize size, VkDeviceSize& offset);
+	// Edges of the texture copied into its padding
+	void pad(const PendingTexture& texture);
+};
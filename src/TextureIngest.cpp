@@ -0,0 +1,185 @@
+#include "TextureIngest.h"
+#include <emmintrin.h>
+#include <math.h>
+#include <string.h>
+
+namespace {
+
+	// sRGB to 12 bits linear, and back
+	struct SrgbTables {
+		uint16_t toLinear[256];
+		uint8_t toSrgb[4096];
+
+		SrgbTables()
+		{
+			for (int i = 0; i < 256; i++) {
+				double c = i / 255.0;
+				double linear = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+				toLinear[i] = uint16_t(linear * 4095.0 + 0.5);
+			}
+			for (int i = 0; i < 4096; i++) {
+				double linear = i / 4095.0;
+				double c = linear <= 0.0031308 ? linear * 12.92 : 1.055 * pow(linear, 1.0 / 2.4) - 0.055;
+				toSrgb[i] = uint8_t(c * 255.0 + 0.5);
+			}
+		}
+	};
+
+	const SrgbTables& getSrgbTables()
+	{
+		static const SrgbTables tables;
+		return tables;
+	}
+
+	inline uint32_t loadPixel(const uint8_t* rgb)
+	{
+		uint32_t pixel;
+		memcpy(&pixel, rgb, 4);
+		return pixel;
+	}
+
+	// x * a / 255 rounded, exact for 16 bits lanes holding x * a
+	inline __m128i divideBy255(__m128i product)
+	{
+		product = _mm_add_epi16(product, _mm_set1_epi16(128));
+		return _mm_srli_epi16(_mm_add_epi16(product, _mm_srli_epi16(product, 8)), 8);
+	}
+
+	// Alpha of 2 pixels in every channel of their 16 bits lanes
+	inline __m128i broadcastAlpha(__m128i pixels)
+	{
+		pixels = _mm_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3));
+		return _mm_shufflehi_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3));
+	}
+}
+
+namespace ingest {
+
+	void expandRGB(const uint8_t* rgb, uint8_t* rgba, uint32_t count)
+	{
+		// 4 pixels per store: each one read as 4 bytes, the fourth replaced by an opaque alpha.
+		// The last pixel would read past the row: it is left to the scalar loop.
+		const __m128i alpha = _mm_set1_epi32(int32_t(0xFF000000));
+		uint32_t i = 0;
+		for (; i + 5 <= count; i += 4) {
+			const uint8_t* src = rgb + i * 3;
+			__m128i pixels = _mm_setr_epi32(int32_t(loadPixel(src)), int32_t(loadPixel(src + 3)),
+											int32_t(loadPixel(src + 6)), int32_t(loadPixel(src + 9)));
+			pixels = _mm_or_si128(_mm_and_si128(pixels, _mm_set1_epi32(0x00FFFFFF)), alpha);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(rgba + i * 4), pixels);
+		}
+		for (; i < count; i++) {
+			rgba[i * 4] = rgb[i * 3];
+			rgba[i * 4 + 1] = rgb[i * 3 + 1];
+			rgba[i * 4 + 2] = rgb[i * 3 + 2];
+			rgba[i * 4 + 3] = 0xFF;
+		}
+	}
+
+	void expandGrey(const uint8_t* grey, uint8_t* rgba, uint32_t count)
+	{
+		const __m128i opaque = _mm_set1_epi8(-1);
+		uint32_t i = 0;
+		for (; i + 16 <= count; i += 16) {
+			__m128i g = _mm_loadu_si128(reinterpret_cast<const __m128i*>(grey + i));
+			__m128i gg = _mm_unpacklo_epi8(g, g);
+			__m128i ga = _mm_unpacklo_epi8(g, opaque);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(rgba + i * 4), _mm_unpacklo_epi16(gg, ga));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(rgba + i * 4 + 16), _mm_unpackhi_epi16(gg, ga));
+			gg = _mm_unpackhi_epi8(g, g);
+			ga = _mm_unpackhi_epi8(g, opaque);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(rgba + i * 4 + 32), _mm_unpacklo_epi16(gg, ga));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(rgba + i * 4 + 48), _mm_unpackhi_epi16(gg, ga));
+		}
+		for (; i < count; i++) {
+			rgba[i * 4] = rgba[i * 4 + 1] = rgba[i * 4 + 2] = grey[i];
+			rgba[i * 4 + 3] = 0xFF;
+		}
+	}
+
+	void premultiply(uint8_t* rgba, uint32_t count, bool srgb)
+	{
+		const SrgbTables* tables = srgb ? &getSrgbTables() : nullptr;
+		const __m128i alphaMask = _mm_set1_epi32(int32_t(0xFF000000));
+		const __m128i zero = _mm_setzero_si128();
+
+		uint32_t i = 0;
+		for (; i + 4 <= count; i += 4) {
+			__m128i* block = reinterpret_cast<__m128i*>(rgba + i * 4);
+			__m128i pixels = _mm_loadu_si128(block);
+
+			// Opaque pixels are left as they are: nothing to do for most of them
+			__m128i alpha = _mm_and_si128(pixels, alphaMask);
+			if (_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, alphaMask)) == 0xFFFF) {
+				continue;
+			}
+
+			if (srgb) {
+				uint8_t* p = rgba + i * 4;
+				for (int k = 0; k < 4; k++, p += 4) {
+					uint32_t a = p[3];
+					for (int c = 0; c < 3; c++) {
+						p[c] = tables->toSrgb[(tables->toLinear[p[c]] * a + 127) / 255];
+					}
+				}
+				continue;
+			}
+
+			// 2 pixels per register in 16 bits lanes, the alpha multiplied by 255 / 255
+			__m128i low = _mm_unpacklo_epi8(pixels, zero);
+			__m128i high = _mm_unpackhi_epi8(pixels, zero);
+			__m128i alphaLow = _mm_or_si128(_mm_and_si128(broadcastAlpha(low), _mm_setr_epi16(-1, -1, -1, 0, -1, -1, -1, 0)),
+											_mm_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255));
+			__m128i alphaHigh = _mm_or_si128(_mm_and_si128(broadcastAlpha(high), _mm_setr_epi16(-1, -1, -1, 0, -1, -1, -1, 0)),
+											 _mm_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255));
+			low = divideBy255(_mm_mullo_epi16(low, alphaLow));
+			high = divideBy255(_mm_mullo_epi16(high, alphaHigh));
+			_mm_storeu_si128(block, _mm_packus_epi16(low, high));
+		}
+
+		for (; i < count; i++) {
+			uint8_t* p = rgba + i * 4;
+			uint32_t a = p[3];
+			for (int c = 0; c < 3; c++) {
+				p[c] = srgb ? tables->toSrgb[(tables->toLinear[p[c]] * a + 127) / 255] : uint8_t((p[c] * a + 127) / 255);
+			}
+		}
+	}
+
+	void convertToRGBA(const uint8_t* src, uint32_t channels, uint32_t width, uint32_t height,
+					   uint8_t* dst, uint32_t pitch, uint32_t flags)
+	{
+		// Without alpha every pixel is opaque: premultiplying changes nothing
+		bool premultiplied = (flags & INGEST_PREMULTIPLY) && (channels == 2 || channels == 4);
+		bool srgb = (flags & INGEST_SRGB) != 0;
+		size_t srcPitch = size_t(width) * channels;
+
+		for (uint32_t y = 0; y < height; y++) {
+			const uint8_t* srcRow = src + y * srcPitch;
+			uint8_t* dstRow = dst + size_t(y) * pitch;
+
+			switch (channels) {
+			case 1:
+				expandGrey(srcRow, dstRow, width);
+				break;
+			case 2:
+				for (uint32_t x = 0; x < width; x++) {
+					dstRow[x * 4] = dstRow[x * 4 + 1] = dstRow[x * 4 + 2] = srcRow[x * 2];
+					dstRow[x * 4 + 3] = srcRow[x * 2 + 1];
+				}
+				break;
+			case 3:
+				expandRGB(srcRow, dstRow, width);
+				break;
+			default:
+				memcpy(dstRow, srcRow, size_t(width) * 4);
+				break;
+			}
+
+			// While the row is still in the cache
+			if (premultiplied) {
+				premultiply(dstRow, width, srgb);
+			}
+		}
+	}
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+enum IngestFlags {
+	INGEST_PREMULTIPLY = 0x1,	// Color multiplied by alpha
+	INGEST_SRGB = 0x2,			// The color is sRGB encoded: premultiplied in linear space
+};
+
+namespace ingest {
+
+	// Decoded 8 bits pixels with 1 (grey), 2 (grey, alpha), 3 (RGB) or 4 (RGBA) channels, rows tightly packed,
+	// to RGBA rows 'pitch' bytes apart: straight into the staging memory, no intermediate copy
+	void convertToRGBA(const uint8_t* src, uint32_t channels, uint32_t width, uint32_t height,
+					   uint8_t* dst, uint32_t pitch, uint32_t flags);
+
+	// Rows of pixels, used by convertToRGBA
+	void expandRGB(const uint8_t* rgb, uint8_t* rgba, uint32_t count);
+	void expandGrey(const uint8_t* grey, uint8_t* rgba, uint32_t count);
+	void premultiply(uint8_t* rgba, uint32_t count, bool srgb);
+}
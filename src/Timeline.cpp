@@ -0,0 +1,287 @@
+#include "Timeline.h"
+#include <assert.h>
+
+void Timeline::init(VkDevice device, VkQueue queue, bool useTimelineSemaphore)
+{
+	this->device = device;
+	this->queue = queue;
+	semaphoreBased = useTimelineSemaphore;
+	submitted = 0;
+	completed = 0;
+
+	if (!semaphoreBased) {
+		return;
+	}
+
+	waitSemaphoresKHR = (PFN_vkWaitSemaphoresKHR)vkGetDeviceProcAddr(device, "vkWaitSemaphoresKHR");
+	signalSemaphoreKHR = (PFN_vkSignalSemaphoreKHR)vkGetDeviceProcAddr(device, "vkSignalSemaphoreKHR");
+	getSemaphoreCounterValueKHR = (PFN_vkGetSemaphoreCounterValueKHR)vkGetDeviceProcAddr(device, "vkGetSemaphoreCounterValueKHR");
+	assert(waitSemaphoresKHR && signalSemaphoreKHR && getSemaphoreCounterValueKHR);
+
+	VkSemaphoreTypeCreateInfoKHR typeInfo = {};
+	typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+	typeInfo.initialValue = 0;
+	typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+
+	VkSemaphoreCreateInfo semaphoreInfo = {};
+	semaphoreInfo.pNext = &typeInfo;
+	semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+	VkResult res = vkCreateSemaphore(device, &semaphoreInfo, nullptr, &semaphore);
+	assert(res == VK_SUCCESS);
+}
+
+void Timeline::destroy()
+{
+	if (semaphore != VK_NULL_HANDLE) {
+		vkDestroySemaphore(device, semaphore, nullptr);
+		semaphore = VK_NULL_HANDLE;
+	}
+
+	// The device is idle: the pending fences are all signaled
+	for (const Pending& entry : pending) {
+		vkDestroyFence(device, entry.fence, nullptr);
+		if (!entry.consumed) {
+			vkDestroySemaphore(device, entry.semaphore, nullptr);
+		}
+		for (VkSemaphore binary : entry.waited) {
+			vkDestroySemaphore(device, binary, nullptr);
+		}
+	}
+	pending.clear();
+	for (VkFence fence : fences) {
+		vkDestroyFence(device, fence, nullptr);
+	}
+	fences.clear();
+	for (VkSemaphore binary : semaphores) {
+		vkDestroySemaphore(device, binary, nullptr);
+	}
+	semaphores.clear();
+}
+
+uint64_t Timeline::getCompleted()
+{
+	if (semaphoreBased) {
+		uint64_t value;
+		getSemaphoreCounterValueKHR(device, semaphore, &value);
+		return value;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	poll();
+	return completed;
+}
+
+bool Timeline::wait(uint64_t value, uint64_t timeout)
+{
+	if (semaphoreBased) {
+		VkSemaphoreWaitInfoKHR waitInfo = {};
+		waitInfo.semaphoreCount = 1;
+		waitInfo.pSemaphores = &semaphore;
+		waitInfo.pValues = &value;
+		waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR;
+		return waitSemaphoresKHR(device, &waitInfo, timeout) == VK_SUCCESS;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+	if (queue == VK_NULL_HANDLE) {
+		if (timeout == UINT64_MAX) {
+			signaled.wait(lock, [this, value]() { return completed >= value; });
+			return true;
+		}
+		return signaled.wait_for(lock, std::chrono::nanoseconds(timeout), [this, value]() { return completed >= value; });
+	}
+
+	poll();
+	if (completed >= value) {
+		return true;
+	}
+
+	// Submissions of a queue are done in order: the first fence reaching the value is enough
+	for (const Pending& entry : pending) {
+		if (entry.value >= value) {
+			VkResult res = vkWaitForFences(device, 1, &entry.fence, VK_TRUE, timeout);
+			poll();
+			return res == VK_SUCCESS;
+		}
+	}
+	assert(!"Waiting for a value never submitted");
+	return false;
+}
+
+void Timeline::signal(uint64_t value)
+{
+	assert(queue == VK_NULL_HANDLE);
+	submitted = value > submitted ? value : submitted;
+
+	if (semaphoreBased) {
+		VkSemaphoreSignalInfoKHR signalInfo = {};
+		signalInfo.semaphore = semaphore;
+		signalInfo.value = value;
+		signalInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SIGNAL_INFO_KHR;
+		VkResult res = signalSemaphoreKHR(device, &signalInfo);
+		assert(res == VK_SUCCESS);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		completed = value > completed ? value : completed;
+	}
+	signaled.notify_all();
+}
+
+uint64_t Timeline::submit(const Submission& submission)
+{
+	assert(queue != VK_NULL_HANDLE);
+	uint64_t value = submitted + 1;
+
+	std::vector<VkSemaphore> waitSemaphores;
+	std::vector<VkPipelineStageFlags> waitStages;
+	std::vector<uint64_t> waitValues;
+	std::vector<VkSemaphore> consumed;
+	for (size_t i = 0; i < submission.waits.size(); i++) {
+		const SyncPoint& point = submission.waits[i];
+		if (point.timeline->isDone(point.value)) {
+			continue;
+		}
+
+		if (point.timeline->semaphoreBased) {
+			waitSemaphores.push_back(point.timeline->semaphore);
+			waitValues.push_back(point.value);
+		}
+		else {
+			VkSemaphore binary = point.timeline->queue != VK_NULL_HANDLE ? point.timeline->consume(point.value) : VK_NULL_HANDLE;
+			if (binary == VK_NULL_HANDLE) {
+				point.timeline->wait(point.value);
+				continue;
+			}
+			waitSemaphores.push_back(binary);
+			waitValues.push_back(0);
+			consumed.push_back(binary);
+		}
+		waitStages.push_back(submission.waitStages[i]);
+	}
+	for (size_t i = 0; i < submission.binaryWaits.size(); i++) {
+		waitSemaphores.push_back(submission.binaryWaits[i]);
+		waitStages.push_back(submission.binaryWaitStages[i]);
+		waitValues.push_back(0);
+	}
+
+	std::vector<VkSemaphore> signalSemaphores;
+	std::vector<uint64_t> signalValues;
+	VkFence fence = VK_NULL_HANDLE;
+	VkSemaphore binary = VK_NULL_HANDLE;
+	if (semaphoreBased) {
+		signalSemaphores.push_back(semaphore);
+		signalValues.push_back(value);
+	}
+	else {
+		std::lock_guard<std::mutex> lock(mutex);
+		fence = getFence();
+		binary = getSemaphore();
+		signalSemaphores.push_back(binary);
+		signalValues.push_back(0);
+	}
+	for (VkSemaphore signal : submission.binarySignals) {
+		signalSemaphores.push_back(signal);
+		signalValues.push_back(0);
+	}
+
+	// Binary semaphores ignore their value
+	VkTimelineSemaphoreSubmitInfoKHR timelineInfo = {};
+	timelineInfo.waitSemaphoreValueCount = uint32_t(waitValues.size());
+	timelineInfo.pWaitSemaphoreValues = waitValues.data();
+	timelineInfo.signalSemaphoreValueCount = uint32_t(signalValues.size());
+	timelineInfo.pSignalSemaphoreValues = signalValues.data();
+	timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+
+	VkSubmitInfo submitInfo = {};
+	submitInfo.pNext = semaphoreBased ? &timelineInfo : nullptr;
+	submitInfo.commandBufferCount = uint32_t(submission.cmdBuffers.size());
+	submitInfo.pCommandBuffers = submission.cmdBuffers.data();
+	submitInfo.waitSemaphoreCount = uint32_t(waitSemaphores.size());
+	submitInfo.pWaitSemaphores = waitSemaphores.data();
+	submitInfo.pWaitDstStageMask = waitStages.data();
+	submitInfo.signalSemaphoreCount = uint32_t(signalSemaphores.size());
+	submitInfo.pSignalSemaphores = signalSemaphores.data();
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+
+	VkResult res = vkQueueSubmit(queue, 1, &submitInfo, fence);
+	assert(res == VK_SUCCESS);
+
+	if (!semaphoreBased) {
+		std::lock_guard<std::mutex> lock(mutex);
+		pending.push_back({ value, fence, binary, false, consumed });
+	}
+	submitted = value;
+	return value;
+}
+
+VkFence Timeline::getFence()
+{
+	if (!fences.empty()) {
+		VkFence fence = fences.back();
+		fences.pop_back();
+		return fence;
+	}
+
+	VkFenceCreateInfo fenceInfo = {};
+	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+	VkFence fence;
+	VkResult res = vkCreateFence(device, &fenceInfo, nullptr, &fence);
+	assert(res == VK_SUCCESS);
+	return fence;
+}
+
+VkSemaphore Timeline::getSemaphore()
+{
+	if (!semaphores.empty()) {
+		VkSemaphore binary = semaphores.back();
+		semaphores.pop_back();
+		return binary;
+	}
+
+	VkSemaphoreCreateInfo semaphoreInfo = {};
+	semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+	VkSemaphore binary;
+	VkResult res = vkCreateSemaphore(device, &semaphoreInfo, nullptr, &binary);
+	assert(res == VK_SUCCESS);
+	return binary;
+}
+
+void Timeline::poll()
+{
+	while (!pending.empty() && vkGetFenceStatus(device, pending.front().fence) == VK_SUCCESS) {
+		Pending& entry = pending.front();
+		completed = entry.value;
+
+		vkResetFences(device, 1, &entry.fence);
+		fences.push_back(entry.fence);
+
+		// Nobody waited: still signaled, it cannot be signaled again.
+		// Otherwise it belongs to the waiting submission, which reuses it once done.
+		if (!entry.consumed) {
+			vkDestroySemaphore(device, entry.semaphore, nullptr);
+		}
+		semaphores.insert(semaphores.end(), entry.waited.begin(), entry.waited.end());
+		pending.pop_front();
+	}
+}
+
+VkSemaphore Timeline::consume(uint64_t value)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	for (Pending& entry : pending) {
+		if (entry.value >= value) {
+			if (entry.consumed) {
+				return VK_NULL_HANDLE;
+			}
+			entry.consumed = true;
+			return entry.semaphore;
+		}
+	}
+	return VK_NULL_HANDLE;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+class Timeline;
+
+// A value of a timeline: reached once the work that signals it is done
+struct SyncPoint {
+	Timeline* timeline = nullptr;
+	uint64_t value = 0;
+};
+
+// A queue submission. Besides the waits on other timelines, the binary semaphores are there for the swapchains.
+struct Submission {
+	std::vector<VkCommandBuffer> cmdBuffers;
+	std::vector<SyncPoint> waits;
+	std::vector<VkPipelineStageFlags> waitStages;	// One per wait
+	std::vector<VkSemaphore> binaryWaits;
+	std::vector<VkPipelineStageFlags> binaryWaitStages;	// One per binary wait
+	std::vector<VkSemaphore> binarySignals;
+
+	void wait(SyncPoint point, VkPipelineStageFlags stages)
+	{
+		if (point.timeline) {
+			waits.push_back(point);
+			waitStages.push_back(stages);
+		}
+	}
+};
+
+// Progress of a queue as a counter: each submission signals the next value, so waiting for some work
+// is waiting for a value instead of draining the queue.
+// Built on a VK_KHR_timeline_semaphore when the device has one. Otherwise each submission gets a fence
+// and a binary semaphore from pools:
+//  - a point another queue waits for can only be waited once by the GPU, later waits are done by the CPU
+//  - signal() only wakes CPU waiters up, GPU waits on such values are done by the CPU before submitting
+class Timeline
+{
+private:
+	struct Pending {
+		uint64_t value;
+		VkFence fence;
+		VkSemaphore semaphore;
+		bool consumed;		// Waited by a submission, which owns it from then on
+		std::vector<VkSemaphore> waited;	// Unsignaled once this submission is done, reused
+	};
+
+	VkDevice device = VK_NULL_HANDLE;
+	VkQueue queue = VK_NULL_HANDLE;		// None for host timelines
+	bool semaphoreBased = false;
+	uint64_t submitted = 0;
+
+	// Timeline semaphore
+	VkSemaphore semaphore = VK_NULL_HANDLE;
+	PFN_vkWaitSemaphoresKHR waitSemaphoresKHR = nullptr;
+	PFN_vkSignalSemaphoreKHR signalSemaphoreKHR = nullptr;
+	PFN_vkGetSemaphoreCounterValueKHR getSemaphoreCounterValueKHR = nullptr;
+
+	// Fallback
+	std::deque<Pending> pending;	// Oldest first
+	std::vector<VkFence> fences;
+	std::vector<VkSemaphore> semaphores;
+	uint64_t completed = 0;
+	std::mutex mutex;
+	std::condition_variable signaled;	// Host timelines
+
+public:
+	// Timeline semaphores need the extension and its feature enabled on the device
+	static const char* getExtensionName() { return VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME; }
+
+	// queue is VK_NULL_HANDLE for a timeline only signaled from the CPU
+	void init(VkDevice device, VkQueue queue, bool useTimelineSemaphore);
+	void destroy();
+
+	bool isSemaphoreBased() const { return semaphoreBased; }
+	VkQueue getQueue() const { return queue; }
+
+	// Value of the last submission
+	uint64_t getSubmitted() const { return submitted; }
+	SyncPoint getLastPoint() { return { this, submitted }; }
+
+	// Largest value reached, does not wait
+	uint64_t getCompleted();
+	bool isDone(uint64_t value) { return value <= getCompleted(); }
+
+	// False on timeout (nanoseconds)
+	bool wait(uint64_t value, uint64_t timeout = UINT64_MAX);
+
+	// From the CPU, host timelines only
+	void signal(uint64_t value);
+
+	// Returns the value signaled by this submission
+	uint64_t submit(const Submission& submission);
+
+private:
+	VkFence getFence();
+	VkSemaphore getSemaphore();
+	void poll();
+	// Fallback: binary semaphore of an unfinished point, VK_NULL_HANDLE when it must be waited from the CPU
+	VkSemaphore consume(uint64_t value);
+};
@@ -0,0 +1,207 @@
+#include "Trace.h"
+#include "Vulkan.h"
+#include <fstream>
+#include <iterator>
+
+// WRITER
+
+bool TraceWriter::open(const std::string& filename)
+{
+	close();
+	file = fopen(filename.c_str(), "wb");
+	if (!file) {
+		return false;
+	}
+	uint32_t header[] = { TRACE_MAGIC, TRACE_VERSION };
+	fwrite(header, sizeof(header), 1, file);
+	return true;
+}
+
+void TraceWriter::close()
+{
+	if (file) {
+		fclose(file);
+		file = nullptr;
+	}
+}
+
+TraceWriter& TraceWriter::begin(TraceRecord type)
+{
+	// Type and size, the size is known at the end
+	record.clear();
+	uint32_t header[] = { uint32_t(type), 0 };
+	return add(header, sizeof(header));
+}
+
+TraceWriter& TraceWriter::add(const void* data, size_t size)
+{
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+	record.insert(record.end(), bytes, bytes + size);
+	return *this;
+}
+
+void TraceWriter::end()
+{
+	uint32_t size = uint32_t(record.size() - 2 * sizeof(uint32_t));
+	memcpy(record.data() + sizeof(uint32_t), &size, sizeof(size));
+	fwrite(record.data(), 1, record.size(), file);
+}
+
+// READER
+
+const void* TraceData::read(size_t size)
+{
+	if (size > remaining()) {
+		offset = this->size;
+		return nullptr;
+	}
+	const void* part = data + offset;
+	offset += uint32_t(size);
+	return part;
+}
+
+bool TraceReader::open(const std::string& filename)
+{
+	std::ifstream file(filename, std::ios::binary);
+	if (!file) {
+		return false;
+	}
+	contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+	uint32_t header[2];
+	if (contents.size() < sizeof(header)) {
+		return false;
+	}
+	memcpy(header, contents.data(), sizeof(header));
+	rewind();
+	return header[0] == TRACE_MAGIC && header[1] == TRACE_VERSION;
+}
+
+void TraceReader::rewind()
+{
+	offset = 2 * sizeof(uint32_t);
+}
+
+bool TraceReader::next(TraceRecord& type, TraceData& data)
+{
+	uint32_t header[2];
+	if (contents.size() - offset < sizeof(header)) {
+		return false;
+	}
+	memcpy(header, contents.data() + offset, sizeof(header));
+	offset += sizeof(header);
+	if (contents.size() - offset < header[1]) {
+		return false;
+	}
+
+	type = TraceRecord(header[0]);
+	data = TraceData(contents.data() + offset, header[1]);
+	offset += header[1];
+	return true;
+}
+
+// PLAYER
+
+bool TracePlayer::open(const std::string& filename)
+{
+	if (!reader.open(filename)) {
+		return false;
+	}
+
+	// Counted first: the caller knows which frame is the last one
+	TraceRecord type;
+	TraceData data;
+	frameCount = 0;
+	while (reader.next(type, data)) {
+		if (type == TRACE_FRAME) {
+			frameCount++;
+		}
+	}
+	reader.rewind();
+	return true;
+}
+
+bool TracePlayer::nextFrame(Vulkan& renderer)
+{
+	TraceRecord type;
+	TraceData data;
+	while (reader.next(type, data)) {
+		switch (type) {
+		case TRACE_CONFIG: {
+			renderer.setSampleCount(data.read<VkSampleCountFlagBits>());
+			renderer.setDepthPrepass(data.read<uint32_t>() != 0);
+			renderer.setOcclusionCulling(data.read<uint32_t>() != 0);
+			renderer.setCullMode(data.read<VkCullModeFlags>());
+			renderer.setGpuLightBinning(data.read<uint32_t>() != 0);
+			break;
+		}
+		case TRACE_VIEW: {
+			VkExtent2D extent = data.read<VkExtent2D>();
+			renderer.addOffscreenView(extent, data.read<VkFormat>());
+			break;
+		}
+		case TRACE_CAMERA: {
+			uint32_t view = data.read<uint32_t>();
+			float fieldOfView = data.read<float>();
+			renderer.setCamera(view, data.read<glm::mat4>(), fieldOfView);
+			break;
+		}
+		case TRACE_MESH: {
+			uint32_t recorded = data.read<uint32_t>();
+			uint32_t vertexCount = data.read<uint32_t>();
+			uint32_t indexCount = data.read<uint32_t>();
+			const Vertex* vertices = static_cast<const Vertex*>(data.read(vertexCount * sizeof(Vertex)));
+			const uint32_t* indices = static_cast<const uint32_t*>(data.read(indexCount * sizeof(uint32_t)));
+			if (vertices && indices) {
+				meshes[recorded] = renderer.addMesh(vertices, vertexCount, indices, indexCount);
+			}
+			break;
+		}
+		case TRACE_OBJECT: {
+			// The built-in meshes keep their index
+			uint32_t mesh = data.read<uint32_t>();
+			uint32_t material = data.read<uint32_t>();
+			auto replayed = meshes.find(mesh);
+			if (replayed != meshes.end()) {
+				mesh = replayed->second;
+			}
+			if (mesh != UINT32_MAX) {
+				renderer.addObject(mesh, material, data.read<glm::mat4>());
+			}
+			break;
+		}
+		case TRACE_LIGHTS: {
+			uint32_t count = data.remaining() / sizeof(LightSource);
+			renderer.setLights(static_cast<const LightSource*>(data.read(count * sizeof(LightSource))), count);
+			break;
+		}
+		case TRACE_SUN: {
+			glm::vec3 direction = data.read<glm::vec3>();
+			renderer.setSun(direction, data.read<glm::vec3>());
+			break;
+		}
+		case TRACE_EXPOSURE:
+			renderer.setExposure(data.read<float>());
+			break;
+		case TRACE_BLOOM: {
+			float intensity = data.read<float>();
+			renderer.setBloom(intensity, data.read<float>());
+			break;
+		}
+		case TRACE_SPRITES: {
+			uint32_t count = data.remaining() / sizeof(Sprite);
+			renderer.drawSprites(static_cast<const Sprite*>(data.read(count * sizeof(Sprite))), count);
+			break;
+		}
+		case TRACE_FRAME: {
+			transforms.resize(data.remaining() / sizeof(glm::mat4));
+			if (!transforms.empty()) {
+				memcpy(transforms.data(), data.read(transforms.size() * sizeof(glm::mat4)), transforms.size() * sizeof(glm::mat4));
+			}
+			renderer.setTransforms(transforms.data(), uint32_t(transforms.size()));
+			return true;
+		}
+		}
+	}
+	return false;
+}
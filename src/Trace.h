@@ -0,0 +1,113 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <glm.hpp>
+
+class Vulkan;
+
+#define TRACE_MAGIC 0x43525456	// "VTRC"
+#define TRACE_VERSION 1
+
+// What the renderer was asked to do, in call order. The payloads are the arguments as they are in memory.
+enum TraceRecord {
+	TRACE_CONFIG,	// Sample count, depth pre-pass, occlusion culling, cull mode, GPU light binning
+	TRACE_VIEW,		// Width, height, format
+	TRACE_CAMERA,	// View, field of view, view matrix
+	TRACE_MESH,		// Mesh returned, vertex count, index count, vertices, indices
+	TRACE_OBJECT,	// Mesh, material, transform
+	TRACE_LIGHTS,	// LightSource array
+	TRACE_SUN,		// Direction, color
+	TRACE_EXPOSURE,
+	TRACE_BLOOM,	// Intensity, threshold
+	TRACE_SPRITES,	// Sprite array
+	TRACE_FRAME,	// Transforms of the renderables in gathering order, then the frame is drawn
+};
+
+// Binary trace being recorded: a header, then records of their type, their size and their payload.
+// A record is built from parts, then written whole.
+class TraceWriter
+{
+private:
+	FILE* file = nullptr;
+	std::vector<uint8_t> record;
+
+public:
+	~TraceWriter() { close(); }
+
+	bool open(const std::string& filename);
+	void close();
+	bool isOpen() const { return file != nullptr; }
+
+	TraceWriter& begin(TraceRecord type);
+	TraceWriter& add(const void* data, size_t size);
+	template <typename T>
+	TraceWriter& add(const T& value) { return add(&value, sizeof(T)); }
+	void end();
+};
+
+// Payload of a record, read in the order its parts were added
+class TraceData
+{
+private:
+	const uint8_t* data = nullptr;
+	uint32_t size = 0;
+	uint32_t offset = 0;
+
+public:
+	TraceData() {}
+	TraceData(const uint8_t* data, uint32_t size) : data(data), size(size) {}
+
+	// 'size' bytes in place, nullptr past the end
+	const void* read(size_t size);
+	template <typename T>
+	T read()
+	{
+		T value = {};
+		const void* source = read(sizeof(T));
+		if (source) {
+			memcpy(&value, source, sizeof(T));
+		}
+		return value;
+	}
+	uint32_t remaining() const { return size - offset; }
+};
+
+// Whole trace in memory: reading it does not weigh on the replay
+class TraceReader
+{
+private:
+	std::vector<uint8_t> contents;
+	size_t offset = 0;
+
+public:
+	// False when the file is missing, not a trace or of another version
+	bool open(const std::string& filename);
+	void rewind();
+	// False at the end, or on a truncated record
+	bool next(TraceRecord& type, TraceData& data);
+};
+
+// Replays a trace into a renderer without a window: every view is offscreen and nothing is presented.
+// The built-in resources (quad, textures) come from the renderer's own init, dynamic resolution stays off
+// so that every replay draws the same load.
+class TracePlayer
+{
+private:
+	TraceReader reader;
+	uint32_t frameCount = 0;
+	std::map<uint32_t, uint32_t> meshes;	// Recorded -> replayed
+	std::vector<glm::mat4> transforms;
+
+public:
+	bool open(const std::string& filename);
+	uint32_t getFrameCount() const { return frameCount; }
+
+	// Makes the calls recorded before the next frame and sets its transforms, the caller draws it.
+	// False once every frame was played.
+	bool nextFrame(Vulkan& renderer);
+};
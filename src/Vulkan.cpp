@@ -1,23 +1,77 @@
 #include "Vulkan.h"
 #include <iostream>
+#include <memory>
 #include <assert.h>
-#include <fstream>
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 #include "helpers\Helpers.h" // TEMPORARY
+#include "ImageDiff.h"
+#include "TextureIngest.h"
+#include <algorithm>
+
+namespace {
+
+	// Matches the constant_id of the shaders
+	struct ShaderSpecialization {
+		VkBool32 vertexColor;
+		VkBool32 texture;
+		VkBool32 alphaTest;
+		float alphaCutoff;
+		VkBool32 lighting;
+	};
+
+	// Largest scale of the axes: bounding spheres stay around their object
+	inline float getMaxScale(const glm::mat4& transform)
+	{
+		return std::max(glm::length(glm::vec3(transform[0].x, transform[0].y, transform[0].z)),
+						std::max(glm::length(glm::vec3(transform[1].x, transform[1].y, transform[1].z)),
+								 glm::length(glm::vec3(transform[2].x, transform[2].y, transform[2].z))));
+	}
+}
 
 
 Vulkan Vulkan::app;
 
 Vulkan::Vulkan()
 {
-	createInstance();
-	createDevice();
+}
+
+void Vulkan::start()
+{
+	if (started) {
+		return;
+	}
+	started = true;
+	jobs.init();
+	shaders.init(&jobs, "shaders");
+
+	// Nothing to wait for: the SPIR-V of every shader and the textures of the scene
+	const char* shaderNames[] = {
+		"color.vert", "color.frag", "meshlet.vert", "sprite.vert", "sprite.frag", "shadow.vert",
+		"cluster.comp", "objectCull.comp", "meshletCull.comp", "depthPyramid.comp", "depthPyramidMS.comp",
+		"bloomDownsample.comp", "bloomUpsample.comp", "tonemap.comp",
+	};
+	for (const char* name : shaderNames) {
+		std::string shader = name;
+		jobs.schedule([this, shader]() { shaders.precompile(shader); });
+	}
+	streamedTextures.push_back({ "textures/test.jpg", 0, {} });
+	texturesDecoded = jobs.schedule([this]() {
+		std::vector<std::string> filenames;
+		for (const StreamedTexture& texture : streamedTextures) {
+			filenames.push_back(texture.filename);
+		}
+		std::vector<DecodedTexture> decoded = decodeTextures(filenames);
+		for (size_t i = 0; i < decoded.size(); i++) {
+			streamedTextures[i].decoded = decoded[i];
+		}
+	});
 
-	VkSemaphoreCreateInfo semaphoreInfo = {};
-	semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-	vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageIsAvailable);
-	vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageIsRendered);
+	// Loading the driver and creating the device takes a while: the window is created meanwhile
+	deviceCreated = jobs.schedule([this]() {
+		createInstance();
+		createDevice();
+	});
 }
 
 void Vulkan::createInstance()
@@ -46,15 +100,26 @@ void Vulkan::createInstance()
 
 void Vulkan::createDevice()
 {
-	uint32_t physicalDeviceCount;
-	vkEnumeratePhysicalDevices(instance, &physicalDeviceCount, nullptr);
-	std::vector<VkPhysicalDevice> physicalDevices(physicalDeviceCount);
-	vkEnumeratePhysicalDevices(instance, &physicalDeviceCount, physicalDevices.data());
-
-	physicalDevice = physicalDevices[0];
-	
 	// This extension is required to display something on the screen
-	const char* extensions[] = { "VK_KHR_swapchain" };
+	std::vector<const char*> extensions = { "VK_KHR_swapchain" };
+
+	capabilities = DeviceCapabilities::choose(instance, extensions[0]);
+	physicalDevice = capabilities.physicalDevice;
+
+	// Waits on values rather than fences when available
+	VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineFeatures = {};
+	timelineFeatures.timelineSemaphore = VK_TRUE;
+	timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+	timelineSemaphores = capabilities.hasExtension(Timeline::getExtensionName());
+	if (timelineSemaphores) {
+		extensions.push_back(Timeline::getExtensionName());
+	}
+
+	// Features used when available, each user checks capabilities.enabled
+	VkPhysicalDeviceFeatures requestedFeatures = {};
+	requestedFeatures.samplerAnisotropy = VK_TRUE;
+	requestedFeatures.depthClamp = VK_TRUE;
+	capabilities.enableFeatures(requestedFeatures);
 
 	float queuePriorities = { 0.0f };
 	VkDeviceQueueCreateInfo queueInfo = {};
@@ -63,29 +128,37 @@ void Vulkan::createDevice()
 	queueInfo.queueFamilyIndex = chooseQueueFamilyIndex();
 	queueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
 
+	// A second queue when the device has a compute-only family
+	VkDeviceQueueCreateInfo queueInfos[] = { queueInfo, queueInfo };
+	queueInfos[1].queueFamilyIndex = chooseComputeFamilyIndex();
+
 	VkDeviceCreateInfo deviceInfo = {};
-	deviceInfo.enabledExtensionCount = 1;
-	deviceInfo.ppEnabledExtensionNames = extensions;
-	deviceInfo.queueCreateInfoCount = 1;
-	deviceInfo.pQueueCreateInfos = &queueInfo;
+	deviceInfo.pNext = timelineSemaphores ? &timelineFeatures : nullptr;
+	deviceInfo.enabledExtensionCount = uint32_t(extensions.size());
+	deviceInfo.ppEnabledExtensionNames = extensions.data();
+	deviceInfo.queueCreateInfoCount = computeFamilyIndex != graphicsFamilyIndex ? 2 : 1;
+	deviceInfo.pQueueCreateInfos = queueInfos;
+	deviceInfo.pEnabledFeatures = &capabilities.enabled;
 	deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
 
 	VkResult res = vkCreateDevice(physicalDevice, &deviceInfo, nullptr, &device);
 	assert(res == VK_SUCCESS);
 
 	vkGetDeviceQueue(device, queueInfo.queueFamilyIndex, 0, &graphicsQueue);
+	vkGetDeviceQueue(device, computeFamilyIndex, 0, &computeQueue);
+	graphicsTimeline.init(device, graphicsQueue, timelineSemaphores);
+
+	shaders.setDevice(device);
 }
 
 uint32_t Vulkan::chooseQueueFamilyIndex()
 {
-	uint32_t familyCount;
-	vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount, nullptr);
-	std::vector<VkQueueFamilyProperties> familyProperties(familyCount);
-	vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount, familyProperties.data());
+	const std::vector<VkQueueFamilyProperties>& familyProperties = capabilities.queueFamilies;
+	uint32_t familyCount = uint32_t(familyProperties.size());
 
 	for (uint32_t i = 0; i < familyCount; i++) {
 		// This family supports graphics
-		if (familyProperties[i].queueFlags & VK_QUEUE_GRAPHICS_BIT == VK_QUEUE_GRAPHICS_BIT) {
+		if ((familyProperties[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) == VK_QUEUE_GRAPHICS_BIT) {
 			graphicsFamilyIndex = i;
 			break;
 		}
@@ -94,62 +167,563 @@ uint32_t Vulkan::chooseQueueFamilyIndex()
 	return graphicsFamilyIndex;
 }
 
+uint32_t Vulkan::chooseComputeFamilyIndex()
+{
+	const std::vector<VkQueueFamilyProperties>& familyProperties = capabilities.queueFamilies;
+	uint32_t familyCount = uint32_t(familyProperties.size());
+
+	// Compute without graphics: runs alongside the graphics queue
+	computeFamilyIndex = graphicsFamilyIndex;
+	for (uint32_t i = 0; i < familyCount; i++) {
+		VkQueueFlags flags = familyProperties[i].queueFlags;
+		if ((flags & VK_QUEUE_COMPUTE_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT)) {
+			computeFamilyIndex = i;
+			break;
+		}
+	}
+
+	return computeFamilyIndex;
+}
+
 void Vulkan::init()
 {
-	createSwapchain();
+	start();
+	jobs.wait(deviceCreated);
+	deletions.init(device);
+	samplers.init(device);
+
+	quadNode = scene.addNode();
+	lastUpdate = std::chrono::steady_clock::now();
+	uint32_t quad = entities.createEntity(COMPONENT_BIT(COMPONENT_MESH) | COMPONENT_BIT(COMPONENT_MATERIAL) |
+		COMPONENT_BIT(COMPONENT_TRANSFORM) | COMPONENT_BIT(COMPONENT_BOUNDS) | COMPONENT_BIT(COMPONENT_SCENE_NODE));
+	entities.get<uint32_t>(quad, COMPONENT_MESH) = 0;
+	entities.get<uint32_t>(quad, COMPONENT_MATERIAL) = 0;
+	entities.get<uint32_t>(quad, COMPONENT_SCENE_NODE) = quadNode;
+	entities.get<Bounds>(quad, COMPONENT_BOUNDS) = { glm::vec3(0.0f, 0.0f, 0.0f), 1.0f };
+
+	// The first window sets the number of frames in flight, the other views follow it
+	assert(!views.empty());
+	View& primary = *views[0];
+	if (primary.surface != VK_NULL_HANDLE) {
+		createSwapchain(primary);
+		frameCount = uint32_t(primary.images.size());
+	}
+	else {
+		// No window: its images are copied like the ones of any offscreen view
+		frameCount = OFFSCREEN_FRAME_COUNT;
+		createOffscreenImages(primary);
+		captureSupported = true;
+	}
 	createCommandBuffers();
+	compute.init(device, graphicsFamilyIndex, computeFamilyIndex, computeQueue, frameCount, timelineSemaphores);
+	if (captureSupported) {
+		// One copy per image in flight, plus one when they are not acquired in order: every frame can be captured
+		capture.init(capabilities, device, primary.extent, primary.format, frameCount + 1);
+	}
+
+	// Sampled with comparisons: no stencil, filtered by the hardware when the format allows it
+	VkFormatFeatureFlags shadowFeatures = VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT;
+	shadowFormat = findCompatibleDepthFormat(shadowFeatures | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT, false);
+	shadowFiltering = shadowFormat != VK_FORMAT_UNDEFINED;
+	if (!shadowFiltering) {
+		shadowFormat = findCompatibleDepthFormat(shadowFeatures, false);
+	}
+	assert(shadowFormat != VK_FORMAT_UNDEFINED);
+
+	// sRGB textures for an sRGB swapchain, so that blending and filtering happen on linear values
+	bool srgb = primary.format == VK_FORMAT_B8G8R8A8_SRGB || primary.format == VK_FORMAT_R8G8B8A8_SRGB;
+	atlas.init(capabilities, device, srgb ? VK_FORMAT_R8G8B8A8_SRGB : VK_FORMAT_R8G8B8A8_UNORM);
+	spriteBatch.init(capabilities, device, &atlas, &jobs, frameCount, MAX_SPRITES);
+	meshletGeometry.init(capabilities, device, sizeof(Vertex));
+
+	// The real textures are still being decoded: the atlas starts with the placeholder
+	uint32_t placeholder = addPlaceholderTexture();
+	uploadResources();
+
+	// Read by the depth pyramid with occlusion culling: sampled, without stencil
+	VkFormatFeatureFlags depthFeatures = VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT;
+	if (useOcclusionCulling) {
+		depthFeatures |= VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT;
+	}
+	depthFormat = findCompatibleDepthFormat(depthFeatures, !useOcclusionCulling);
+	assert(depthFormat != VK_FORMAT_UNDEFINED);
+	chooseSampleCount();
+
+	// STAGES: independent steps run in parallel, the pipelines wait for the layouts and the passes
+	Job vertices = jobs.schedule([this]() { prepareVertices(); });
+	Job uniforms = jobs.schedule([this]() {
+		loadSampler();
+		prepareUniforms();
+	});
+	Job view = jobs.schedule([this, &primary]() { setupView(primary); });
+	Job pipelines = jobs.schedule([this]() { createGraphicsPipeline(); }, { uniforms, view });
+	jobs.wait(vertices);
+	jobs.wait(pipelines);
+
+	for (const StreamedTexture& texture : streamedTextures) {
+		materials[texture.material].texture = placeholder;
+	}
+	initialized = true;
+
+	// Settings as used, a replay on another device adapts them to it again
+	if (trace.isOpen()) {
+		trace.begin(TRACE_CONFIG).add(sampleCount).add(uint32_t(useDepthPrepass)).add(uint32_t(useOcclusionCulling))
+			.add(cullMode).add(uint32_t(gpuLightBinning)).end();
+	}
+}
+
+uint32_t Vulkan::addWindow(GLFWwindow* window)
+{
+	// The surface only needs the instance, the device comes with it
+	start();
+	jobs.wait(deviceCreated);
+	assert(views.size() < MAX_VIEWS);
+	views.emplace_back(new View());
+	View& view = *views.back();
+	view.index = uint32_t(views.size()) - 1;
+	glfwCreateWindowSurface(instance, window, nullptr, &view.surface);
+
+	if (!initialized) {
+		init();
+	}
+	else {
+		// The frames in flight do not use it yet
+		createSwapchain(view);
+		setupView(view);
+	}
+	traceView(view);
+	return view.index;
+}
+
+uint32_t Vulkan::addOffscreenView(VkExtent2D extent, VkFormat format)
+{
+	assert(views.size() < MAX_VIEWS);
+	views.emplace_back(new View());
+	View& view = *views.back();
+	view.index = uint32_t(views.size()) - 1;
+	view.format = format;
+	view.extent = extent;
+	view.renderExtent = extent;
+
+	if (!initialized) {
+		init();
+	}
+	else {
+		createOffscreenImages(view);
+		setupView(view);
+	}
+	traceView(view);
+	return view.index;
+}
+
+void Vulkan::traceView(const View& view)
+{
+	// Replayed offscreen, windows included
+	if (trace.isOpen()) {
+		trace.begin(TRACE_VIEW).add(view.extent).add(view.format).end();
+	}
+}
 
-	loadTexture("textures/test.jpg");
-	loadSampler();
+VkImage Vulkan::getOffscreenImage(uint32_t view) const
+{
+	const View& offscreen = *views[view];
+	assert(offscreen.surface == VK_NULL_HANDLE);
+	return offscreen.images[offscreen.imageIndex];
+}
 
-	findCompatibleDepthFormat();
-	createDepthBuffer();
+void Vulkan::setCamera(uint32_t view, const glm::mat4& viewMatrix, float fieldOfView)
+{
+	views[view]->viewMatrix = viewMatrix;
+	views[view]->fieldOfView = fieldOfView;
+	if (trace.isOpen()) {
+		trace.begin(TRACE_CAMERA).add(view).add(fieldOfView).add(viewMatrix).end();
+	}
+}
 
-	prepareVertices();
-	prepareUniforms();
+void Vulkan::setLights(const LightSource* lights, uint32_t count)
+{
+	lightSources.assign(lights, lights + count);
+	for (auto& view : views) {
+		view->lighting.setLights(lights, count);
+	}
+	if (trace.isOpen()) {
+		trace.begin(TRACE_LIGHTS).add(lights, count * sizeof(LightSource)).end();
+	}
+}
 
-	createRenderPass();
-	createFrameBuffers();
-	createGraphicsPipeline();
-	recordDrawCommand();
+void Vulkan::setSun(const glm::vec3& direction, const glm::vec3& color)
+{
+	sunDirection = direction;
+	sunColor = color;
+	for (auto& view : views) {
+		view->shadows.setLight(direction, color);
+	}
+	if (trace.isOpen()) {
+		trace.begin(TRACE_SUN).add(direction).add(color).end();
+	}
+}
+
+void Vulkan::setExposure(float value)
+{
+	exposure = value;
+	for (auto& view : views) {
+		view->postProcess.setExposure(value);
+	}
+	if (trace.isOpen()) {
+		trace.begin(TRACE_EXPOSURE).add(value).end();
+	}
+}
+
+void Vulkan::setBloom(float intensity, float threshold)
+{
+	bloomIntensity = intensity;
+	bloomThreshold = threshold;
+	for (auto& view : views) {
+		view->postProcess.setBloom(intensity, threshold);
+	}
+	if (trace.isOpen()) {
+		trace.begin(TRACE_BLOOM).add(intensity).add(threshold).end();
+	}
+}
+
+void Vulkan::setFrameBudget(float milliseconds, float minScale)
+{
+	frameBudget = milliseconds;
+	minRenderScale = minScale;
+	for (auto& view : views) {
+		view->resolution.setBudget(milliseconds, minScale);
+	}
+}
+
+void Vulkan::drawSprites(const Sprite* sprites, uint32_t count)
+{
+	spriteBatch.add(sprites, count);
+	if (trace.isOpen()) {
+		trace.begin(TRACE_SPRITES).add(sprites, count * sizeof(Sprite)).end();
+	}
+}
+
+uint32_t Vulkan::addMesh(const Vertex* vertices, uint32_t vertexCount, const uint32_t* indices, uint32_t indexCount)
+{
+	assert(initialized && vertexCount > 0);
+	MeshletRange range;
+	if (!meshletGeometry.add(vertices, vertexCount, indices, indexCount, range)) {
+		return UINT32_MAX;
+	}
+
+	// Sphere around the box of the vertices: sorting and shadows
+	glm::vec3 low(vertices[0].position[0], vertices[0].position[1], vertices[0].position[2]);
+	glm::vec3 high = low;
+	for (uint32_t i = 1; i < vertexCount; i++) {
+		glm::vec3 position(vertices[i].position[0], vertices[i].position[1], vertices[i].position[2]);
+		low = glm::min(low, position);
+		high = glm::max(high, position);
+	}
+
+	Mesh mesh = {};
+	mesh.vertexBuffer = meshletGeometry.getVertexBuffer();
+	mesh.indexBuffer = meshletGeometry.getIndexBuffer();
+	mesh.indexCount = range.indexCount;
+	mesh.firstIndex = range.firstIndex;
+	mesh.vertexOffset = range.vertexOffset;
+	mesh.bounds.center = (low + high) * 0.5f;
+	mesh.bounds.radius = glm::length(high - low) * 0.5f;
+	mesh.firstMeshlet = range.firstMeshlet;
+	mesh.meshletCount = range.meshletCount;
+	mesh.triangleCount = range.triangleCount;
+	meshes.push_back(mesh);
+	uint32_t index = uint32_t(meshes.size()) - 1;
+	if (trace.isOpen()) {
+		trace.begin(TRACE_MESH).add(index).add(vertexCount).add(indexCount)
+			.add(vertices, vertexCount * sizeof(Vertex)).add(indices, indexCount * sizeof(uint32_t)).end();
+	}
+	return index;
+}
+
+uint32_t Vulkan::addObject(uint32_t mesh, uint32_t material, const glm::mat4& transform)
+{
+	// Not in the scene graph: keeps its transform
+	uint32_t entity = entities.createEntity(COMPONENT_BIT(COMPONENT_MESH) | COMPONENT_BIT(COMPONENT_MATERIAL) |
+		COMPONENT_BIT(COMPONENT_TRANSFORM) | COMPONENT_BIT(COMPONENT_BOUNDS));
+	entities.get<uint32_t>(entity, COMPONENT_MESH) = mesh;
+	entities.get<uint32_t>(entity, COMPONENT_MATERIAL) = material;
+	entities.get<glm::mat4>(entity, COMPONENT_TRANSFORM) = transform;
+	entities.get<Bounds>(entity, COMPONENT_BOUNDS) = meshes[mesh].bounds;
+	if (trace.isOpen()) {
+		trace.begin(TRACE_OBJECT).add(mesh).add(material).add(transform).end();
+	}
+	return entity;
+}
+
+void Vulkan::setupView(View& view)
+{
+	// Own pool: recorded on a job thread, alongside the other views
+	VkCommandPoolCreateInfo commandPoolInfo = {};
+	commandPoolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT; // Recorded again every frame
+	commandPoolInfo.queueFamilyIndex = graphicsFamilyIndex;
+	commandPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	VkResult res = vkCreateCommandPool(device, &commandPoolInfo, nullptr, &view.commandPool);
+	assert(res == VK_SUCCESS);
+	for (uint32_t i = 0; i < frameCount; i++) {
+		view.commandBuffers.push_back(vk::createCommandBuffer(view.commandPool, device));
+	}
+
+	// Acquired while the image of the previous frame may still be presented: one per frame in flight.
+	// Presented once rendered: one per image, an image is only acquired again once its presentation is done.
+	if (view.swapchain != VK_NULL_HANDLE) {
+		VkSemaphoreCreateInfo semaphoreInfo = {};
+		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+		view.imageIsAvailable.resize(frameCount);
+		view.imageIsRendered.resize(view.images.size());
+		for (VkSemaphore& semaphore : view.imageIsAvailable) {
+			vkCreateSemaphore(device, &semaphoreInfo, nullptr, &semaphore);
+		}
+		for (VkSemaphore& semaphore : view.imageIsRendered) {
+			vkCreateSemaphore(device, &semaphoreInfo, nullptr, &semaphore);
+		}
+	}
+
+	// The light lists of its camera are built by the compute queue while the previous frame is drawn
+	View* target = &view;
+	view.lighting.init(capabilities, device, compute, &jobs, frameCount, MAX_LIGHTS, gpuLightBinning);
+	view.lighting.setLights(lightSources.data(), uint32_t(lightSources.size()));
+	Job lightingPipeline;
+	if (gpuLightBinning) {
+		lightingPipeline = jobs.schedule([this, target]() {
+			VkShaderModule clusterModule = shaders.createModule("cluster.comp");
+			target->lighting.createPipeline(clusterModule);
+			vkDestroyShaderModule(device, clusterModule, nullptr);
+		});
+		compute.addTask("lightClusters", [this, target](VkCommandBuffer cmdBuffer) { target->lighting.record(cmdBuffer, currentFrame); },
+						VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+	}
+
+	// Fitted to its camera
+	view.shadows.init(capabilities, device, samplers, shadowFormat, shadowFiltering, frameCount);
+	view.shadows.setLight(sunDirection, sunColor);
+	Job shadowPipeline = jobs.schedule([this, target]() {
+		VkPipelineShaderStageCreateInfo shadowStage = createShaderStage("shadow.vert", VK_SHADER_STAGE_VERTEX_BIT);
+		target->shadows.createPipeline(shadowStage, sizeof(Vertex), capabilities.enabled.depthClamp == VK_TRUE);
+		vkDestroyShaderModule(device, shadowStage.module, nullptr);
+	});
+
+	// Objects and meshlets culled against its camera and its depth pyramid before its scene is drawn
+	view.pyramid.init(capabilities, device, samplers, view.extent, sampleCount);
+	view.objects.init(capabilities, device, view.pyramid, frameCount, MAX_OBJECTS);
+	view.meshlets.init(capabilities, device, meshletGeometry, view.pyramid, frameCount);
+	Job cullPipelines = jobs.schedule([this, target]() {
+		VkShaderModule cullModules[] = {
+			shaders.createModule("objectCull.comp"),
+			shaders.createModule("meshletCull.comp"),
+		};
+		target->objects.createPipeline(cullModules[0]);
+		target->meshlets.createPipeline(cullModules[1]);
+		for (VkShaderModule module : cullModules) {
+			vkDestroyShaderModule(device, module, nullptr);
+		}
+		if (useOcclusionCulling) {
+			VkShaderModule reduceModule = shaders.createModule("depthPyramid.comp");
+			VkShaderModule multisampledModule = shaders.createModule("depthPyramidMS.comp");
+			target->pyramid.createPipelines(reduceModule, multisampledModule);
+			vkDestroyShaderModule(device, reduceModule, nullptr);
+			vkDestroyShaderModule(device, multisampledModule, nullptr);
+		}
+	});
+
+	view.resolution.init(capabilities, device, graphicsFamilyIndex, frameCount);
+	view.resolution.setBudget(frameBudget, minRenderScale);
+
+	// Between the scene and the target, the passes are added with the others
+	view.postProcess.init(capabilities, device, samplers, view.format);
+	view.postProcess.setExposure(exposure);
+	view.postProcess.setBloom(bloomIntensity, bloomThreshold);
+	Job postPipelines = jobs.schedule([this, target]() {
+		VkShaderModule postModules[] = {
+			shaders.createModule("bloomDownsample.comp"),
+			shaders.createModule("bloomUpsample.comp"),
+			shaders.createModule("tonemap.comp"),
+		};
+		target->postProcess.createPipelines(postModules[0], postModules[1], postModules[2]);
+		for (VkShaderModule module : postModules) {
+			vkDestroyShaderModule(device, module, nullptr);
+		}
+	});
+
+	// The graph is built while the pipelines compile
+	view.renderGraph.init(physicalDevice, device);
+	createDepthBuffer(view);
+	createRenderPass(view);
+	jobs.wait(lightingPipeline);
+	jobs.wait(shadowPipeline);
+	jobs.wait(cullPipelines);
+	jobs.wait(postPipelines);
+}
+
+void Vulkan::destroyView(View& view)
+{
+	view.lighting.destroy();
+	view.shadows.destroy();
+	view.objects.destroy();
+	view.meshlets.destroy();
+	view.pyramid.destroy();
+	view.postProcess.destroy();
+	view.resolution.destroy();
+	view.renderGraph.reset();
+
+	for (VkImageView imageView : view.imageViews) {
+		vkDestroyImageView(device, imageView, nullptr);
+	}
+	for (size_t i = 0; i < view.imageMemory.size(); i++) {
+		vkDestroyImage(device, view.images[i], nullptr);
+		vkFreeMemory(device, view.imageMemory[i], nullptr);
+	}
+	for (VkSemaphore semaphore : view.imageIsAvailable) {
+		vkDestroySemaphore(device, semaphore, nullptr);
+	}
+	for (VkSemaphore semaphore : view.imageIsRendered) {
+		vkDestroySemaphore(device, semaphore, nullptr);
+	}
+	vkDestroyCommandPool(device, view.commandPool, nullptr);
+
+	if (view.swapchain != VK_NULL_HANDLE) {
+		vkDestroySwapchainKHR(device, view.swapchain, nullptr);
+		vkDestroySurfaceKHR(instance, view.surface, nullptr);
+	}
 }
 
 void Vulkan::draw()
 {
-	loadUniforms();
+	// The command buffers and the uniforms of this frame in flight may still be in use
+	currentFrame = uint32_t(frameNumber % frameCount);
+	frameNumber++;
+	graphicsTimeline.wait(frameValues[currentFrame]);
+
+	// Get the next image of every swapchain, offscreen views have one image per frame in flight
+	for (auto& view : views) {
+		if (view->swapchain != VK_NULL_HANDLE) {
+			vkAcquireNextImageKHR(device, view->swapchain, UINT64_MAX, view->imageIsAvailable[currentFrame], 0, &view->imageIndex);
+		}
+		else {
+			view->imageIndex = currentFrame;
+		}
+	}
 
-	// Get next image in swapchain
-	uint32_t imageIndex;
-	vkAcquireNextImageKHR(device, swapchain, UINT64_MAX, imageIsAvailable, 0, &imageIndex);
+	// Frame boundary: shaders modified since the last frame are used from now on,
+	// so are the pipelines and the textures that were not ready for the previous frames
+	swapReloadedPipelines();
+	adoptCompiledPipelines();
+	streamTextures();
+	if (meshletGeometry.hasPending()) {
+		uploadResources();
+	}
+	if (textureGenerations[currentFrame] != atlasGeneration) {
+		// The atlas was recreated: the set of this frame is not in use anymore, the others follow when their turn comes
+		writeTextureDescriptor(currentFrame);
+	}
+	uint64_t completed = graphicsTimeline.getCompleted();
+	deletions.collect(completed);
+	collectCaptures(completed);
+
+	// Shared by the views: the transforms, the shadow casters and the sprites
+	updateScene();
+	gatherShadowCasters();
+	spriteBatch.prepare(currentFrame);
+
+	// Each step is spread over the job threads already
+	for (auto& view : views) {
+		prepareView(*view);
+	}
 
-	VkPipelineShaderStageCreateFlags waitDstStageMsk = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	VkSubmitInfo submitInfo = {};
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &graphicsCommandBuffers[imageIndex]; // We want to send on the ith swapchain
-	submitInfo.pWaitDstStageMask = &waitDstStageMsk;
-	submitInfo.waitSemaphoreCount = 1;
-	submitInfo.pWaitSemaphores = &imageIsAvailable;
-	submitInfo.signalSemaphoreCount = 1;
-	submitInfo.pSignalSemaphores = &imageIsRendered;
-	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	// Recorded in parallel, each view from its own command pool
+	jobs.parallelFor(uint32_t(views.size()), 1, [this](uint32_t begin, uint32_t end) {
+		for (uint32_t i = begin; i < end; i++) {
+			recordDrawCommand(*views[i]);
+		}
+	});
+
+	// Compute goes first, graphics only waits for it where its results are read
+	VkPipelineStageFlags computeStages;
+	SyncPoint computeIsDone = compute.submit(currentFrame, computeStages);
+
+	// All the views in one submission
+	Submission submission;
+	submission.wait(computeIsDone, computeStages);
+	std::vector<VkSwapchainKHR> swapchains;
+	std::vector<uint32_t> imageIndices;
+	for (auto& view : views) {
+		submission.cmdBuffers.push_back(view->commandBuffers[currentFrame]);
+		if (view->swapchain == VK_NULL_HANDLE) {
+			continue;
+		}
 
-	// Sends the draw command to the GPU (draws in the buffers)
-	vkQueueSubmit(graphicsQueue, 1, &submitInfo, 0);
+		// First written by the copy at the end of the post chain, then by the overlay
+		submission.binaryWaits.push_back(view->imageIsAvailable[currentFrame]);
+		submission.binaryWaitStages.push_back(VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+		submission.binarySignals.push_back(view->imageIsRendered[view->imageIndex]);
+		swapchains.push_back(view->swapchain);
+		imageIndices.push_back(view->imageIndex);
+	}
+
+	// Sends the draw commands to the GPU (draws in the buffers)
+	frameValues[currentFrame] = graphicsTimeline.submit(submission);
+	deletions.close(frameValues[currentFrame]);
 
 	VkPresentInfoKHR presentInfo = {};
-	presentInfo.pImageIndices = &imageIndex;
-	presentInfo.swapchainCount = 1;
-	presentInfo.pSwapchains = &swapchain;
-	presentInfo.waitSemaphoreCount = 1;
-	presentInfo.pWaitSemaphores = &imageIsRendered;
+	presentInfo.pImageIndices = imageIndices.data();
+	presentInfo.swapchainCount = uint32_t(swapchains.size());
+	presentInfo.pSwapchains = swapchains.data();
+	presentInfo.waitSemaphoreCount = uint32_t(submission.binarySignals.size());
+	presentInfo.pWaitSemaphores = submission.binarySignals.data();
 	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
 
-	// Present the buffer's content to the screen (surface)
-	vkQueuePresentKHR(graphicsQueue, &presentInfo);
+	// Present the buffers' content to the screens (surfaces)
+	if (!swapchains.empty()) {
+		vkQueuePresentKHR(graphicsQueue, &presentInfo);
+	}
 }
 
-void Vulkan::createSwapchain()
+void Vulkan::waitIdle()
 {
+	vkDeviceWaitIdle(device);
+}
+
+void Vulkan::prepareView(View& view)
+{
+	// The last frame drawn with this slot is done: its GPU time gives the scale of this one
+	view.resolution.update(currentFrame);
+	view.renderExtent = view.resolution.getExtent(view.extent);
+	view.renderGraph.setRenderArea(view.mainPass, view.renderExtent);	// With the depth pre-pass, same render pass
+	if (view.lateMainPass != UINT32_MAX) {
+		view.renderGraph.setRenderArea(view.lateMainPass, view.renderExtent);
+	}
+	view.postProcess.setSourceExtent(view.renderExtent);
+
+	loadUniforms(view);
+	view.lighting.prepare(currentFrame, view.viewMatrix, view.fieldOfView, view.renderExtent, view.nearPlane, view.farPlane);
+	view.shadows.prepare(currentFrame, view.viewMatrix, view.fieldOfView, (float)view.extent.width / (float)view.extent.height,
+						 view.nearPlane, view.farPlane, shadowCasters);
+
+	// Draws are sorted again every frame as the camera and the objects move, then culled by the GPU.
+	// The meshlets facing away only get culled when the back faces are.
+	const glm::mat4& projection = view.uniforms.projectionMatrix;
+	CullConstants& culling = view.culling;
+	culling = {};
+	culling.tanHalfFov[1] = tanf(view.fieldOfView * 0.5f);
+	culling.tanHalfFov[0] = culling.tanHalfFov[1] * (float)view.extent.width / (float)view.extent.height;
+	culling.nearPlane = view.nearPlane;
+	culling.farPlane = view.farPlane;
+	culling.projection[0] = projection[0][0];
+	culling.projection[1] = projection[1][1];
+	culling.projection[2] = projection[2][2];
+	culling.projection[3] = projection[3][2];
+	culling.coneCulling = (cullMode & VK_CULL_MODE_BACK_BIT) != 0 ? 1 : 0;
+	view.meshlets.begin(currentFrame);
+	gatherDraws(view);
+}
+
+void Vulkan::createSwapchain(View& view)
+{
+	VkSurfaceKHR surface = view.surface;
 	VkBool32 surfaceSupported = VK_FALSE;
 	vkGetPhysicalDeviceSurfaceSupportKHR(physicalDevice, graphicsFamilyIndex, surface, &surfaceSupported);
 	assert(surfaceSupported == VK_TRUE);
@@ -162,7 +736,7 @@ void Vulkan::createSwapchain()
 	std::vector<VkSurfaceFormatKHR> surfaceFormats(formatsCount);
 	vkGetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, surface, &formatsCount, surfaceFormats.data());
 
-	this->surfaceFormat = surfaceFormats[0];
+	view.format = surfaceFormats[0].format;
 
 	uint32_t presentModesCount;
 	vkGetPhysicalDeviceSurfacePresentModesKHR(physicalDevice, surface, &presentModesCount, nullptr);
@@ -175,6 +749,13 @@ void Vulkan::createSwapchain()
 	swapchainInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
 	swapchainInfo.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
 	swapchainInfo.imageUsage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+	bool copySupported = (surfaceCapabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT) != 0;
+	if (copySupported) {
+		swapchainInfo.imageUsage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+	}
+	if (view.index == 0) {
+		captureSupported = copySupported;
+	}
 	swapchainInfo.queueFamilyIndexCount = 1;
 	swapchainInfo.pQueueFamilyIndices = &graphicsFamilyIndex;
 	swapchainInfo.surface = surface;
@@ -184,24 +765,67 @@ void Vulkan::createSwapchain()
 	swapchainInfo.minImageCount = surfaceCapabilities.minImageCount + 1;
 	swapchainInfo.presentMode = presentModes[0]; // TODO : Choose a better one
 	swapchainInfo.preTransform = surfaceCapabilities.currentTransform;
-	swapchainInfo.oldSwapchain = swapchain;
+	swapchainInfo.oldSwapchain = view.swapchain;
 	swapchainInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
 
-	surfaceExtent = swapchainInfo.imageExtent;
-	VkResult res = vkCreateSwapchainKHR(device, &swapchainInfo, nullptr, &swapchain);
+	view.extent = swapchainInfo.imageExtent;
+	view.renderExtent = view.extent;
+	VkResult res = vkCreateSwapchainKHR(device, &swapchainInfo, nullptr, &view.swapchain);
 	assert(res == VK_SUCCESS);
 
 	uint32_t swapchainImageCount;
-	vkGetSwapchainImagesKHR(device, swapchain, &swapchainImageCount, nullptr);
-	swapchainImages.resize(swapchainImageCount);
-	vkGetSwapchainImagesKHR(device, swapchain, &swapchainImageCount, swapchainImages.data());
+	vkGetSwapchainImagesKHR(device, view.swapchain, &swapchainImageCount, nullptr);
+	view.images.resize(swapchainImageCount);
+	vkGetSwapchainImagesKHR(device, view.swapchain, &swapchainImageCount, view.images.data());
+
+	createImageViews(view);
+}
+
+void Vulkan::createOffscreenImages(View& view)
+{
+	// Written by the end of the post chain like a swapchain image, then read back by whoever uses the view
+	VkImageCreateInfo imageInfo = {};
+	imageInfo.arrayLayers = 1;
+	imageInfo.extent.width = view.extent.width;
+	imageInfo.extent.height = view.extent.height;
+	imageInfo.extent.depth = 1;
+	imageInfo.imageType = VK_IMAGE_TYPE_2D;
+	imageInfo.format = view.format;
+	imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	imageInfo.mipLevels = 1;
+	imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+	imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+	imageInfo.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+	imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+
+	// One per frame in flight: a frame does not overwrite the one being read
+	view.images.resize(frameCount);
+	view.imageMemory.resize(frameCount);
+	for (uint32_t i = 0; i < frameCount; i++) {
+		VkResult res = vkCreateImage(device, &imageInfo, nullptr, &view.images[i]);
+		assert(res == VK_SUCCESS);
+
+		VkMemoryRequirements memReqs;
+		vkGetImageMemoryRequirements(device, view.images[i], &memReqs);
+
+		VkMemoryAllocateInfo memoryAllocInfo = {};
+		memoryAllocInfo.allocationSize = memReqs.size;
+		memoryAllocInfo.memoryTypeIndex = getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+		memoryAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+		res = vkAllocateMemory(device, &memoryAllocInfo, nullptr, &view.imageMemory[i]);
+		assert(res == VK_SUCCESS);
 
-	createSwapchainImageViews();
+		res = vkBindImageMemory(device, view.images[i], view.imageMemory[i], 0);
+		assert(res == VK_SUCCESS);
+	}
+
+	createImageViews(view);
 }
 
-void Vulkan::createSwapchainImageViews()
+void Vulkan::createImageViews(View& view)
 {
-	swapchainImageViews.resize(swapchainImages.size());
+	view.imageViews.resize(view.images.size());
 
 	VkImageSubresourceRange subResourceRange = {};
 	subResourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -215,22 +839,22 @@ void Vulkan::createSwapchainImageViews()
 	imageViewInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
 	imageViewInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
 	imageViewInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
-	imageViewInfo.format = surfaceFormat.format;
+	imageViewInfo.format = view.format;
 	imageViewInfo.subresourceRange = subResourceRange;
 	imageViewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
 	imageViewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
 
 	VkResult res;
-	for (int i = 0; i < swapchainImageViews.size(); i++) {
-		imageViewInfo.image = swapchainImages[i];
-		res = vkCreateImageView(device, &imageViewInfo, nullptr, &swapchainImageViews[i]);
+	for (int i = 0; i < view.imageViews.size(); i++) {
+		imageViewInfo.image = view.images[i];
+		res = vkCreateImageView(device, &imageViewInfo, nullptr, &view.imageViews[i]);
 		assert(res == VK_SUCCESS);
 	}
 }
 
 
 
-void Vulkan::findCompatibleDepthFormat()
+VkFormat Vulkan::findCompatibleDepthFormat(VkFormatFeatureFlags features, bool allowStencil)
 {
 	VkFormat orderedDepthFormatsList[] = {
 		VK_FORMAT_D32_SFLOAT_S8_UINT,
@@ -242,72 +866,78 @@ void Vulkan::findCompatibleDepthFormat()
 
 	VkFormatProperties props;
 	for (VkFormat& format : orderedDepthFormatsList) {
+		bool stencil = format == VK_FORMAT_D32_SFLOAT_S8_UINT || format == VK_FORMAT_D24_UNORM_S8_UINT || format == VK_FORMAT_D16_UNORM_S8_UINT;
+		if (stencil && !allowStencil) {
+			continue;
+		}
 		vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &props);
-		if (props.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) {
-			depthFormat = format;
-			return;
+		if ((props.optimalTilingFeatures & features) == features) {
+			return format;
 		}
 	}
+	return VK_FORMAT_UNDEFINED;
 }
 
-void Vulkan::createDepthBuffer()
+void Vulkan::setSampleCount(VkSampleCountFlagBits samples)
 {
-	VkImageCreateInfo imageCreateInfo = {};
-	imageCreateInfo.arrayLayers = 1;
-	imageCreateInfo.extent.width = surfaceExtent.width;
-	imageCreateInfo.extent.height = surfaceExtent.height;
-	imageCreateInfo.extent.depth = 1;
-	imageCreateInfo.format = depthFormat;
-	imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
-	imageCreateInfo.mipLevels = 1;
-	imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-	imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
-	imageCreateInfo.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
-	imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	sampleCount = samples;
+}
 
-	VkResult res = vkCreateImage(device, &imageCreateInfo, nullptr, &depthBufferImage);
-	assert(res == VK_SUCCESS);
+void Vulkan::setDepthPrepass(bool enabled)
+{
+	useDepthPrepass = enabled;
+}
 
-	VkImageSubresourceRange subResourceRange = {};
-	subResourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT;
-	subResourceRange.baseArrayLayer = 0;
-	subResourceRange.baseMipLevel = 0;
-	subResourceRange.layerCount = 1;
-	subResourceRange.levelCount = 1;
+void Vulkan::setOcclusionCulling(bool enabled)
+{
+	useOcclusionCulling = enabled;
+}
+
+void Vulkan::setCullMode(VkCullModeFlags mode)
+{
+	cullMode = mode;
+}
 
-	VkImageViewCreateInfo depthImageViewCreateInfo = {};
-	depthImageViewCreateInfo.format = depthFormat;
-	depthImageViewCreateInfo.image = depthBufferImage;
-	depthImageViewCreateInfo.subresourceRange = subResourceRange;
-	depthImageViewCreateInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-	depthImageViewCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+void Vulkan::setGpuLightBinning(bool enabled)
+{
+	gpuLightBinning = enabled;
+}
 
-	// MEMORY ALLOCATION IS REQUIRED
-	VkMemoryRequirements memReqs;
-	vkGetImageMemoryRequirements(device, depthBufferImage, &memReqs);
+void Vulkan::chooseSampleCount()
+{
+	// Both the color and the depth attachments must support it, and the depth pyramid must be able to read the depth
+	VkSampleCountFlags supported = capabilities.limits().framebufferColorSampleCounts & capabilities.limits().framebufferDepthSampleCounts;
+	if (useOcclusionCulling) {
+		supported &= capabilities.limits().sampledImageDepthSampleCounts;
+	}
+	while (sampleCount > VK_SAMPLE_COUNT_1_BIT && !(supported & sampleCount)) {
+		sampleCount = VkSampleCountFlagBits(sampleCount >> 1);
+	}
+}
 
-	VkMemoryAllocateInfo allocateInfo = {};
-	allocateInfo.allocationSize = memReqs.size;
-	allocateInfo.memoryTypeIndex = getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-	allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+void Vulkan::createDepthBuffer(View& view)
+{
+	VkImageAspectFlags aspect = VK_IMAGE_ASPECT_DEPTH_BIT;
+	if (depthFormat == VK_FORMAT_D32_SFLOAT_S8_UINT || depthFormat == VK_FORMAT_D24_UNORM_S8_UINT || depthFormat == VK_FORMAT_D16_UNORM_S8_UINT) {
+		aspect |= VK_IMAGE_ASPECT_STENCIL_BIT;
+	}
 
-	res = vkAllocateMemory(device, &allocateInfo, nullptr, &depthBufferMemory);
-	assert(res == VK_SUCCESS);
-	res = vkBindImageMemory(device, depthBufferImage, depthBufferMemory, 0);
-	assert(res == VK_SUCCESS);
+	VkClearValue clearValue = {};
+	clearValue.depthStencil.depth = 1.0f;
+	clearValue.depthStencil.stencil = 0;
 
-	res = vkCreateImageView(device, &depthImageViewCreateInfo, nullptr, &depthBufferImageView);
-	assert(res == VK_SUCCESS);
+	// The render graph creates and allocates it once it knows how the depth is used
+	view.depthBuffer = view.renderGraph.createImage("depth", depthFormat, view.extent, aspect, clearValue, sampleCount);
 }
 
 // TODO : Factorize this
 void Vulkan::prepareVertices()
 {
 	std::vector<Vertex> vertices = {
-		{ { 1.0f, -1.0f, -1.0f },{ 1.0f, 0.0f, 0.0f }, { 0.0f, 0.0f } },
-		{ { 1.0f,  1.0f, -1.0f },{ 1.0f, 0.0f, 0.0f }, { 1.0f, 0.0f } },
-		{ { 1.0f, -1.0f,  1.0f },{ 1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f } },
-		{ { 1.0f,  1.0f,  1.0f },{ 1.0f, 0.0f, 0.0f }, { 1.0f, 1.0f } },
+		{ { 1.0f, -1.0f, -1.0f },{ 1.0f, 0.0f, 0.0f }, { 0.0f, 0.0f }, { 1.0f, 0.0f, 0.0f } },
+		{ { 1.0f,  1.0f, -1.0f },{ 1.0f, 0.0f, 0.0f }, { 1.0f, 0.0f }, { 1.0f, 0.0f, 0.0f } },
+		{ { 1.0f, -1.0f,  1.0f },{ 1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f }, { 1.0f, 0.0f, 0.0f } },
+		{ { 1.0f,  1.0f,  1.0f },{ 1.0f, 0.0f, 0.0f }, { 1.0f, 1.0f }, { 1.0f, 0.0f, 0.0f } },
 	};
 
 	VkBufferCreateInfo vertexBufferInfo = {};
@@ -374,12 +1004,22 @@ void Vulkan::prepareVertices()
 	res = vkBindBufferMemory(device, indexBuffer, indexMemory, 0);
 	assert(res == VK_SUCCESS);
 
+	Mesh quad = {};
+	quad.vertexBuffer = vertexBuffer;
+	quad.indexBuffer = indexBuffer;
+	quad.indexCount = uint32_t(indices.size());
+	meshes.push_back(quad);
 }
 
 void Vulkan::prepareUniforms()
 {
+	// One block per object and per frame, bound with a dynamic offset
+	VkDeviceSize alignment = capabilities.limits().minUniformBufferOffsetAlignment;
+	uniformStride = (sizeof(Uniforms) + alignment - 1) / alignment * alignment;
+
 	VkBufferCreateInfo uniformBufferInfo = {};
-	uniformBufferInfo.size = sizeof(Uniforms);
+	// One region per view, then per frame in flight
+	uniformBufferInfo.size = uniformStride * MAX_OBJECTS * frameCount * MAX_VIEWS;
 	uniformBufferInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
 	uniformBufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
 
@@ -401,125 +1041,233 @@ void Vulkan::prepareUniforms()
 	res = vkBindBufferMemory(device, uniformBuffer, uniformMemory, 0);
 	assert(res == VK_SUCCESS);
 
+	// Stays mapped, written every frame
+	void* data;
+	res = vkMapMemory(device, uniformMemory, 0, VK_WHOLE_SIZE, 0, &data);
+	assert(res == VK_SUCCESS);
+	uniformData = static_cast<uint8_t*>(data);
+
 	uniformDescriptor.buffer = uniformBuffer;
 	uniformDescriptor.offset = 0;
-	uniformDescriptor.range = uniformBufferInfo.size;
+	uniformDescriptor.range = sizeof(Uniforms);
 
-	loadUniforms();
 	createDescriptorPool();
 	setupDescriptorSets();
 }
 
-void Vulkan::loadUniforms()
+void Vulkan::updateScene()
 {
-	static float y = 0.0f;
-	uniforms.modelMatrix = glm::rotate(glm::mat4x4(), y, glm::vec3(0, 1, 1));
-	uniforms.projectionMatrix = glm::perspective(glm::radians(70.0f), (float)surfaceExtent.width/ (float)surfaceExtent.height, 0.1f, 100.0f);
-	uniforms.viewMatrix = glm::translate(glm::mat4x4(), glm::vec3(0.0f, 0.0f, -5.0f));
+	// The test quad turns at the same speed whatever the frame rate
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	quadAngle += QUAD_ROTATION_SPEED * std::chrono::duration<float>(now - lastUpdate).count();
+	lastUpdate = now;
+	scene.setRotation(quadNode, glm::angleAxis(quadAngle, glm::normalize(glm::vec3(0, 1, 1))));
+	scene.update(&jobs);
+
+	// Transforms driven by the scene graph
+	entities.forEachChunk(COMPONENT_BIT(COMPONENT_TRANSFORM) | COMPONENT_BIT(COMPONENT_SCENE_NODE), &jobs, [this](EntityChunk& chunk, uint32_t) {
+		glm::mat4* transforms = chunk.get<glm::mat4>(COMPONENT_TRANSFORM);
+		const uint32_t* nodes = chunk.get<uint32_t>(COMPONENT_SCENE_NODE);
+		for (uint32_t i = 0; i < chunk.count; i++) {
+			transforms[i] = scene.getWorldMatrix(nodes[i]);
+		}
+	});
+
+	// One uniform block per renderable, numbered in iteration order
+	objectCount = entities.count(RENDERABLE_COMPONENTS);
+	assert(objectCount <= MAX_OBJECTS);
+
+	// Replays put back the transforms the trace kept, traces keep them: the draws are gathered from them
+	if (!replayedTransforms.empty()) {
+		assert(replayedTransforms.size() == entities.count(RENDERABLE_COMPONENTS));
+		entities.forEachChunk(RENDERABLE_COMPONENTS, &jobs, [this](EntityChunk& chunk, uint32_t first) {
+			memcpy(chunk.get<glm::mat4>(COMPONENT_TRANSFORM), &replayedTransforms[first], chunk.count * sizeof(glm::mat4));
+		});
+		replayedTransforms.clear();
+	}
+	if (trace.isOpen()) {
+		tracedTransforms.resize(entities.count(RENDERABLE_COMPONENTS));
+		entities.forEachChunk(RENDERABLE_COMPONENTS, &jobs, [this](EntityChunk& chunk, uint32_t first) {
+			memcpy(&tracedTransforms[first], chunk.get<glm::mat4>(COMPONENT_TRANSFORM), chunk.count * sizeof(glm::mat4));
+		});
+		trace.begin(TRACE_FRAME).add(tracedTransforms.data(), tracedTransforms.size() * sizeof(glm::mat4)).end();
+	}
+}
 
-	void* data;
-	VkResult res = vkMapMemory(device, uniformMemory, 0, sizeof(uniforms), 0, &data);
-	assert(res == VK_SUCCESS);
-	memcpy(data, &uniforms, sizeof(uniforms));
-	vkUnmapMemory(device, uniformMemory);
+bool Vulkan::startTrace(const std::string& filename)
+{
+	assert(!initialized);
+	return trace.open(filename);
+}
 
-	y += 0.001f;
+void Vulkan::stopTrace()
+{
+	trace.close();
 }
 
-void Vulkan::loadTexture(const std::string & filename)
+void Vulkan::setTransforms(const glm::mat4* transforms, uint32_t count)
 {
-	// CREATE TEXTURE'S IMAGE
+	replayedTransforms.assign(transforms, transforms + count);
+}
 
+void Vulkan::loadUniforms(View& view)
+{
+	Uniforms& uniforms = view.uniforms;
+	uniforms.projectionMatrix = glm::perspective(view.fieldOfView, (float)view.extent.width / (float)view.extent.height, view.nearPlane, view.farPlane);
+	uniforms.viewMatrix = view.viewMatrix;
+
+	uint8_t* frameData = uniformData + getUniformOffset(view, 0);
+	entities.forEachChunk(RENDERABLE_COMPONENTS, &jobs, [this, &uniforms, frameData](EntityChunk& chunk, uint32_t first) {
+		const glm::mat4* transforms = chunk.get<glm::mat4>(COMPONENT_TRANSFORM);
+		const uint32_t* materialIds = chunk.get<uint32_t>(COMPONENT_MATERIAL);
+		for (uint32_t i = 0; i < chunk.count; i++) {
+			Uniforms* object = reinterpret_cast<Uniforms*>(frameData + (first + i) * uniformStride);
+			object->projectionMatrix = uniforms.projectionMatrix;
+			object->modelMatrix = transforms[i];
+			object->viewMatrix = uniforms.viewMatrix;
+
+			const AtlasRegion& region = atlas.getRegion(materials[materialIds[i]].texture);
+			object->uvTransform = glm::vec4(region.uvOffset[0], region.uvOffset[1], region.uvScale[0], region.uvScale[1]);
+			object->textureLayer = float(region.layer);
+		}
+	});
+}
 
-	int texWidth;
-	int texHeight;
-	int texComp;
+uint32_t Vulkan::getUniformOffset(const View& view, uint32_t object) const
+{
+	return uint32_t(((view.index * frameCount + currentFrame) * MAX_OBJECTS + object) * uniformStride);
+}
 
-	stbi_uc* pixels = stbi_load(filename.c_str(), &texWidth, &texHeight, &texComp, STBI_rgb_alpha);
-	assert(pixels);
+uint32_t Vulkan::loadTexture(const std::string & filename)
+{
+	return loadTextures({ filename })[0];
+}
 
+std::vector<uint32_t> Vulkan::loadTextures(const std::vector<std::string>& filenames)
+{
+	std::vector<DecodedTexture> decoded = decodeTextures(filenames);
+	return addTextures(decoded);
+}
 
-	VkImage hostImage;
-	VkDeviceMemory hostMemory;
+std::vector<DecodedTexture> Vulkan::decodeTextures(const std::vector<std::string>& filenames)
+{
+	std::vector<DecodedTexture> decoded(filenames.size());
+
+	// Decoded on every thread, with the channels of the file: the expansion to RGBA is done when added
+	jobs.parallelFor(uint32_t(filenames.size()), 1, [&](uint32_t begin, uint32_t end) {
+		for (uint32_t i = begin; i < end; i++) {
+			DecodedTexture& texture = decoded[i];
+			texture.pixels = stbi_load(filenames[i].c_str(), &texture.width, &texture.height, &texture.channels, 0);
+			assert(texture.pixels);
+		}
+	});
+	return decoded;
+}
 
-	vk::createImage(
-		physicalDevice,
-		device,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		VK_IMAGE_TILING_LINEAR,
-		VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
-		hostImage, texWidth, texHeight, hostMemory);
+std::vector<uint32_t> Vulkan::addTextures(std::vector<DecodedTexture>& decoded)
+{
+	// Packed tallest first, they leave fewer holes under the skyline
+	std::vector<uint32_t> order(decoded.size());
+	for (uint32_t i = 0; i < order.size(); i++) {
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(), [&decoded](uint32_t a, uint32_t b) { return decoded[a].height > decoded[b].height; });
+	std::vector<AtlasWrite> writes(decoded.size());
+	for (uint32_t i : order) {
+		writes[i] = atlas.allocate(uint32_t(decoded[i].width), uint32_t(decoded[i].height));
+	}
 
+	// Converted straight into the staging memory, on the GPU after the next uploadResources()
+	uint32_t flags = INGEST_PREMULTIPLY;
+	if (atlas.getFormat() == VK_FORMAT_R8G8B8A8_SRGB) {
+		flags |= INGEST_SRGB;
+	}
+	std::vector<uint32_t> regions(decoded.size());
+	jobs.parallelFor(uint32_t(decoded.size()), 1, [&](uint32_t begin, uint32_t end) {
+		for (uint32_t i = begin; i < end; i++) {
+			DecodedTexture& texture = decoded[i];
+			ingest::convertToRGBA(texture.pixels, uint32_t(texture.channels), uint32_t(texture.width), uint32_t(texture.height),
+								  writes[i].pixels, writes[i].pitch, flags);
+			stbi_image_free(texture.pixels);
+			texture.pixels = nullptr;
+			regions[i] = writes[i].region;
+		}
+	});
+	return regions;
+}
 
-	void* data;
-	VkDeviceSize size = texHeight * texHeight * 4;
-	VkResult res = vkMapMemory(device, hostMemory, 0, size, 0, &data);
-	assert(res == VK_SUCCESS);
-	memcpy(data, pixels, size_t(size));
-	vkUnmapMemory(device, hostImage);
+uint32_t Vulkan::addPlaceholderTexture()
+{
+	// Mid grey: neither the lighting nor the bloom stand out until the real one is there
+	std::vector<uint8_t> pixels(4 * 4 * 4, 0x80);
+	for (size_t i = 3; i < pixels.size(); i += 4) {
+		pixels[i] = 0xFF;
+	}
+	return atlas.add(pixels.data(), 4, 4);
+}
 
-	// LAYOUTS TRANSITION
-	VkImage deviceImage;
-	VkDeviceMemory deviceMemory;
+void Vulkan::streamTextures()
+{
+	if (streamedTextures.empty() || !JobSystem::isDone(texturesDecoded)) {
+		return;
+	}
 
-	
-	vk::createImage(
-		physicalDevice,
-		device,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-		VK_IMAGE_TILING_LINEAR,
-		VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-		deviceImage, texWidth, texHeight, deviceMemory);
-
-	vk::changeImageLayout(graphicsQueue, hostImage, VK_IMAGE_LAYOUT_PREINITIALIZED, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, commandPool, device);
-	vk::changeImageLayout(graphicsQueue, deviceImage, VK_IMAGE_LAYOUT_PREINITIALIZED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, commandPool, device);
-
-	vk::copyImage(graphicsQueue, hostImage, deviceImage, texWidth, texHeight, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT, commandPool, device);
-	vk::changeImageLayout(graphicsQueue, deviceImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, commandPool, device);
-	
-	texture.width = texWidth;
-	texture.height = texHeight;
-	texture.memory = deviceMemory;
-	texture.image = deviceImage;
+	std::vector<DecodedTexture> decoded;
+	for (const StreamedTexture& texture : streamedTextures) {
+		decoded.push_back(texture.decoded);
+	}
+	std::vector<uint32_t> regions = addTextures(decoded);
+
+	// Same queue as the frames: the upload comes after the ones in flight and before this one.
+	// A new atlas image is written to the set of each frame as it comes around, the previous one is released
+	// by the deletion queue once the frames sampling it are done.
+	uploadResources();
+	for (size_t i = 0; i < streamedTextures.size(); i++) {
+		materials[streamedTextures[i].material].texture = regions[i];
+	}
+	streamedTextures.clear();
+}
+
+void Vulkan::uploadResources()
+{
+	// One submission for everything loaded since the last upload, nobody waits for it:
+	// the frames are submitted after it on the same queue, the barriers order them
+	VkCommandBuffer cmdBuffer = vk::createAndBeginCommandBuffer(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT, commandPool, device);
+	if (atlas.upload(cmdBuffer, deletions)) {
+		atlasGeneration++;
+	}
+	spriteBatch.upload(cmdBuffer, deletions);
+	meshletGeometry.upload(cmdBuffer, deletions);
+	vkEndCommandBuffer(cmdBuffer);
+
+	Submission upload;
+	upload.cmdBuffers.push_back(cmdBuffer);
+	graphicsTimeline.submit(upload);
 
-	vkDestroyImage(device, hostImage, nullptr);
-	vkFreeMemory(device, hostMemory, nullptr);
+	// Released once the upload is done
+	deletions.free(commandPool, cmdBuffer);
+	deletions.close(graphicsTimeline.getSubmitted());
 }
 
 void Vulkan::loadSampler()
 {
-	// ACCESS THE IMAGE THROUGH THE VIEW
-	VkImageViewCreateInfo viewInfo = {};
-	viewInfo.format = VK_FORMAT_R8G8B8A8_UNORM;
-	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-	viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-	viewInfo.subresourceRange.baseArrayLayer = 0;
-	viewInfo.subresourceRange.baseMipLevel = 0;
-	viewInfo.subresourceRange.layerCount = 1;
-	viewInfo.subresourceRange.levelCount = 1;
-	viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-	viewInfo.image = texture.image;
-
-	VkResult res = vkCreateImageView(device, &viewInfo, nullptr, &texture.view);
-	assert(res == VK_SUCCESS);
-
-	// CREATING THE SAMPLER
+	// Atlas regions must not wrap into their neighbours
 	VkSamplerCreateInfo samplerInfo = {};
-	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_MIRRORED_REPEAT;
-	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_MIRRORED_REPEAT;
-	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_MIRRORED_REPEAT;
-	samplerInfo.anisotropyEnable = VK_TRUE;
+	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.anisotropyEnable = capabilities.enabled.samplerAnisotropy;
 	samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
 	samplerInfo.compareEnable = VK_FALSE;
 	samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
 	samplerInfo.magFilter = VK_FILTER_LINEAR;
-	samplerInfo.maxAnisotropy = 8;
+	samplerInfo.minFilter = VK_FILTER_LINEAR;
+	samplerInfo.maxAnisotropy = capabilities.limits().maxSamplerAnisotropy < 8.0f ? capabilities.limits().maxSamplerAnisotropy : 8.0f;
 	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
 	samplerInfo.unnormalizedCoordinates = VK_FALSE;
 	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
 
-	res = vkCreateSampler(device, &samplerInfo, nullptr, &texture.sampler);
-	assert(res == VK_SUCCESS);
+	textureSampler = samplers.get(samplerInfo);
 }
 
 uint32_t Vulkan::getMemoryType(uint32_t typeBits, VkFlags properties)
@@ -540,17 +1288,18 @@ uint32_t Vulkan::getMemoryType(uint32_t typeBits, VkFlags properties)
 
 void Vulkan::createDescriptorPool()
 {
+	// One set per frame in flight: the atlas can change while the others are in use
 	VkDescriptorPoolSize uniformDescriptor = {};
-	uniformDescriptor.descriptorCount = 1;
-	uniformDescriptor.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	uniformDescriptor.descriptorCount = frameCount;
+	uniformDescriptor.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 
 	VkDescriptorPoolSize samplerDescriptor = {};
-	samplerDescriptor.descriptorCount = 1;
+	samplerDescriptor.descriptorCount = frameCount;
 	samplerDescriptor.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
 
 	VkDescriptorPoolSize descriptors[] = { uniformDescriptor, samplerDescriptor };
 	VkDescriptorPoolCreateInfo descriptorPoolInfo = {};
-	descriptorPoolInfo.maxSets = 1;
+	descriptorPoolInfo.maxSets = frameCount;
 	descriptorPoolInfo.poolSizeCount = 2;
 	descriptorPoolInfo.pPoolSizes = descriptors;
 	descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
@@ -564,7 +1313,7 @@ void Vulkan::setupDescriptorSets()
 	VkDescriptorSetLayoutBinding uniformBinding = {};
 	uniformBinding.descriptorCount = 1;
 	uniformBinding.binding = 0;
-	uniformBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	uniformBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC; // Offset given per object
 	uniformBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 
 	VkDescriptorSetLayoutBinding samplerBinding = {};
@@ -582,169 +1331,524 @@ void Vulkan::setupDescriptorSets()
 	VkResult res = vkCreateDescriptorSetLayout(device, &descriptorSetLayoutInfo, nullptr, &descriptorSetLayout);
 	assert(res == VK_SUCCESS);
 
-	// Add a new descriptor using the descriptor pool
+	// Add new descriptors using the descriptor pool, one per frame in flight
+	std::vector<VkDescriptorSetLayout> setLayouts(frameCount, descriptorSetLayout);
 	VkDescriptorSetAllocateInfo descriptorSetAllocInfo = {};
 	descriptorSetAllocInfo.descriptorPool = descriptorPool;
-	descriptorSetAllocInfo.descriptorSetCount = 1;
-	descriptorSetAllocInfo.pSetLayouts = &descriptorSetLayout;
+	descriptorSetAllocInfo.descriptorSetCount = frameCount;
+	descriptorSetAllocInfo.pSetLayouts = setLayouts.data();
 	descriptorSetAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
 
-	res = vkAllocateDescriptorSets(device, &descriptorSetAllocInfo, &descriptorSet);
+	descriptorSets.resize(frameCount);
+	res = vkAllocateDescriptorSets(device, &descriptorSetAllocInfo, descriptorSets.data());
 	assert(res == VK_SUCCESS);
 
-	VkDescriptorImageInfo textureDescriptor = {};
-	textureDescriptor.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-	textureDescriptor.imageView = texture.view;
-	textureDescriptor.sampler = texture.sampler;
-
-	// Match binding points to the descirptor set
-
-	// Binding : 0
-	VkWriteDescriptorSet writeDescriptorSets[2];
-	writeDescriptorSets[0] = {};
-	writeDescriptorSets[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-	writeDescriptorSets[0].descriptorCount = 1;
-	writeDescriptorSets[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	writeDescriptorSets[0].dstSet = descriptorSet;
-	writeDescriptorSets[0].pBufferInfo = &uniformDescriptor;
-	writeDescriptorSets[0].dstBinding = 0;
-
-	// Binding : 1
-	writeDescriptorSets[1] = {};
-	writeDescriptorSets[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-	writeDescriptorSets[1].descriptorCount = 1;
-	writeDescriptorSets[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-	writeDescriptorSets[1].dstSet = descriptorSet;
-	writeDescriptorSets[1].pImageInfo = &textureDescriptor;
-	writeDescriptorSets[1].dstBinding = 1;
+	// Match binding points to the descriptor sets: the uniforms do not change, the atlas does
+	textureGenerations.resize(frameCount);
+	for (uint32_t frame = 0; frame < frameCount; frame++) {
+		VkWriteDescriptorSet writeDescriptorSet = {};
+		writeDescriptorSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writeDescriptorSet.descriptorCount = 1;
+		writeDescriptorSet.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+		writeDescriptorSet.dstSet = descriptorSets[frame];
+		writeDescriptorSet.pBufferInfo = &uniformDescriptor;
+		writeDescriptorSet.dstBinding = 0;
+		vkUpdateDescriptorSets(device, 1, &writeDescriptorSet, 0, nullptr);
+		writeTextureDescriptor(frame);
+	}
 
-	vkUpdateDescriptorSets(device, 2, writeDescriptorSets, 0, nullptr);
- }
+	Material material;
+	material.pipeline = 0; // Chosen with the pipelines
+	material.meshletPipeline = UINT32_MAX;
+	material.texture = 0;
+	materials.push_back(material);
+}
 
-void Vulkan::createSurface(GLFWwindow* window)
+void Vulkan::writeTextureDescriptor(uint32_t frame)
 {
-	glfwCreateWindowSurface(instance, window, nullptr, &surface);
+	VkDescriptorImageInfo textureDescriptor = {};
+	textureDescriptor.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	textureDescriptor.imageView = atlas.getView();
+	textureDescriptor.sampler = textureSampler;
+
+	VkWriteDescriptorSet writeDescriptorSet = {};
+	writeDescriptorSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	writeDescriptorSet.descriptorCount = 1;
+	writeDescriptorSet.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	writeDescriptorSet.dstSet = descriptorSets[frame];
+	writeDescriptorSet.pImageInfo = &textureDescriptor;
+	writeDescriptorSet.dstBinding = 1;
+	vkUpdateDescriptorSets(device, 1, &writeDescriptorSet, 0, nullptr);
+	textureGenerations[frame] = atlasGeneration;
 }
 
 void Vulkan::createCommandBuffers()
 {
 	VkCommandPoolCreateInfo commandPoolInfo = {};
+	commandPoolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT; // Recorded again every frame
 	commandPoolInfo.queueFamilyIndex = graphicsFamilyIndex;
 	commandPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
 	VkResult res = vkCreateCommandPool(device, &commandPoolInfo, nullptr, &commandPool);
 	assert(res == VK_SUCCESS);
 
-	// One buffer per image on the swapchain
+	// The views record into their own pools.
+	// Value 0 is reached from the start: nothing to wait for on the first use of each frame in flight
+	frameValues.resize(frameCount, 0);
+}
 
-	for (int i = 0; i < swapchainImages.size(); i++) {
-		graphicsCommandBuffers.push_back(vk::createCommandBuffer(commandPool, device));
-	}
+void Vulkan::gatherDraws(View& view)
+{
+	// Same numbering as the uniform blocks: the commands point at them by index
+	uint32_t count = entities.count(RENDERABLE_COMPONENTS);
+
+	// Every chunk writes its own range of the lists: no lock while gathering
+	DrawList& drawList = view.drawList;
+	DrawList& depthDrawList = view.depthDrawList;
+	drawList.resize(count);
+	depthDrawList.resize(useDepthPrepass ? count : 0);
+	view.objects.begin(currentFrame, count);
+
+	glm::mat4 viewMatrix = view.viewMatrix;
+	float farPlane = view.farPlane;
+	entities.forEachChunk(RENDERABLE_COMPONENTS, &jobs, [&, viewMatrix, farPlane](EntityChunk& chunk, uint32_t first) {
+		const uint32_t* meshIds = chunk.get<uint32_t>(COMPONENT_MESH);
+		const uint32_t* materialIds = chunk.get<uint32_t>(COMPONENT_MATERIAL);
+		const glm::mat4* transforms = chunk.get<glm::mat4>(COMPONENT_TRANSFORM);
+		const Bounds* bounds = chunk.get<Bounds>(COMPONENT_BOUNDS);
+		DrawCommand* commands = drawList.data() + first;
+		DrawCommand* depthCommands = depthDrawList.data() + first;
+
+		for (uint32_t i = 0; i < chunk.count; i++) {
+			glm::mat4 modelView = viewMatrix * transforms[i];
+			glm::vec4 center = modelView * glm::vec4(bounds[i].center, 1.0f);
+			float depth = -center.z;
+
+			// Clustered meshes go through the meshlet culling while it has room for them
+			const Mesh& mesh = meshes[meshIds[i]];
+			const Material& material = materials[materialIds[i]];
+			float scale = getMaxScale(transforms[i]);
+			DrawCommand& command = commands[i];
+			command.instance = UINT32_MAX;
+			if (mesh.meshletCount > 0 && material.meshletPipeline != UINT32_MAX) {
+				command.instance = view.meshlets.addInstance(modelView, scale, mesh.firstMeshlet, mesh.meshletCount, mesh.triangleCount);
+			}
+			command.pipeline = command.instance != UINT32_MAX ? material.meshletPipeline : material.pipeline;
+			command.material = materialIds[i];
+			command.mesh = meshIds[i];
+			command.object = first + i;
+			command.key = DrawList::makeKey(command.pipeline, command.material, depth, farPlane, command.mesh);
+
+			// The others by the object culling, with the range of their mesh
+			CulledObject culled = {};
+			culled.center[0] = center.x;
+			culled.center[1] = center.y;
+			culled.center[2] = center.z;
+			culled.radius = bounds[i].radius * scale;
+			if (command.instance == UINT32_MAX) {
+				culled.indexCount = mesh.indexCount;
+				culled.firstIndex = mesh.firstIndex;
+				culled.vertexOffset = mesh.vertexOffset;
+			}
+			view.objects.setObject(command.object, culled);
+
+			if (useDepthPrepass) {
+				depthCommands[i] = command;
+				depthCommands[i].key = DrawList::makeDepthKey(command.pipeline, depth, farPlane, command.mesh);
+			}
+		}
+	});
+
+	drawList.sort();
+	depthDrawList.sort();
+}
+
+void Vulkan::gatherShadowCasters()
+{
+	uint32_t casters = COMPONENT_BIT(COMPONENT_MESH) | COMPONENT_BIT(COMPONENT_TRANSFORM) | COMPONENT_BIT(COMPONENT_BOUNDS);
+	shadowCasters.resize(entities.count(casters));
+
+	// Same order every frame while the entities do not change: the cascades tell the moving ones apart
+	entities.forEachChunk(casters, &jobs, [this](EntityChunk& chunk, uint32_t first) {
+		const uint32_t* meshIds = chunk.get<uint32_t>(COMPONENT_MESH);
+		const glm::mat4* transforms = chunk.get<glm::mat4>(COMPONENT_TRANSFORM);
+		const Bounds* bounds = chunk.get<Bounds>(COMPONENT_BOUNDS);
+		for (uint32_t i = 0; i < chunk.count; i++) {
+			const Mesh& mesh = meshes[meshIds[i]];
+			const glm::mat4& transform = transforms[i];
+			ShadowCaster& caster = shadowCasters[first + i];
+			caster.vertexBuffer = mesh.vertexBuffer;
+			caster.indexBuffer = mesh.indexBuffer;
+			caster.indexCount = mesh.indexCount;
+			caster.firstIndex = mesh.firstIndex;
+			caster.vertexOffset = mesh.vertexOffset;
+			caster.transform = transform;
+
+			// World space sphere, scaled by the largest axis
+			glm::vec4 center = transform * glm::vec4(bounds[i].center, 1.0f);
+			caster.center = glm::vec3(center.x, center.y, center.z);
+			caster.radius = bounds[i].radius * getMaxScale(transform);
+		}
+	});
 }
 
-void Vulkan::recordDrawCommand()
+// On a job thread: only touches the view, and the captures for the first one
+void Vulkan::recordDrawCommand(View& view)
 {
 	VkCommandBufferBeginInfo beginInfo = {};
-	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
 
-	VkImageSubresourceRange subResourceRange = {};
-	subResourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-	subResourceRange.baseArrayLayer = 0;
-	subResourceRange.layerCount = 1;
-	subResourceRange.baseMipLevel = 0;
-	subResourceRange.levelCount = 1;
+	// PIPELINE BARRIERS ARE DERIVED BY THE RENDER GRAPH
+
+	VkCommandBuffer cmdBuffer = view.commandBuffers[currentFrame];
+	vkResetCommandBuffer(cmdBuffer, 0);
+	vkBeginCommandBuffer(cmdBuffer, &beginInfo);
 
-	VkClearValue clearValues[2];
-	clearValues[0].color = {0.0f, 0.0f, 0.0f, 1.0f};
-	clearValues[1].depthStencil.depth = 1.0f;
-	clearValues[1].depthStencil.stencil = 0.0f;
+	// Layered depth image and early culling, outside of the graph: the passes only read them
+	view.resolution.begin(cmdBuffer, currentFrame);
+	view.shadows.record(cmdBuffer);
+	cullDraws(view, cmdBuffer, CULL_EARLY);
+	view.renderGraph.execute(cmdBuffer, view.imageIndex);
+	view.resolution.end(cmdBuffer, currentFrame);
 
-	// PIPELINE BARRIER NOT NEEDED IF THERE IS A RENDERPASS
+	if (view.index != 0) {
+		vkEndCommandBuffer(cmdBuffer);
+		return;
+	}
 
-	VkRenderPassBeginInfo renderPassBegin = {};
-	renderPassBegin.clearValueCount = 2;
-	renderPassBegin.pClearValues = clearValues;
-	renderPassBegin.renderArea.extent = surfaceExtent;
-	renderPassBegin.renderArea.offset = { 0, 0 };
-	renderPassBegin.renderPass = renderPass;
-	renderPassBegin.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+	// Copied after the last pass, the copy is read once this submission is done
+	bool streaming = stream.isRunning();
+	if ((streaming || !captureRequests.empty()) && !capture.isFull()) {
+		CaptureRequest request = {};
+		if (!captureRequests.empty()) {
+			request = captureRequests.front();
+			captureRequests.pop_front();
+		}
+		request.streamed = streaming;
 
+		VkImageLayout layout = view.swapchain != VK_NULL_HANDLE ? VK_IMAGE_LAYOUT_PRESENT_SRC_KHR : VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		capture.record(cmdBuffer, view.images[view.imageIndex], layout,
+					   graphicsTimeline.getSubmitted() + 1, request.filename);
+		capturesInFlight.push_back(request);
+	}
+	else if (streaming) {
+		stream.drop();
+	}
+	vkEndCommandBuffer(cmdBuffer);
+}
+
+void Vulkan::cullDraws(View& view, VkCommandBuffer cmdBuffer, CullPhase phase)
+{
+	// The early phase tests the pyramid of the previous frame, the late one the pyramid just built from the early draws.
+	// Its image is made readable even when nothing tests it: the culling sets point to it.
+	CullConstants constants = view.culling;
+	constants.phase = phase;
+	if (phase == CULL_EARLY) {
+		view.pyramid.prepare(cmdBuffer);
+	}
+	if (useOcclusionCulling) {
+		view.pyramid.setConstants(constants);
+	}
+	view.objects.record(cmdBuffer, currentFrame, constants);
+	view.meshlets.record(cmdBuffer, currentFrame, constants);
+}
+
+void Vulkan::drawDepthPrepass(const View& view, VkCommandBuffer cmdBuffer, CullPhase phase)
+{
 	VkDeviceSize offsets = { 0 };
+	uint32_t boundPipeline = UINT32_MAX;
+	uint32_t boundMesh = UINT32_MAX;
+
+	setSceneViewport(view, cmdBuffer);
+
+	// Declared by color.frag even when the lighting is compiled out
+	VkDescriptorSet frameSets[] = { view.lighting.getDescriptorSet(currentFrame), view.shadows.getDescriptorSet(currentFrame),
+									view.meshlets.getDrawSet(currentFrame) };
+	vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 1, 3, frameSets, 0, nullptr);
 
-	for (uint32_t i = 0; i < swapchainImages.size(); i++) {
-		renderPassBegin.framebuffer = frameBuffers[i];
+	for (const DrawCommand& command : view.depthDrawList) {
+		if (command.pipeline != boundPipeline) {
+			vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.depthPrepass[command.pipeline]);
+			boundPipeline = command.pipeline;
+		}
+
+		// The material only matters to the alpha tested draws
+		uint32_t uniformOffset = getUniformOffset(view, command.object);
+		vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[currentFrame], 1, &uniformOffset);
 
-		vkBeginCommandBuffer(graphicsCommandBuffers[i], &beginInfo);
-		vkCmdBeginRenderPass(graphicsCommandBuffers[i], &renderPassBegin, VK_SUBPASS_CONTENTS_INLINE);
-		
-		vkCmdBindDescriptorSets(graphicsCommandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
-		vkCmdBindPipeline(graphicsCommandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
-		vkCmdBindVertexBuffers(graphicsCommandBuffers[i], VERTEX_BINDING_ID, 1, &vertexBuffer, &offsets);
-		vkCmdBindIndexBuffer(graphicsCommandBuffers[i], indexBuffer, 0, VK_INDEX_TYPE_UINT32);
-		vkCmdDrawIndexed(graphicsCommandBuffers[i], 6, 1, 0, 0, 1);
+		if (command.instance != UINT32_MAX) {
+			// Triangles of its visible meshlets, from the index buffer of the culling
+			view.meshlets.draw(cmdBuffer, currentFrame, command.instance, phase);
+			boundMesh = UINT32_MAX;
+			continue;
+		}
 
-		vkCmdEndRenderPass(graphicsCommandBuffers[i]);
-		vkEndCommandBuffer(graphicsCommandBuffers[i]);
+		const Mesh& mesh = meshes[command.mesh];
+		if (command.mesh != boundMesh) {
+			vkCmdBindVertexBuffers(cmdBuffer, VERTEX_BINDING_ID, 1, &mesh.vertexBuffer, &offsets);
+			vkCmdBindIndexBuffer(cmdBuffer, mesh.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+			boundMesh = command.mesh;
+		}
+		view.objects.draw(cmdBuffer, currentFrame, command.object, phase);
 	}
 }
 
-void Vulkan::createRenderPass()
+void Vulkan::drawScene(const View& view, VkCommandBuffer cmdBuffer, CullPhase phase)
 {
-	VkAttachmentDescription attachmentDescriptions[2];
+	VkDeviceSize offsets = { 0 };
+	uint32_t boundPipeline = UINT32_MAX;
+	uint32_t boundMesh = UINT32_MAX;
 
-	attachmentDescriptions[0] = {};
-	attachmentDescriptions[0].format = surfaceFormat.format;
-	attachmentDescriptions[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-	attachmentDescriptions[0].finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-	attachmentDescriptions[0].samples = VK_SAMPLE_COUNT_1_BIT;
-	attachmentDescriptions[0].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-	attachmentDescriptions[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-	attachmentDescriptions[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-	attachmentDescriptions[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-	
-	attachmentDescriptions[1] = {};
-	attachmentDescriptions[1].format = depthFormat;
-	attachmentDescriptions[1].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-	attachmentDescriptions[1].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-	attachmentDescriptions[1].samples = VK_SAMPLE_COUNT_1_BIT;
-	attachmentDescriptions[1].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-	attachmentDescriptions[1].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-	attachmentDescriptions[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-	attachmentDescriptions[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-
-	VkAttachmentReference colorAttachment = {};
-	colorAttachment.attachment = 0;
-	colorAttachment.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-
-	VkAttachmentReference depthAttachment = {};
-	depthAttachment.attachment = 1;
-	depthAttachment.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-	
-	VkSubpassDescription subPassDescription = {};
-	subPassDescription.colorAttachmentCount = 1;
-	subPassDescription.pColorAttachments = &colorAttachment;
-	subPassDescription.pDepthStencilAttachment = &depthAttachment;
-	subPassDescription.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-	
-	VkRenderPassCreateInfo renderPassInfo = {};
-	renderPassInfo.attachmentCount = 2;
-	renderPassInfo.pAttachments = attachmentDescriptions;
-	renderPassInfo.subpassCount = 1;
-	renderPassInfo.pSubpasses = &subPassDescription;
-	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-
-	VkResult res = vkCreateRenderPass(device, &renderPassInfo, nullptr, &renderPass);
-	assert(res == VK_SUCCESS);
+	setSceneViewport(view, cmdBuffer);
+
+	// The lights, shadows and meshlets of the frame stay bound, the sets of the materials come before them
+	VkDescriptorSet frameSets[] = { view.lighting.getDescriptorSet(currentFrame), view.shadows.getDescriptorSet(currentFrame),
+									view.meshlets.getDrawSet(currentFrame) };
+	vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 1, 3, frameSets, 0, nullptr);
+
+	// The list is sorted by state: only bind what changes between two draws
+	for (const DrawCommand& command : view.drawList) {
+		if (command.pipeline != boundPipeline) {
+			vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.graphics[command.pipeline]);
+			boundPipeline = command.pipeline;
+		}
+
+		// The set of the material, with the uniforms of the object
+		uint32_t uniformOffset = getUniformOffset(view, command.object);
+		vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[currentFrame], 1, &uniformOffset);
+
+		if (command.instance != UINT32_MAX) {
+			// Triangles of its visible meshlets, from the index buffer of the culling
+			view.meshlets.draw(cmdBuffer, currentFrame, command.instance, phase);
+			boundMesh = UINT32_MAX;
+			continue;
+		}
+
+		const Mesh& mesh = meshes[command.mesh];
+		if (command.mesh != boundMesh) {
+			vkCmdBindVertexBuffers(cmdBuffer, VERTEX_BINDING_ID, 1, &mesh.vertexBuffer, &offsets);
+			vkCmdBindIndexBuffer(cmdBuffer, mesh.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+			boundMesh = command.mesh;
+		}
+		view.objects.draw(cmdBuffer, currentFrame, command.object, phase);
+	}
+}
+
+void Vulkan::setSceneViewport(const View& view, VkCommandBuffer cmdBuffer)
+{
+	// Scaled with the resolution, same aspect ratio: the projection does not change
+	VkViewport viewport = {};
+	viewport.width = float(view.renderExtent.width);
+	viewport.height = float(view.renderExtent.height);
+	viewport.maxDepth = 1.0f;
+	vkCmdSetViewport(cmdBuffer, 0, 1, &viewport);
+
+	VkRect2D scissor = {};
+	scissor.extent = view.renderExtent;
+	vkCmdSetScissor(cmdBuffer, 0, 1, &scissor);
+}
+
+void Vulkan::drawOverlay(const View& view, VkCommandBuffer cmdBuffer)
+{
+	// Any dynamic offset does for the atlas
+	spriteBatch.record(cmdBuffer, currentFrame, view.extent, descriptorSets[currentFrame], getUniformOffset(view, 0));
+}
+
+void Vulkan::createRenderPass(View& view)
+{
+	VkClearValue clearColor = {};
+	clearColor.color = { 0.0f, 0.0f, 0.0f, 1.0f };
+
+	// Presented, or copied out of the offscreen image
+	RenderGraph& renderGraph = view.renderGraph;
+	bool offscreen = view.swapchain == VK_NULL_HANDLE;
+	view.backBuffer = renderGraph.importImage("backbuffer", view.format, view.extent, view.images, view.imageViews,
+											  offscreen ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, clearColor);
+	view.hdrBuffer = renderGraph.createImage("hdr", HDR_FORMAT, view.extent, VK_IMAGE_ASPECT_COLOR_BIT, clearColor);
+
+	// Lays the depth down first so that the main pass shades each pixel only once
+	const View* drawn = &view;
+	if (useDepthPrepass) {
+		view.depthPrepass = renderGraph.addPass("depthPrepass", [this, drawn](VkCommandBuffer cmdBuffer) { drawDepthPrepass(*drawn, cmdBuffer, CULL_EARLY); });
+		renderGraph.setDepthOutput(view.depthPrepass, view.depthBuffer);
+	}
+
+	// Same subpasses, formats and samples in every view: the render passes are compatible with the pipelines
+	view.mainPass = renderGraph.addPass("main", [this, drawn](VkCommandBuffer cmdBuffer) { drawScene(*drawn, cmdBuffer, CULL_EARLY); });
+	if (sampleCount == VK_SAMPLE_COUNT_1_BIT) {
+		renderGraph.addColorOutput(view.mainPass, view.hdrBuffer);
+	}
+	else {
+		// MSAA: resolved into the HDR image at the end of the subpass
+		view.colorBuffer = renderGraph.createImage("color", HDR_FORMAT, view.extent, VK_IMAGE_ASPECT_COLOR_BIT, clearColor, sampleCount);
+		renderGraph.addColorOutput(view.mainPass, view.colorBuffer, view.hdrBuffer);
+	}
+	if (useDepthPrepass) {
+		renderGraph.setDepthInput(view.mainPass, view.depthBuffer);
+	}
+	else {
+		renderGraph.setDepthOutput(view.mainPass, view.depthBuffer);
+	}
+
+	// Occlusion culling: the pyramid is built from the depth of the early passes, then the late passes
+	// draw what it no longer hides over them, with the same subpasses
+	if (useOcclusionCulling) {
+		View* culled = &view;
+		uint32_t pyramidPass = renderGraph.addCommandPass("depthPyramid", [this, culled](VkCommandBuffer cmdBuffer) {
+			culled->pyramid.record(cmdBuffer, culled->renderExtent);
+			cullDraws(*culled, cmdBuffer, CULL_LATE);
+		});
+		renderGraph.addComputeInput(pyramidPass, view.depthBuffer);
+
+		if (useDepthPrepass) {
+			view.lateDepthPrepass = renderGraph.addPass("lateDepthPrepass", [this, drawn](VkCommandBuffer cmdBuffer) { drawDepthPrepass(*drawn, cmdBuffer, CULL_LATE); });
+			renderGraph.setDepthOutput(view.lateDepthPrepass, view.depthBuffer);
+		}
+		view.lateMainPass = renderGraph.addPass("lateMain", [this, drawn](VkCommandBuffer cmdBuffer) { drawScene(*drawn, cmdBuffer, CULL_LATE); });
+		if (sampleCount == VK_SAMPLE_COUNT_1_BIT) {
+			renderGraph.addColorOutput(view.lateMainPass, view.hdrBuffer);
+		}
+		else {
+			renderGraph.addColorOutput(view.lateMainPass, view.colorBuffer, view.hdrBuffer);
+		}
+		if (useDepthPrepass) {
+			renderGraph.setDepthInput(view.lateMainPass, view.depthBuffer);
+		}
+		else {
+			renderGraph.setDepthOutput(view.lateMainPass, view.depthBuffer);
+		}
+	}
+
+	// Bloom and tonemapping into the target, the sprites go over the result of the first view
+	view.postProcess.addPasses(renderGraph, view.hdrBuffer, view.backBuffer, view.extent);
+	if (view.index == 0) {
+		view.overlayPass = renderGraph.addPass("overlay", [this, drawn](VkCommandBuffer cmdBuffer) { drawOverlay(*drawn, cmdBuffer); });
+		renderGraph.addColorOutput(view.overlayPass, view.backBuffer);
+	}
+
+	// Load/store ops, layouts and dependencies are deduced from the passes:
+	// without occlusion culling the depth and multisampled color are never read back
+	// so they are not stored and can stay transient (lazily allocated when the GPU allows it)
+	renderGraph.compile();
+	view.postProcess.createDescriptorSets(renderGraph);
+	if (useOcclusionCulling) {
+		view.pyramid.createDescriptorSets(renderGraph.getImageView(view.depthBuffer));
+	}
 }
 
 void Vulkan::createGraphicsPipeline()
 {
+	// Shared by the views, built against the passes of the first one
+	const View& primary = *views[0];
+	renderPass = primary.renderGraph.getRenderPass(primary.mainPass);
+	mainSubpass = primary.renderGraph.getSubpass(primary.mainPass);
+	depthSubpass = useDepthPrepass ? primary.renderGraph.getSubpass(primary.depthPrepass) : 0;
+
+	// Material and object, then the lights, the shadows and the visible meshlets of the frame.
+	// The layouts of the views are identically defined: their sets are compatible with these.
+	VkDescriptorSetLayout setLayouts[] = { descriptorSetLayout, primary.lighting.getSetLayout(), primary.shadows.getSetLayout(),
+										   primary.meshlets.getDrawSetLayout() };
 	VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
 	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-	pipelineLayoutInfo.setLayoutCount = 1;
-	pipelineLayoutInfo.pSetLayouts = &descriptorSetLayout;
+	pipelineLayoutInfo.setLayoutCount = 4;
+	pipelineLayoutInfo.pSetLayouts = setLayouts;
 	vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout);
 
+	// The sprites compile alongside the scene
+	Job sprites = jobs.schedule([this, &primary]() {
+		VkPipelineShaderStageCreateInfo spriteStages[] = {
+			createShaderStage("sprite.vert", VK_SHADER_STAGE_VERTEX_BIT),
+			createShaderStage("sprite.frag", VK_SHADER_STAGE_FRAGMENT_BIT),
+		};
+		spriteBatch.createPipeline(primary.renderGraph.getRenderPass(primary.overlayPass), primary.renderGraph.getSubpass(primary.overlayPass),
+								   VK_SAMPLE_COUNT_1_BIT, descriptorSetLayout, spriteStages);
+		for (const VkPipelineShaderStageCreateInfo& stage : spriteStages) {
+			vkDestroyShaderModule(device, stage.module, nullptr);
+		}
+	});
+
+	// The test quad is textured and lit, its vertex colors are ignored.
+	// The first frames draw it unlit: the lighting is compiled out of the smallest permutation.
+	// On a job thread like the others, before the first frame.
+	Pipelines minimal = createPipelines({ SHADER_TEXTURE });
+	{
+		std::lock_guard<std::mutex> lock(reloadMutex);
+		materials[0].pipeline = addPermutation(minimal);
+	}
+	compilePipeline(0, SHADER_TEXTURE | SHADER_LIGHTING);
+	// Its clustered meshes are drawn without culling until this one is there
+	compilePipeline(0, SHADER_TEXTURE | SHADER_LIGHTING | SHADER_MESHLETS);
+	jobs.wait(sprites);
+
+	// Hot reloading of the scene pipelines: the other modules build theirs once
+	shaders.watch({ "color.vert", "color.frag", "meshlet.vert" }, [this](const std::string&) {
+		{
+			std::lock_guard<std::mutex> lock(reloadMutex);
+			shaderGeneration++;
+		}
+		rebuildPipelines();
+	});
+}
+
+uint32_t Vulkan::addPermutation(const Pipelines& created)
+{
+	uint32_t features = created.features[0];
+	pipelines.features.push_back(features);
+	pipelines.graphics.push_back(created.graphics[0]);
+	pipelines.depthPrepass.push_back(created.depthPrepass[0]);
+
+	uint32_t index = uint32_t(pipelines.graphics.size()) - 1;
+	permutations[features] = index;
+	return index;
+}
+
+void Vulkan::compilePipeline(uint32_t material, uint32_t features)
+{
+	jobs.submit([this, material, features]() {
+		uint32_t generation;
+		{
+			std::lock_guard<std::mutex> lock(reloadMutex);
+			generation = shaderGeneration;
+		}
+		Pipelines created = createPipelines({ features });
+
+		std::lock_guard<std::mutex> lock(reloadMutex);
+		compiledPipelines.push_back({ material, generation, created });
+	});
+}
+
+void Vulkan::adoptCompiledPipelines()
+{
+	std::lock_guard<std::mutex> lock(reloadMutex);
+	for (const CompiledPipeline& compiled : compiledPipelines) {
+		uint32_t features = compiled.pipelines.features[0];
+		Material& material = materials[compiled.material];
+		uint32_t& materialPipeline = (features & SHADER_MESHLETS) ? material.meshletPipeline : material.pipeline;
+		auto permutation = permutations.find(features);
+		if (permutation != permutations.end()) {
+			// Compiled meanwhile for another material: this one was never used
+			destroyPipelines(compiled.pipelines);
+			materialPipeline = permutation->second;
+			continue;
+		}
+		if (compiled.generation != shaderGeneration) {
+			// Built from shaders edited since: the reload of that edit did not know it, compiled again
+			destroyPipelines(compiled.pipelines);
+			compilePipeline(compiled.material, features);
+			continue;
+		}
+
+		// A reload in progress does not know it: swapReloadedPipelines() starts that reload over
+		materialPipeline = addPermutation(compiled.pipelines);
+	}
+	compiledPipelines.clear();
+}
+
+// Called from the job threads as well: only reads state that does not change after init()
+Pipelines Vulkan::createPipelines(const std::vector<uint32_t>& features)
+{
+	Pipelines created;
+
 	VkPipelineColorBlendAttachmentState colorBlendAttachment = {};
 	colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
 	colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
@@ -770,11 +1874,11 @@ void Vulkan::createGraphicsPipeline()
 
 	VkPipelineMultisampleStateCreateInfo multisampleState = {};
 	multisampleState.minSampleShading = 1.0f;
-	multisampleState.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+	multisampleState.rasterizationSamples = sampleCount;
 	multisampleState.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
 
 	VkPipelineRasterizationStateCreateInfo rasterizationState = {};
-	rasterizationState.cullMode = VK_CULL_MODE_NONE;
+	rasterizationState.cullMode = cullMode;
 	rasterizationState.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
 	rasterizationState.lineWidth = 1.0f;
 	rasterizationState.polygonMode = VK_POLYGON_MODE_FILL;
@@ -804,169 +1908,369 @@ void Vulkan::createGraphicsPipeline()
 	uvDescription.location = 2;
 	uvDescription.offset = offsetof(Vertex, uv);
 
+	VkVertexInputAttributeDescription normalDescription = {};
+	normalDescription.binding = VERTEX_BINDING_ID;
+	normalDescription.format = VK_FORMAT_R32G32B32_SFLOAT;
+	normalDescription.location = 3;
+	normalDescription.offset = offsetof(Vertex, normal);
+
 	VkVertexInputAttributeDescription attributeDescriptions[] = {
-		positionDescription, colorDescription, uvDescription
+		positionDescription, colorDescription, uvDescription, normalDescription
 	};
 
 	VkPipelineVertexInputStateCreateInfo vertexInput = {};
 	vertexInput.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
 	vertexInput.vertexBindingDescriptionCount = 1;
 	vertexInput.pVertexBindingDescriptions = &vertexBindingDescription;
-	vertexInput.vertexAttributeDescriptionCount = 3; // COLOR, POSITION, UV
+	vertexInput.vertexAttributeDescriptionCount = 4; // COLOR, POSITION, UV, NORMAL
 	vertexInput.pVertexAttributeDescriptions = attributeDescriptions;
 
-	VkViewport viewport;
-	viewport.height = surfaceExtent.height;
-	viewport.width = surfaceExtent.width;
-	viewport.minDepth = 0.0f;
-	viewport.maxDepth = 1.0f;
-	viewport.x = 0.0f;
-	viewport.y = 0.0f;
-
-	VkRect2D scissor;
-	scissor.extent = surfaceExtent;
-	scissor.offset.x = 0;
-	scissor.offset.y = 0;
+	// Meshlets: the vertex shader reads its vertices itself
+	VkPipelineVertexInputStateCreateInfo pulledVertexInput = {};
+	pulledVertexInput.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
 
+	// Set when drawing: follows the dynamic resolution
 	VkPipelineViewportStateCreateInfo viewportState = {};
 	viewportState.viewportCount = 1;
-	viewportState.pViewports = &viewport;
 	viewportState.scissorCount = 1;
-	viewportState.pScissors = &scissor;
 	viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
 
+	VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+	VkPipelineDynamicStateCreateInfo dynamicState = {};
+	dynamicState.dynamicStateCount = 2;
+	dynamicState.pDynamicStates = dynamicStates;
+	dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+
 	VkPipelineShaderStageCreateInfo shadersStages[] = {
-		createShaderStage("shaders/colorVert.spirv", VK_SHADER_STAGE_VERTEX_BIT),	// VERTEX SHADER
-		createShaderStage("shaders/colorFrag.spirv", VK_SHADER_STAGE_FRAGMENT_BIT),	// FRAGMENT SHADER
+		createShaderStage("color.vert", VK_SHADER_STAGE_VERTEX_BIT),	// VERTEX SHADER
+		createShaderStage("color.frag", VK_SHADER_STAGE_FRAGMENT_BIT),	// FRAGMENT SHADER
 	};
+	VkPipelineShaderStageCreateInfo meshletStage = {};
+	for (uint32_t permutation : features) {
+		if ((permutation & SHADER_MESHLETS) && meshletStage.module == VK_NULL_HANDLE) {
+			meshletStage = createShaderStage("meshlet.vert", VK_SHADER_STAGE_VERTEX_BIT);
+		}
+	}
 
 	VkPipelineDepthStencilStateCreateInfo depthStencilState = {};
 	depthStencilState.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
 	depthStencilState.depthTestEnable = VK_TRUE;
 	depthStencilState.depthWriteEnable = VK_TRUE;
+	if (useDepthPrepass) {
+		// The depth is already there: only the closest surface passes
+		depthStencilState.depthCompareOp = VK_COMPARE_OP_EQUAL;
+		depthStencilState.depthWriteEnable = VK_FALSE;
+	}
 	depthStencilState.back.compareOp = VK_COMPARE_OP_ALWAYS;
 	depthStencilState.front = depthStencilState.back;
 	depthStencilState.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
 
-	VkGraphicsPipelineCreateInfo graphicsPipelineInfo = {};
-	graphicsPipelineInfo.basePipelineIndex = -1;
-	graphicsPipelineInfo.subpass = 0;
-	graphicsPipelineInfo.renderPass = renderPass;
-	graphicsPipelineInfo.layout = pipelineLayout;
-	graphicsPipelineInfo.pColorBlendState = &colorBlendState;
-	graphicsPipelineInfo.pInputAssemblyState = &inputAssembly;
-	graphicsPipelineInfo.pMultisampleState = &multisampleState;
-	graphicsPipelineInfo.pRasterizationState = &rasterizationState;
-	graphicsPipelineInfo.pVertexInputState = &vertexInput;
-	graphicsPipelineInfo.pViewportState = &viewportState;
-	graphicsPipelineInfo.pDepthStencilState = &depthStencilState;
-	graphicsPipelineInfo.stageCount = 2;
-	graphicsPipelineInfo.pStages = shadersStages;
-	graphicsPipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-
-	VkResult res = vkCreateGraphicsPipelines(device, 0, 1, &graphicsPipelineInfo, nullptr, &graphicsPipeline);
-	assert(res == VK_SUCCESS);
+	// Feature switches, the disabled paths are removed when the pipeline is compiled
+	VkSpecializationMapEntry specializationEntries[] = {
+		{ 0, offsetof(ShaderSpecialization, vertexColor), sizeof(VkBool32) },
+		{ 1, offsetof(ShaderSpecialization, texture), sizeof(VkBool32) },
+		{ 2, offsetof(ShaderSpecialization, alphaTest), sizeof(VkBool32) },
+		{ 3, offsetof(ShaderSpecialization, alphaCutoff), sizeof(float) },
+		{ 4, offsetof(ShaderSpecialization, lighting), sizeof(VkBool32) },
+	};
+
+	VkPipelineDepthStencilStateCreateInfo depthOnlyStencilState = depthStencilState;
+	depthOnlyStencilState.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+	depthOnlyStencilState.depthWriteEnable = VK_TRUE;
+
+	VkPipelineColorBlendStateCreateInfo depthOnlyBlendState = colorBlendState;
+	depthOnlyBlendState.attachmentCount = 0;
+	depthOnlyBlendState.pAttachments = nullptr;
+
+	for (uint32_t permutation : features) {
+		ShaderSpecialization specialization = {};
+		specialization.vertexColor = (permutation & SHADER_VERTEX_COLOR) ? VK_TRUE : VK_FALSE;
+		specialization.texture = (permutation & SHADER_TEXTURE) ? VK_TRUE : VK_FALSE;
+		specialization.alphaTest = (permutation & SHADER_ALPHA_TEST) ? VK_TRUE : VK_FALSE;
+		specialization.alphaCutoff = 0.5f;
+		specialization.lighting = (permutation & SHADER_LIGHTING) ? VK_TRUE : VK_FALSE;
+
+		VkSpecializationInfo specializationInfo = {};
+		specializationInfo.mapEntryCount = 5;
+		specializationInfo.pMapEntries = specializationEntries;
+		specializationInfo.dataSize = sizeof(specialization);
+		specializationInfo.pData = &specialization;
+
+		bool meshlets = (permutation & SHADER_MESHLETS) != 0;
+		VkPipelineShaderStageCreateInfo stages[] = { meshlets ? meshletStage : shadersStages[0], shadersStages[1] };
+		stages[0].pSpecializationInfo = &specializationInfo;
+		stages[1].pSpecializationInfo = &specializationInfo;
+
+		VkGraphicsPipelineCreateInfo graphicsPipelineInfo = {};
+		graphicsPipelineInfo.flags = VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT;
+		graphicsPipelineInfo.basePipelineIndex = -1;
+		graphicsPipelineInfo.subpass = mainSubpass;
+		graphicsPipelineInfo.renderPass = renderPass;
+		graphicsPipelineInfo.layout = pipelineLayout;
+		graphicsPipelineInfo.pColorBlendState = &colorBlendState;
+		graphicsPipelineInfo.pInputAssemblyState = &inputAssembly;
+		graphicsPipelineInfo.pMultisampleState = &multisampleState;
+		graphicsPipelineInfo.pRasterizationState = &rasterizationState;
+		graphicsPipelineInfo.pVertexInputState = meshlets ? &pulledVertexInput : &vertexInput;
+		graphicsPipelineInfo.pViewportState = &viewportState;
+		graphicsPipelineInfo.pDynamicState = &dynamicState;
+		graphicsPipelineInfo.pDepthStencilState = &depthStencilState;
+		graphicsPipelineInfo.stageCount = 2;
+		graphicsPipelineInfo.pStages = stages;
+		graphicsPipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+
+		VkPipeline graphicsPipeline;
+		VkResult res = vkCreateGraphicsPipelines(device, 0, 1, &graphicsPipelineInfo, nullptr, &graphicsPipeline);
+		assert(res == VK_SUCCESS);
+		created.features.push_back(permutation);
+		created.graphics.push_back(graphicsPipeline);
+
+		// DEPTH PRE-PASS: derived from the main pipeline, without color output.
+		// The fragment shader is only needed to discard the alpha tested fragments.
+		VkPipeline depthPipeline = VK_NULL_HANDLE;
+		if (useDepthPrepass) {
+			VkGraphicsPipelineCreateInfo depthPipelineInfo = graphicsPipelineInfo;
+			depthPipelineInfo.flags = VK_PIPELINE_CREATE_DERIVATIVE_BIT;
+			depthPipelineInfo.basePipelineHandle = graphicsPipeline;
+			depthPipelineInfo.basePipelineIndex = -1;
+			depthPipelineInfo.subpass = depthSubpass;
+			depthPipelineInfo.pColorBlendState = &depthOnlyBlendState;
+			depthPipelineInfo.pDepthStencilState = &depthOnlyStencilState;
+			depthPipelineInfo.stageCount = (permutation & SHADER_ALPHA_TEST) ? 2 : 1;
+			depthPipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+
+			res = vkCreateGraphicsPipelines(device, 0, 1, &depthPipelineInfo, nullptr, &depthPipeline);
+			assert(res == VK_SUCCESS);
+		}
+		created.depthPrepass.push_back(depthPipeline);
+	}
+
+	// The pipelines keep their own copy of the code
+	for (const VkPipelineShaderStageCreateInfo& stage : shadersStages) {
+		vkDestroyShaderModule(device, stage.module, nullptr);
+	}
+	if (meshletStage.module != VK_NULL_HANDLE) {
+		vkDestroyShaderModule(device, meshletStage.module, nullptr);
+	}
 
-	vkDestroyShaderModule(device, vertexShaderModule, nullptr);
-	vkDestroyShaderModule(device, fragmentShaderModule, nullptr);
+	return created;
 }
 
-VkPipelineShaderStageCreateInfo Vulkan::createShaderStage(const std::string& filename, VkShaderStageFlagBits shaderStage)
+void Vulkan::destroyPipelines(const Pipelines& destroyed)
 {
-	std::ifstream file(filename, std::ios::binary);
-	file.seekg(0, std::ios::end);
-	std::vector<char> code(file.tellg());
-	file.seekg(0, std::ios::beg);
-	file.read(code.data(), code.size());
+	for (VkPipeline pipeline : destroyed.graphics) {
+		vkDestroyPipeline(device, pipeline, nullptr);
+	}
+	for (VkPipeline pipeline : destroyed.depthPrepass) {
+		if (pipeline != VK_NULL_HANDLE) {
+			vkDestroyPipeline(device, pipeline, nullptr);
+		}
+	}
+}
+
+void Vulkan::rebuildPipelines()
+{
+	std::vector<uint32_t> features;
+	{
+		std::lock_guard<std::mutex> lock(reloadMutex);
+		features = pipelines.features;
+	}
 
-	VkShaderModuleCreateInfo shaderModuleInfo = {};
-	shaderModuleInfo.codeSize = code.size();
-	shaderModuleInfo.pCode = (uint32_t*) code.data();
-	shaderModuleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	// Every permutation known so far, the swap starts over if some are added meanwhile
+	Pipelines reloaded = createPipelines(features);
 
-	VkShaderModule shaderModule;
-	if (shaderStage == VK_SHADER_STAGE_VERTEX_BIT) {
-		vkCreateShaderModule(device, &shaderModuleInfo, nullptr, &vertexShaderModule);
-		shaderModule = vertexShaderModule;
+	std::lock_guard<std::mutex> lock(reloadMutex);
+	if (pipelinesReloaded) {
+		// Never used: the render thread did not pick it up yet
+		destroyPipelines(reloadedPipelines);
 	}
-	else {
-		vkCreateShaderModule(device, &shaderModuleInfo, nullptr, &fragmentShaderModule);
-		shaderModule = fragmentShaderModule;
+	reloadedPipelines = reloaded;
+	pipelinesReloaded = true;
+}
+
+void Vulkan::swapReloadedPipelines()
+{
+	std::lock_guard<std::mutex> lock(reloadMutex);
+	if (!pipelinesReloaded) {
+		return;
 	}
 
-	VkPipelineShaderStageCreateInfo shaderStageInfo = {};
-	shaderStageInfo.module = shaderModule;
-	shaderStageInfo.pName = "main";
-	shaderStageInfo.stage = shaderStage;
-	shaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	// Permutations were adopted since the reload started: rebuilt on a job with them, the current ones stay until then.
+	// Nothing is compiled here, only built handles are exchanged.
+	if (reloadedPipelines.features.size() < pipelines.features.size()) {
+		destroyPipelines(reloadedPipelines);
+		pipelinesReloaded = false;
+		jobs.submit([this]() { rebuildPipelines(); });
+		return;
+	}
 
-	return shaderStageInfo;
+	// The frames in flight still use the old ones
+	Pipelines retired = pipelines;
+	deletions.destroy([this, retired]() { destroyPipelines(retired); });
+	pipelines = reloadedPipelines;
+	pipelinesReloaded = false;
+}
+
+void Vulkan::captureFrame(const std::string& filename, const std::string& golden, double minPsnr, double maxTileMse)
+{
+	if (!captureSupported) {
+		std::cerr << "Capture: the swapchain images cannot be copied" << std::endl;
+		return;
+	}
+	captureRequests.push_back({ filename, golden, minPsnr, maxTileMse, false });
+}
+
+void Vulkan::startStream(StreamSink* sink, uint32_t fps)
+{
+	if (!captureSupported) {
+		std::cerr << "Stream: the swapchain images cannot be copied" << std::endl;
+		delete sink;
+		return;
+	}
+	stream.start(sink, views[0]->extent.width, views[0]->extent.height, fps, &jobs);
 }
 
-void Vulkan::createFrameBuffers()
+void Vulkan::stopStream()
 {
-	frameBuffers.resize(swapchainImages.size());
+	// The frames in flight are still sent
+	finishCaptures();
+	stream.stop();
+}
 
-	VkImageView attachments[2];
-	attachments[1] = depthBufferImageView;
+void Vulkan::collectCaptures(uint64_t completed)
+{
+	if (capturesInFlight.empty()) {
+		return;
+	}
 
-	VkFramebufferCreateInfo frameBufferInfo = {};
-	frameBufferInfo.height = surfaceExtent.height;
-	frameBufferInfo.width = surfaceExtent.width;
-	frameBufferInfo.layers = 1;
-	frameBufferInfo.attachmentCount = 2;
-	frameBufferInfo.renderPass = renderPass;
-	frameBufferInfo.pAttachments = attachments;
-	frameBufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+	capture.collect(completed, [this](const CapturedFrame& frame) {
+		CaptureRequest request = capturesInFlight.front();
+		capturesInFlight.pop_front();
 
-	VkResult res;
-	for (int i = 0; i < swapchainImages.size(); i++) {
-		attachments[0] = swapchainImageViews[i];
-		res = vkCreateFramebuffer(device, &frameBufferInfo, nullptr, &frameBuffers[i]);
-		assert(res == VK_SUCCESS);
+		// Converted right away, the rendering of the next frames goes on meanwhile on the GPU
+		if (request.streamed) {
+			stream.push(frame);
+		}
+		if (request.filename.empty()) {
+			return;
+		}
+
+		// The slot is reused as soon as this returns: the pixels are copied, written and compared on a job
+		auto image = std::make_shared<Image>();
+		image->width = frame.width;
+		image->height = frame.height;
+		image->pixels.assign(frame.pixels, frame.pixels + size_t(frame.width) * frame.height * 4);
+		bool bgra = frame.format == VK_FORMAT_B8G8R8A8_UNORM || frame.format == VK_FORMAT_B8G8R8A8_SRGB;
+
+		pendingWrites++;
+		jobs.submit([this, request, image, bgra]() {
+			if (bgra) {
+				image::swapRedBlue(image->pixels.data(), image->pixels.size() / 4);
+			}
+			if (!image::write(request.filename, *image)) {
+				std::cerr << "Capture: cannot write " << request.filename << std::endl;
+			}
+
+			if (!request.golden.empty()) {
+				Image golden;
+				bool loaded = image::load(request.golden, golden);
+				ImageDiff diff = compareImages(*image, golden);
+				bool passed = loaded && diff.passes(request.minPsnr, request.maxTileMse);
+
+				std::lock_guard<std::mutex> lock(captureMutex);
+				if (!passed) {
+					captureFailures++;
+				}
+				std::cout << (passed ? "PASS " : "FAIL ") << request.filename << " vs " << request.golden;
+				if (diff.sameSize) {
+					std::cout << ": PSNR " << diff.psnr << " dB, worst tile " << diff.worstTile % diff.tilesX << "," << diff.worstTile / diff.tilesX
+							  << " MSE " << diff.tileMse[diff.worstTile] << ", max error " << int(diff.maxError);
+				}
+				std::cout << std::endl;
+			}
+			pendingWrites--;
+		});
+	});
+}
+
+uint32_t Vulkan::finishCaptures()
+{
+	// Only place where the CPU waits for the GPU: the end of a run
+	if (!capturesInFlight.empty()) {
+		graphicsTimeline.wait(graphicsTimeline.getSubmitted());
+		collectCaptures(graphicsTimeline.getCompleted());
 	}
+	while (pendingWrites > 0) {
+		std::this_thread::yield();
+	}
+
+	std::lock_guard<std::mutex> lock(captureMutex);
+	return captureFailures;
+}
+
+VkPipelineShaderStageCreateInfo Vulkan::createShaderStage(const std::string& name, VkShaderStageFlagBits shaderStage)
+{
+	VkPipelineShaderStageCreateInfo shaderStageInfo = {};
+	shaderStageInfo.module = shaders.createModule(name);
+	shaderStageInfo.pName = "main";
+	shaderStageInfo.stage = shaderStage;
+	shaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+
+	return shaderStageInfo;
 }
 
 Vulkan::~Vulkan()
 {
+	// No reload must be running when the device goes away
+	shaders.stop();
+	stream.stop();
+	jobs.shutdown();
+	for (const StreamedTexture& texture : streamedTextures) {
+		if (texture.decoded.pixels) {
+			stbi_image_free(texture.decoded.pixels);
+		}
+	}
+	if (!initialized) {
+		// No window was ever opened: the objects below do not exist
+		return;
+	}
+
+	// Nothing is in flight anymore: whatever was waiting for a frame is released at once
 	vkDeviceWaitIdle(device);
-	vkQueueWaitIdle(graphicsQueue);
-	
+	deletions.flush();
+
 	vkFreeMemory(device, indexMemory, nullptr);
 	vkFreeMemory(device, vertexMemory, nullptr);
+	vkUnmapMemory(device, uniformMemory);
 	vkFreeMemory(device, uniformMemory, nullptr);
-	vkFreeMemory(device, depthBufferMemory, nullptr);
-	vkFreeMemory(device, texture.memory, nullptr);
 
 	vkDestroyBuffer(device, vertexBuffer, nullptr);
 	vkDestroyBuffer(device, indexBuffer, nullptr);
 	vkDestroyBuffer(device, uniformBuffer, nullptr);
 
-	vkDestroyImageView(device, depthBufferImageView, nullptr);
-	vkDestroyImageView(device, texture.view, nullptr);
-	vkDestroyImage(device, depthBufferImage, nullptr);
-	vkDestroyImage(device, texture.image, nullptr);
-
-	vkDestroySampler(device, texture.sampler, nullptr);
-
-	for (auto& frameBuffer : frameBuffers) {
-		vkDestroyFramebuffer(device, frameBuffer, nullptr);
-	}
-	for (auto& imageView : swapchainImageViews) {
-		vkDestroyImageView(device, imageView, nullptr);
+	for (auto& view : views) {
+		destroyView(*view);
 	}
+	spriteBatch.destroy();
+	meshletGeometry.destroy();
+	atlas.destroy();
+	samplers.destroy();
 
 	vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
 	vkDestroyDescriptorPool(device, descriptorPool, nullptr);
 
-	vkDestroyRenderPass(device, renderPass, nullptr);
-	vkDestroySemaphore(device, imageIsAvailable, nullptr);
-	vkDestroySemaphore(device, imageIsRendered, nullptr);
+	compute.destroy();
+	capture.destroy();
 	vkDestroyCommandPool(device, commandPool, nullptr);
 	vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
-	vkDestroyPipeline(device, graphicsPipeline, nullptr);
-	vkDestroySwapchainKHR(device, swapchain, nullptr);
-	vkDestroySurfaceKHR(instance, surface, nullptr);
+	destroyPipelines(pipelines);
+	if (pipelinesReloaded) {
+		destroyPipelines(reloadedPipelines);
+	}
+	for (const CompiledPipeline& compiled : compiledPipelines) {
+		destroyPipelines(compiled.pipelines);
+	}
+	graphicsTimeline.destroy();
 	vkDestroyDevice(device, nullptr);
 	vkDestroyInstance(instance, nullptr);
 }
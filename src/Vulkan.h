@@ -5,13 +5,48 @@
 #include <GLFW/glfw3.h>
 #include <glm.hpp>
 #include <gtc/matrix_transform.hpp>
+#include "RenderGraph.h"
+#include "DrawList.h"
+#include "SceneGraph.h"
+#include "JobSystem.h"
+#include "EntityStore.h"
+#include "ShaderManager.h"
+#include "ComputeScheduler.h"
+#include "DeviceCapabilities.h"
+#include "FrameCapture.h"
+#include "FrameStream.h"
+#include "DeletionQueue.h"
+#include "TextureAtlas.h"
+#include "SamplerCache.h"
+#include "SpriteBatch.h"
+#include "ClusteredLighting.h"
+#include "ShadowCascades.h"
+#include "PostProcess.h"
+#include "DynamicResolution.h"
+#include "Meshlets.h"
+#include "DepthPyramid.h"
+#include "ObjectCulling.h"
+#include "Trace.h"
+#include <mutex>
+#include <map>
+#include <deque>
+#include <atomic>
+#include <memory>
+#include <chrono>
 
 #define VERTEX_BINDING_ID 0
+#define MAX_OBJECTS 4096 // Per frame
+#define MAX_SPRITES 524288 // Per frame
+#define MAX_LIGHTS 4096 // Visible per frame
+#define MAX_VIEWS 4 // Windows and offscreen targets drawn by the device
+#define OFFSCREEN_FRAME_COUNT 3 // Frames in flight without a window
+#define QUAD_ROTATION_SPEED 0.06f // Radians per second
 
 struct Vertex {
 	float position[3];
 	float color[3];
 	float uv[2];
+	float normal[3];
 };
 
 // JUST FOR TESTING
@@ -19,15 +54,129 @@ struct Uniforms {
 	glm::mat4 projectionMatrix;
 	glm::mat4 modelMatrix;
 	glm::mat4 viewMatrix;
+	glm::vec4 uvTransform;	// Atlas region: offset in xy, scale in zw
+	float textureLayer;
 };
 
-struct Texture {
-	VkDeviceMemory memory;
-	VkImage image;
-	VkImageView view;
-	VkSampler sampler;
+struct Mesh {
+	VkBuffer vertexBuffer;
+	VkBuffer indexBuffer;
+	uint32_t indexCount;
+	uint32_t firstIndex;
+	int32_t vertexOffset;
+	Bounds bounds;	// Object space
+
+	// Clustered meshes only, in the meshlet geometry
+	uint32_t firstMeshlet;
+	uint32_t meshletCount;
+	uint32_t triangleCount;
+};
+
+// Shader permutations, selected with specialization constants
+enum ShaderFeature {
+	SHADER_VERTEX_COLOR = 0x1,
+	SHADER_TEXTURE = 0x2,
+	SHADER_ALPHA_TEST = 0x4,
+	SHADER_LIGHTING = 0x8,
+	SHADER_MESHLETS = 0x10,	// Vertices pulled from the meshlet buffers, drawn after the culling
+};
+
+// One entry per permutation
+struct Pipelines {
+	std::vector<uint32_t> features;
+	std::vector<VkPipeline> graphics;
+	std::vector<VkPipeline> depthPrepass;	// VK_NULL_HANDLE without pre-pass
+};
+
+// Built on a job thread for a material: it keeps its pipeline until the next frame boundary
+struct CompiledPipeline {
+	uint32_t material;
+	uint32_t generation;	// Of the shaders it was built from
+	Pipelines pipelines;	// One permutation
+};
+
+// Pixels as decoded from a file, with its channels
+struct DecodedTexture {
+	unsigned char* pixels;
 	int width;
 	int height;
+	int channels;
+};
+
+// Decoded while the renderer starts, its material samples a placeholder until then
+struct StreamedTexture {
+	std::string filename;
+	uint32_t material;
+	DecodedTexture decoded;
+};
+
+// Drawn with the scene set of the frame: uniforms and atlas
+struct Material {
+	uint32_t pipeline;
+	uint32_t meshletPipeline;	// Same features with SHADER_MESHLETS, UINT32_MAX until compiled
+	uint32_t texture;	// Atlas region
+};
+
+// Frame written to a file, and compared to a golden image when there is one
+struct CaptureRequest {
+	std::string filename;
+	std::string golden;
+	double minPsnr;
+	double maxTileMse;
+	bool streamed;		// Also sent to the video stream
+};
+
+// One output of the renderer: a window or an offscreen image, seen from its own camera.
+// The device, the meshes, the materials, the textures and the pipelines are shared by the views.
+// The targets, the lights binned for the camera, the cascades fitted to it, the post chain
+// and the command buffers are their own: the views are recorded in parallel.
+struct View {
+	uint32_t index;
+	VkSurfaceKHR surface = VK_NULL_HANDLE;	// None offscreen
+	VkSwapchainKHR swapchain = VK_NULL_HANDLE;
+	VkFormat format;
+	VkExtent2D extent;
+	VkExtent2D renderExtent;	// Drawn part of the scene targets, extent without dynamic resolution
+
+	// Swapchain images, or one offscreen image per frame in flight
+	std::vector<VkImage> images;
+	std::vector<VkImageView> imageViews;
+	std::vector<VkDeviceMemory> imageMemory;	// Offscreen only
+	uint32_t imageIndex = 0;	// Drawn by this frame
+
+	VkCommandPool commandPool;
+	std::vector<VkCommandBuffer> commandBuffers;	// Per frame in flight
+	std::vector<VkSemaphore> imageIsAvailable;	// Per frame in flight
+	std::vector<VkSemaphore> imageIsRendered;	// Per swapchain image
+
+	RenderGraph renderGraph;
+	uint32_t backBuffer;
+	uint32_t hdrBuffer;	// Scene color, before the post chain
+	uint32_t colorBuffer;
+	uint32_t depthBuffer;
+	uint32_t depthPrepass;
+	uint32_t mainPass;
+	uint32_t lateDepthPrepass;	// Late phase of the occlusion culling, in a render pass of its own
+	uint32_t lateMainPass = UINT32_MAX;	// None without occlusion culling
+	uint32_t overlayPass = UINT32_MAX;	// Sprites, first view only
+
+	// Camera, the model matrix is set per object
+	Uniforms uniforms;
+	glm::mat4 viewMatrix = glm::translate(glm::mat4x4(), glm::vec3(0.0f, 0.0f, -5.0f));
+	float fieldOfView = glm::radians(70.0f);
+	float nearPlane = 0.1f;
+	float farPlane = 100.0f;
+
+	DrawList drawList;
+	DrawList depthDrawList;
+	CullConstants culling;	// Of the frame being prepared
+	DepthPyramid pyramid;
+	ObjectCulling objects;
+	MeshletCulling meshlets;
+	ClusteredLighting lighting;
+	ShadowCascades shadows;
+	PostProcess postProcess;
+	DynamicResolution resolution;
 };
 
 class Vulkan
@@ -35,47 +184,89 @@ class Vulkan
 private:
 	VkInstance instance;
 	VkPhysicalDevice physicalDevice;
-	VkDevice device;
-	VkSurfaceKHR surface;
-	VkSwapchainKHR swapchain = VK_NULL_HANDLE;
-	VkSurfaceFormatKHR surfaceFormat;
-	VkExtent2D surfaceExtent;
+	DeviceCapabilities capabilities;
+	VkDevice device = VK_NULL_HANDLE;
 
-	std::vector<VkImage> swapchainImages;
-	std::vector<VkImageView> swapchainImageViews;
+	// The first one is the primary view: captures, streams and sprites
+	std::vector<std::unique_ptr<View>> views;
+	bool started = false;
+	bool initialized = false;
+	Job deviceCreated;	// Instance and device, created on a job thread by start()
 
-	VkImage depthBufferImage;
-	VkImageView depthBufferImageView;
-	VkDeviceMemory depthBufferMemory;
 	VkFormat depthFormat;
+	VkSampleCountFlagBits sampleCount = VK_SAMPLE_COUNT_4_BIT;
+	VkFormat shadowFormat;
+	bool shadowFiltering = false;
 
+	VkCommandPool commandPool;	// Uploads
+	Timeline graphicsTimeline;
+	uint32_t frameCount = 0;	// Frames in flight, images of the first swapchain
+	uint64_t frameNumber = 0;
+	std::vector<uint64_t> frameValues;	// Last submission of each frame in flight
+	bool timelineSemaphores = false;
+	DeletionQueue deletions;	// Released once the frames using them are done
 
-	VkCommandPool commandPool;
-	std::vector<VkCommandBuffer> graphicsCommandBuffers;
-	std::vector<VkFramebuffer> frameBuffers;
-
+	// Of the first view, the render passes of the others are compatible: same formats and samples
 	VkRenderPass renderPass;
-	VkPipeline graphicsPipeline;
+	uint32_t mainSubpass;
+	uint32_t depthSubpass;
+	Pipelines pipelines;
+	std::map<uint32_t, uint32_t> permutations;	// Features -> pipeline index
+	ShaderManager shaders;
+
+	// Rebuilt on a job thread when a shader changes, swapped in by draw()
+	std::mutex reloadMutex;
+	Pipelines reloadedPipelines;
+	bool pipelinesReloaded = false;
+	std::vector<CompiledPipeline> compiledPipelines;	// Waiting for the next frame boundary
+	uint32_t shaderGeneration = 0;	// Counts the shader edits
+	VkCullModeFlags cullMode = VK_CULL_MODE_BACK_BIT;
+	bool useDepthPrepass = true;
+	bool useOcclusionCulling = true;
+	bool gpuLightBinning = true;
+
+	std::vector<Mesh> meshes;
+	MeshletGeometry meshletGeometry;
+	std::vector<Material> materials;
+	JobSystem jobs;
+	SceneGraph scene;
+	EntityStore entities;
+	uint32_t quadNode;
+	float quadAngle = 0.0f;	// Around (0, 1, 1)
+	std::chrono::steady_clock::time_point lastUpdate;	// Of the scene
+	uint32_t currentFrame = 0;	// Frame in flight
+	uint32_t objectCount = 0;
 
-	VkSemaphore imageIsAvailable;
-	VkSemaphore imageIsRendered;
+	// Copies of the swapchain images, read a few frames later
+	FrameCapture capture;
+	bool captureSupported = false;
+	std::deque<CaptureRequest> captureRequests;
+	std::deque<CaptureRequest> capturesInFlight;	// Same order as the copies in the ring
+	std::atomic<uint32_t> pendingWrites{ 0 };
+	std::mutex captureMutex;
+	uint32_t captureFailures = 0;
+	FrameStream stream;
 
 	VkPipelineLayout pipelineLayout;
-	VkShaderModule vertexShaderModule;
-	VkShaderModule fragmentShaderModule;
 
 	VkDescriptorPool descriptorPool;
 
 
 	VkDescriptorSetLayout descriptorSetLayout;
-	VkDescriptorSet descriptorSet;
-	Uniforms uniforms; // FOR TESTING
+	std::vector<VkDescriptorSet> descriptorSets;	// Per frame in flight
+	uint32_t atlasGeneration = 0;	// Counts the recreations of the atlas image
+	std::vector<uint32_t> textureGenerations;	// Of the atlas each set points to
 	VkBuffer uniformBuffer;
 	VkDeviceMemory uniformMemory;
 	VkDescriptorBufferInfo uniformDescriptor;
+	VkDeviceSize uniformStride;
+	uint8_t* uniformData;
 
 	uint32_t graphicsFamilyIndex = -1;
 	VkQueue graphicsQueue;
+	uint32_t computeFamilyIndex = -1;
+	VkQueue computeQueue;
+	ComputeScheduler compute;
 
 	VkBuffer vertexBuffer;
 	VkDeviceMemory vertexMemory;
@@ -83,43 +274,166 @@ private:
 	VkBuffer indexBuffer;
 	VkDeviceMemory indexMemory;
 
-	Texture texture;
+	// Every texture, behind one view and one sampler
+	TextureAtlas atlas;
+	SamplerCache samplers;
+	VkSampler textureSampler;
+	std::vector<StreamedTexture> streamedTextures;
+	Job texturesDecoded;
+	SpriteBatch spriteBatch;	// Overlay, drawn over the tonemapped image of the first view
+	std::vector<ShadowCaster> shadowCasters;	// Gathered every frame, for every view
+
+	// Given to every view, the ones added later included
+	std::vector<LightSource> lightSources;
+	glm::vec3 sunDirection = glm::vec3(0.0f, 1.0f, 0.0f);
+	glm::vec3 sunColor = glm::vec3(0.0f);
+	float exposure = 1.0f;
+	float bloomIntensity = 0.5f;
+	float bloomThreshold = 1.0f;
+	float frameBudget = 0.0f;
+	float minRenderScale = 0.5f;
+
+	TraceWriter trace;
+	std::vector<glm::mat4> tracedTransforms;
+	std::vector<glm::mat4> replayedTransforms;	// Empty: the scene's
 
 public:
 	static Vulkan app;
 
 	Vulkan();
 	virtual ~Vulkan();
-	
-	void createSurface(GLFWwindow* window);
+
+	// Creates the device and compiles the shaders and decodes the textures on the job threads,
+	// while the caller goes on (creates its window). Called by the first window otherwise.
+	void start();
+	// Window drawn by the device, returns its view. The first one initializes the renderer.
+	uint32_t addWindow(GLFWwindow* window);
+	// Drawn every frame like the windows, into an image per frame in flight.
+	// The first view when there is no window (replays): it initializes the renderer.
+	uint32_t addOffscreenView(VkExtent2D extent, VkFormat format = VK_FORMAT_R8G8B8A8_UNORM);
+	// Image of the last frame drawn into an offscreen view, transfer source once that frame is done
+	VkImage getOffscreenImage(uint32_t view) const;
+	void setCamera(uint32_t view, const glm::mat4& viewMatrix, float fieldOfView = glm::radians(70.0f));
+	void setSampleCount(VkSampleCountFlagBits samples);
+	void setDepthPrepass(bool enabled);
+	// Before init(): draws tested against the depth pyramid, in two phases. Without it only the frustum culls them.
+	void setOcclusionCulling(bool enabled);
+	void setCullMode(VkCullModeFlags mode);
+	// Before init(): the lights are binned on the job threads instead of a compute pass
+	void setGpuLightBinning(bool enabled);
+	const DeviceCapabilities& getCapabilities() const { return capabilities; }
+	// Draws as soon as the minimal pipelines exist: the full permutations and the textures come in later frames
 	void init();
+	// One frame of every view: recorded in parallel, submitted and presented together
 	void draw();
+	// Every frame in flight is done
+	void waitIdle();
+
+	// The next frame drawn is written to 'filename' (.png or .ppm), without stalling the rendering.
+	// With a golden image, a PSNR under minPsnr or a tile error over maxTileMse counts as a failure.
+	void captureFrame(const std::string& filename, const std::string& golden = "", double minPsnr = 40.0, double maxTileMse = 10.0);
+	// Waits for the requested captures to be written. Returns the number of failed comparisons.
+	uint32_t finishCaptures();
+
+	// Every frame is read back, converted to YUV 4:2:0 and written to the sink (Y4M), until stopStream()
+	void startStream(StreamSink* sink, uint32_t fps = 60);
+	void stopStream();
+
+	// Drawn over the next frame only, in pixels. 'texture' is a region of the texture atlas.
+	void drawSprites(const Sprite* sprites, uint32_t count);
+
+	// After init(): split into meshlets, uploaded at the next frame boundary. The objects using it are
+	// culled per meshlet by the GPU once the material has its meshlet pipeline. UINT32_MAX when it does not fit.
+	uint32_t addMesh(const Vertex* vertices, uint32_t vertexCount, const uint32_t* indices, uint32_t indexCount);
+	// Static object, drawn from the next frame on
+	uint32_t addObject(uint32_t mesh, uint32_t material, const glm::mat4& transform);
+
+	// Lights the scene from the next frame on, until the next call
+	void setLights(const LightSource* lights, uint32_t count);
+	// Directional light with shadows, 'direction' towards the light. A black color turns it off.
+	void setSun(const glm::vec3& direction, const glm::vec3& color);
+	// Scene color scale before the tonemapping
+	void setExposure(float value);
+	// Added to what is brighter than the threshold, 0 turns the bloom off
+	void setBloom(float intensity, float threshold = 1.0f);
+	// Dynamic resolution: the scene of a view is drawn at a lower resolution when its GPU time goes over
+	// 'milliseconds', down to minScale of its size. 0 always draws at full resolution.
+	void setFrameBudget(float milliseconds, float minScale = 0.5f);
+	float getRenderScale(uint32_t view = 0) const { return views[view]->resolution.getScale(); }
+
+	// Before the first view: the views, the settings, the calls above and the transforms of every frame
+	// are written to 'filename' until stopTrace(). TracePlayer draws them again.
+	bool startTrace(const std::string& filename);
+	void stopTrace();
+	// Replays: transforms of the renderables for the next frame only, in gathering order, instead of the scene's
+	void setTransforms(const glm::mat4* transforms, uint32_t count);
 
 private:
 	void createInstance();
 	void createDevice();
 	uint32_t chooseQueueFamilyIndex();
-	void createSwapchain();
-	void createSwapchainImageViews();
+	uint32_t chooseComputeFamilyIndex();
+	void createSwapchain(View& view);
+	void createOffscreenImages(View& view);
+	void createImageViews(View& view);
+	// Targets, graph, command buffers and per camera state, once the shared resources exist
+	void setupView(View& view);
+	void destroyView(View& view);
+	// Written to the trace once the view exists
+	void traceView(const View& view);
 
-	void findCompatibleDepthFormat();
-	void createDepthBuffer();
+	// First depth format with these features, VK_FORMAT_UNDEFINED if there is none
+	VkFormat findCompatibleDepthFormat(VkFormatFeatureFlags features, bool allowStencil = true);
+	void chooseSampleCount();
+	void createDepthBuffer(View& view);
 	
 	void prepareVertices();
 	void prepareUniforms();
-	void loadUniforms();
+	void updateScene();
+	void loadUniforms(View& view);
+	uint32_t getUniformOffset(const View& view, uint32_t object) const;
 
-	void loadTexture(const std::string& filename);
+	uint32_t loadTexture(const std::string& filename);
+	// Decoded and converted in parallel, returns the atlas regions in the same order
+	std::vector<uint32_t> loadTextures(const std::vector<std::string>& filenames);
+	std::vector<DecodedTexture> decodeTextures(const std::vector<std::string>& filenames);
+	// Into the atlas, the pixels are freed
+	std::vector<uint32_t> addTextures(std::vector<DecodedTexture>& decoded);
+	// Drawn with until the textures of the materials are decoded
+	uint32_t addPlaceholderTexture();
+	// At a frame boundary, once the decoding is done
+	void streamTextures();
+	void uploadResources();
 	void loadSampler();
+	// Once the frame is not in flight anymore
+	void writeTextureDescriptor(uint32_t frame);
 
 	uint32_t getMemoryType(uint32_t typeBits, VkFlags properties);
 	void createDescriptorPool();
 	void setupDescriptorSets();
 
 	void createCommandBuffers();
-	void recordDrawCommand();
-	void createRenderPass();
+	void prepareView(View& view);
+	void gatherDraws(View& view);
+	void gatherShadowCasters();
+	void recordDrawCommand(View& view);
+	void cullDraws(View& view, VkCommandBuffer cmdBuffer, CullPhase phase);
+	void drawDepthPrepass(const View& view, VkCommandBuffer cmdBuffer, CullPhase phase);
+	void drawScene(const View& view, VkCommandBuffer cmdBuffer, CullPhase phase);
+	void drawOverlay(const View& view, VkCommandBuffer cmdBuffer);
+	void setSceneViewport(const View& view, VkCommandBuffer cmdBuffer);
+	void createRenderPass(View& view);
 	void createGraphicsPipeline();
-	void createFrameBuffers();
-	VkPipelineShaderStageCreateInfo createShaderStage(const std::string& filename, VkShaderStageFlagBits shaderStage);
+	// Appends the single permutation of 'created', under the reload lock. Returns its index.
+	uint32_t addPermutation(const Pipelines& created);
+	// The material draws with its current pipeline until this one is compiled
+	void compilePipeline(uint32_t material, uint32_t features);
+	void adoptCompiledPipelines();
+	Pipelines createPipelines(const std::vector<uint32_t>& features);
+	void destroyPipelines(const Pipelines& destroyed);
+	// Every permutation with the current code, on a job thread: swapped in at the next frame boundary
+	void rebuildPipelines();
+	void swapReloadedPipelines();
+	void collectCaptures(uint64_t completed);
+	VkPipelineShaderStageCreateInfo createShaderStage(const std::string& name, VkShaderStageFlagBits shaderStage);
 };
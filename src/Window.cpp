@@ -6,12 +6,14 @@ Window::Window(const std::string & title, int width, int height)
 {
 	glfwInit();
 
+	// The device is created while the window opens
+	Vulkan::app.start();
+
 	this->title = title;
 	this->width = width;
 	this->height = height;
 	window = glfwCreateWindow(width, height, title.c_str(), nullptr, nullptr);
-	Vulkan::app.createSurface(window);
-	Vulkan::app.init();
+	view = Vulkan::app.addWindow(window);
 }
 
 bool Window::shouldClose()
@@ -22,5 +24,7 @@ bool Window::shouldClose()
 void Window::clear()
 {
 	glfwPollEvents();
-	Vulkan::app.draw();
+	if (view == 0) {
+		Vulkan::app.draw();
+	}
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <stdint.h>
 #include <GLFW\glfw3.h>
 
 class Window
@@ -11,9 +12,12 @@ private:
 	std::string title;
 
 	GLFWwindow *window;
+	uint32_t view;
 
 public:
+	// Every window is a view of the same device, the first one initializes it
 	Window(const std::string& title, int width, int height);
+	// The views are drawn together, with the first window: the others only poll their events
 	void clear();
 
 	bool shouldClose();
@@ -21,4 +25,5 @@ public:
 	inline int getWidth() const { return width; }
 	inline int getHeight() const { return height; }
 	inline std::string getTitle() const { return title; }
+	inline uint32_t getView() const { return view; }
 };
\ No newline at end of file
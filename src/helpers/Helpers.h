@@ -2,7 +2,7 @@
 
 namespace vk {
 
-	uint32_t getMemoryType(VkPhysicalDevice& physicalDevice, uint32_t typeBits, VkFlags properties)
+	inline uint32_t getMemoryType(VkPhysicalDevice& physicalDevice, uint32_t typeBits, VkFlags properties)
 	{
 		VkPhysicalDeviceMemoryProperties deviceMemoryProperties;
 		vkGetPhysicalDeviceMemoryProperties(physicalDevice, &deviceMemoryProperties);
@@ -18,7 +18,7 @@ namespace vk {
 		return -1;
 	}
 
-	void flushCommandBuffer(VkCommandBuffer& cmdBuffer, VkQueue graphicsQueue)
+	inline void flushCommandBuffer(VkCommandBuffer& cmdBuffer, VkQueue graphicsQueue)
 	{
 		vkEndCommandBuffer(cmdBuffer);
 
@@ -31,7 +31,7 @@ namespace vk {
 		vkQueueSubmit(graphicsQueue, 1, &submitInfo, 0);
 	}
 
-	VkCommandBuffer createCommandBuffer(VkCommandPool& commandPool, VkDevice& device)
+	inline VkCommandBuffer createCommandBuffer(VkCommandPool& commandPool, VkDevice& device)
 	{
 		VkCommandBufferAllocateInfo bufferAllocInfo = {};
 		bufferAllocInfo.commandBufferCount = 1;
@@ -46,7 +46,7 @@ namespace vk {
 		return cmdBuffer;
 	}
 	
-	VkCommandBuffer createAndBeginCommandBuffer(VkFlags flags, VkCommandPool& commandPool, VkDevice& device)
+	inline VkCommandBuffer createAndBeginCommandBuffer(VkFlags flags, VkCommandPool& commandPool, VkDevice& device)
 	{
 		VkCommandBuffer cmdBuffer = createCommandBuffer(commandPool, device);
 
@@ -59,10 +59,9 @@ namespace vk {
 		return cmdBuffer;
 	}
 
-	void copyImage(VkQueue& queue, VkImage srcImage, VkImage dstImage, int width, int height, VkFlags flags, VkCommandPool& commandPool, VkDevice& device)
+	// Recorded only: the caller submits, and releases the source once the copy is done
+	inline void copyImage(VkCommandBuffer cmdBuffer, VkImage srcImage, VkImage dstImage, int width, int height)
 	{
-		VkCommandBuffer cmdBuffer = createAndBeginCommandBuffer(flags, commandPool, device);
-
 		VkImageSubresourceLayers subResources = {};
 		subResources.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
 		subResources.baseArrayLayer = 0;
@@ -90,21 +89,17 @@ namespace vk {
 			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
 			1, &copy
 		);
-
-		flushCommandBuffer(cmdBuffer, queue);
-		vkQueueWaitIdle(queue);
-		vkFreeCommandBuffers(device, commandPool, 1, &cmdBuffer);
 	}
 
-	void changeImageLayout(VkQueue& queue, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, VkCommandPool& commandPool, VkDevice& device)
+	// Recorded only, like copyImage
+	inline void changeImageLayout(VkCommandBuffer cmdBuffer, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout)
 	{
-		VkCommandBuffer cmdBuffer = createAndBeginCommandBuffer(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
-																commandPool, device);
-
 		VkImageMemoryBarrier memoryBarrier = {};
 		memoryBarrier.image = image;
 		memoryBarrier.newLayout = newLayout;
 		memoryBarrier.oldLayout = oldLayout;
+		memoryBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		memoryBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
 		memoryBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
 		memoryBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
 		memoryBarrier.subresourceRange.baseArrayLayer = 0;
@@ -112,17 +107,19 @@ namespace vk {
 		memoryBarrier.subresourceRange.layerCount = 1;
 		memoryBarrier.subresourceRange.levelCount = 1;
 
-		vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-							 0, 0, 0, 0, 0, 1, &memoryBarrier);
-		
+		VkPipelineStageFlags srcStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+		VkPipelineStageFlags dstStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+
 		switch (oldLayout)
 		{
 		case VK_IMAGE_LAYOUT_PREINITIALIZED:
 			memoryBarrier.srcAccessMask = VK_ACCESS_HOST_WRITE_BIT;
+			srcStage = VK_PIPELINE_STAGE_HOST_BIT;
 			break;
 
 		case VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL:
 			memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			srcStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
 			break;
 		}
 
@@ -139,15 +136,14 @@ namespace vk {
 
 		case VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL:
 			memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+			dstStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
 			break;
 		}
-		
-		flushCommandBuffer(cmdBuffer, queue);
-		vkQueueWaitIdle(queue);
-		vkFreeCommandBuffers(device, commandPool, 1, &cmdBuffer);
+
+		vkCmdPipelineBarrier(cmdBuffer, srcStage, dstStage, 0, 0, nullptr, 0, nullptr, 1, &memoryBarrier);
 	}
 
-	void createImage(VkPhysicalDevice& physicalDevice, VkDevice& device, VkFlags props, VkImageTiling tiling, VkImageUsageFlags usage, VkImage& image, int w, int h, VkDeviceMemory& memory)
+	inline void createImage(VkPhysicalDevice& physicalDevice, VkDevice& device, VkFlags props, VkImageTiling tiling, VkImageUsageFlags usage, VkImage& image, int w, int h, VkDeviceMemory& memory)
 	{
 		VkImageCreateInfo imageInfo = {};
 		imageInfo.arrayLayers = 1;
@@ -182,4 +178,155 @@ namespace vk {
 		res = vkBindImageMemory(device, image, memory, 0);
 		assert(res == VK_SUCCESS);
 	}
+
+	// The create info gives the sharing mode, for buffers used by several queue families
+	inline void createBuffer(VkPhysicalDevice& physicalDevice, VkDevice& device, VkFlags props, const VkBufferCreateInfo& bufferInfo, VkBuffer& buffer, VkDeviceMemory& memory)
+	{
+		VkResult res = vkCreateBuffer(device, &bufferInfo, nullptr, &buffer);
+		assert(res == VK_SUCCESS);
+
+		VkMemoryRequirements memReqs;
+		vkGetBufferMemoryRequirements(device, buffer, &memReqs);
+
+		VkMemoryAllocateInfo memoryAllocInfo = {};
+		memoryAllocInfo.allocationSize = memReqs.size;
+		memoryAllocInfo.memoryTypeIndex = getMemoryType(physicalDevice, memReqs.memoryTypeBits, props);
+		memoryAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+		res = vkAllocateMemory(device, &memoryAllocInfo, nullptr, &memory);
+		assert(res == VK_SUCCESS);
+
+		res = vkBindBufferMemory(device, buffer, memory, 0);
+		assert(res == VK_SUCCESS);
+	}
+
+	inline void createBuffer(VkPhysicalDevice& physicalDevice, VkDevice& device, VkFlags props, VkBufferUsageFlags usage, VkDeviceSize size, VkBuffer& buffer, VkDeviceMemory& memory)
+	{
+		VkBufferCreateInfo bufferInfo = {};
+		bufferInfo.size = size;
+		bufferInfo.usage = usage;
+		bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+
+		createBuffer(physicalDevice, device, props, bufferInfo, buffer, memory);
+	}
+
+	// COMPUTE
+
+	// Binding i of the layout gets types[i]
+	inline VkDescriptorSetLayout createDescriptorSetLayout(VkDevice& device, const VkDescriptorType* types, uint32_t count, VkShaderStageFlags stages)
+	{
+		std::vector<VkDescriptorSetLayoutBinding> bindings(count);
+		for (uint32_t i = 0; i < count; i++) {
+			bindings[i] = {};
+			bindings[i].binding = i;
+			bindings[i].descriptorCount = 1;
+			bindings[i].descriptorType = types[i];
+			bindings[i].stageFlags = stages;
+		}
+
+		VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+		layoutInfo.bindingCount = count;
+		layoutInfo.pBindings = bindings.data();
+		layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+
+		VkDescriptorSetLayout layout;
+		VkResult res = vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &layout);
+		assert(res == VK_SUCCESS);
+
+		return layout;
+	}
+
+	inline VkPipelineLayout createPipelineLayout(VkDevice& device, VkDescriptorSetLayout setLayout, uint32_t pushConstantsSize, VkShaderStageFlags pushConstantsStages)
+	{
+		VkPushConstantRange pushConstants = {};
+		pushConstants.size = pushConstantsSize;
+		pushConstants.stageFlags = pushConstantsStages;
+
+		VkPipelineLayoutCreateInfo layoutInfo = {};
+		layoutInfo.setLayoutCount = 1;
+		layoutInfo.pSetLayouts = &setLayout;
+		layoutInfo.pushConstantRangeCount = pushConstantsSize > 0 ? 1 : 0;
+		layoutInfo.pPushConstantRanges = &pushConstants;
+		layoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+
+		VkPipelineLayout layout;
+		VkResult res = vkCreatePipelineLayout(device, &layoutInfo, nullptr, &layout);
+		assert(res == VK_SUCCESS);
+
+		return layout;
+	}
+
+	inline VkPipeline createComputePipeline(VkDevice& device, VkShaderModule shaderModule, VkPipelineLayout layout, const VkSpecializationInfo* specialization = nullptr)
+	{
+		VkPipelineShaderStageCreateInfo stageInfo = {};
+		stageInfo.module = shaderModule;
+		stageInfo.pName = "main";
+		stageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+		stageInfo.pSpecializationInfo = specialization;
+		stageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+
+		VkComputePipelineCreateInfo pipelineInfo = {};
+		pipelineInfo.stage = stageInfo;
+		pipelineInfo.layout = layout;
+		pipelineInfo.basePipelineIndex = -1;
+		pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+
+		VkPipeline pipeline;
+		VkResult res = vkCreateComputePipelines(device, 0, 1, &pipelineInfo, nullptr, &pipeline);
+		assert(res == VK_SUCCESS);
+
+		return pipeline;
+	}
+
+	// Work groups needed to cover 'size' invocations
+	inline uint32_t getGroupCount(uint32_t size, uint32_t groupSize)
+	{
+		return (size + groupSize - 1) / groupSize;
+	}
+
+	inline void dispatch(VkCommandBuffer cmdBuffer, VkPipeline pipeline, VkPipelineLayout layout, VkDescriptorSet descriptorSet,
+						 uint32_t groupsX, uint32_t groupsY = 1, uint32_t groupsZ = 1)
+	{
+		vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+		vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, layout, 0, 1, &descriptorSet, 0, nullptr);
+		vkCmdDispatch(cmdBuffer, groupsX, groupsY, groupsZ);
+	}
+
+	// Makes the writes of a stage visible to another one
+	inline void bufferBarrier(VkCommandBuffer cmdBuffer, VkBuffer buffer, VkAccessFlags srcAccess, VkAccessFlags dstAccess,
+							  VkPipelineStageFlags srcStage, VkPipelineStageFlags dstStage)
+	{
+		VkBufferMemoryBarrier barrier = {};
+		barrier.buffer = buffer;
+		barrier.size = VK_WHOLE_SIZE;
+		barrier.srcAccessMask = srcAccess;
+		barrier.dstAccessMask = dstAccess;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+
+		vkCmdPipelineBarrier(cmdBuffer, srcStage, dstStage, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+	}
+
+	// Layout change of some layers of an image, with the dependency that goes with it
+	inline void transitionLayers(VkCommandBuffer cmdBuffer, VkImage image, VkImageAspectFlags aspect, uint32_t firstLayer, uint32_t layerCount,
+								 VkImageLayout oldLayout, VkImageLayout newLayout, VkAccessFlags srcAccess, VkAccessFlags dstAccess,
+								 VkPipelineStageFlags srcStage, VkPipelineStageFlags dstStage)
+	{
+		VkImageMemoryBarrier imageBarrier = {};
+		imageBarrier.image = image;
+		imageBarrier.oldLayout = oldLayout;
+		imageBarrier.newLayout = newLayout;
+		imageBarrier.srcAccessMask = srcAccess;
+		imageBarrier.dstAccessMask = dstAccess;
+		imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		imageBarrier.subresourceRange.aspectMask = aspect;
+		imageBarrier.subresourceRange.levelCount = 1;
+		imageBarrier.subresourceRange.baseArrayLayer = firstLayer;
+		imageBarrier.subresourceRange.layerCount = layerCount;
+		imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+
+		vkCmdPipelineBarrier(cmdBuffer, srcStage, dstStage, 0, 0, nullptr, 0, nullptr, 1, &imageBarrier);
+	}
 }
\ No newline at end of file
@@ -0,0 +1,51 @@
+#include "../src/ImageDiff.h"
+#include "../src/JobSystem.h"
+#include <iostream>
+#include <stdlib.h>
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+
+// imagediff image golden [minPsnr] [maxTileMse] [tileSize]
+// Exit code 0 when the images match, 1 when they differ, 2 when they cannot be read
+int main(int argc, char** argv)
+{
+	if (argc < 3) {
+		std::cerr << "Usage: imagediff image golden [minPsnr=40] [maxTileMse=10] [tileSize=32]" << std::endl;
+		return 2;
+	}
+
+	double minPsnr = argc > 3 ? atof(argv[3]) : 40.0;
+	double maxTileMse = argc > 4 ? atof(argv[4]) : 10.0;
+	uint32_t tileSize = argc > 5 ? atoi(argv[5]) : 32;
+
+	Image image, golden;
+	if (!image::load(argv[1], image) || !image::load(argv[2], golden)) {
+		std::cerr << "Cannot read the images" << std::endl;
+		return 2;
+	}
+
+	JobSystem jobs;
+	jobs.init();
+	ImageDiff diff = compareImages(image, golden, tileSize, &jobs);
+	if (!diff.sameSize) {
+		std::cout << "FAIL: " << image.width << "x" << image.height << " vs " << golden.width << "x" << golden.height << std::endl;
+		return 1;
+	}
+
+	std::cout << "PSNR: " << diff.psnr << " dB" << std::endl;
+	std::cout << "MSE: " << diff.mse << ", max error: " << int(diff.maxError) << std::endl;
+	std::cout << "Worst tile: " << diff.worstTile % diff.tilesX << "," << diff.worstTile / diff.tilesX
+			  << " (" << tileSize << "px) MSE " << diff.tileMse[diff.worstTile] << std::endl;
+
+	// Tiles over the limit, for a quick look at where the image is broken
+	for (uint32_t ty = 0; ty < diff.tilesY; ty++) {
+		for (uint32_t tx = 0; tx < diff.tilesX; tx++) {
+			std::cout << (diff.tileMse[ty * diff.tilesX + tx] > maxTileMse ? '#' : '.');
+		}
+		std::cout << std::endl;
+	}
+
+	bool passed = diff.passes(minPsnr, maxTileMse);
+	std::cout << (passed ? "PASS" : "FAIL") << std::endl;
+	return passed ? 0 : 1;
+}